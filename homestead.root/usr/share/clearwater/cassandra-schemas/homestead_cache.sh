@@ -58,3 +58,19 @@ then
   echo "USE homestead_cache;
         CREATE TABLE impi_mapping (private_id text PRIMARY KEY, unused text) WITH read_repair_chance = 1.0;" | $namespace_prefix cqlsh -2
 fi
+
+# The irs table holds the IMS subscription and charging addresses for each
+# implicit registration set, keyed by its default public ID.  impu rows point
+# at it through the irs_id column when homestead runs with --irs-table.
+if [[ ! -e /var/lib/cassandra/data/homestead_cache/irs ]];
+then
+  echo "USE homestead_cache;
+        CREATE TABLE irs (irs_id text PRIMARY KEY, ims_subscription_xml text, primary_ccf text, secondary_ccf text, primary_ecf text, secondary_ecf text) WITH read_repair_chance = 1.0;
+        ALTER TABLE impu ADD irs_id text;" | $namespace_prefix cqlsh -2
+fi
+
+# The irs_summary column holds the identities parsed out of the IMS
+# subscription, so that readers don't need to parse the XML.
+echo "USE homestead_cache;
+      ALTER TABLE impu ADD irs_summary blob;
+      ALTER TABLE irs ADD irs_summary blob;" | $namespace_prefix cqlsh -2
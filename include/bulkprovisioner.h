@@ -0,0 +1,159 @@
+/**
+ * @file bulkprovisioner.h bulk loading of subscribers into the cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BULKPROVISIONER_H__
+#define BULKPROVISIONER_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <istream>
+#include <pthread.h>
+
+#include "cache.h"
+
+/// Loads subscribers into the cache in bulk, for deployments without an HSS
+/// where homestead holds the master copy of the data.
+///
+/// The input is newline-delimited JSON, one subscriber per line:
+///
+///   {"impi": "...", "ha1": "...", "realm": "...",
+///    "impus": ["...", ...], "xml": "<IMSSubscription>..."}
+///
+/// "impus" is optional, and defaults to the public IDs in the IMS
+/// subscription.  Any listed public IDs must be in the IMS subscription.
+///
+/// Lines are parsed and validated on a pool of threads, which then submit
+/// the subscriber's writes to the cache (where they are batched if the cache
+/// is configured to batch writes).  Memory is bounded by limiting both the
+/// number of lines waiting to be validated and the number of writes in
+/// flight.
+class BulkProvisioner
+{
+public:
+  /// Counts of what happened to the input.
+  struct Stats
+  {
+    Stats() : lines(0), invalid(0), written(0), failed(0) {}
+
+    size_t lines;
+    size_t invalid;
+    size_t written;
+    size_t failed;
+  };
+
+  /// Constructor.
+  ///
+  /// @param cache          - The cache to write to.  It must be started.
+  /// @param num_threads    - The number of threads validating subscribers.
+  /// @param max_queued     - The most lines that can be waiting for a
+  ///                         validating thread.
+  /// @param max_in_flight  - The most subscribers that can have writes in
+  ///                         flight.
+  BulkProvisioner(Cache* cache,
+                  unsigned int num_threads = 4,
+                  size_t max_queued = 1000,
+                  size_t max_in_flight = 1000);
+  virtual ~BulkProvisioner();
+
+  /// Load all the subscribers from a stream.  Blocks until they have all
+  /// been written (or have failed).
+  ///
+  /// @param input - The stream to read.
+  /// @param stats - (out) What happened to the input.
+  /// @returns     - true if every subscriber was written.
+  bool provision(std::istream& input, Stats& stats);
+
+  /// A subscriber to provision.
+  struct Subscriber
+  {
+    std::string impi;
+    std::string ha1;
+    std::string realm;
+    std::vector<std::string> impus;
+    std::string xml;
+  };
+
+  /// Parse and validate a line of input.
+  ///
+  /// @param line       - The line.
+  /// @param subscriber - (out) The subscriber it describes.
+  /// @param error      - (out) Why the line isn't valid.
+  /// @returns          - Whether the line describes a valid subscriber.
+  static bool parse(const std::string& line,
+                    Subscriber& subscriber,
+                    std::string& error);
+
+private:
+  class WriteTransaction;
+
+  struct Line
+  {
+    size_t number;
+    std::string text;
+  };
+
+  // A subscriber whose writes are in flight.
+  struct Pending
+  {
+    std::string impi;
+    int writes_remaining;
+    bool failed;
+  };
+
+  static void* thread_entry(void* provisioner);
+  void run();
+
+  // Submit the writes for a subscriber.
+  void write(const Subscriber& subscriber);
+
+  // Called as each of a subscriber's writes completes.
+  void write_complete(Pending* pending, bool success);
+
+  Cache* _cache;
+  unsigned int _num_threads;
+  size_t _max_queued;
+  size_t _max_in_flight;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<Line> _queue;
+  bool _end_of_input;
+  size_t _in_flight;
+  Stats _stats;
+};
+
+#endif
@@ -40,20 +40,479 @@
 #include "reg_state.h"
 #include "charging_addresses.h"
 #include "authvector.h"
+#include "irssummary.h"
+#include "regdatacache.h"
+#include "negativecache.h"
+#include "localstore.h"
+#include "objectpool.h"
+#include "nativeclient.h"
 
 class Cache : public CassandraStore::Store
 {
 public:
+  /// Priorities of operations queued for the cache's worker pool.
+  enum Priority
+  {
+    /// Reads that a user-facing request is waiting for.
+    PRIORITY_HIGH = 0,
+    PRIORITY_NORMAL,
+    /// Background writes that nothing is waiting for.
+    PRIORITY_LOW,
+    NUM_PRIORITIES
+  };
+
+  /// Interface used by the cache to report statistics.
+  class StatsInterface
+  {
+  public:
+    virtual ~StatsInterface() {}
+
+    /// Called when a read is satisfied by an identical read that was
+    /// already in flight, rather than being sent to Cassandra itself.
+    virtual void incr_cache_coalesced_reads() = 0;
+
+    /// Called when an operation is queued for the cache's worker pool,
+    /// with the number of worker threads and of queued operations.  If key
+    /// affinity is configured, the depth is that of the shard's queue.
+    virtual void update_cache_worker_threads(unsigned long threads) = 0;
+    virtual void update_cache_queue_depth(unsigned long depth) = 0;
+
+    /// Called periodically when key affinity is configured, with the number
+    /// of operations sent to the busiest shard as a percentage of the
+    /// average per shard.  100 means the load is evenly spread.
+    virtual void update_cache_shard_imbalance(unsigned long percent) = 0;
+
+    /// Called when a slow read is hedged by running it again.
+    virtual void incr_cache_hedged_reads() = 0;
+
+    /// Called when an operation of the specified priority is taken off the
+    /// worker pool's queue, with how long it was queued for.
+    virtual void update_cache_queue_wait_us(Priority priority,
+                                            unsigned long wait_us) = 0;
+
+    /// Called when a write is queued for the write-behind stage, with the
+    /// number of queued writes and how long the oldest has been queued.
+    virtual void update_cache_write_behind_backlog(unsigned long depth) = 0;
+    virtual void update_cache_write_behind_age_us(unsigned long age_us) = 0;
+
+    /// Called when an operation is failed without being run, because it
+    /// was still queued at its deadline.
+    virtual void incr_cache_expired_operations() = 0;
+  };
+
+  /// Consistency levels an operation reads and writes at.
+  struct Consistency
+  {
+    Consistency(org::apache::cassandra::ConsistencyLevel::type _level =
+                  org::apache::cassandra::ConsistencyLevel::ONE,
+                org::apache::cassandra::ConsistencyLevel::type _not_found_level =
+                  org::apache::cassandra::ConsistencyLevel::QUORUM) :
+      level(_level),
+      not_found_level(_not_found_level) {}
+
+    /// The level rows are read and written at.
+    org::apache::cassandra::ConsistencyLevel::type level;
+
+    /// The level reads of rows that aren't found at the first level are
+    /// retried at, as the rows may just not have reached those replicas yet.
+    /// If this is the same as the first level, reads aren't retried.
+    org::apache::cassandra::ConsistencyLevel::type not_found_level;
+  };
+
+  class CacheOperation;
+
   virtual ~Cache();
 
+  /// Configure the object used to report cache statistics.
+  ///
+  /// @param stats - The stats object.  May be NULL, in which case no
+  ///                statistics are reported.
+  void configure_stats(StatsInterface* stats);
+
   /// @return the singleton cache instance.
   static inline Cache* get_instance() { return INSTANCE; }
 
+  /// Configure the cache to use a single Cassandra node.
+  using CassandraStore::Store::configure;
+
+  /// Configure the cache to spread requests over several Cassandra nodes.
+  /// Each thread keeps a connection to each node it uses, and each request
+  /// goes to the node with the lowest recent latency, weighted by how many
+  /// requests that node already has in flight.  A node that fails
+  /// repeatedly, or is much slower than the others, is not used for a
+  /// while, and then tried again.
+  ///
+  /// @param cass_hostnames - The nodes to use.  Must not be empty.  If there
+  ///                         is only one, this is the same as configuring a
+  ///                         single node.
+  /// @param cass_port      - The Thrift port of every node.
+  /// @param num_threads    - The number of threads in the store's thread
+  ///                         pool.
+  /// @param max_queue      - The maximum number of queued operations.
+  /// @param comm_monitor   - Monitor told about connection successes and
+  ///                         failures.
+  void configure(const std::vector<std::string>& cass_hostnames,
+                 uint16_t cass_port,
+                 unsigned int num_threads,
+                 unsigned int max_queue = 0,
+                 CommunicationMonitor* comm_monitor = NULL);
+
+  /// Configure the cache to talk to Cassandra over its native binary
+  /// protocol rather than Thrift.  Each node then has a single connection,
+  /// shared by all the threads using it, on which requests are multiplexed,
+  /// and the rows read by a multiget are read concurrently.  Must be called
+  /// after configure, and before the cache is started.
+  ///
+  /// @param port - The native protocol port of every node.
+  void configure_native_protocol(uint16_t port);
+
+  /// Configure the in-process cache of registration data that sits in front
+  /// of the IMPU table.  The cache is disabled unless this is called with a
+  /// non-zero size.
+  ///
+  /// @param max_entries - The maximum number of public IDs to cache.
+  /// @param max_age_ms  - The maximum time an entry is served for before it
+  ///                      is re-read from Cassandra.
+  void configure_reg_data_cache(size_t max_entries, long max_age_ms);
+
+  /// Configure the in-process record of rows that were not found in
+  /// Cassandra.  Reads for these rows are answered locally for the TTL, or
+  /// until the row is written.
+  ///
+  /// @param max_entries - The maximum number of rows to remember.  Zero
+  ///                      disables the negative cache.
+  /// @param ttl_ms      - How long to remember that a row does not exist.
+  ///                      Zero disables the negative cache.
+  void configure_negative_cache(size_t max_entries, long ttl_ms);
+
+  /// Configure batching of writes.  When enabled, the columns written by
+  /// operations that support it are gathered up and written to Cassandra
+  /// with a single batch_mutate, rather than each operation making its own
+  /// request.
+  ///
+  /// @param window_us   - The longest a write is held waiting for others to
+  ///                      join its batch.  Zero disables batching.
+  /// @param max_columns - A batch is written as soon as it holds this many
+  ///                      columns.
+  void configure_write_batching(long window_us, size_t max_columns);
+
+  /// Configure where the IMS subscription and charging addresses of an
+  /// implicit registration set are written.
+  ///
+  /// @param enabled - If true, they are written once to the "irs" table,
+  ///                  keyed by the set's default public ID, and each "impu"
+  ///                  row just points at that row.  If false, they are copied
+  ///                  into every "impu" row.  Either layout can be read
+  ///                  regardless of this setting.
+  ///
+  /// Writing an IMS subscription also removes what the set's "impu" rows
+  /// pointed at before, if that is now out of date: the "irs" row of the
+  /// set's old default public ID if the default has changed, and (if the
+  /// "irs" table is no longer in use) the pointers themselves.  This needs
+  /// the "impu" rows to be read first, so those writes aren't batched.  With
+  /// the "irs" table off, this is only done once an "impu" row pointing at
+  /// an "irs" row has been read, so that deployments that have never used
+  /// the "irs" table don't pay for it.
+  void configure_irs_table(bool enabled);
+
+  /// Configure compression of IMS subscription XML.  Compressed XML can be
+  /// read regardless of this setting.
+  ///
+  /// @param threshold - XML of at least this many bytes is compressed before
+  ///                    it is written.  Zero disables compression.
+  void configure_xml_compression(size_t threshold);
+
+  /// Configure deletions from the IMPU, IMPI mapping and IRS tables to
+  /// overwrite the deleted columns with short-lived markers rather than
+  /// deleting them, so that deregistration churn doesn't leave tombstones
+  /// for reads to skip over.  Deleting a whole row marks the columns its
+  /// table always has and any others the operation knows of, without reading
+  /// the row (so a whole IMPI mapping row, whose columns aren't known, is
+  /// deleted as normal).  Columns holding markers are treated as absent on
+  /// read, regardless of this setting.
+  ///
+  /// @param ttl_s - How long markers last, in seconds.  Zero deletes
+  ///                columns as normal.
+  void configure_deletion_markers(int32_t ttl_s);
+
+  /// Configure a pool of worker threads that grows and shrinks with the load
+  /// to run operations, in place of the store's fixed size thread pool.
+  ///
+  /// A worker is added when an operation is queued and none are idle, if
+  /// either operations are waiting longer in the queue than they take to
+  /// run, or there are at least as many operations queued as there are
+  /// workers.  A worker that has been idle for the idle timeout exits.
+  ///
+  /// Queued operations are run in priority order (see
+  /// CacheOperation::priority), except that an operation that has been
+  /// queued for longer than the starvation limit is run next regardless of
+  /// its priority.
+  ///
+  /// @param min_threads         - The number of workers the pool shrinks to.
+  /// @param max_threads         - The number of workers the pool grows to.
+  ///                              If this is less than min_threads, or zero,
+  ///                              the store's own thread pool is used.
+  /// @param idle_timeout_ms     - How long a worker waits for work before it
+  ///                              exits.
+  /// @param starvation_limit_ms - How long an operation can be held back by
+  ///                              ones of a higher priority.
+  void configure_worker_pool(unsigned int min_threads,
+                             unsigned int max_threads,
+                             long idle_timeout_ms = 10000,
+                             long starvation_limit_ms = 500);
+
+  /// Configure a fixed set of worker threads, each with its own queue, to
+  /// run operations in place of the worker pool.  Each operation is queued
+  /// for the worker picked by hashing its primary key (see
+  /// CacheOperation::affinity_key), so operations on one subscriber run one
+  /// at a time and in the order they were submitted, without locking.
+  /// Operations without a key are spread across the workers in turn.
+  ///
+  /// Each worker runs its operations in the order they are queued, as
+  /// running them in priority order would reorder operations on one key.
+  /// Batched and write-behind writes are still run on their own threads.
+  /// Operations that mustn't wait behind others on their key still run on
+  /// the worker pool, or the store's thread pool if there is no worker pool,
+  /// so that must still be sized for them.
+  ///
+  /// @param num_shards - The number of workers.  Zero disables key
+  ///                     affinity.
+  void configure_key_affinity(unsigned int num_shards);
+
+  /// Configure hedging of reads (see CacheOperation::hedgeable).  If a read
+  /// is still running once it has taken longer than the specified
+  /// percentile of recent reads, the same read is run again.  If several
+  /// Cassandra nodes are configured, the hedged read is sent to a different
+  /// node from the first.  The first of the two to succeed completes the
+  /// transaction.
+  ///
+  /// Hedged reads are run on threads of their own, so they don't wait for
+  /// the operations queued ahead of the read they are hedging.
+  ///
+  /// @param percentile     - The percentile of read latency after which a
+  ///                         read is hedged.  Zero disables hedging.
+  /// @param budget_percent - The most reads that can be hedged, as a
+  ///                         percentage of all reads.
+  void configure_hedging(int percentile, int budget_percent = 5);
+
+  /// Configure a write-behind stage for writes whose results nothing waits
+  /// for (see CacheOperation::set_write_behind).  These are run on their
+  /// own threads (and so Cassandra connections), and retried with backoff
+  /// if they fail, so they never hold up reads.
+  ///
+  /// @param threads          - The number of threads writing.  Zero disables
+  ///                           the write-behind stage.
+  /// @param max_queue        - The most writes that can be queued.  Once the
+  ///                           queue is full, writes are run in the same way
+  ///                           as other operations.
+  /// @param max_retries      - How many times a failed write is retried.
+  /// @param retry_backoff_ms - How long to wait before the first retry.  The
+  ///                           wait doubles for each retry after that.
+  void configure_write_behind(unsigned int threads,
+                              size_t max_queue,
+                              int max_retries = 3,
+                              long retry_backoff_ms = 100);
+
+  /// Configure the consistency levels used by one type of operation.  By
+  /// default operations write at ONE, and read at ONE, retrying at QUORUM
+  /// any rows that aren't found.  Writes that are batched (see
+  /// configure_write_batching) are only batched with others that write at
+  /// the same level.
+  ///
+  /// Must not be called once operations are being submitted.
+  ///
+  /// @param operation   - The name of the type of operation, such as
+  ///                      "GetRegData" (see CacheOperation::name).
+  /// @param consistency - The levels to use.
+  /// @returns           - false if there is no such type of operation.
+  bool configure_consistency(const std::string& operation,
+                             const Consistency& consistency);
+
+  /// Configure the cache to keep its tables in an embedded store rather than
+  /// in Cassandra.  This is intended for deployments without an HSS, where
+  /// homestead holds the master copy of the data.
+  ///
+  /// @param local_store - The store, which must have been started.  NULL to
+  ///                      use Cassandra.  The cache does not take ownership.
+  void configure_local_store(LocalStore* local_store);
+
+  /// Read the registration data of the specified public IDs into the
+  /// in-process registration data cache, so that the first requests after a
+  /// restart don't all have to go to Cassandra.  Blocks until all the reads
+  /// have completed, logging progress as they do.  Does nothing if the
+  /// registration data cache is disabled.
+  ///
+  /// @param public_ids    - The public IDs to read.
+  /// @param batch_size    - How many public IDs each multiget reads.
+  /// @param max_in_flight - How many multigets can be in flight at once.
+  /// @returns             - The number of entries in the registration data
+  ///                        cache once the reads have completed.
+  size_t warm_up(const std::vector<std::string>& public_ids,
+                 size_t batch_size = 100,
+                 unsigned int max_in_flight = 4);
+
+  /// Get the public IDs that are in the in-process registration data cache,
+  /// so that they can be passed to warm_up() after a restart.
+  void get_hot_public_ids(std::vector<std::string>& public_ids);
+
+  /// Stop the cache, first writing any batched and write-behind writes that
+  /// are waiting and running any queued operations.
+  void stop();
+
+  /// Submit an operation for asynchronous processing.  Operations that can
+  /// be satisfied without going to Cassandra are completed before this
+  /// method returns, and their transactions are called back by threads that
+  /// never go to Cassandra, so that they don't wait behind operations that
+  /// do.  All others are passed to the sharded workers if key affinity is
+  /// configured, the worker pool if there is one, or the store's thread pool
+  /// if not.
+  ///
+  /// Takes ownership of the operation and transaction (and sets the passed
+  /// in pointers to NULL).
+  ///
+  /// A read that is identical to one already in flight is not queued.
+  /// Instead it is completed with the in-flight read's result when that
+  /// read finishes.
+  ///
+  /// The transaction is always called back on another thread, never from
+  /// within do_async, even if the operation is completed from the
+  /// in-process caches without going to Cassandra.
+  virtual void do_async(CassandraStore::Operation*& op,
+                        CassandraStore::Transaction*& trx);
+
+  /// Perform an operation synchronously.  Overridden so that any reads
+  /// coalesced onto this operation are completed with its result.
+  virtual bool do_sync(CassandraStore::Operation* op, SAS::TrailId trail);
+
+  /// Get a client for the current thread.  Overridden to use the local store
+  /// if there is one.
+  virtual CassandraStore::ClientInterface* get_client();
+  virtual void release_client();
+
 private:
   // Singleton variables.
   static Cache* INSTANCE;
   static Cache DEFAULT_INSTANCE;
 
+  // In-process cache of IMPU table rows.  NULL if disabled.
+  RegDataCache* _reg_data_cache;
+
+  // In-process record of rows that don't exist.  NULL if disabled.
+  NegativeCache* _negative_cache;
+
+  StatsInterface* _stats;
+
+  // Embedded store used in place of Cassandra.  NULL if Cassandra is used.
+  LocalStore* _local_store;
+
+  // Whether registration data is written using the "irs" table.
+  bool _irs_table;
+
+  // Whether an "impu" row pointing at an "irs" row has been read since the
+  // cache started.
+  std::atomic<bool> _irs_rows_seen;
+
+  // Consistency levels configured for each type of operation, keyed by the
+  // operation's name.  Not locked, as it is only changed at start of day.
+  std::map<std::string, Consistency> _consistency;
+
+  // Size of IMS subscription XML above which it is compressed.  Zero if
+  // compression is disabled.
+  size_t _xml_compression_threshold;
+
+  // TTL of deletion markers.  Zero if deletes are used instead.
+  int32_t _deletion_marker_ttl;
+
+  // Reads that are currently in flight, keyed by the table, row and columns
+  // they read (see CacheOperation::coalescing_key).  Protected by
+  // _in_flight_reads_lock.
+  std::map<std::string, CacheOperation*> _in_flight_reads;
+  pthread_mutex_t _in_flight_reads_lock;
+
+  // Attach an operation to an identical read that is already in flight.  If
+  // there is no such read, the operation is recorded as in flight so that
+  // later reads can attach to it.
+  //
+  // @returns - true if the operation was attached (in which case ownership of
+  //            the operation and transaction has passed to the in-flight
+  //            read), false if it must be submitted as normal.
+  bool coalesce_read(CacheOperation* op, CassandraStore::Transaction* trx);
+
+  // Complete any operations attached to a read that has just finished.
+  void complete_coalesced_reads(CacheOperation* op, bool success);
+
+  // @returns - true if an operation has passed its deadline.  The deadline
+  // of a read that others are attached to is the latest of theirs.
+  bool past_deadline(CacheOperation* op);
+
+  // Stop later reads of the specified rows from being attached to reads that
+  // are currently in flight, because the rows are being written.
+  void stop_coalescing(const std::string& table,
+                       const std::vector<std::string>& keys);
+
+  // Gathers up batchable writes.  NULL if write batching is disabled.
+  class WriteBatcher;
+  WriteBatcher* _write_batcher;
+
+  // Runs operations on a variable number of threads.  NULL if the store's
+  // thread pool is used instead.
+  class WorkerPool;
+  WorkerPool* _worker_pool;
+
+  // Runs operations on a fixed set of workers chosen by key.  NULL if key
+  // affinity is disabled.
+  class ShardedExecutor;
+  ShardedExecutor* _sharded_executor;
+
+  // Hedges slow reads.  NULL if hedging is disabled.
+  class Hedger;
+  Hedger* _hedger;
+
+  // Chooses the Cassandra node each operation is sent to, and holds each
+  // thread's connections to the nodes.  NULL if there is only one node,
+  // and Thrift is used.
+  class NodeSelector;
+  NodeSelector* _node_selector;
+
+  // The Cassandra nodes, and their Thrift port.
+  std::vector<std::string> _cass_hostnames;
+  uint16_t _cass_port;
+
+  // Connections to the nodes over the native protocol, and the port they
+  // are made to.  NULL if Thrift is used.
+  NativeConnectionPool* _native_pool;
+  uint16_t _native_port;
+
+  // (Re)create the node selector, if one is needed for the nodes and
+  // protocol configured.
+  void configure_node_selector();
+
+  // Pass an operation to the sharded executor, worker pool or store's
+  // thread pool to be run.  Takes ownership of the operation and
+  // transaction.
+  //
+  // @param by_key - false if the operation must not be queued by key.
+  void dispatch(CassandraStore::Operation*& op,
+                CassandraStore::Transaction*& trx,
+                bool by_key);
+
+  // Runs writes that nothing waits for.  NULL if write-behind is disabled.
+  class WriteBehind;
+  WriteBehind* _write_behind;
+
+  // Calls back the transactions of operations that were completed when they
+  // were submitted, so never goes to Cassandra.
+  WorkerPool* _callback_pool;
+  static const unsigned int MAX_CALLBACK_THREADS = 4;
+  static const long CALLBACK_IDLE_TIMEOUT_MS = 10000;
+
+  // Write a batch of mutations gathered from several operations that all
+  // write at the specified consistency level, and complete the operations.
+  void write_batch(const std::map<std::string, std::map<std::string, std::vector<org::apache::cassandra::Mutation> > >& mutations,
+                   org::apache::cassandra::ConsistencyLevel::type consistency_level,
+                   std::vector<std::pair<CacheOperation*,
+                                         CassandraStore::Transaction*> >& ops);
+
 protected:
   // The constructors and assignment operation are protected to prevent multiple
   // instances of the class from being created.
@@ -61,13 +520,276 @@ protected:
   Cache(Cache const&);
   void operator=(Cache const&);
 
+  // Create a client connected to a Cassandra node.  Used when the cache is
+  // configured with several nodes, or the native protocol.  Virtual so that
+  // UTs can supply mock clients.
+  virtual CassandraStore::ClientInterface* create_client(const std::string& hostname,
+                                                         uint16_t port);
+
 public:
   //
   // Operations
   //
 
+  /// Containers that operations build up their parameters and results in.
+  /// Like the operations themselves, these are created and destroyed for
+  /// every request, so are allocated from the ObjectPool.  The public IDs
+  /// and private IDs an operation is asked about are kept in standard
+  /// vectors, as they are passed unchanged to the Thrift client.
+  typedef std::vector<std::string, PoolAllocator<std::string> > PooledStrings;
+  typedef std::map<std::string,
+                   std::string,
+                   std::less<std::string>,
+                   PoolAllocator<std::pair<const std::string, std::string> > > PooledColumns;
+  typedef std::map<std::string,
+                   uint64_t,
+                   std::less<std::string>,
+                   PoolAllocator<std::pair<const std::string, uint64_t> > > PooledGenerations;
+  typedef std::vector<std::pair<CacheOperation*, CassandraStore::Transaction*>,
+                      PoolAllocator<std::pair<CacheOperation*,
+                                              CassandraStore::Transaction*> > > CoalescedOperations;
+
+  /// @class CacheOperation base class for all operations on the cache.
+  ///
+  /// Gives operations access to the cache they were submitted to, so that
+  /// they can use (and keep up to date) the in-process caches that sit in
+  /// front of Cassandra.
+  ///
+  /// Operations are created and destroyed for every request, so are
+  /// allocated from per-thread pools rather than the heap.
+  class CacheOperation : public CassandraStore::Operation, public PooledObject
+  {
+  public:
+    CacheOperation();
+    virtual ~CacheOperation();
+
+    /// Mark this operation as one whose result nothing waits for, so that it
+    /// can be run by the write-behind stage rather than competing with reads.
+    void set_write_behind() { _write_behind = true; }
+
+    /// Set the time (on the monotonic clock) by which this operation must
+    /// have started running.  An operation that is still queued at its
+    /// deadline is failed without being run, as whoever submitted it will
+    /// have given up waiting for it.  Operations have no deadline unless
+    /// this is called.
+    void set_deadline(const struct timespec& deadline);
+
+  protected:
+    friend class Cache;
+
+    /// Called by Cache::do_async when the operation is submitted, before it
+    /// is queued.
+    ///
+    /// @returns - true if the operation has been completed without needing
+    ///            to go to Cassandra (in which case its results must have
+    ///            been filled in), false if it must be run as normal.
+    virtual bool on_submit() { return false; }
+
+    /// Get the key identifying the data this operation reads.  Operations
+    /// with the same key must be of the same type, and must produce the same
+    /// result if run at the same time.
+    ///
+    /// @returns - The key, or an empty string if the operation can't be
+    ///            coalesced with other operations.
+    virtual std::string coalescing_key() const { return ""; }
+
+    /// Copy the results of an identical operation into this one.  Only called
+    /// with operations that have the same coalescing key.
+    virtual void copy_result(const CacheOperation& other) {}
+
+    /// Get the key of the row this operation is primarily about, so that
+    /// all the operations on that row are run by the same worker when key
+    /// affinity is configured.
+    ///
+    /// @returns - The key, or an empty string if the operation can run on
+    ///            any worker.
+    virtual std::string affinity_key() const { return ""; }
+
+    /// @returns - true if this is a read that can be hedged (see
+    ///            Cache::configure_hedging), in which case clone() must be
+    ///            implemented.
+    virtual bool hedgeable() const { return false; }
+
+    /// Create a new operation that makes the same request as this one, for
+    /// hedging.  Called while this operation may be running, so must only
+    /// copy the request parameters.
+    virtual CacheOperation* clone() const { return NULL; }
+
+    /// Copy the cache and deadline of this operation to a clone of it.
+    ///
+    /// @returns - The clone.
+    CacheOperation* init_clone(CacheOperation* clone) const;
+
+    /// Get the columns this operation writes, so that they can be batched
+    /// with the writes of other operations.
+    ///
+    /// @returns - false if the operation's writes can't be batched.
+    virtual bool get_batchable_writes(std::vector<CassandraStore::RowColumns>& rows,
+                                      int64_t& timestamp,
+                                      int32_t& ttl) { return false; }
+
+    /// Called once this operation's columns have been written.
+    virtual void on_written() {}
+
+    /// Get the priority of this operation in the worker pool's queue.
+    virtual Priority priority() const { return PRIORITY_NORMAL; }
+
+    /// Get the name of this type of operation, which is used to look up the
+    /// consistency levels configured for it.
+    ///
+    /// @returns - The name, or an empty string if the operation always uses
+    ///            the default consistency levels.
+    virtual std::string name() const { return ""; }
+
+    /// Get the consistency levels this operation should use.
+    ///
+    /// @returns - false if none have been configured for this type of
+    ///            operation, in which case consistency is left at the
+    ///            defaults.
+    bool configured_consistency(Consistency& consistency) const;
+
+    // The following hide the CassandraStore::Operation methods of the same
+    // names, so that operations use the consistency levels configured for
+    // them.  If none are configured they just call the hidden methods.
+    // Reads drop columns holding deletion markers, and deletes write them if
+    // configured (see Cache::configure_deletion_markers).  When they are,
+    // delete_columns marks the columns of rows being deleted entirely that
+    // their column family always has, plus those listed for the column
+    // family in known_columns.
+    void ha_get_columns(CassandraStore::ClientInterface* client,
+                        const std::string& column_family,
+                        const std::string& key,
+                        const std::vector<std::string>& names,
+                        std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns);
+    void ha_get_all_columns(CassandraStore::ClientInterface* client,
+                            const std::string& column_family,
+                            const std::string& key,
+                            std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns);
+    void ha_get_columns_with_prefix(CassandraStore::ClientInterface* client,
+                                    const std::string& column_family,
+                                    const std::string& key,
+                                    const std::string& prefix,
+                                    std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns);
+    void ha_multiget_columns_with_prefix(CassandraStore::ClientInterface* client,
+                                         const std::string& column_family,
+                                         const std::vector<std::string>& keys,
+                                         const std::string& prefix,
+                                         std::map<std::string, std::vector<org::apache::cassandra::ColumnOrSuperColumn> >& columns);
+    void put_columns(CassandraStore::ClientInterface* client,
+                     const std::string& column_family,
+                     const std::vector<std::string>& keys,
+                     const std::map<std::string, std::string>& columns,
+                     int64_t timestamp,
+                     int32_t ttl);
+    void put_columns(CassandraStore::ClientInterface* client,
+                     const std::vector<CassandraStore::RowColumns>& to_put,
+                     int64_t timestamp,
+                     int32_t ttl);
+    void delete_row(CassandraStore::ClientInterface* client,
+                    const std::string& column_family,
+                    const std::string& key,
+                    int64_t timestamp);
+    void delete_columns(CassandraStore::ClientInterface* client,
+                        const std::vector<CassandraStore::RowColumns>& to_rm,
+                        int64_t timestamp,
+                        const std::map<std::string, std::vector<std::string> >& known_columns =
+                          std::map<std::string, std::vector<std::string> >());
+
+    /// Delete rows and columns, without using deletion markers.
+    void remove_columns(CassandraStore::ClientInterface* client,
+                        const std::vector<CassandraStore::RowColumns>& to_rm,
+                        int64_t timestamp);
+
+    /// @returns - The first of some keys, or an empty string if there are
+    ///            none.
+    static std::string first_key(const std::vector<std::string>& keys)
+    {
+      return keys.empty() ? "" : keys.front();
+    }
+
+    /// Build a coalescing key.
+    static std::string make_coalescing_key(const std::string& table,
+                                           const std::string& key,
+                                           const std::string& columns);
+
+    /// Remove the specified public IDs from the registration data cache.
+    void invalidate_reg_data(const std::vector<std::string>& public_ids);
+
+    /// Forget any record that the specified rows don't exist, because they
+    /// are being written.
+    void invalidate_absence(const std::string& table,
+                            const std::vector<std::string>& keys);
+
+    /// Stop later reads of the specified rows being coalesced with reads
+    /// that are already in flight, because the rows are being written.
+    void invalidate_in_flight(const std::string& table,
+                              const std::vector<std::string>& keys);
+
+    /// Check whether a row is known not to exist.
+    ///
+    /// @param generation - Filled in with the negative cache generation if
+    ///                     the row is not known to be absent, for passing to
+    ///                     record_absence() once the row has been read.
+    bool known_absent(const std::string& table,
+                      const std::string& key,
+                      uint64_t& generation);
+
+    /// Remember that a row does not exist.
+    void record_absence(const std::string& table,
+                        const std::string& key,
+                        uint64_t generation);
+
+    /// @returns - true if registration data should be written using the
+    ///            "irs" table.
+    bool use_irs_table() const;
+
+    /// @returns - true if writes of IMS subscriptions should check what the
+    ///            "impu" rows point at, to remove "irs" rows and pointers
+    ///            that are out of date (see Cache::configure_irs_table).
+    bool check_irs_ids() const;
+
+    /// If an "impu" row points at an "irs" row, read the "irs" row and merge
+    /// its columns into the "impu" row's.  Where both rows have a column,
+    /// the most recently written one is kept.  If names is not empty, only
+    /// those columns of the "irs" row are read.
+    void merge_irs_columns(CassandraStore::ClientInterface* client,
+                           std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns,
+                           const std::vector<std::string>& names = std::vector<std::string>());
+
+    /// The cache the operation was submitted to.  NULL if the operation was
+    /// not submitted through Cache::do_async.
+    Cache* _cache;
+
+    /// The coalescing key this operation is registered as in flight under,
+    /// or empty if it isn't.
+    std::string _in_flight_key;
+
+    /// Whether this operation can be run by the write-behind stage.
+    bool _write_behind;
+
+    /// Whether on_submit completed this operation, so that running it only
+    /// calls its transaction back.
+    bool _completed;
+
+    /// The operation's deadline.  Zero if it has none.
+    struct timespec _deadline;
+
+    /// Set on reads that may be hedged, so that the two attempts at the
+    /// read go to different Cassandra nodes whichever of them starts first.
+    /// The operation records the index of the node it is running on in
+    /// _attempt_node (-1 once it isn't running), and avoids the node in
+    /// _other_attempt_node if another can be used.  NULL on other
+    /// operations, and unused if only one node is configured.
+    std::atomic<int>* _attempt_node;
+    const std::atomic<int>* _other_attempt_node;
+
+    /// Identical operations (and their transactions) waiting for this one to
+    /// complete.  Protected by the cache's _in_flight_reads_lock.
+    CoalescedOperations _coalesced;
+  };
+
   /// @class PutRegData write the registration data for some number of public IDs.
-  class PutRegData : public CassandraStore::Operation
+  class PutRegData : public CacheOperation
   {
   public:
     /// Constructors. Stores off the public IDs that we're changing, the
@@ -106,8 +828,29 @@ public:
     int64_t _timestamp;
     int32_t _ttl;
 
-    std::map<std::string, std::string> _columns;
-    std::vector<CassandraStore::RowColumns> _to_put;
+    PooledColumns _columns;
+    std::vector<CassandraStore::RowColumns,
+                PoolAllocator<CassandraStore::RowColumns> > _to_put;
+
+    bool on_submit();
+    bool get_batchable_writes(std::vector<CassandraStore::RowColumns>& rows,
+                              int64_t& timestamp,
+                              int32_t& ttl);
+    void on_written();
+    std::string affinity_key() const { return first_key(_public_ids); }
+    std::string name() const { return "PutRegData"; }
+
+    // Get the columns to write.
+    void get_writes(std::vector<CassandraStore::RowColumns>& rows);
+
+    // @returns - true if the "impu" rows must be read before writing, to
+    //            find "irs" rows and pointers that are out of date.
+    bool checks_irs_ids() const;
+
+    // Read what the "impu" rows point at, and get the "irs" rows and
+    // pointers that this write leaves out of date.
+    void get_stale_irs_rows(CassandraStore::ClientInterface* client,
+                            std::vector<CassandraStore::RowColumns>& to_delete);
 
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
@@ -130,7 +873,7 @@ public:
                           ttl);
   }
 
-  class PutAssociatedPrivateID : public CassandraStore::Operation
+  class PutAssociatedPrivateID : public CacheOperation
   {
   public:
     /// Give a set of public IDs (representing an implicit registration set) an associated private ID.
@@ -149,6 +892,14 @@ public:
     int64_t _timestamp;
     int32_t _ttl;
 
+    bool on_submit();
+    bool get_batchable_writes(std::vector<CassandraStore::RowColumns>& rows,
+                              int64_t& timestamp,
+                              int32_t& ttl);
+    void on_written();
+    Priority priority() const { return PRIORITY_LOW; }
+    std::string affinity_key() const { return first_key(_impus); }
+    std::string name() const { return "PutAssociatedPrivateID"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -161,7 +912,7 @@ public:
     return new PutAssociatedPrivateID(impus, impi, timestamp, ttl);
   }
 
-  class PutAssociatedPublicID : public CassandraStore::Operation
+  class PutAssociatedPublicID : public CacheOperation
   {
   public:
     /// Give a private_id an associated public ID.
@@ -180,6 +931,14 @@ public:
     int64_t _timestamp;
     int32_t _ttl;
 
+    bool on_submit();
+    bool get_batchable_writes(std::vector<CassandraStore::RowColumns>& rows,
+                              int64_t& timestamp,
+                              int32_t& ttl);
+    void on_written();
+    Priority priority() const { return PRIORITY_LOW; }
+    std::string affinity_key() const { return _private_id; }
+    std::string name() const { return "PutAssociatedPublicID"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -191,7 +950,7 @@ public:
     return new PutAssociatedPublicID(private_id, assoc_public_id, timestamp, ttl);
   }
 
-  class PutAuthVector : public CassandraStore::Operation
+  class PutAuthVector : public CacheOperation
   {
   public:
     /// Set the authorization vector used for a private ID.
@@ -213,6 +972,10 @@ public:
     int64_t _timestamp;
     int32_t _ttl;
 
+    bool on_submit();
+    Priority priority() const { return PRIORITY_LOW; }
+    std::string affinity_key() const { return first_key(_private_ids); }
+    std::string name() const { return "PutAuthVector"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -224,13 +987,33 @@ public:
     return new PutAuthVector(private_id, auth_vector, timestamp, ttl);
   }
 
-  class GetRegData : public CassandraStore::Operation
+  /// Flags for the parts of the registration data that GetRegData and
+  /// GetRegDataMulti read.  Callers that only need some of the data can
+  /// avoid reading the (possibly large) IMS subscription XML.
+  enum RegDataColumns
+  {
+    /// The IMS subscription XML and its summary.
+    REG_DATA_XML = 0x01,
+    /// The registration state.
+    REG_DATA_REG_STATE = 0x02,
+    /// The associated IMPIs.  These can only be found by reading the whole
+    /// row, so requesting them reads everything.
+    REG_DATA_IMPIS = 0x04,
+    /// The charging addresses.
+    REG_DATA_CHARGING_ADDRS = 0x08,
+    REG_DATA_ALL = 0x0F
+  };
+
+  class GetRegData : public CacheOperation
   {
   public:
     /// Get the IMS subscription XML for a public identity.
     ///
     /// @param public_id the public identity.
-    GetRegData(const std::string& public_id);
+    /// @param columns   the parts of the registration data to read (a
+    ///                  combination of RegDataColumns).  Those that aren't
+    ///                  read are left in their default state in the result.
+    GetRegData(const std::string& public_id, int columns = REG_DATA_ALL);
     virtual ~GetRegData();
     virtual void get_result(std::pair<RegistrationState, std::string>& result);
 
@@ -256,27 +1039,51 @@ public:
     /// @param charging_addrs the charging addresses for this public identity.
     virtual void get_charging_addrs(ChargingAddresses& charging_addrs);
 
+    /// Access the summary of the IMS subscription, so that the caller
+    /// doesn't have to parse the XML to find the identities in it.
+    ///
+    /// @param summary the summary of the IMS subscription XML.
+    virtual void get_irs_summary(IRSSummary& summary);
+
     struct Result
     {
       std::string xml;
       RegistrationState state;
       std::vector<std::string> impis;
       ChargingAddresses charging_addrs;
+      IRSSummary summary;
     };
     virtual void get_result(Result& result);
 
   protected:
     // Request parameters.
     std::string _public_id;
+    int _columns;
 
     // Result.
     std::string _xml;
     RegistrationState _reg_state;
     int32_t _xml_ttl;
     int32_t _reg_state_ttl;
-    std::vector<std::string> _impis;
+    PooledStrings _impis;
     ChargingAddresses _charging_addrs;
-
+    IRSSummary _irs_summary;
+
+    // Generation of the registration data cache when the read was
+    // submitted.
+    uint64_t _reg_data_cache_generation;
+
+    // Generation of the negative cache when the read was submitted.
+    uint64_t _negative_cache_generation;
+
+    bool on_submit();
+    std::string coalescing_key() const;
+    void copy_result(const CacheOperation& other);
+    Priority priority() const { return PRIORITY_HIGH; }
+    std::string affinity_key() const { return _public_id; }
+    std::string name() const { return "GetRegData"; }
+    bool hedgeable() const { return true; }
+    CacheOperation* clone() const;
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -285,6 +1092,69 @@ public:
     return new GetRegData(public_id);
   }
 
+  virtual GetRegData* create_GetRegData(const std::string& public_id,
+                                        int columns)
+  {
+    return new GetRegData(public_id, columns);
+  }
+
+  /// @class GetRegDataMulti get the registration data for several public IDs
+  /// with a single Cassandra request.
+  class GetRegDataMulti : public CacheOperation
+  {
+  public:
+    /// Get the registration data for some public identities.
+    ///
+    /// @param public_ids the public identities.
+    /// @param columns    the parts of the registration data to read, as for
+    ///                   GetRegData.
+    GetRegDataMulti(const std::vector<std::string>& public_ids,
+                    int columns = REG_DATA_ALL);
+    virtual ~GetRegDataMulti();
+
+    /// Access the result of the request.
+    ///
+    /// @param results the registration data, keyed by public identity.
+    ///                Every requested public identity has an entry.  Those
+    ///                that were not found are NOT_REGISTERED with no XML,
+    ///                exactly as for GetRegData.
+    virtual void get_result(std::map<std::string, GetRegData::Result>& results);
+
+  protected:
+    // Request parameters.
+    std::vector<std::string> _public_ids;
+    int _columns;
+
+    // Result.
+    typedef std::map<std::string,
+                     RegDataCache::RegData,
+                     std::less<std::string>,
+                     PoolAllocator<std::pair<const std::string,
+                                             RegDataCache::RegData> > > RegDataMap;
+    RegDataMap _reg_data;
+
+    // The public IDs that need to be read from Cassandra (i.e. that were not
+    // found in the in-process caches), with the generations of those caches
+    // when the read was submitted.
+    PooledGenerations _reg_data_cache_generations;
+    PooledGenerations _negative_cache_generations;
+
+    bool on_submit();
+    std::string name() const { return "GetRegDataMulti"; }
+    bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
+  };
+
+  virtual GetRegDataMulti* create_GetRegDataMulti(const std::vector<std::string>& public_ids)
+  {
+    return new GetRegDataMulti(public_ids);
+  }
+
+  virtual GetRegDataMulti* create_GetRegDataMulti(const std::vector<std::string>& public_ids,
+                                                  int columns)
+  {
+    return new GetRegDataMulti(public_ids, columns);
+  }
+
   /// Get all the public IDs that are associated with one or more
   /// private IDs.
 
@@ -292,7 +1162,7 @@ public:
   // database operation that stores associations between IMPIs and
   // primary public IDs for use in handling RTRs, see GetAssociatedPrimaryPublicIDs.
 
-  class GetAssociatedPublicIDs : public CassandraStore::Operation
+  class GetAssociatedPublicIDs : public CacheOperation
   {
   public:
     /// Get the public Ids that are associated with a single private ID.
@@ -316,8 +1186,19 @@ public:
     std::vector<std::string> _private_ids;
 
     // Result.
-    std::vector<std::string> _public_ids;
-
+    PooledStrings _public_ids;
+
+    // Negative cache generations of the private IDs that must be read.
+    PooledGenerations _negative_cache_generations;
+
+    bool on_submit();
+    std::string coalescing_key() const;
+    void copy_result(const CacheOperation& other);
+    Priority priority() const { return PRIORITY_HIGH; }
+    std::string affinity_key() const { return first_key(_private_ids); }
+    std::string name() const { return "GetAssociatedPublicIDs"; }
+    bool hedgeable() const { return true; }
+    CacheOperation* clone() const;
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -340,7 +1221,7 @@ public:
   /// when we have a HSS) not the "impi" table (storing the SIP digest
   /// HA1 and all the public IDs associated with this IMPI, and only
   /// used when subscribers are locally provisioned).
-  class GetAssociatedPrimaryPublicIDs : public CassandraStore::Operation
+  class GetAssociatedPrimaryPublicIDs : public CacheOperation
   {
   public:
     /// Get the primary public Ids that are associated with a single private ID.
@@ -360,8 +1241,11 @@ public:
     std::vector<std::string> _private_ids;
 
     // Result.
-    std::vector<std::string> _public_ids;
+    PooledStrings _public_ids;
 
+    std::string name() const { return "GetAssociatedPrimaryPublicIDs"; }
+    bool hedgeable() const { return true; }
+    CacheOperation* clone() const;
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -377,7 +1261,7 @@ public:
     return new GetAssociatedPrimaryPublicIDs(private_ids);
   }
 
-  class GetAuthVector : public CassandraStore::Operation
+  class GetAuthVector : public CacheOperation
   {
   public:
     /// Get the auth vector of a private ID.
@@ -408,6 +1292,17 @@ public:
     // Result.
     DigestAuthVector _auth_vector;
 
+    // Generation of the negative cache when the read was submitted.
+    uint64_t _negative_cache_generation;
+
+    bool on_submit();
+    std::string coalescing_key() const;
+    void copy_result(const CacheOperation& other);
+    Priority priority() const { return PRIORITY_HIGH; }
+    std::string affinity_key() const { return _private_id; }
+    std::string name() const { return "GetAuthVector"; }
+    bool hedgeable() const { return true; }
+    CacheOperation* clone() const;
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -422,7 +1317,7 @@ public:
     return new GetAuthVector(private_id, public_id);
   }
 
-  class DeletePublicIDs : public CassandraStore::Operation
+  class DeletePublicIDs : public CacheOperation
   {
   public:
     /// Delete several public IDs from the cache, and also dissociate
@@ -453,6 +1348,9 @@ public:
     std::vector<std::string> _impis;
     int64_t _timestamp;
 
+    bool on_submit();
+    std::string affinity_key() const { return first_key(_public_ids); }
+    std::string name() const { return "DeletePublicIDs"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -472,7 +1370,7 @@ public:
     return new DeletePublicIDs(public_id, impis, timestamp);
   }
 
-  class DeletePrivateIDs : public CassandraStore::Operation
+  class DeletePrivateIDs : public CacheOperation
   {
   public:
     /// Delete a single private ID from the cache.
@@ -491,6 +1389,9 @@ public:
     std::vector<std::string> _private_ids;
     int64_t _timestamp;
 
+    bool on_submit();
+    std::string affinity_key() const { return first_key(_private_ids); }
+    std::string name() const { return "DeletePrivateIDs"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -515,7 +1416,7 @@ public:
   /// may specify a private ID and require the S-CSCF to clear all data
   /// and bindings associated with it.
 
-  class DeleteIMPIMapping : public CassandraStore::Operation
+  class DeleteIMPIMapping : public CacheOperation
   {
   public:
     /// Delete a mapping from private IDs to the IMPUs they have authenticated.
@@ -528,6 +1429,8 @@ public:
     std::vector<std::string> _private_ids;
     int64_t _timestamp;
 
+    Priority priority() const { return PRIORITY_LOW; }
+    std::string name() const { return "DeleteIMPIMapping"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -551,7 +1454,7 @@ public:
 
   /// The main use-case is for Registration-Termination-Requests.
 
-  class DissociateImplicitRegistrationSetFromImpi : public CassandraStore::Operation
+  class DissociateImplicitRegistrationSetFromImpi : public CacheOperation
   {
   public:
     /// Delete a mapping from private IDs to the IMPUs they have authenticated.
@@ -569,6 +1472,9 @@ public:
     std::vector<std::string> _impis;
     int64_t _timestamp;
 
+    bool on_submit();
+    std::string affinity_key() const { return first_key(_impus); }
+    std::string name() const { return "DissociateImplicitRegistrationSetFromImpi"; }
     bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
   };
 
@@ -587,6 +1493,90 @@ public:
   {
     return new DissociateImplicitRegistrationSetFromImpi(impus, impis, timestamp);
   }
+
+  /// @class ScanRows read a page of the rows of a table in token order, so
+  /// that the table can be exported without reading it all into memory.
+  /// Connections to Cassandra and stores that implement RangeScanInterface
+  /// support this, and the operation fails with INVALID_REQUEST on any
+  /// other.
+  class ScanRows : public CacheOperation
+  {
+  public:
+    /// A row, with all of its columns.
+    struct Row
+    {
+      std::string key;
+      std::map<std::string, std::string> columns;
+    };
+
+    /// Read the first page of a token range.
+    ///
+    /// @param table       the table to scan.
+    /// @param start_token the token the range starts just after.
+    /// @param end_token   the last token in the range.
+    /// @param max_rows    the most rows to return.
+    ScanRows(const std::string& table,
+             int64_t start_token,
+             int64_t end_token,
+             int32_t max_rows);
+
+    /// Read the next page of a token range.
+    ///
+    /// @param last_key    the key of the last row of the previous page.
+    ScanRows(const std::string& table,
+             const std::string& last_key,
+             int64_t end_token,
+             int32_t max_rows);
+    virtual ~ScanRows() {};
+
+    /// Access the result of the request.
+    ///
+    /// @param rows the rows read, in token order.
+    virtual void get_result(std::vector<Row>& rows);
+
+    /// @returns whether there may be more rows in the range after this page.
+    bool more() const { return _more; }
+
+    /// @returns the key of the last row read, which the next page carries on
+    /// from.  This may be after the last row returned, as rows deleted with
+    /// deletion markers are skipped.  Empty if no rows were read.
+    const std::string& last_row_key() const { return _last_row_key; }
+
+  protected:
+    // Request parameters.
+    std::string _table;
+    int64_t _start_token;
+    std::string _last_key;
+    int64_t _end_token;
+    int32_t _max_rows;
+
+    // Result.
+    std::vector<Row> _rows;
+    bool _more;
+    std::string _last_row_key;
+
+    // Scans run behind all other requests, so that an export doesn't delay
+    // live traffic.
+    Priority priority() const { return PRIORITY_LOW; }
+    std::string name() const { return "ScanRows"; }
+    bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail);
+  };
+
+  virtual ScanRows* create_ScanRows(const std::string& table,
+                                    int64_t start_token,
+                                    int64_t end_token,
+                                    int32_t max_rows)
+  {
+    return new ScanRows(table, start_token, end_token, max_rows);
+  }
+
+  virtual ScanRows* create_ScanRows(const std::string& table,
+                                    const std::string& last_key,
+                                    int64_t end_token,
+                                    int32_t max_rows)
+  {
+    return new ScanRows(table, last_key, end_token, max_rows);
+  }
 };
 
 #endif
@@ -0,0 +1,67 @@
+/**
+ * @file columncompression.h compression of large column values.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef COLUMNCOMPRESSION_H__
+#define COLUMNCOMPRESSION_H__
+
+#include <string>
+
+/// Encoding of column values that are worth compressing (such as IMS
+/// subscription XML).
+///
+/// A compressed value starts with a NUL byte (which can't appear in XML, so
+/// can't be the start of an uncompressed value), then a format version byte,
+/// then the length of the uncompressed value (4 bytes, network byte order),
+/// then the value compressed with zlib.  Values that don't start with a NUL
+/// byte are stored uncompressed.
+namespace ColumnCompression
+{
+  /// Compress a value.
+  ///
+  /// @returns - The compressed value, or the value itself if compressing it
+  ///            would not make it any smaller.
+  std::string compress(const std::string& value);
+
+  /// Decode a value read from Cassandra, decompressing it if necessary.
+  ///
+  /// @param value   - The value as stored in Cassandra.
+  /// @param decoded - Filled in with the decoded value.
+  /// @returns       - false if the value is compressed but can't be
+  ///                  decompressed.
+  bool decode(const std::string& value, std::string& decoded);
+}
+
+#endif
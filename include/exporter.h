@@ -0,0 +1,137 @@
+/**
+ * @file exporter.h Streams the rows of the cache's tables out for auditing
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef EXPORTER_H__
+#define EXPORTER_H__
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cache.h"
+
+/// Exports the rows of the cache's tables, for audits, migrations and
+/// reconciliation with the HSS.
+///
+/// The token ring is split into ranges that are scanned in parallel, a page
+/// at a time, and each page is written out as soon as it is read, so memory
+/// use doesn't depend on the size of the table.  The rate at which rows are
+/// read can be limited, so that an export can run alongside live traffic.
+///
+/// Each row is written as a line:
+///
+///   <table> <key> <name>=<value> <name>=<value> ...
+///
+/// with spaces, '=', '%' and any unprintable characters percent-encoded.
+/// Lines from different ranges are interleaved, so the rows aren't in any
+/// particular order.
+class Exporter
+{
+public:
+  /// Constructor.
+  ///
+  /// @param cache            - The cache to read from.  It must be started.
+  /// @param num_threads      - The number of ranges to scan in parallel.
+  /// @param page_size        - The number of rows to read at a time.
+  /// @param max_rows_per_sec - The most rows to read per second.  Zero for
+  ///                           no limit.
+  Exporter(Cache* cache,
+           unsigned int num_threads = 4,
+           int32_t page_size = 100,
+           unsigned long max_rows_per_sec = 0);
+  virtual ~Exporter();
+
+  /// Write all the rows of a table to a stream.  Blocks until done.
+  ///
+  /// @param table  - The table.
+  /// @param output - The stream to write to.
+  /// @param rows   - (out) The number of rows written.
+  /// @returns      - true if the whole table was written.
+  bool export_table(const std::string& table,
+                    std::ostream& output,
+                    size_t& rows);
+
+  /// Percent-encode a key, column name or value.
+  static std::string encode(const std::string& data);
+
+  /// Split the token ring into ranges.
+  ///
+  /// @param num_ranges - The number of ranges.
+  /// @param ranges     - (out) The start (exclusive) and end (inclusive)
+  ///                     tokens of each range.
+  static void split_ring(unsigned int num_ranges,
+                         std::vector<std::pair<int64_t, int64_t> >& ranges);
+
+private:
+  // The scan of a single range.
+  struct Scan
+  {
+    Exporter* exporter;
+    std::string table;
+    int64_t start_token;
+    int64_t end_token;
+    std::ostream* output;
+    size_t rows;
+    bool success;
+  };
+
+  static void* scan_thread_entry(void* scan);
+  void scan(Scan* scan);
+
+  // Read a page of a range, retrying if it fails.
+  bool read_page(Cache::ScanRows* op, const std::string& table);
+
+  // Wait until reading some more rows will keep within the rate limit.
+  void throttle(size_t rows);
+
+  Cache* _cache;
+  unsigned int _num_threads;
+  int32_t _page_size;
+  unsigned long _max_rows_per_sec;
+
+  // Lines are written to the output a page at a time under this lock.
+  pthread_mutex_t _output_lock;
+
+  // The time (on the monotonic clock) until which the rows read so far are
+  // paid for.
+  pthread_mutex_t _rate_lock;
+  struct timespec _paid_until;
+};
+
+#endif
@@ -46,6 +46,7 @@
 #include "statisticsmanager.h"
 #include "sas.h"
 #include "sproutconnection.h"
+#include "reregistrationscheduler.h"
 
 // Result-Code AVP constants
 const int32_t DIAMETER_SUCCESS = 2001;
@@ -90,16 +91,20 @@ const std::string JSON_SCSCF = "scscf";
 class HssCacheTask : public HttpStackUtils::Task
 {
 public:
-  HssCacheTask(HttpStack::Request& req, SAS::TrailId trail) :
-    HttpStackUtils::Task(req, trail)
-  {};
+  HssCacheTask(HttpStack::Request& req, SAS::TrailId trail);
 
   static void configure_diameter(Diameter::Stack* diameter_stack,
                                  const std::string& dest_realm,
                                  const std::string& dest_host,
                                  const std::string& server_name,
                                  Cx::Dictionary* dict);
-  static void configure_cache(Cache* cache);
+  /// @param cache       - The cache.
+  /// @param deadline_ms - How long after a request arrives the cache
+  ///                      operations it makes can be queued for before they
+  ///                      are dropped.  Zero for no limit, unless the request
+  ///                      has an X-Deadline header, which holds the number of
+  ///                      milliseconds the requester will wait.
+  static void configure_cache(Cache* cache, long deadline_ms = 0);
   static void configure_stats(StatisticsManager* stats_manager);
 
   inline Cache* cache() const
@@ -109,6 +114,9 @@ public:
 
   void on_diameter_timeout();
 
+  /// Give a cache operation this request's deadline.
+  void set_deadline(CassandraStore::Operation* op);
+
   // Stats the HSS cache handlers can update.
   enum StatsFlags
   {
@@ -199,7 +207,8 @@ public:
   };
 
   template <class H>
-  class CacheTransaction : public CassandraStore::Transaction
+  class CacheTransaction : public CassandraStore::Transaction,
+                           public PooledObject
   {
   public:
     typedef void(H::*success_clbk_t)(CassandraStore::Operation*);
@@ -271,7 +280,12 @@ protected:
   static std::string _server_name;
   static Cx::Dictionary* _dict;
   static Cache* _cache;
+  static long _cache_deadline_ms;
   static StatisticsManager* _stats_manager;
+
+  // The time (on the monotonic clock) after which this request's cache
+  // operations aren't worth running.  Zero if there is no deadline.
+  struct timespec _deadline;
 };
 
 class ImpiTask : public HssCacheTask
@@ -425,13 +439,65 @@ public:
   {
     Config(bool _hss_configured = true,
            int _hss_reregistration_time = 3600,
-           int _diameter_timeout_ms = 200) :
+           int _diameter_timeout_ms = 200,
+           ReregistrationScheduler* _reregistration_scheduler = NULL) :
       hss_configured(_hss_configured),
       hss_reregistration_time(_hss_reregistration_time),
-      diameter_timeout_ms(_diameter_timeout_ms) {}
+      diameter_timeout_ms(_diameter_timeout_ms),
+      reregistration_scheduler(_reregistration_scheduler) {}
     bool hss_configured;
     int hss_reregistration_time;
     int diameter_timeout_ms;
+
+    // Re-registers IRSs with the HSS ahead of time.  NULL if re-registrations
+    // are only made when a REGISTER finds they're needed.
+    ReregistrationScheduler* reregistration_scheduler;
+  };
+
+  /// Re-registers IRSs with the HSS off the request path, for the
+  /// re-registration scheduler.
+  class BackgroundReregisterer : public ReregistrationScheduler::Reregisterer
+  {
+  public:
+    BackgroundReregisterer(const Config* cfg) : _cfg(cfg) {}
+    void reregister(const std::string& impu, const std::string& impi);
+
+  private:
+    const Config* _cfg;
+  };
+
+  /// A single background re-registration.  This checks the IRS is still
+  /// registered in the cache, sends a RE_REGISTRATION SAR, and caches the
+  /// User-Data from the answer.
+  class BackgroundReregistration
+  {
+  public:
+    BackgroundReregistration(const Config* cfg,
+                             const std::string& impu,
+                             const std::string& impi);
+    void run();
+
+    SAS::TrailId trail() const { return _trail; }
+    void record_penalty() {}
+
+    void on_get_reg_data_success(CassandraStore::Operation* op);
+    void on_get_reg_data_failure(CassandraStore::Operation* op,
+                                 CassandraStore::ResultCode error,
+                                 std::string& text);
+    void on_sar_response(Diameter::Message& rsp);
+    void on_sar_timeout();
+
+    typedef HssCacheTask::CacheTransaction<BackgroundReregistration> CacheTransaction;
+    typedef HssCacheTask::DiameterTransaction<BackgroundReregistration> DiameterTransaction;
+
+  private:
+    // Tell the scheduler how it went, and delete this object.
+    void complete(bool success);
+
+    const Config* _cfg;
+    std::string _impu;
+    std::string _impi;
+    SAS::TrailId _trail;
   };
 
   ImpuRegDataTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
@@ -538,10 +604,10 @@ private:
                                             CassandraStore::ResultCode error,
                                             std::string& text);
   void get_registration_sets();
-  void get_registration_set_success(CassandraStore::Operation* op);
-  void get_registration_set_failure(CassandraStore::Operation* op,
-                                    CassandraStore::ResultCode error,
-                                    std::string& text);
+  void get_registration_sets_success(CassandraStore::Operation* op);
+  void get_registration_sets_failure(CassandraStore::Operation* op,
+                                     CassandraStore::ResultCode error,
+                                     std::string& text);
   void delete_registrations();
   void dissociate_implicit_registration_sets();
   void delete_impi_mappings();
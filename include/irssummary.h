@@ -0,0 +1,80 @@
+/**
+ * @file irssummary.h summary of the identities in an IMS subscription.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef IRSSUMMARY_H__
+#define IRSSUMMARY_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/// The identities in an IMS subscription that homestead needs to process
+/// requests, so that they can be stored alongside the XML and read without
+/// parsing it.
+class IRSSummary
+{
+public:
+  /// Default constructor - an empty summary.
+  IRSSummary() : public_ids(), private_id(), xml_hash(hash("")) {}
+
+  /// Build the summary of an IMS subscription by parsing its XML.
+  IRSSummary(const std::string& xml);
+
+  /// The public IDs, in the order they appear in the XML.
+  std::vector<std::string> public_ids;
+
+  /// The private ID, or empty if there isn't one.
+  std::string private_id;
+
+  /// Hash of the XML the summary was built from.
+  uint64_t xml_hash;
+
+  /// @returns - true if this is the summary of the given XML.
+  bool matches(const std::string& xml) const { return xml_hash == hash(xml); }
+
+  /// Serialize the summary for storing in Cassandra.
+  std::string encode() const;
+
+  /// Deserialize a summary read from Cassandra.
+  ///
+  /// @returns - false if the value isn't a valid summary.
+  bool decode(const std::string& value);
+
+  /// 64-bit FNV-1a hash of some XML.
+  static uint64_t hash(const std::string& xml);
+};
+
+#endif
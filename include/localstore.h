@@ -0,0 +1,280 @@
+/**
+ * @file localstore.h embedded storage for the cache's tables.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef LOCALSTORE_H__
+#define LOCALSTORE_H__
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cassandra_store.h"
+#include "rangescan.h"
+
+/// An embedded replacement for a Cassandra cluster, for deployments where
+/// homestead holds the master copy of the subscriber data (i.e. there is no
+/// HSS) and the site is too small to justify running Cassandra.
+///
+/// It implements the same Thrift client interface as a connection to
+/// Cassandra, so the cache's operations run against it unchanged.  Rows are
+/// held in memory per column family, ordered by token so that they can be
+/// scanned in ranges as Cassandra's are, and columns are resolved by
+/// timestamp as Cassandra would.  Every write is appended to a
+/// log before it is applied, and a snapshot of the whole store is written
+/// periodically (after which the log is cut down to the writes made since the
+/// snapshot was taken).  On start up the latest snapshot is mapped into
+/// memory and loaded, and the log is replayed on top of it.
+///
+/// By default a write isn't acknowledged until the log has been flushed to
+/// disk, so an acknowledged write survives a power cut.  Writers waiting for
+/// the log to be flushed share a single flush (a group commit), so this costs
+/// a flush per batch of concurrent writes rather than one per write.  Flushing
+/// can be turned off, in which case a write survives the process crashing
+/// but a power cut can lose the last few seconds of writes.  Either way, a
+/// write is visible to readers as soon as it is logged.
+///
+/// Snapshots and the log are written in the machine's native byte order.
+///
+/// Only one process can use a store's directory at a time.  Another process
+/// can load a copy of the store read-only (to export it, say) while it is
+/// in use, as snapshots aren't swapped in while a copy is being loaded.
+class LocalStore : public CassandraStore::ClientInterface,
+                   public RangeScanInterface
+{
+public:
+  /// Constructor.
+  ///
+  /// @param directory            - The directory holding the log and
+  ///                               snapshots.  It must already exist.
+  /// @param snapshot_interval_ms - How often to write a snapshot.  Zero
+  ///                               disables periodic snapshots.
+  /// @param read_only            - true to load a copy of the store without
+  ///                               taking over its directory.  Nothing is
+  ///                               written to the directory, and writes to
+  ///                               the store fail.
+  /// @param sync_writes          - false to acknowledge writes without
+  ///                               waiting for the log to be flushed to disk.
+  LocalStore(const std::string& directory,
+             long snapshot_interval_ms,
+             bool read_only = false,
+             bool sync_writes = true);
+  virtual ~LocalStore();
+
+  /// Load the store's contents from disk and (unless the store is read-only)
+  /// open the log for writing.
+  ///
+  /// @returns - false if the contents could not be loaded, the log could
+  ///            not be opened, or another process is using the store.
+  bool start();
+
+  /// Write a final snapshot and close the log.
+  void stop();
+
+  /// Write a snapshot of the store's contents and drop what it includes from
+  /// the log.  The contents are copied with writes held off, but writes carry
+  /// on while the copy is written out.
+  ///
+  /// @returns - false if the snapshot could not be written (or the store is
+  ///            read-only), in which case the log is left as it was.
+  bool snapshot();
+
+  /// Methods implementing the client interface.  The consistency level is
+  /// ignored, as there is only one copy of the data.
+  void set_keyspace(const std::string& keyspace) {}
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<org::apache::cassandra::Mutation> > >& mutation_map,
+                    const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+  void get_slice(std::vector<org::apache::cassandra::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const org::apache::cassandra::ColumnParent& column_parent,
+                 const org::apache::cassandra::SlicePredicate& predicate,
+                 const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+  void multiget_slice(std::map<std::string, std::vector<org::apache::cassandra::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const org::apache::cassandra::ColumnParent& column_parent,
+                      const org::apache::cassandra::SlicePredicate& predicate,
+                      const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+  void remove(const std::string& key,
+              const org::apache::cassandra::ColumnPath& column_path,
+              const int64_t timestamp,
+              const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  /// Method implementing the range scan interface.
+  void get_range_slices(std::vector<org::apache::cassandra::KeySlice>& _return,
+                        const org::apache::cassandra::ColumnParent& column_parent,
+                        const org::apache::cassandra::SlicePredicate& predicate,
+                        const org::apache::cassandra::KeyRange& range,
+                        const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  /// @returns the token of a row key.  This is a 64-bit FNV-1a hash of the
+  ///          key, rather than the Murmur3 hash Cassandra uses, but is spread
+  ///          over the same range.
+  static int64_t token(const std::string& key);
+
+  /// @returns the number of rows in a column family.
+  size_t num_rows(const std::string& column_family);
+
+private:
+  struct Column
+  {
+    std::string value;
+    int64_t timestamp;
+
+    // The time (in seconds since the epoch) the column expires.  Zero if it
+    // never does.
+    int64_t expiry_s;
+  };
+
+  typedef std::map<std::string, Column> Row;
+  // Rows are keyed by token and then key, so that a table can be scanned in
+  // token order.
+  typedef std::pair<int64_t, std::string> RowKey;
+  typedef std::map<RowKey, Row> Table;
+
+  static RowKey row_key(const std::string& key)
+  {
+    return RowKey(token(key), key);
+  }
+
+  // A change to a single row.  The log and the snapshots are both made up of
+  // these.
+  struct Change
+  {
+    enum Type
+    {
+      PUT_COLUMN = 'P',
+      DELETE_COLUMN = 'D',
+      DELETE_ROW = 'R'
+    };
+
+    Type type;
+    std::string table;
+    std::string key;
+    std::string name;
+    Column column;
+  };
+
+  // Apply changes to the in-memory tables.  Must be called with the lock held
+  // for writing.
+  void apply(const std::vector<Change>& changes);
+
+  // Log changes and then apply them.
+  void write(const std::vector<Change>& changes);
+
+  // Wait for the log to be flushed to disk up to a write, flushing it if no
+  // other thread is.
+  //
+  // @param seq  - The write's sequence number.
+  // @returns    - false if the log could not be flushed.
+  bool sync(uint64_t seq);
+
+  // Write a snapshot of some tables to a file, and flush it to disk.
+  bool write_snapshot(const std::map<std::string, Table>& tables,
+                      const std::string& path);
+
+  // Swap a snapshot in for the current one, and cut the log down to what was
+  // written to it after the given length (i.e. after the snapshot's contents
+  // were copied).  Must be called with the lock held for writing.
+  bool install_snapshot(const std::string& path, size_t log_length);
+
+  // Copy the columns of a row selected by a predicate into a Thrift result.
+  static void select(const Row& row,
+                     const org::apache::cassandra::SlicePredicate& predicate,
+                     int64_t now_s,
+                     std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns);
+
+  // Remove expired columns, and rows left empty.
+  void purge_expired();
+
+  // Encode changes as a record, and decode records.  A record is a length
+  // and checksum followed by the changes.
+  static void encode(const std::vector<Change>& changes, std::string& record);
+  static bool decode(const char* data,
+                     size_t length,
+                     size_t& consumed,
+                     std::vector<Change>& changes);
+
+  // Apply all the complete records in a file.
+  //
+  // @param valid_length - Filled in with the length of the file up to the
+  //                       end of the last complete record.
+  bool load(const std::string& path, size_t& valid_length);
+
+  static void* snapshot_thread_entry(void* store);
+  void snapshot_thread();
+
+  static int64_t now_s();
+
+  std::string _directory;
+  std::string _snapshot_path;
+  std::string _log_path;
+  std::string _lock_path;
+  long _snapshot_interval_ms;
+  bool _read_only;
+  bool _sync_writes;
+
+  // Locked for as long as this process is using the store's directory.
+  int _lock_fd;
+
+  std::map<std::string, Table> _tables;
+  pthread_rwlock_t _lock;
+
+  // The log file, and the length of the complete records in it.  Writes are
+  // serialized by _lock, and the log is only replaced with both _lock (held
+  // for writing) and _sync_lock held.
+  int _log_fd;
+  size_t _log_length;
+
+  // Writes are numbered in the order they are logged.  The following are
+  // protected by _sync_lock.
+  pthread_mutex_t _sync_lock;
+  pthread_cond_t _sync_cond;
+  uint64_t _written_seq;
+  uint64_t _synced_seq;
+  bool _syncing;
+
+  // Only one snapshot can be written at a time.
+  pthread_mutex_t _snapshot_lock;
+
+  pthread_t _snapshot_thread;
+  bool _snapshot_thread_running;
+  bool _terminated;
+  pthread_mutex_t _thread_lock;
+  pthread_cond_t _thread_cond;
+};
+
+#endif
@@ -0,0 +1,300 @@
+/**
+ * @file nativeclient.h Client for Cassandra's native binary protocol.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef NATIVECLIENT_H__
+#define NATIVECLIENT_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/shared_ptr.hpp>
+
+#include "cassandra_store.h"
+#include "rangescan.h"
+
+/// A connection to a Cassandra node over its native binary protocol
+/// (version 3), as an alternative to Thrift.
+///
+/// Any number of threads can use the connection at once.  Each request is
+/// sent on a stream of its own, and a receive thread hands each response to
+/// whoever is waiting for it, so requests don't wait for each other.  The
+/// statements run on the connection are prepared the first time each one is
+/// used.
+///
+/// Errors are reported by throwing the same exceptions as the Thrift client,
+/// so the store handles them in the same way.
+class NativeConnection
+{
+public:
+  /// A statement to run, and the values to bind to its markers.  Values are
+  /// in the protocol's encoding (see bigint and int_value).
+  struct Statement
+  {
+    Statement() : query(), values(), page_size(0), paging_state() {}
+
+    std::string query;
+    std::vector<std::string> values;
+
+    /// The most rows to return at a time, or zero to return them all.
+    int32_t page_size;
+
+    /// Where to carry on reading from, as returned with the previous page.
+    std::string paging_state;
+  };
+
+  /// A value in a row of a result.
+  struct Value
+  {
+    std::string data;
+    bool null;
+  };
+
+  typedef std::vector<Value> Row;
+
+  /// The rows returned by a statement.
+  struct Result
+  {
+    std::vector<Row> rows;
+
+    /// Where to carry on reading from if there are more rows, or empty if
+    /// there aren't.
+    std::string paging_state;
+  };
+
+  NativeConnection(const std::string& hostname, uint16_t port);
+  virtual ~NativeConnection();
+
+  /// Connect to the node and start up the protocol.
+  ///
+  /// @throws TTransportException if the node can't be reached.
+  void connect();
+
+  /// @returns - false if the connection has failed, after which requests on
+  ///            it fail with TTransportException.
+  bool is_connected();
+
+  /// Switch the connection to a keyspace.  Does nothing if it is already
+  /// using that keyspace.
+  void use_keyspace(const std::string& keyspace);
+
+  /// Run some statements, all at once, and wait for all their results.
+  void execute(const std::vector<Statement>& statements,
+               org::apache::cassandra::ConsistencyLevel::type consistency_level,
+               std::vector<Result>& results);
+
+  /// Run a single statement.
+  void execute(const Statement& statement,
+               org::apache::cassandra::ConsistencyLevel::type consistency_level,
+               Result& result);
+
+  /// Run some statements that change a single partition (or several
+  /// partitions independently) as an unlogged batch.
+  void batch(const std::vector<Statement>& statements,
+             org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  /// Encode and decode values of the protocol's integer types.
+  static std::string bigint(int64_t value);
+  static std::string int_value(int32_t value);
+  static int64_t get_bigint(const std::string& data);
+  static int32_t get_int_value(const std::string& data);
+
+  /// The highest stream ID.  Version 3 of the protocol allows 32768 streams
+  /// per connection.
+  static const int MAX_STREAM = 32767;
+
+private:
+  // A request waiting for its response.
+  struct Request
+  {
+    Request(uint8_t opcode, const std::string& body);
+    ~Request();
+
+    uint8_t opcode;
+    std::string body;
+
+    // The following are protected by the connection's lock.
+    bool done;
+    bool failed;
+    uint8_t response_opcode;
+    std::string response;
+    pthread_cond_t cond;
+  };
+
+  // Send requests, each on a free stream.
+  void send(std::vector<Request*>& requests);
+
+  // Wait for the responses to requests.
+  void wait(std::vector<Request*>& requests);
+
+  // Send a request and wait for its response.
+  //
+  // @returns - the opcode of the response.
+  uint8_t exchange(uint8_t opcode, const std::string& body, std::string& response);
+
+  // As exchange, but throws if the response is an error.
+  uint8_t run(uint8_t opcode, const std::string& body, std::string& response);
+
+  // Get the ID of a prepared statement, preparing it if necessary.
+  std::string prepared_id(const std::string& query);
+
+  // Forget a prepared statement, as the node has.
+  void forget_prepared(const std::string& query);
+
+  // Throw the exception corresponding to an error response.
+  static void throw_error(const std::string& body);
+
+  // @returns - true if an error response says a statement isn't prepared.
+  static bool is_unprepared(uint8_t opcode, const std::string& body);
+
+  // Decode a result.
+  static void decode_result(const std::string& body, Result& result);
+
+  // Fail the connection, and every request waiting on it.
+  void fail();
+
+  static void* receive_thread_entry(void* connection);
+  void receive_loop();
+
+  std::string _hostname;
+  uint16_t _port;
+  int _fd;
+
+  pthread_t _receive_thread;
+  bool _receive_thread_running;
+
+  // Frames are written to the socket whole under this lock.
+  pthread_mutex_t _write_lock;
+
+  // The following are protected by _lock.
+  pthread_mutex_t _lock;
+  bool _connected;
+  std::vector<Request*> _streams;
+  std::vector<int16_t> _free_streams;
+  pthread_cond_t _stream_cond;
+  std::map<std::string, std::string> _prepared;
+  std::string _keyspace;
+};
+
+/// A client that makes the requests of the Thrift client interface over a
+/// NativeConnection, which may be shared with other clients.  Column
+/// families are read and written as the tables CQL presents them as, with
+/// columns "key", "column1" and "value".
+class NativeClient : public CassandraStore::ClientInterface,
+                     public RangeScanInterface
+{
+public:
+  NativeClient(boost::shared_ptr<NativeConnection> connection);
+  virtual ~NativeClient();
+
+  /// Methods implementing the client interface.
+  void set_keyspace(const std::string& keyspace);
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<org::apache::cassandra::Mutation> > >& mutation_map,
+                    const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+  void get_slice(std::vector<org::apache::cassandra::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const org::apache::cassandra::ColumnParent& column_parent,
+                 const org::apache::cassandra::SlicePredicate& predicate,
+                 const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+  void multiget_slice(std::map<std::string, std::vector<org::apache::cassandra::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const org::apache::cassandra::ColumnParent& column_parent,
+                      const org::apache::cassandra::SlicePredicate& predicate,
+                      const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+  void remove(const std::string& key,
+              const org::apache::cassandra::ColumnPath& column_path,
+              const int64_t timestamp,
+              const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  /// Method implementing the range scan interface.  Only ranges of tokens
+  /// are supported.
+  void get_range_slices(std::vector<org::apache::cassandra::KeySlice>& _return,
+                        const org::apache::cassandra::ColumnParent& column_parent,
+                        const org::apache::cassandra::SlicePredicate& predicate,
+                        const org::apache::cassandra::KeyRange& range,
+                        const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+private:
+  // The number of columns read at a time when scanning a range.
+  static const int32_t SCAN_PAGE_SIZE = 1000;
+
+  // Build the statement reading the columns of a row selected by a
+  // predicate.
+  //
+  // @returns - false if the predicate can't select any columns.
+  static bool select_statement(const std::string& column_family,
+                               const std::string& key,
+                               const org::apache::cassandra::SlicePredicate& predicate,
+                               NativeConnection::Statement& statement);
+
+  // Convert a row of a result (name, value, write time and TTL) to a
+  // column.
+  static void to_column(const NativeConnection::Row& row,
+                        size_t first,
+                        org::apache::cassandra::ColumnOrSuperColumn& column);
+
+  // @returns - true if a predicate selects a column.
+  static bool selects(const org::apache::cassandra::SlicePredicate& predicate,
+                      const std::string& name);
+
+  // Quote the name of a column family for use in a statement.
+  static std::string table(const std::string& column_family);
+
+  boost::shared_ptr<NativeConnection> _connection;
+};
+
+/// The native protocol connections to each node, which are shared by all
+/// the threads using the node.
+class NativeConnectionPool
+{
+public:
+  NativeConnectionPool();
+  virtual ~NativeConnectionPool();
+
+  /// Get a client for a node.  If there isn't a working connection to the
+  /// node, a new one is made.
+  ///
+  /// @throws TTransportException if the node can't be reached.
+  CassandraStore::ClientInterface* get_client(const std::string& hostname,
+                                              uint16_t port);
+
+private:
+  pthread_mutex_t _lock;
+  std::map<std::pair<std::string, uint16_t>, boost::shared_ptr<NativeConnection> > _connections;
+};
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ * @file negativecache.h cache of identities known not to exist.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef NEGATIVECACHE_H__
+#define NEGATIVECACHE_H__
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <pthread.h>
+
+/// A short-lived record of cache rows that were found not to exist, keyed by
+/// column family and row key.  Lookups for identities that don't exist (from
+/// misconfigured UEs or scanners, say) are then answered without going to
+/// Cassandra.
+///
+/// Any write to a row must invalidate its entry.  As with RegDataCache,
+/// readers note the shard generation before reading and only record an
+/// absence if no invalidation has happened since, so a read that races with
+/// a write can't leave a stale entry behind.
+class NegativeCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param max_entries - The maximum number of rows to remember.
+  /// @param ttl_ms      - How long an absence is remembered for.
+  /// @param num_shards  - The number of independently locked shards.
+  NegativeCache(size_t max_entries,
+                long ttl_ms,
+                int num_shards = DEFAULT_NUM_SHARDS);
+  virtual ~NegativeCache();
+
+  /// @returns whether the specified row is known not to exist.
+  bool is_absent(const std::string& table, const std::string& key);
+
+  /// Get the current generation for the shard that holds a row.  This must
+  /// be called before issuing the read whose result will be passed to
+  /// record_absent().
+  uint64_t generation(const std::string& table, const std::string& key);
+
+  /// Remember that a row does not exist.
+  ///
+  /// @param generation - The generation returned by generation() before the
+  ///                     row was read.  Nothing is recorded if the row has
+  ///                     been invalidated since.
+  /// @returns          - Whether the absence was recorded.
+  bool record_absent(const std::string& table,
+                     const std::string& key,
+                     uint64_t generation);
+
+  /// Forget any absence recorded for a row, because it is being written.
+  void invalidate(const std::string& table, const std::string& key);
+
+  /// @returns the number of rows currently remembered.
+  size_t size();
+
+  static const int DEFAULT_NUM_SHARDS = 16;
+
+private:
+  struct Entry
+  {
+    unsigned long expiry_ms;
+    std::list<std::string>::iterator position;
+  };
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    uint64_t generation;
+    std::unordered_map<std::string, Entry> entries;
+
+    // Row identifiers in the order they were recorded.
+    std::list<std::string> order;
+  };
+
+  static std::string row_id(const std::string& table, const std::string& key);
+  Shard& shard_for(const std::string& id);
+  void remove_entry(Shard& shard,
+                    std::unordered_map<std::string, Entry>::iterator entry);
+  static unsigned long now_ms();
+
+  std::vector<Shard*> _shards;
+  size_t _max_entries_per_shard;
+  long _ttl_ms;
+};
+
+#endif
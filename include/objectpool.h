@@ -0,0 +1,231 @@
+/**
+ * @file objectpool.h per-thread pools of small, short-lived objects.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef OBJECTPOOL_H__
+#define OBJECTPOOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <limits>
+#include <new>
+#include <utility>
+
+/// Per-thread free lists of memory for the objects that are created and
+/// destroyed for every request, such as cache operations and transactions.
+///
+/// Memory is handed out in a small number of size classes.  Each block
+/// belongs to the thread that first allocated it, and is always returned to
+/// that thread's free lists, however many threads it passes through.  This
+/// matters because these objects are typically allocated on one thread (the
+/// one handling a request) and freed on another (the cache worker that ran
+/// the operation).  Blocks freed by the owning thread go straight back on
+/// its free list.  Blocks freed by any other thread are pushed onto a
+/// lock-free queue of the owner's, which the owner takes over once its own
+/// free list is empty.  So in the steady state these objects don't go to the
+/// heap at all, and threads never contend for a lock.
+///
+/// Each free list is bounded, and blocks beyond that are returned to the
+/// heap.  Blocks still in use when their owner exits are returned to the
+/// heap when they are freed.
+///
+/// Classes use the pool by deriving from PooledObject, and containers by
+/// using PoolAllocator.
+class ObjectPool
+{
+public:
+  /// Allocate memory for an object.  Objects larger than MAX_POOLED_SIZE
+  /// come straight from the heap.
+  static void* allocate(size_t size);
+
+  /// Free memory returned by allocate().  May be called on any thread.
+  ///
+  /// @param size - The size that was passed to allocate().
+  static void release(void* ptr, size_t size);
+
+  /// Allocation counts for the calling thread, so that UTs can check how
+  /// many allocations were served without going to the heap.
+  struct Stats
+  {
+    uint64_t pool_allocations;
+    uint64_t heap_allocations;
+
+    /// The number of pooled blocks allocated by the thread that haven't yet
+    /// been freed (on any thread).
+    uint64_t outstanding;
+  };
+  static Stats thread_stats();
+
+  /// Free any blocks on the calling thread's free lists.
+  static void trim();
+
+  static const size_t GRANULARITY = 64;
+  static const size_t MAX_POOLED_SIZE = 2048;
+  static const size_t MAX_FREE_PER_CLASS = 256;
+
+private:
+  static const size_t NUM_CLASSES = MAX_POOLED_SIZE / GRANULARITY;
+
+  struct ThreadState;
+
+  /// Precedes each pooled block, recording the thread it belongs to.  Padded
+  /// so that the memory handed out keeps the heap's alignment.
+  union BlockHeader
+  {
+    ThreadState* owner;
+    long double align;
+  };
+
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  struct ThreadState
+  {
+    // The owning thread's free lists.  Only used by that thread.
+    FreeBlock* free[NUM_CLASSES];
+    size_t num_free[NUM_CLASSES];
+
+    // Blocks freed by other threads, waiting to be taken over by the owner.
+    std::atomic<FreeBlock*> remote_free[NUM_CLASSES];
+
+    // The number of blocks allocated from this state that haven't been
+    // freed, plus one until the owning thread exits.  The state is deleted
+    // once this drops to zero, as nothing can then return blocks to it.
+    std::atomic<uint64_t> refs;
+
+    // Set once the owning thread has exited.
+    std::atomic<bool> exited;
+
+    Stats stats;
+  };
+
+  static ThreadState* thread_state();
+  static void delete_thread_state(void* state);
+  static void release_ref(ThreadState* state);
+  static bool take_remote_blocks(ThreadState* state, size_t size_class);
+  static void free_blocks(ThreadState* state);
+  static void free_list(FreeBlock* block);
+  static void create_key();
+};
+
+/// Base for classes whose objects should be allocated from the ObjectPool.
+/// Classes deriving from this must have virtual destructors if they are
+/// deleted through a base class pointer, so that the size of the most
+/// derived class is passed to operator delete.
+class PooledObject
+{
+public:
+  static void* operator new(size_t size)
+  {
+    return ObjectPool::allocate(size);
+  }
+
+  static void operator delete(void* ptr, size_t size)
+  {
+    ObjectPool::release(ptr, size);
+  }
+};
+
+/// Standard allocator that allocates from the ObjectPool, for the containers
+/// inside pooled objects.
+template <class T>
+class PoolAllocator
+{
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind
+  {
+    typedef PoolAllocator<U> other;
+  };
+
+  PoolAllocator() {}
+  PoolAllocator(const PoolAllocator&) {}
+  template <class U> PoolAllocator(const PoolAllocator<U>&) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void* hint = 0)
+  {
+    return (pointer)ObjectPool::allocate(n * sizeof(T));
+  }
+
+  void deallocate(pointer p, size_type n)
+  {
+    ObjectPool::release(p, n * sizeof(T));
+  }
+
+  size_type max_size() const
+  {
+    return std::numeric_limits<size_type>::max() / sizeof(T);
+  }
+
+  template <class U, class... Args>
+  void construct(U* p, Args&&... args)
+  {
+    ::new((void*)p) U(std::forward<Args>(args)...);
+  }
+
+  template <class U>
+  void destroy(U* p)
+  {
+    p->~U();
+  }
+};
+
+template <class T, class U>
+inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+  return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+  return false;
+}
+
+#endif
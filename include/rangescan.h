@@ -0,0 +1,93 @@
+/**
+ * @file rangescan.h Interface to stores that can scan a table by token range
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef RANGESCAN_H__
+#define RANGESCAN_H__
+
+#include <string>
+#include <vector>
+
+#include "cassandra_store.h"
+
+/// Interface to stores that can read the rows of a column family in token
+/// order, as Cassandra's get_range_slices does.  This isn't part of
+/// CassandraStore::ClientInterface, so operations that scan tables look for
+/// it on the client they are given (or use ThriftRangeScanner on a
+/// connection to Cassandra).
+///
+/// Tokens are signed 64-bit integers, formatted as decimal strings (as for
+/// Cassandra's Murmur3Partitioner).  A range runs from just after its start
+/// token (or from its start key, inclusive) up to and including its end
+/// token.
+class RangeScanInterface
+{
+public:
+  virtual ~RangeScanInterface() {}
+
+  virtual void get_range_slices(std::vector<org::apache::cassandra::KeySlice>& _return,
+                                const org::apache::cassandra::ColumnParent& column_parent,
+                                const org::apache::cassandra::SlicePredicate& predicate,
+                                const org::apache::cassandra::KeyRange& range,
+                                const org::apache::cassandra::ConsistencyLevel::type consistency_level) = 0;
+};
+
+/// Scans ranges over a Thrift connection to Cassandra.  The connection
+/// already has get_range_slices, but doesn't implement RangeScanInterface as
+/// it comes from cpp-common.
+class ThriftRangeScanner : public RangeScanInterface
+{
+public:
+  ThriftRangeScanner(CassandraStore::Client* client) : _client(client) {}
+  virtual ~ThriftRangeScanner() {}
+
+  void get_range_slices(std::vector<org::apache::cassandra::KeySlice>& _return,
+                        const org::apache::cassandra::ColumnParent& column_parent,
+                        const org::apache::cassandra::SlicePredicate& predicate,
+                        const org::apache::cassandra::KeyRange& range,
+                        const org::apache::cassandra::ConsistencyLevel::type consistency_level)
+  {
+    _client->get_range_slices(_return,
+                              column_parent,
+                              predicate,
+                              range,
+                              consistency_level);
+  }
+
+private:
+  CassandraStore::Client* _client;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file regdatacache.h in-process cache of registration data.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REGDATACACHE_H__
+#define REGDATACACHE_H__
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "reg_state.h"
+#include "charging_addresses.h"
+#include "irssummary.h"
+
+/// A bounded, sharded, in-memory cache of the registration data held in the
+/// IMPU table, keyed by public ID.  This sits in front of Cassandra so that
+/// repeated reads of the same IMPU (e.g. on the call path) do not each need
+/// a database round trip.
+///
+/// Entries are held for at most a configured maximum age (so that changes
+/// made through other homestead nodes are picked up) and never beyond the
+/// TTL of the underlying columns.  Local writes invalidate the affected
+/// entries.
+///
+/// Each shard has a generation number that is bumped on every invalidation.
+/// Readers note the generation before reading from Cassandra and only store
+/// their result if it hasn't changed, so a read that races with a write can
+/// never re-populate the cache with stale data.
+class RegDataCache
+{
+public:
+  /// The registration data held for a single public ID.
+  struct RegData
+  {
+    RegData() : reg_state(RegistrationState::NOT_REGISTERED),
+                xml_ttl(0),
+                reg_state_ttl(0) {}
+
+    std::string xml;
+    RegistrationState reg_state;
+    std::vector<std::string> impis;
+    ChargingAddresses charging_addrs;
+    IRSSummary summary;
+
+    // Remaining time-to-live of the XML and registration state columns in
+    // seconds.  Zero means the column does not expire.
+    int32_t xml_ttl;
+    int32_t reg_state_ttl;
+  };
+
+  /// Constructor.
+  ///
+  /// @param max_entries - The maximum number of public IDs to hold.
+  /// @param max_age_ms  - How long an entry may be served for before it must
+  ///                      be re-read from Cassandra.
+  /// @param num_shards  - The number of independently locked shards.
+  RegDataCache(size_t max_entries,
+               long max_age_ms,
+               int num_shards = DEFAULT_NUM_SHARDS);
+  virtual ~RegDataCache();
+
+  /// Look up the registration data for a public ID.  The TTLs in the
+  /// returned data are adjusted for the time the entry has been cached.
+  ///
+  /// @param public_id - The public ID to look up.
+  /// @param data      - (out) The cached registration data.
+  /// @returns         - Whether a valid entry was found.
+  bool get(const std::string& public_id, RegData& data);
+
+  /// Get the current generation for the shard that holds a public ID.
+  /// This must be called before issuing the read whose result will be
+  /// passed to put().
+  uint64_t generation(const std::string& public_id);
+
+  /// Store the registration data for a public ID.
+  ///
+  /// @param public_id  - The public ID.
+  /// @param data       - The registration data read from Cassandra.
+  /// @param generation - The generation returned by generation() before
+  ///                     the data was read.
+  /// @returns          - Whether the data was stored.  It is not stored if
+  ///                     the entry has been invalidated since the read
+  ///                     started.
+  bool put(const std::string& public_id,
+           const RegData& data,
+           uint64_t generation);
+
+  /// Remove any cached data for the specified public IDs.
+  void invalidate(const std::string& public_id);
+  void invalidate(const std::vector<std::string>& public_ids);
+
+  /// @returns the number of entries currently cached.
+  size_t size();
+
+  /// Get the public IDs that currently have entries (including any that
+  /// have expired but not yet been removed).
+  ///
+  /// @param public_ids - (out) The public IDs, most recently used first
+  ///                     within each shard.
+  void public_ids(std::vector<std::string>& public_ids);
+
+  static const int DEFAULT_NUM_SHARDS = 16;
+
+private:
+  struct Entry
+  {
+    RegData data;
+    unsigned long stored_ms;
+    unsigned long expiry_ms;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    uint64_t generation;
+    std::unordered_map<std::string, Entry> entries;
+
+    // Public IDs in least- to most-recently used order.
+    std::list<std::string> lru;
+  };
+
+  Shard& shard_for(const std::string& public_id);
+  void remove_entry(Shard& shard,
+                    std::unordered_map<std::string, Entry>::iterator entry);
+  static unsigned long now_ms();
+
+  std::vector<Shard*> _shards;
+  size_t _max_entries_per_shard;
+  long _max_age_ms;
+};
+
+#endif
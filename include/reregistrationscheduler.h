@@ -0,0 +1,162 @@
+/**
+ * @file reregistrationscheduler.h Re-registers subscribers with the HSS ahead of time
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REREGISTRATIONSCHEDULER_H__
+#define REREGISTRATIONSCHEDULER_H__
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+/// Re-registers subscribers with the HSS in the background, so that
+/// REGISTERs can be answered from the cache.
+///
+/// Registration data is cached for twice the HSS re-registration time, and a
+/// REGISTER that finds less than the re-registration time left re-registers
+/// with the HSS before it is answered.  The scheduler tracks the IRSs that
+/// have re-registered, and re-registers each of them with the HSS (which
+/// also refreshes the cached data) shortly before that point is reached.
+///
+/// Each REGISTER arms a single refresh, so IRSs that stop re-registering
+/// drop out of the scheduler instead of being kept alive indefinitely.
+class ReregistrationScheduler
+{
+public:
+  /// Interface to whatever re-registers IRSs with the HSS.  It must call
+  /// reregistration_complete once it has finished with each one.
+  class Reregisterer
+  {
+  public:
+    virtual ~Reregisterer() {}
+    virtual void reregister(const std::string& impu,
+                            const std::string& impi) = 0;
+  };
+
+  /// Constructor.
+  ///
+  /// @param reregisterer          - Re-registers IRSs with the HSS.
+  /// @param reregistration_time_s - The HSS re-registration time.
+  /// @param lead_time_s           - How long before a REGISTER would have to
+  ///                                re-register with the HSS to do it.
+  /// @param max_in_flight         - The most re-registrations to have in
+  ///                                progress at once.
+  ReregistrationScheduler(Reregisterer* reregisterer,
+                          int reregistration_time_s,
+                          int lead_time_s = 60,
+                          unsigned int max_in_flight = 100);
+  virtual ~ReregistrationScheduler();
+
+  /// Start and stop the thread that runs the re-registrations.
+  bool start();
+  void stop();
+
+  /// Called when an IRS has (re-)registered.
+  ///
+  /// @param impu  - The public ID the IRS registered with.
+  /// @param impi  - The private ID it registered with.
+  /// @param ttl_s - The time left before the cached registration data
+  ///                expires.
+  virtual void registered(const std::string& impu,
+                          const std::string& impi,
+                          int32_t ttl_s);
+
+  /// Called when an IRS has been deregistered.
+  virtual void deregistered(const std::string& impu);
+
+  /// Called by the reregisterer when it has finished re-registering an IRS.
+  virtual void reregistration_complete(const std::string& impu, bool success);
+
+  /// @returns the number of IRSs being tracked.
+  size_t size();
+
+  /// Start all the re-registrations that are due (up to the in-flight limit).
+  ///
+  /// @returns - The number of milliseconds until the next one is due, or -1
+  ///            if none are.
+  long run_due();
+
+private:
+  struct Entry
+  {
+    Entry() :
+      impi(), due_ms(0), expires_ms(0), in_flight(false), rearmed(false)
+    {}
+
+    std::string impi;
+
+    // When the re-registration is due, and when the cached data expires, in
+    // milliseconds on the monotonic clock.
+    uint64_t due_ms;
+    uint64_t expires_ms;
+
+    bool in_flight;
+
+    // Whether the IRS registered again while it was being re-registered.
+    bool rearmed;
+  };
+
+  typedef std::multimap<uint64_t, std::string> DueIndex;
+
+  // Schedule an entry.  Must be called with the lock held.
+  void schedule(const std::string& impu, Entry& entry, uint64_t due_ms);
+
+  // Remove an entry from the due index.  Must be called with the lock held.
+  void unschedule(const std::string& impu, const Entry& entry);
+
+  static void* thread_entry(void* scheduler);
+  void thread();
+
+  static uint64_t now_ms();
+
+  Reregisterer* _reregisterer;
+  int _reregistration_time_s;
+  int _lead_time_s;
+  unsigned int _max_in_flight;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::map<std::string, Entry> _entries;
+  DueIndex _due;
+  unsigned int _in_flight;
+
+  pthread_t _thread;
+  bool _thread_running;
+  bool _terminated;
+};
+
+#endif
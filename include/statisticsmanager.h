@@ -41,6 +41,7 @@
 #include "counter.h"
 #include "accumulator.h"
 #include "httpstack.h"
+#include "cache.h"
 
 #define COUNTER_INCR_METHOD(NAME) \
   virtual void incr_##NAME() { (NAME).increment(); }
@@ -48,7 +49,8 @@
 #define ACCUMULATOR_UPDATE_METHOD(NAME) \
   virtual void update_##NAME(unsigned long sample) { (NAME).accumulate(sample); }
 
-class StatisticsManager : public HttpStack::StatsInterface
+class StatisticsManager : public HttpStack::StatsInterface,
+                          public Cache::StatsInterface
 {
 public:
   StatisticsManager(long poll_timeout_ms = 1000);
@@ -59,9 +61,20 @@ public:
   ACCUMULATOR_UPDATE_METHOD(H_hss_digest_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_hss_subscription_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_cache_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_worker_threads);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_queue_depth);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_high_priority_queue_wait_us);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_normal_priority_queue_wait_us);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_low_priority_queue_wait_us);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_write_behind_backlog);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_write_behind_age_us);
+  ACCUMULATOR_UPDATE_METHOD(H_cache_shard_imbalance);
 
   COUNTER_INCR_METHOD(H_incoming_requests);
   COUNTER_INCR_METHOD(H_rejected_overload);
+  COUNTER_INCR_METHOD(H_cache_coalesced_reads);
+  COUNTER_INCR_METHOD(H_cache_expired_operations);
+  COUNTER_INCR_METHOD(H_cache_hedged_reads);
 
   // Methods required to implement the HTTP stack stats interface.
   void update_http_latency_us(unsigned long latency_us)
@@ -71,6 +84,33 @@ public:
   void incr_http_incoming_requests() { incr_H_incoming_requests(); }
   void incr_http_rejected_overload() { incr_H_rejected_overload(); }
 
+  // Methods required to implement the cache stats interface.
+  void incr_cache_coalesced_reads() { incr_H_cache_coalesced_reads(); }
+  void update_cache_worker_threads(unsigned long threads)
+  {
+    update_H_cache_worker_threads(threads);
+  }
+  void update_cache_queue_depth(unsigned long depth)
+  {
+    update_H_cache_queue_depth(depth);
+  }
+  void update_cache_queue_wait_us(Cache::Priority priority,
+                                  unsigned long wait_us);
+  void update_cache_write_behind_backlog(unsigned long depth)
+  {
+    update_H_cache_write_behind_backlog(depth);
+  }
+  void update_cache_write_behind_age_us(unsigned long age_us)
+  {
+    update_H_cache_write_behind_age_us(age_us);
+  }
+  void incr_cache_expired_operations() { incr_H_cache_expired_operations(); }
+  void update_cache_shard_imbalance(unsigned long percent)
+  {
+    update_H_cache_shard_imbalance(percent);
+  }
+  void incr_cache_hedged_reads() { incr_H_cache_hedged_reads(); }
+
 private:
   LastValueCache lvc;
 
@@ -79,9 +119,20 @@ private:
   StatisticAccumulator H_hss_digest_latency_us;
   StatisticAccumulator H_hss_subscription_latency_us;
   StatisticAccumulator H_cache_latency_us;
+  StatisticAccumulator H_cache_worker_threads;
+  StatisticAccumulator H_cache_queue_depth;
+  StatisticAccumulator H_cache_high_priority_queue_wait_us;
+  StatisticAccumulator H_cache_normal_priority_queue_wait_us;
+  StatisticAccumulator H_cache_low_priority_queue_wait_us;
+  StatisticAccumulator H_cache_write_behind_backlog;
+  StatisticAccumulator H_cache_write_behind_age_us;
+  StatisticAccumulator H_cache_shard_imbalance;
 
   StatisticCounter H_incoming_requests;
   StatisticCounter H_rejected_overload;
+  StatisticCounter H_cache_coalesced_reads;
+  StatisticCounter H_cache_expired_operations;
+  StatisticCounter H_cache_hedged_reads;
 };
 
 #endif
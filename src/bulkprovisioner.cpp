@@ -0,0 +1,403 @@
+/**
+ * @file bulkprovisioner.cpp bulk loading of subscribers into the cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <algorithm>
+
+#include "bulkprovisioner.h"
+#include "xmlutils.h"
+#include "log.h"
+#include "rapidjson/document.h"
+
+/// Transaction for one of a subscriber's writes.
+class BulkProvisioner::WriteTransaction : public CassandraStore::Transaction
+{
+public:
+  WriteTransaction(BulkProvisioner* provisioner, Pending* pending) :
+    CassandraStore::Transaction(0),
+    _provisioner(provisioner),
+    _pending(pending)
+  {}
+
+  void on_success(CassandraStore::Operation* op)
+  {
+    _provisioner->write_complete(_pending, true);
+  }
+
+  void on_failure(CassandraStore::Operation* op)
+  {
+    LOG_ERROR("Failed to write subscriber %s: %s",
+              _pending->impi.c_str(), op->get_error_text().c_str());
+    _provisioner->write_complete(_pending, false);
+  }
+
+private:
+  BulkProvisioner* _provisioner;
+  Pending* _pending;
+};
+
+BulkProvisioner::BulkProvisioner(Cache* cache,
+                                 unsigned int num_threads,
+                                 size_t max_queued,
+                                 size_t max_in_flight) :
+  _cache(cache),
+  _num_threads(std::max(num_threads, 1u)),
+  _max_queued(std::max(max_queued, (size_t)1)),
+  _max_in_flight(std::max(max_in_flight, (size_t)1)),
+  _queue(),
+  _end_of_input(false),
+  _in_flight(0),
+  _stats()
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+BulkProvisioner::~BulkProvisioner()
+{
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool BulkProvisioner::provision(std::istream& input, Stats& stats)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  _stats = Stats();
+  _end_of_input = false;
+
+  std::vector<pthread_t> threads;
+
+  for (unsigned int ii = 0; ii < _num_threads; ii++)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, thread_entry, this) == 0)
+    {
+      threads.push_back(thread);
+    }
+  }
+
+  if (threads.empty())
+  {
+    LOG_ERROR("Failed to start any bulk provisioning threads");
+    stats = _stats;
+    return false;
+  }
+
+  Line line;
+  line.number = 0;
+
+  while (std::getline(input, line.text))
+  {
+    line.number++;
+
+    if (line.text.empty())
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    while (_queue.size() >= _max_queued)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    _queue.push_back(line);
+    _stats.lines++;
+    pthread_cond_broadcast(&_cond);
+
+    if ((_stats.lines % 100000) == 0)
+    {
+      LOG_STATUS("Bulk provisioning has read %zu subscribers", _stats.lines);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  pthread_mutex_lock(&_lock);
+  _end_of_input = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator thread = threads.begin();
+       thread != threads.end();
+       ++thread)
+  {
+    pthread_join(*thread, NULL);
+  }
+
+  // Wait for the last writes to complete.
+  pthread_mutex_lock(&_lock);
+
+  while (_in_flight > 0)
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+
+  stats = _stats;
+  pthread_mutex_unlock(&_lock);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned long elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000) +
+                             ((end.tv_nsec - start.tv_nsec) / 1000000);
+
+  LOG_STATUS("Bulk provisioning took %lums - %zu subscribers written, "
+             "%zu invalid, %zu failed",
+             elapsed_ms, stats.written, stats.invalid, stats.failed);
+
+  return ((stats.invalid == 0) && (stats.failed == 0));
+}
+
+bool BulkProvisioner::parse(const std::string& line,
+                            Subscriber& subscriber,
+                            std::string& error)
+{
+  rapidjson::Document document;
+  document.Parse<0>(line.c_str());
+
+  if ((document.HasParseError()) || (!document.IsObject()))
+  {
+    error = "Not a JSON object";
+    return false;
+  }
+
+  const char* const string_members[] = {"impi", "ha1", "realm", "xml"};
+  std::string* const strings[] = {&subscriber.impi,
+                                  &subscriber.ha1,
+                                  &subscriber.realm,
+                                  &subscriber.xml};
+
+  for (size_t ii = 0; ii < sizeof(strings) / sizeof(strings[0]); ii++)
+  {
+    if ((!document.HasMember(string_members[ii])) ||
+        (!document[string_members[ii]].IsString()))
+    {
+      error = std::string("Missing string \"") + string_members[ii] + "\"";
+      return false;
+    }
+
+    *strings[ii] = std::string(document[string_members[ii]].GetString(),
+                               document[string_members[ii]].GetStringLength());
+  }
+
+  if ((subscriber.impi.empty()) || (subscriber.ha1.empty()))
+  {
+    error = "Empty \"impi\" or \"ha1\"";
+    return false;
+  }
+
+  std::vector<std::string> xml_impus = XmlUtils::get_public_ids(subscriber.xml);
+
+  if (xml_impus.empty())
+  {
+    error = "IMS subscription has no public identities";
+    return false;
+  }
+
+  subscriber.impus.clear();
+
+  if (document.HasMember("impus"))
+  {
+    const rapidjson::Value& impus = document["impus"];
+
+    if (!impus.IsArray())
+    {
+      error = "\"impus\" is not an array";
+      return false;
+    }
+
+    for (rapidjson::SizeType ii = 0; ii < impus.Size(); ii++)
+    {
+      if (!impus[ii].IsString())
+      {
+        error = "\"impus\" contains a non-string";
+        return false;
+      }
+
+      std::string impu(impus[ii].GetString(), impus[ii].GetStringLength());
+
+      if (std::find(xml_impus.begin(), xml_impus.end(), impu) == xml_impus.end())
+      {
+        error = "Public identity " + impu + " is not in the IMS subscription";
+        return false;
+      }
+
+      subscriber.impus.push_back(impu);
+    }
+  }
+
+  if (subscriber.impus.empty())
+  {
+    subscriber.impus = xml_impus;
+  }
+
+  return true;
+}
+
+void* BulkProvisioner::thread_entry(void* provisioner)
+{
+  ((BulkProvisioner*)provisioner)->run();
+  return NULL;
+}
+
+void BulkProvisioner::run()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    while ((!_end_of_input) && (_queue.empty()))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    if (_queue.empty())
+    {
+      break;
+    }
+
+    Line line = _queue.front();
+    _queue.pop_front();
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    Subscriber subscriber;
+    std::string error;
+    bool valid = parse(line.text, subscriber, error);
+
+    pthread_mutex_lock(&_lock);
+
+    if (!valid)
+    {
+      LOG_ERROR("Line %zu of bulk provisioning input is invalid: %s",
+                line.number, error.c_str());
+      _stats.invalid++;
+      continue;
+    }
+
+    while (_in_flight >= _max_in_flight)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    _in_flight++;
+    pthread_mutex_unlock(&_lock);
+
+    // Writes can complete before do_async returns, so the lock mustn't be
+    // held while they're submitted.
+    write(subscriber);
+
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void BulkProvisioner::write(const Subscriber& subscriber)
+{
+  int64_t timestamp = Cache::generate_timestamp();
+
+  DigestAuthVector av;
+  av.ha1 = subscriber.ha1;
+  av.realm = subscriber.realm;
+  av.qop = "auth";
+
+  std::vector<CassandraStore::Operation*> ops;
+
+  ops.push_back(_cache->create_PutAuthVector(subscriber.impi, av, timestamp));
+
+  for (std::vector<std::string>::const_iterator impu = subscriber.impus.begin();
+       impu != subscriber.impus.end();
+       ++impu)
+  {
+    ops.push_back(_cache->create_PutAssociatedPublicID(subscriber.impi,
+                                                       *impu,
+                                                       timestamp));
+  }
+
+  ops.push_back(_cache->create_PutAssociatedPrivateID(subscriber.impus,
+                                                      subscriber.impi,
+                                                      timestamp));
+
+  Cache::PutRegData* put_reg_data = _cache->create_PutRegData(subscriber.impus,
+                                                              timestamp);
+  put_reg_data->with_xml(subscriber.xml);
+  ops.push_back(put_reg_data);
+
+  // The pending record is deleted by the last write to complete, so must be
+  // complete before any are submitted.
+  Pending* pending = new Pending();
+  pending->impi = subscriber.impi;
+  pending->writes_remaining = ops.size();
+  pending->failed = false;
+
+  for (std::vector<CassandraStore::Operation*>::iterator op = ops.begin();
+       op != ops.end();
+       ++op)
+  {
+    CassandraStore::Transaction* trx = new WriteTransaction(this, pending);
+    _cache->do_async(*op, trx);
+  }
+}
+
+void BulkProvisioner::write_complete(Pending* pending, bool success)
+{
+  pthread_mutex_lock(&_lock);
+
+  pending->failed = pending->failed || !success;
+  pending->writes_remaining--;
+
+  if (pending->writes_remaining == 0)
+  {
+    if (pending->failed)
+    {
+      _stats.failed++;
+    }
+    else
+    {
+      _stats.written++;
+    }
+
+    delete pending;
+    _in_flight--;
+    pthread_cond_broadcast(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
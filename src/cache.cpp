@@ -35,8 +35,22 @@
  */
 
 #include <boost/format.hpp>
+#include <boost/algorithm/string/join.hpp>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/protocol/TBinaryProtocol.h>
 
 #include "cache.h"
+#include "rangescan.h"
+#include "columncompression.h"
 
 using namespace apache::thrift;
 using namespace apache::thrift::transport;
@@ -48,9 +62,11 @@ const static std::string KEYSPACE = "homestead_cache";
 const static std::string IMPI = "impi";
 const static std::string IMPI_MAPPING = "impi_mapping";
 const static std::string IMPU = "impu";
+const static std::string IRS = "irs";
 
 // Column names in the IMPU column family.
 const static std::string IMS_SUB_XML_COLUMN_NAME = "ims_subscription_xml";
+const static std::string IRS_SUMMARY_COLUMN_NAME = "irs_summary";
 const static std::string REG_STATE_COLUMN_NAME = "is_registered";
 const static std::string PRIMARY_CCF_COLUMN_NAME = "primary_ccf";
 const static std::string SECONDARY_CCF_COLUMN_NAME = "secondary_ccf";
@@ -58,6 +74,11 @@ const static std::string PRIMARY_ECF_COLUMN_NAME = "primary_ecf";
 const static std::string SECONDARY_ECF_COLUMN_NAME = "secondary_ecf";
 const static std::string IMPI_COLUMN_PREFIX = "associated_impi__";
 const static std::string IMPI_MAPPING_PREFIX = "associated_primary_impu__";
+const static std::string IRS_ID_COLUMN_NAME = "irs_id";
+
+// The IRS column family holds the IMS subscription XML, IRS summary and
+// charging address columns, with the same names as in the IMPU column
+// family.
 
 // Column names in the IMPI column family.
 const static std::string ASSOC_PUBLIC_ID_COLUMN_PREFIX = "public_id_";
@@ -66,21 +87,3489 @@ const static std::string DIGEST_REALM_COLUMN_NAME    = "digest_realm";
 const static std::string DIGEST_QOP_COLUMN_NAME      = "digest_qop";
 const static std::string KNOWN_PREFERRED_COLUMN_NAME = "known_preferred";
 
-// Variables to store the singleton cache object.
-//
-// Must create this after the constants above so that they have been
-// initialized before we initialize the cache.
-Cache* Cache::INSTANCE = &DEFAULT_INSTANCE;
-Cache Cache::DEFAULT_INSTANCE;
+// Name under which the negative cache records private IDs that have no
+// associated public IDs.  This is kept apart from IMPI, as the row of such a
+// private ID may still hold an authentication vector.
+const static std::string IMPI_PUBLIC_IDS = "impi_public_ids";
+
+// Value written over deleted columns of the IMPU, IMPI mapping and IRS column
+// families when deletion markers are enabled.  Columns with this value are
+// treated as absent.
+const static std::string DELETION_MARKER = std::string("\0homestead-deleted", 18);
+
+// Names of the types of operation whose consistency levels can be configured.
+const static std::string OPERATION_NAMES[] = {
+  "PutRegData",
+  "PutAssociatedPrivateID",
+  "PutAssociatedPublicID",
+  "PutAuthVector",
+  "GetRegData",
+  "GetRegDataMulti",
+  "GetAssociatedPublicIDs",
+  "GetAssociatedPrimaryPublicIDs",
+  "GetAuthVector",
+  "DeletePublicIDs",
+  "DeletePrivateIDs",
+  "DeleteIMPIMapping",
+  "DissociateImplicitRegistrationSetFromImpi",
+  "ScanRows",
+};
+const static int NUM_OPERATION_NAMES = sizeof(OPERATION_NAMES) / sizeof(std::string);
+
+// Variables to store the singleton cache object.
+//
+// Must create this after the constants above so that they have been
+// initialized before we initialize the cache.
+Cache* Cache::INSTANCE = &DEFAULT_INSTANCE;
+Cache Cache::DEFAULT_INSTANCE;
+
+//
+// Write batching.
+//
+
+// Operation that writes a pre-built set of mutations in one request.
+class BatchMutateOperation : public CassandraStore::Operation
+{
+public:
+  BatchMutateOperation(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutations,
+                       ConsistencyLevel::type consistency_level) :
+    CassandraStore::Operation(),
+    _mutations(mutations),
+    _consistency_level(consistency_level)
+  {}
+
+protected:
+  const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& _mutations;
+  ConsistencyLevel::type _consistency_level;
+
+  bool perform(CassandraStore::ClientInterface* client, SAS::TrailId trail)
+  {
+    client->batch_mutate(_mutations, _consistency_level);
+    return true;
+  }
+};
+
+// Gathers writes from several operations into batches, and writes each batch
+// on its own thread once it is full or has been waiting for the batching
+// window.  Operations are only batched with others that write at the same
+// consistency level, so there is a separate batch for each level.
+class Cache::WriteBatcher
+{
+public:
+  WriteBatcher(Cache* cache, long window_us, size_t max_columns) :
+    _cache(cache),
+    _window_us(window_us),
+    _max_columns(max_columns),
+    _terminated(false),
+    _writing(false),
+    _batches()
+  {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&_lock, NULL);
+
+    pthread_create(&_thread, NULL, &WriteBatcher::thread_entry, this);
+  }
+
+  ~WriteBatcher()
+  {
+    stop();
+    pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  // Add an operation's writes to the current batch for its consistency
+  // level.
+  void add(CacheOperation* op,
+           CassandraStore::Transaction* trx,
+           const std::vector<CassandraStore::RowColumns>& rows,
+           int64_t timestamp,
+           int32_t ttl)
+  {
+    Consistency consistency;
+    op->configured_consistency(consistency);
+
+    pthread_mutex_lock(&_lock);
+
+    Batch& batch = _batches[consistency.level];
+
+    if (batch.ops.empty())
+    {
+      // This is the first write in the batch, so it sets the deadline for
+      // the batch to be written.
+      clock_gettime(CLOCK_MONOTONIC, &batch.deadline);
+      batch.deadline.tv_sec += _window_us / 1000000;
+      batch.deadline.tv_nsec += (_window_us % 1000000) * 1000;
+      if (batch.deadline.tv_nsec >= 1000000000)
+      {
+        batch.deadline.tv_sec++;
+        batch.deadline.tv_nsec -= 1000000000;
+      }
+    }
+
+    for (std::vector<CassandraStore::RowColumns>::const_iterator row = rows.begin();
+         row != rows.end();
+         ++row)
+    {
+      std::map<std::string, PendingColumn>& pending =
+                                   batch.columns[std::make_pair(row->key, row->cf)];
+
+      for (std::map<std::string, std::string>::const_iterator column = row->columns.begin();
+           column != row->columns.end();
+           ++column)
+      {
+        std::map<std::string, PendingColumn>::iterator existing =
+                                                      pending.find(column->first);
+        if (existing == pending.end())
+        {
+          PendingColumn& added = pending[column->first];
+          added.value = column->second;
+          added.timestamp = timestamp;
+          added.ttl = ttl;
+          batch.num_columns++;
+        }
+        else if (existing->second.timestamp <= timestamp)
+        {
+          // Cassandra keeps the write with the latest timestamp, so this
+          // write supersedes the one already in the batch.
+          existing->second.value = column->second;
+          existing->second.timestamp = timestamp;
+          existing->second.ttl = ttl;
+        }
+      }
+    }
+
+    batch.ops.push_back(std::make_pair(op, trx));
+
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Stop batching, and wait for any writes already in a batch to complete.
+  void stop()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_broadcast(&_cond);
+
+    while (!_batches.empty() || _writing)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  struct PendingColumn
+  {
+    std::string value;
+    int64_t timestamp;
+    int32_t ttl;
+  };
+
+  // Pending columns, indexed by (row key, column family) and column name.
+  typedef std::map<std::pair<std::string, std::string>,
+                   std::map<std::string, PendingColumn> > Columns;
+
+  struct Batch
+  {
+    Batch() : columns(), num_columns(0), ops() {}
+
+    Columns columns;
+    size_t num_columns;
+    std::vector<std::pair<CacheOperation*, CassandraStore::Transaction*> > ops;
+    struct timespec deadline;
+  };
+
+  typedef std::map<ConsistencyLevel::type, Batch> Batches;
+
+  static void* thread_entry(void* batcher)
+  {
+    ((WriteBatcher*)batcher)->run();
+    return NULL;
+  }
+
+  // Find a batch that is ready to write, because it is full, its window has
+  // ended or the batcher is stopping.  Must be called with _lock held.
+  //
+  // @param next_deadline - Set to the earliest deadline of the batches if
+  //                        none is ready.
+  Batches::iterator ready_batch(struct timespec& next_deadline)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (Batches::iterator batch = _batches.begin();
+         batch != _batches.end();
+         ++batch)
+    {
+      const struct timespec& deadline = batch->second.deadline;
+
+      if ((_terminated) ||
+          (batch->second.num_columns >= _max_columns) ||
+          (now.tv_sec > deadline.tv_sec) ||
+          ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec >= deadline.tv_nsec)))
+      {
+        return batch;
+      }
+
+      if ((batch == _batches.begin()) ||
+          (deadline.tv_sec < next_deadline.tv_sec) ||
+          ((deadline.tv_sec == next_deadline.tv_sec) &&
+           (deadline.tv_nsec < next_deadline.tv_nsec)))
+      {
+        next_deadline = deadline;
+      }
+    }
+
+    return _batches.end();
+  }
+
+  void run()
+  {
+    pthread_mutex_lock(&_lock);
+
+    while (true)
+    {
+      // Wait until there is a batch ready to write.
+      struct timespec next_deadline;
+      Batches::iterator ready = ready_batch(next_deadline);
+
+      while ((ready == _batches.end()) && (!_terminated))
+      {
+        if (_batches.empty())
+        {
+          pthread_cond_wait(&_cond, &_lock);
+        }
+        else
+        {
+          pthread_cond_timedwait(&_cond, &_lock, &next_deadline);
+        }
+
+        ready = ready_batch(next_deadline);
+      }
+
+      if (ready == _batches.end())
+      {
+        // Terminated with nothing left to write.
+        break;
+      }
+
+      ConsistencyLevel::type level = ready->first;
+      Batch batch;
+      std::swap(batch.columns, ready->second.columns);
+      std::swap(batch.ops, ready->second.ops);
+      _batches.erase(ready);
+      _writing = true;
+
+      pthread_mutex_unlock(&_lock);
+      write(batch.columns, batch.ops, level);
+      pthread_mutex_lock(&_lock);
+
+      _writing = false;
+      pthread_cond_broadcast(&_cond);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void write(const Columns& columns,
+             std::vector<std::pair<CacheOperation*,
+                                   CassandraStore::Transaction*> >& ops,
+             ConsistencyLevel::type consistency_level)
+  {
+    // Build the mutations in the same way as CassandraStore::put_columns.
+    std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutations;
+
+    for (Columns::const_iterator row = columns.begin();
+         row != columns.end();
+         ++row)
+    {
+      std::vector<Mutation>& row_mutations =
+                                mutations[row->first.first][row->first.second];
+
+      for (std::map<std::string, PendingColumn>::const_iterator pending = row->second.begin();
+           pending != row->second.end();
+           ++pending)
+      {
+        row_mutations.push_back(Mutation());
+        Mutation& mutation = row_mutations.back();
+        Column* column = &mutation.column_or_supercolumn.column;
+
+        column->name = pending->first;
+        column->value = pending->second.value;
+        column->__isset.value = true;
+        column->timestamp = pending->second.timestamp;
+        column->__isset.timestamp = true;
+
+        if (pending->second.ttl > 0)
+        {
+          column->ttl = pending->second.ttl;
+          column->__isset.ttl = true;
+        }
+
+        mutation.column_or_supercolumn.__isset.column = true;
+        mutation.__isset.column_or_supercolumn = true;
+      }
+    }
+
+    _cache->write_batch(mutations, consistency_level, ops);
+  }
+
+  Cache* _cache;
+  long _window_us;
+  size_t _max_columns;
+
+  pthread_t _thread;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+
+  // The following are all protected by _lock.
+  bool _terminated;
+  bool _writing;
+  Batches _batches;
+};
+
+//
+// Worker pool.
+//
+
+// Runs operations on a pool of threads that grows when operations start to
+// back up in its queues, and shrinks again when workers are left idle.  There
+// is a queue for each priority, and the highest priority operation is run
+// first unless a lower priority one has been starved.
+class Cache::WorkerPool
+{
+public:
+  // @param report_stats - false if the pool's queue and threads aren't
+  //                       reported in the cache's statistics.
+  WorkerPool(Cache* cache,
+             unsigned int min_threads,
+             unsigned int max_threads,
+             long idle_timeout_ms,
+             long starvation_limit_ms,
+             bool report_stats = true) :
+    _cache(cache),
+    _min_threads(min_threads),
+    _max_threads(max_threads),
+    _idle_timeout_ms(idle_timeout_ms),
+    _starvation_limit_us(starvation_limit_ms * 1000),
+    _report_stats(report_stats),
+    _terminated(false),
+    _num_queued(0),
+    _num_threads(0),
+    _num_idle(0),
+    _wait_us(0),
+    _latency_us(0)
+  {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &cond_attr);
+    pthread_cond_init(&_threads_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&_lock, NULL);
+
+    pthread_mutex_lock(&_lock);
+
+    for (unsigned int ii = 0; ii < _min_threads; ii++)
+    {
+      start_thread();
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  ~WorkerPool()
+  {
+    stop();
+    pthread_cond_destroy(&_threads_cond);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  // Queue an operation to be run by a worker.
+  void add(CassandraStore::Operation* op, CassandraStore::Transaction* trx)
+  {
+    CacheOperation* cache_op = dynamic_cast<CacheOperation*>(op);
+
+    Work work;
+    work.op = op;
+    work.trx = trx;
+    work.priority = (cache_op != NULL) ? cache_op->priority() : PRIORITY_NORMAL;
+    work.queued_us = now_us();
+
+    pthread_mutex_lock(&_lock);
+
+    _queues[work.priority].push_back(work);
+    _num_queued++;
+
+    if (_num_idle > 0)
+    {
+      pthread_cond_signal(&_cond);
+    }
+    else if ((_num_threads < _max_threads) &&
+             ((_num_threads < _min_threads) ||
+              (_wait_us > _latency_us) ||
+              (_num_queued >= _num_threads)))
+    {
+      // Every worker is busy and operations are backing up, so add another.
+      start_thread();
+    }
+
+    unsigned long num_threads = _num_threads;
+    unsigned long queue_depth = _num_queued;
+
+    pthread_mutex_unlock(&_lock);
+
+    if ((_report_stats) && (_cache->_stats != NULL))
+    {
+      _cache->_stats->update_cache_worker_threads(num_threads);
+      _cache->_stats->update_cache_queue_depth(queue_depth);
+    }
+  }
+
+  // Stop the pool once all the queued operations have been run.
+  void stop()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_broadcast(&_cond);
+
+    while (_num_threads > 0)
+    {
+      pthread_cond_wait(&_threads_cond, &_lock);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  struct Work
+  {
+    CassandraStore::Operation* op;
+    CassandraStore::Transaction* trx;
+    Priority priority;
+    unsigned long queued_us;
+  };
+
+  static unsigned long now_us()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+  }
+
+  // Update an exponentially weighted moving average with a new sample.
+  static void update_average(unsigned long& average, unsigned long sample)
+  {
+    average = ((average * 7) + sample) / 8;
+  }
+
+  // Start a worker thread.  Must be called with _lock held.
+  void start_thread()
+  {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, &WorkerPool::thread_entry, this) == 0)
+    {
+      pthread_detach(thread);
+      _num_threads++;
+      LOG_DEBUG("Started cache worker thread (%u running)", _num_threads);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to start cache worker thread (%u running): %d",
+                _num_threads, errno);
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  static void* thread_entry(void* pool)
+  {
+    ((WorkerPool*)pool)->run();
+    return NULL;
+  }
+
+  // Take the next operation to run off the queues.  Must be called with
+  // _lock held, and with at least one operation queued.
+  Work next_work(unsigned long now)
+  {
+    int next = -1;
+
+    // Run the longest queued of any operations that have been starved by
+    // those of higher priorities.
+    for (int priority = 0; priority < NUM_PRIORITIES; priority++)
+    {
+      if ((!_queues[priority].empty()) &&
+          (now - _queues[priority].front().queued_us >= _starvation_limit_us) &&
+          ((next == -1) ||
+           (_queues[priority].front().queued_us < _queues[next].front().queued_us)))
+      {
+        next = priority;
+      }
+    }
+
+    // Otherwise run the highest priority operation.
+    for (int priority = 0; (next == -1) && (priority < NUM_PRIORITIES); priority++)
+    {
+      if (!_queues[priority].empty())
+      {
+        next = priority;
+      }
+    }
+
+    Work work = _queues[next].front();
+    _queues[next].pop_front();
+    _num_queued--;
+    return work;
+  }
+
+  void run()
+  {
+    pthread_mutex_lock(&_lock);
+
+    while (true)
+    {
+      if (_num_queued == 0)
+      {
+        if (_terminated)
+        {
+          break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += _idle_timeout_ms / 1000;
+        deadline.tv_nsec += (_idle_timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+
+        _num_idle++;
+        int rc = pthread_cond_timedwait(&_cond, &_lock, &deadline);
+        _num_idle--;
+
+        if ((rc == ETIMEDOUT) &&
+            (_num_queued == 0) &&
+            (_num_threads > _min_threads))
+        {
+          // There's been no work for this thread for a while, so the pool
+          // is bigger than it needs to be.
+          break;
+        }
+
+        continue;
+      }
+
+      unsigned long now = now_us();
+      Work work = next_work(now);
+      unsigned long wait_us = now - work.queued_us;
+      update_average(_wait_us, wait_us);
+
+      pthread_mutex_unlock(&_lock);
+
+      if ((_report_stats) && (_cache->_stats != NULL))
+      {
+        _cache->_stats->update_cache_queue_wait_us(work.priority, wait_us);
+      }
+
+      unsigned long start_us = now_us();
+      run_operation(work.op, work.trx);
+      unsigned long latency_us = now_us() - start_us;
+
+      pthread_mutex_lock(&_lock);
+
+      update_average(_latency_us, latency_us);
+    }
+
+    _num_threads--;
+    LOG_DEBUG("Stopped cache worker thread (%u running)", _num_threads);
+    pthread_cond_broadcast(&_threads_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Run an operation and call its transaction back, as the store's thread
+  // pool does.
+  void run_operation(CassandraStore::Operation* op,
+                     CassandraStore::Transaction* trx)
+  {
+    trx->start_timer();
+    bool success = _cache->do_sync(op, trx->trail);
+    trx->stop_timer();
+
+    if (success)
+    {
+      trx->on_success(op);
+    }
+    else
+    {
+      trx->on_failure(op);
+    }
+
+    delete trx; trx = NULL;
+    delete op; op = NULL;
+  }
+
+  Cache* _cache;
+  unsigned int _min_threads;
+  unsigned int _max_threads;
+  long _idle_timeout_ms;
+  unsigned long _starvation_limit_us;
+  bool _report_stats;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_cond_t _threads_cond;
+
+  // The following are all protected by _lock.
+  bool _terminated;
+  std::deque<Work> _queues[NUM_PRIORITIES];
+  size_t _num_queued;
+  unsigned int _num_threads;
+  unsigned int _num_idle;
+
+  // Moving averages of how long operations wait in the queue, and how long
+  // they then take to run.
+  unsigned long _wait_us;
+  unsigned long _latency_us;
+};
+
+//
+// Sharded executor.
+//
+
+// Runs operations on a fixed set of workers, each with its own queue.  Every
+// operation on a given key is queued for the same worker, so they run one at
+// a time in the order they were submitted.
+class Cache::ShardedExecutor
+{
+public:
+  ShardedExecutor(Cache* cache, unsigned int num_shards) :
+    _cache(cache),
+    _shards(num_shards),
+    _stopped(false),
+    _num_routed(0)
+  {
+    for (unsigned int ii = 0; ii < _shards.size(); ii++)
+    {
+      Shard* shard = new Shard();
+      shard->executor = this;
+      shard->terminated = false;
+      shard->routed = 0;
+      pthread_cond_init(&shard->cond, NULL);
+      pthread_mutex_init(&shard->lock, NULL);
+      _shards[ii] = shard;
+
+      pthread_create(&shard->thread, NULL, &ShardedExecutor::thread_entry, shard);
+    }
+  }
+
+  ~ShardedExecutor()
+  {
+    stop();
+
+    for (std::vector<Shard*>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_cond_destroy(&(*shard)->cond);
+      pthread_mutex_destroy(&(*shard)->lock);
+      delete *shard;
+    }
+  }
+
+  // Queue an operation for the worker that owns its key.
+  void add(CassandraStore::Operation* op, CassandraStore::Transaction* trx)
+  {
+    CacheOperation* cache_op = dynamic_cast<CacheOperation*>(op);
+    std::string key = (cache_op != NULL) ? cache_op->affinity_key() : "";
+    unsigned long routed = _num_routed++;
+
+    // Operations that aren't tied to a key are dealt out in turn.
+    size_t index = key.empty() ? (routed % _shards.size()) :
+                                 (_hash(key) % _shards.size());
+    Shard* shard = _shards[index];
+
+    Work work;
+    work.op = op;
+    work.trx = trx;
+    work.priority = (cache_op != NULL) ? cache_op->priority() : PRIORITY_NORMAL;
+    work.queued_us = now_us();
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->terminated)
+    {
+      // The worker may already have exited, so run the operation here.
+      pthread_mutex_unlock(&shard->lock);
+      run_operation(op, trx);
+      return;
+    }
+
+    shard->queue.push_back(work);
+    shard->routed++;
+    unsigned long queue_depth = shard->queue.size();
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (_cache->_stats != NULL)
+    {
+      _cache->_stats->update_cache_worker_threads(_shards.size());
+      _cache->_stats->update_cache_queue_depth(queue_depth);
+
+      if ((routed + 1) % IMBALANCE_SAMPLE_SIZE == 0)
+      {
+        _cache->_stats->update_cache_shard_imbalance(sample_imbalance());
+      }
+    }
+  }
+
+  // Stop the workers once all the queued operations have been run.
+  void stop()
+  {
+    if (_stopped)
+    {
+      return;
+    }
+
+    for (std::vector<Shard*>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_mutex_lock(&(*shard)->lock);
+      (*shard)->terminated = true;
+      pthread_cond_signal(&(*shard)->cond);
+      pthread_mutex_unlock(&(*shard)->lock);
+    }
+
+    for (std::vector<Shard*>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_join((*shard)->thread, NULL);
+    }
+
+    _stopped = true;
+  }
+
+private:
+  // How many operations are routed between each report of the imbalance.
+  static const unsigned long IMBALANCE_SAMPLE_SIZE = 1000;
+
+  struct Work
+  {
+    CassandraStore::Operation* op;
+    CassandraStore::Transaction* trx;
+    Priority priority;
+    unsigned long queued_us;
+  };
+
+  struct Shard
+  {
+    ShardedExecutor* executor;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // The following are all protected by lock.
+    bool terminated;
+    std::deque<Work> queue;
+
+    // Operations routed to this shard since the imbalance was last sampled.
+    unsigned long routed;
+  };
+
+  static unsigned long now_us()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+  }
+
+  static void* thread_entry(void* shard)
+  {
+    ((Shard*)shard)->executor->run((Shard*)shard);
+    return NULL;
+  }
+
+  // Work out how many operations have been routed to the busiest shard as a
+  // percentage of the average, and start counting again.
+  unsigned long sample_imbalance()
+  {
+    unsigned long total = 0;
+    unsigned long busiest = 0;
+
+    for (std::vector<Shard*>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_mutex_lock(&(*shard)->lock);
+      unsigned long routed = (*shard)->routed;
+      (*shard)->routed = 0;
+      pthread_mutex_unlock(&(*shard)->lock);
+
+      total += routed;
+      busiest = std::max(busiest, routed);
+    }
+
+    return (total > 0) ? ((busiest * _shards.size() * 100) / total) : 100;
+  }
+
+  void run(Shard* shard)
+  {
+    pthread_mutex_lock(&shard->lock);
+
+    while (true)
+    {
+      while ((!shard->terminated) && (shard->queue.empty()))
+      {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+      }
+
+      if (shard->queue.empty())
+      {
+        // Terminated with nothing left to run.
+        break;
+      }
+
+      Work work = shard->queue.front();
+      shard->queue.pop_front();
+
+      pthread_mutex_unlock(&shard->lock);
+
+      unsigned long wait_us = now_us() - work.queued_us;
+
+      if (_cache->_stats != NULL)
+      {
+        _cache->_stats->update_cache_queue_wait_us(work.priority, wait_us);
+      }
+
+      run_operation(work.op, work.trx);
+
+      pthread_mutex_lock(&shard->lock);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  // Run an operation and call its transaction back, as the store's thread
+  // pool does.
+  void run_operation(CassandraStore::Operation* op,
+                     CassandraStore::Transaction* trx)
+  {
+    trx->start_timer();
+    bool success = _cache->do_sync(op, trx->trail);
+    trx->stop_timer();
+
+    if (success)
+    {
+      trx->on_success(op);
+    }
+    else
+    {
+      trx->on_failure(op);
+    }
+
+    delete trx; trx = NULL;
+    delete op; op = NULL;
+  }
+
+  Cache* _cache;
+  std::vector<Shard*> _shards;
+  std::hash<std::string> _hash;
+  bool _stopped;
+
+  // Count of operations routed, used to deal out operations without a key.
+  std::atomic<unsigned long> _num_routed;
+};
+
+//
+// Hedged reads.
+//
+
+// Runs reads, and if one hasn't completed after a delay based on how long
+// recent reads have taken, runs the same read again on a thread of the
+// hedger's own, and so over another Cassandra connection - to a different
+// node from the first read's, if there is more than one.  The transaction is
+// completed with whichever read succeeds first.
+class Cache::Hedger
+{
+public:
+  Hedger(Cache* cache, int percentile, int budget_percent) :
+    _cache(cache),
+    _percentile(percentile),
+    _budget_per_read(budget_percent / 100.0),
+    _stopped(false),
+    _pool(NULL),
+    _terminated(false),
+    _timers(),
+    _budget(0),
+    _delay_us(0),
+    _latencies(),
+    _next_latency(0),
+    _num_latencies(0)
+  {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&_lock, NULL);
+
+    // There can't be more hedges running than the budget allows, so there's
+    // no need for more threads than that.
+    _pool = new WorkerPool(cache,
+                           0,
+                           (unsigned int)MAX_BUDGET,
+                           HEDGE_IDLE_TIMEOUT_MS,
+                           0,
+                           false);
+
+    pthread_create(&_thread, NULL, &Hedger::thread_entry, this);
+  }
+
+  ~Hedger()
+  {
+    stop();
+    delete _pool; _pool = NULL;
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  // Run a read, hedging it if it is slow.
+  void run(CacheOperation* op, CassandraStore::Transaction* trx)
+  {
+    Read* read = new Read();
+    read->op = op;
+    read->trx = trx;
+    read->trail = trx->trail;
+    read->outstanding = 1;
+    read->refs = 1;
+    read->primary_done = false;
+    read->delivered = false;
+    read->primary_node = -1;
+    read->hedge_node = -1;
+
+    // The read is kept until the first attempt completes, so the attempt
+    // can refer to it while it runs.
+    op->_attempt_node = &read->primary_node;
+    op->_other_attempt_node = &read->hedge_node;
+
+    // Time the transaction across all the attempts.
+    trx->start_timer();
+
+    pthread_mutex_lock(&_lock);
+
+    _budget = std::min(_budget + _budget_per_read, MAX_BUDGET);
+
+    if ((_delay_us > 0) && (!_terminated))
+    {
+      read->refs++;
+      _timers.insert(std::make_pair(now_us() + _delay_us, read));
+      pthread_cond_signal(&_cond);
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    CassandraStore::Operation* primary_op = op;
+    CassandraStore::Transaction* attempt = new Attempt(this, read, true);
+    _cache->dispatch(primary_op, attempt, true);
+  }
+
+  // Stop hedging.  Reads that are already running still complete.
+  void stop()
+  {
+    if (_stopped)
+    {
+      return;
+    }
+
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+    _pool->stop();
+    _stopped = true;
+  }
+
+private:
+  // The most hedged reads that can be saved up.
+  static const double MAX_BUDGET;
+
+  // The number of read latencies the hedging delay is worked out from, and
+  // how many are needed before reads are hedged.
+  static const size_t NUM_LATENCIES = 1024;
+  static const size_t MIN_LATENCIES = 64;
+
+  // How long a thread that runs hedged reads is kept once it is idle.
+  static const long HEDGE_IDLE_TIMEOUT_MS = 10000;
+
+  // A read that may be hedged.
+  struct Read
+  {
+    // The first attempt.  Only valid until that attempt completes.
+    CacheOperation* op;
+
+    // The submitter's transaction, and its trail.
+    CassandraStore::Transaction* trx;
+    SAS::TrailId trail;
+
+    // The following are protected by the hedger's lock.  The read is deleted
+    // once it has no references from attempts or timers.
+    int outstanding;
+    int refs;
+    bool primary_done;
+    bool delivered;
+
+    // The nodes the first attempt and the hedge are running on (see
+    // CacheOperation::_attempt_node).
+    std::atomic<int> primary_node;
+    std::atomic<int> hedge_node;
+  };
+
+  // Transaction for one attempt at a read.
+  class Attempt : public CassandraStore::Transaction, public PooledObject
+  {
+  public:
+    Attempt(Hedger* hedger, Read* read, bool primary) :
+      CassandraStore::Transaction(read->trail),
+      _hedger(hedger),
+      _read(read),
+      _primary(primary)
+    {}
+
+    void on_success(CassandraStore::Operation* op)
+    {
+      _hedger->complete(this, op, true);
+    }
+
+    void on_failure(CassandraStore::Operation* op)
+    {
+      _hedger->complete(this, op, false);
+    }
+
+    Hedger* _hedger;
+    Read* _read;
+    bool _primary;
+  };
+
+  static unsigned long now_us()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+  }
+
+  static void* thread_entry(void* hedger)
+  {
+    ((Hedger*)hedger)->run_timers();
+    return NULL;
+  }
+
+  // Record how long a first attempt took, and periodically recalculate the
+  // hedging delay.  Must be called with _lock held.
+  void record_latency(unsigned long latency_us)
+  {
+    if (_latencies.size() < NUM_LATENCIES)
+    {
+      _latencies.push_back(latency_us);
+    }
+    else
+    {
+      _latencies[_next_latency] = latency_us;
+    }
+
+    _next_latency = (_next_latency + 1) % NUM_LATENCIES;
+    _num_latencies++;
+
+    if ((_latencies.size() >= MIN_LATENCIES) &&
+        (_num_latencies % MIN_LATENCIES == 0))
+    {
+      std::vector<unsigned long> sorted(_latencies);
+      std::vector<unsigned long>::iterator nth =
+                     sorted.begin() + ((sorted.size() - 1) * _percentile) / 100;
+      std::nth_element(sorted.begin(), nth, sorted.end());
+      _delay_us = std::max(*nth, 1ul);
+    }
+  }
+
+  // Drop a reference to a read.  Must be called with _lock held.
+  void release(Read* read)
+  {
+    if (--read->refs == 0)
+    {
+      delete read;
+    }
+  }
+
+  // Handle an attempt completing.  The first to succeed completes the
+  // submitter's transaction.  A failure only does so once no other attempt
+  // can succeed.
+  void complete(Attempt* attempt, CassandraStore::Operation* op, bool success)
+  {
+    Read* read = attempt->_read;
+    unsigned long latency_us;
+
+    pthread_mutex_lock(&_lock);
+
+    if ((attempt->_primary) && (attempt->get_duration(latency_us)))
+    {
+      record_latency(latency_us);
+    }
+
+    if (attempt->_primary)
+    {
+      read->primary_done = true;
+    }
+
+    read->outstanding--;
+    bool deliver = ((!read->delivered) &&
+                    ((success) ||
+                     ((read->outstanding == 0) && (read->primary_done))));
+    read->delivered = read->delivered || deliver;
+
+    pthread_mutex_unlock(&_lock);
+
+    if (deliver)
+    {
+      read->trx->stop_timer();
+
+      if (success)
+      {
+        read->trx->on_success(op);
+      }
+      else
+      {
+        read->trx->on_failure(op);
+      }
+
+      delete read->trx; read->trx = NULL;
+    }
+
+    pthread_mutex_lock(&_lock);
+    release(read);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Hedge reads whose first attempts are taking too long.
+  void run_timers()
+  {
+    pthread_mutex_lock(&_lock);
+
+    while (!_terminated)
+    {
+      if (_timers.empty())
+      {
+        pthread_cond_wait(&_cond, &_lock);
+        continue;
+      }
+
+      unsigned long now = now_us();
+      std::multimap<unsigned long, Read*>::iterator timer = _timers.begin();
+
+      if (timer->first > now)
+      {
+        struct timespec deadline;
+        deadline.tv_sec = timer->first / 1000000;
+        deadline.tv_nsec = (timer->first % 1000000) * 1000;
+        pthread_cond_timedwait(&_cond, &_lock, &deadline);
+        continue;
+      }
+
+      Read* read = timer->second;
+      _timers.erase(timer);
+
+      CacheOperation* hedge_op = NULL;
+
+      if ((!read->primary_done) && (_budget >= 1.0))
+      {
+        // The first attempt hasn't finished, so is still valid to copy.
+        // The copy goes to a different node, so that it doesn't wait on
+        // whatever is holding the first attempt up.  If the first attempt
+        // is still queued, it avoids the copy's node once it starts.
+        hedge_op = read->op->clone();
+        hedge_op->_attempt_node = &read->hedge_node;
+        hedge_op->_other_attempt_node = &read->primary_node;
+      }
+
+      if (hedge_op != NULL)
+      {
+        _budget -= 1.0;
+        read->outstanding++;
+        read->refs++;
+      }
+
+      release(read);
+
+      if (hedge_op != NULL)
+      {
+        pthread_mutex_unlock(&_lock);
+
+        LOG_DEBUG("Cache read is slow - hedging it");
+
+        if (_cache->_stats != NULL)
+        {
+          _cache->_stats->incr_cache_hedged_reads();
+        }
+
+        // Run the hedge on the hedger's own threads, as the threads the
+        // first attempt was queued on may all be as stuck as it is.
+        _pool->add(hedge_op, new Attempt(this, read, false));
+
+        pthread_mutex_lock(&_lock);
+      }
+    }
+
+    // Drop the timers of reads that haven't been hedged.  They complete as
+    // normal.
+    for (std::multimap<unsigned long, Read*>::iterator timer = _timers.begin();
+         timer != _timers.end();
+         ++timer)
+    {
+      release(timer->second);
+    }
+
+    _timers.clear();
+    pthread_mutex_unlock(&_lock);
+  }
+
+  Cache* _cache;
+  int _percentile;
+  double _budget_per_read;
+  bool _stopped;
+
+  // Runs the hedged reads.
+  WorkerPool* _pool;
+
+  pthread_t _thread;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+
+  // The following are all protected by _lock.
+  bool _terminated;
+
+  // Reads to hedge if they are still running, keyed by when to hedge them.
+  std::multimap<unsigned long, Read*> _timers;
+
+  // How many reads can be hedged.  Each read adds to this, up to a limit.
+  double _budget;
+
+  // How long to wait before hedging a read.  Zero until enough reads have
+  // completed to work it out.
+  unsigned long _delay_us;
+
+  // Latencies of recent first attempts, as a ring buffer.
+  std::vector<unsigned long> _latencies;
+  size_t _next_latency;
+  unsigned long _num_latencies;
+};
+
+const double Cache::Hedger::MAX_BUDGET = 10.0;
+
+//
+// Multiple Cassandra nodes.
+//
+
+// Chooses the node each operation is sent to, based on a moving average of
+// each node's latency and the number of operations it already has in
+// flight.  Nodes that fail repeatedly, or are much slower than the fastest
+// other node, are not used for a while.  The time a node is left out for
+// doubles each time it is left out, until it has run enough operations
+// successfully.  Each thread has its own connection to each node it uses.
+class Cache::NodeSelector
+{
+public:
+  NodeSelector(Cache* cache,
+               const std::vector<std::string>& hostnames,
+               uint16_t port) :
+    _cache(cache),
+    _port(port),
+    _nodes(hostnames.begin(), hostnames.end())
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_key_create(&_thread_key, &NodeSelector::delete_thread_state);
+  }
+
+  ~NodeSelector()
+  {
+    // Threads that have already exited have deleted their own connections,
+    // so this only needs to delete the connections of the current thread.
+    delete_thread_state(pthread_getspecific(_thread_key));
+    pthread_setspecific(_thread_key, NULL);
+    pthread_key_delete(_thread_key);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  // Choose the node for the operation the current thread is about to run.
+  //
+  // @param op - The operation, or NULL.  If it is an attempt at a read that
+  //             may be hedged, the node the other attempt is running on is
+  //             avoided, and the chosen node recorded.  Both are done under
+  //             the lock, so two attempts starting at once can't both
+  //             choose the same node.
+  void start_operation(CacheOperation* op)
+  {
+    ThreadState* state = thread_state();
+
+    pthread_mutex_lock(&_lock);
+
+    int avoid_node = ((op != NULL) && (op->_other_attempt_node != NULL)) ?
+                       op->_other_attempt_node->load() : -1;
+    state->node = choose_node(now_us(), avoid_node);
+    _nodes[state->node].in_flight++;
+
+    if ((op != NULL) && (op->_attempt_node != NULL))
+    {
+      op->_attempt_node->store((int)state->node);
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    state->start_us = now_us();
+  }
+
+  // Record the outcome of the operation the current thread has just run.
+  //
+  // @param connection_failed - true if the node could not be reached.
+  void end_operation(bool connection_failed)
+  {
+    ThreadState* state = thread_state();
+    unsigned long now = now_us();
+
+    pthread_mutex_lock(&_lock);
+
+    Node& node = _nodes[state->node];
+    node.in_flight--;
+
+    if (connection_failed)
+    {
+      node.successes = 0;
+      node.failures++;
+
+      if (node.failures >= MAX_FAILURES)
+      {
+        eject(state->node, now, "failed");
+      }
+    }
+    else
+    {
+      double latency_us = now - state->start_us;
+      node.latency_us = (node.latency_us == 0) ?
+                          latency_us :
+                          ((1 - LATENCY_WEIGHT) * node.latency_us) +
+                            (LATENCY_WEIGHT * latency_us);
+      node.failures = 0;
+
+      if (++node.successes >= RECOVERED_SUCCESSES)
+      {
+        node.eject_ms = MIN_EJECT_MS;
+      }
+
+      double fastest_us = fastest_other(state->node);
+
+      if ((node.latency_us > MIN_SLOW_LATENCY_US) &&
+          (fastest_us > 0) &&
+          (node.latency_us > SLOW_FACTOR * fastest_us))
+      {
+        eject(state->node, now, "slow");
+      }
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    state->node = NO_NODE;
+  }
+
+  // Get the current thread's connection to the node chosen for its current
+  // operation, connecting if necessary.  If no operation is running (for
+  // example, when testing the connection), the best node is used.
+  CassandraStore::ClientInterface* get_client()
+  {
+    ThreadState* state = thread_state();
+    state->client_node = state->node;
+
+    if (state->client_node == NO_NODE)
+    {
+      pthread_mutex_lock(&_lock);
+      state->client_node = choose_node(now_us());
+      pthread_mutex_unlock(&_lock);
+    }
+
+    CassandraStore::ClientInterface*& client = state->clients[state->client_node];
+
+    if (client == NULL)
+    {
+      const std::string& hostname = _nodes[state->client_node].hostname;
+      LOG_DEBUG("Connecting to Cassandra node %s", hostname.c_str());
+      client = _cache->create_client(hostname, _port);
+    }
+
+    return client;
+  }
+
+  // Drop the current thread's connection to the node it last used, so that
+  // the next request reconnects.
+  void release_client()
+  {
+    ThreadState* state = thread_state();
+
+    if (state->client_node != NO_NODE)
+    {
+      delete state->clients[state->client_node];
+      state->clients[state->client_node] = NULL;
+    }
+  }
+
+private:
+  struct Node
+  {
+    Node(const std::string& _hostname) :
+      hostname(_hostname),
+      latency_us(0),
+      in_flight(0),
+      failures(0),
+      successes(0),
+      ejected_until_us(0),
+      eject_ms(MIN_EJECT_MS)
+    {}
+
+    std::string hostname;
+
+    // Moving average of the node's latency.  Zero until an operation has
+    // completed on the node.
+    double latency_us;
+
+    unsigned int in_flight;
+
+    // Consecutive connection failures, and operations run successfully since
+    // the node was last left out.
+    unsigned int failures;
+    unsigned int successes;
+
+    // Time until which the node is left out, or zero if it is in use.
+    unsigned long ejected_until_us;
+
+    // How long the node will be left out for next time.
+    long eject_ms;
+  };
+
+  // Connections and current operation of a thread.
+  struct ThreadState
+  {
+    ThreadState(size_t num_nodes) :
+      clients(num_nodes, (CassandraStore::ClientInterface*)NULL),
+      node(NO_NODE),
+      client_node(NO_NODE),
+      start_us(0)
+    {}
+
+    std::vector<CassandraStore::ClientInterface*> clients;
+
+    // The node chosen for the running operation, and the node of the client
+    // most recently returned by get_client.
+    size_t node;
+    size_t client_node;
+
+    unsigned long start_us;
+  };
+
+  static const size_t NO_NODE = (size_t)-1;
+
+  // Weight given to each latency sample in the moving average.
+  static const double LATENCY_WEIGHT;
+
+  // Consecutive connection failures after which a node is left out.
+  static const unsigned int MAX_FAILURES = 3;
+
+  // A node is left out as slow if its average latency is more than this
+  // many times that of the fastest other node, and at least the minimum.
+  static const double SLOW_FACTOR;
+  static const double MIN_SLOW_LATENCY_US;
+
+  // Bounds on how long a node is left out for.
+  static const long MIN_EJECT_MS = 1000;
+  static const long MAX_EJECT_MS = 60000;
+
+  // Successful operations after which a node that has been left out is
+  // considered to have recovered.
+  static const unsigned int RECOVERED_SUCCESSES = 100;
+
+  ThreadState* thread_state()
+  {
+    ThreadState* state = (ThreadState*)pthread_getspecific(_thread_key);
+
+    if (state == NULL)
+    {
+      state = new ThreadState(_nodes.size());
+      pthread_setspecific(_thread_key, state);
+    }
+
+    return state;
+  }
+
+  static void delete_thread_state(void* state_ptr)
+  {
+    ThreadState* state = (ThreadState*)state_ptr;
+
+    if (state != NULL)
+    {
+      for (size_t ii = 0; ii < state->clients.size(); ii++)
+      {
+        delete state->clients[ii];
+      }
+
+      delete state;
+    }
+  }
+
+  // Choose the node with the lowest latency weighted by the operations in
+  // flight on it, first bringing back any nodes that have been left out for
+  // long enough.  The node to avoid (if any) is only chosen if every other
+  // node has been left out.  Must be called with the lock held.
+  size_t choose_node(unsigned long now, int avoid_node = -1)
+  {
+    size_t best = NO_NODE;
+    double best_score = 0;
+
+    for (size_t ii = 0; ii < _nodes.size(); ii++)
+    {
+      Node& node = _nodes[ii];
+
+      if ((int)ii == avoid_node)
+      {
+        continue;
+      }
+
+      if (node.ejected_until_us != 0)
+      {
+        if (now < node.ejected_until_us)
+        {
+          continue;
+        }
+
+        // Start the node off level with the fastest node, so that it gets a
+        // fair share of operations until its latency is known again.
+        LOG_STATUS("Using Cassandra node %s again", node.hostname.c_str());
+        node.ejected_until_us = 0;
+        node.latency_us = fastest_other(ii);
+      }
+
+      double score = (node.latency_us + 1) * (node.in_flight + 1);
+
+      if ((best == NO_NODE) || (score < best_score))
+      {
+        best = ii;
+        best_score = score;
+      }
+    }
+
+    if ((best == NO_NODE) &&
+        (avoid_node >= 0) &&
+        (_nodes[avoid_node].ejected_until_us == 0))
+    {
+      // The node to avoid is the only one in use.
+      best = avoid_node;
+    }
+    else if (best == NO_NODE)
+    {
+      // Every node has been left out, so use the one that is due back
+      // first.
+      best = 0;
+
+      for (size_t ii = 1; ii < _nodes.size(); ii++)
+      {
+        if (_nodes[ii].ejected_until_us < _nodes[best].ejected_until_us)
+        {
+          best = ii;
+        }
+      }
+    }
+
+    return best;
+  }
+
+  // @returns - The lowest latency of the nodes in use other than the
+  //            specified one, or zero if none of them has a latency yet.
+  //            Must be called with the lock held.
+  double fastest_other(size_t index)
+  {
+    double fastest_us = 0;
+
+    for (size_t ii = 0; ii < _nodes.size(); ii++)
+    {
+      if ((ii != index) &&
+          (_nodes[ii].ejected_until_us == 0) &&
+          (_nodes[ii].latency_us > 0) &&
+          ((fastest_us == 0) || (_nodes[ii].latency_us < fastest_us)))
+      {
+        fastest_us = _nodes[ii].latency_us;
+      }
+    }
+
+    return fastest_us;
+  }
+
+  // Leave a node out, unless it is the only node still in use.  Must be
+  // called with the lock held.
+  void eject(size_t index, unsigned long now, const char* reason)
+  {
+    for (size_t ii = 0; ii < _nodes.size(); ii++)
+    {
+      if ((ii != index) && (_nodes[ii].ejected_until_us == 0))
+      {
+        Node& node = _nodes[index];
+        LOG_WARNING("Cassandra node %s is %s - not using it for %ldms",
+                    node.hostname.c_str(), reason, node.eject_ms);
+        node.ejected_until_us = now + (node.eject_ms * 1000);
+        node.eject_ms = (node.eject_ms * 2 < MAX_EJECT_MS) ?
+                          node.eject_ms * 2 : MAX_EJECT_MS;
+        node.failures = 0;
+        node.successes = 0;
+        return;
+      }
+    }
+  }
+
+  static unsigned long now_us()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+  }
+
+  Cache* _cache;
+  uint16_t _port;
+
+  // The nodes.  The list is fixed, but the state of each node is protected
+  // by _lock.
+  std::vector<Node> _nodes;
+  pthread_mutex_t _lock;
+
+  // Key for each thread's ThreadState.
+  pthread_key_t _thread_key;
+};
+
+const double Cache::NodeSelector::LATENCY_WEIGHT = 0.2;
+const double Cache::NodeSelector::SLOW_FACTOR = 5.0;
+const double Cache::NodeSelector::MIN_SLOW_LATENCY_US = 10000.0;
+
+//
+// Write-behind.
+//
+
+// Runs writes that nothing is waiting for on a fixed set of threads of its
+// own, retrying them with exponential backoff if they fail.
+class Cache::WriteBehind
+{
+public:
+  WriteBehind(Cache* cache,
+              unsigned int num_threads,
+              size_t max_queue,
+              int max_retries,
+              long retry_backoff_ms) :
+    _cache(cache),
+    _max_queue(max_queue),
+    _max_retries(max_retries),
+    _retry_backoff_ms(retry_backoff_ms),
+    _threads(num_threads),
+    _terminated(false),
+    _queue(),
+    _num_writing(0)
+  {
+    pthread_cond_init(&_cond, NULL);
+    pthread_mutex_init(&_lock, NULL);
+
+    for (std::vector<pthread_t>::iterator thread = _threads.begin();
+         thread != _threads.end();
+         ++thread)
+    {
+      pthread_create(&(*thread), NULL, &WriteBehind::thread_entry, this);
+    }
+  }
+
+  ~WriteBehind()
+  {
+    stop();
+
+    for (std::vector<pthread_t>::iterator thread = _threads.begin();
+         thread != _threads.end();
+         ++thread)
+    {
+      pthread_join(*thread, NULL);
+    }
+
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  // Queue a write.
+  //
+  // @returns - false if the queue is full, in which case the caller keeps
+  //            ownership of the operation and transaction.
+  bool add(CacheOperation* op, CassandraStore::Transaction* trx)
+  {
+    Work work;
+    work.op = op;
+    work.trx = trx;
+    work.queued_us = now_us();
+
+    pthread_mutex_lock(&_lock);
+
+    if ((_terminated) || (_queue.size() >= _max_queue))
+    {
+      pthread_mutex_unlock(&_lock);
+      return false;
+    }
+
+    _queue.push_back(work);
+    unsigned long depth = _queue.size();
+    unsigned long age_us = work.queued_us - _queue.front().queued_us;
+
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    if (_cache->_stats != NULL)
+    {
+      _cache->_stats->update_cache_write_behind_backlog(depth);
+      _cache->_stats->update_cache_write_behind_age_us(age_us);
+    }
+
+    return true;
+  }
+
+  // Stop accepting writes, and wait for those already queued to be written.
+  void stop()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_broadcast(&_cond);
+
+    while ((!_queue.empty()) || (_num_writing > 0))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  struct Work
+  {
+    CacheOperation* op;
+    CassandraStore::Transaction* trx;
+    unsigned long queued_us;
+  };
+
+  static unsigned long now_us()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+  }
+
+  static void* thread_entry(void* write_behind)
+  {
+    ((WriteBehind*)write_behind)->run();
+    return NULL;
+  }
+
+  void run()
+  {
+    pthread_mutex_lock(&_lock);
+
+    while (true)
+    {
+      while ((!_terminated) && (_queue.empty()))
+      {
+        pthread_cond_wait(&_cond, &_lock);
+      }
+
+      if (_queue.empty())
+      {
+        // Terminated with nothing left to write.
+        break;
+      }
+
+      Work work = _queue.front();
+      _queue.pop_front();
+      _num_writing++;
+
+      pthread_mutex_unlock(&_lock);
+      write(work.op, work.trx);
+      pthread_mutex_lock(&_lock);
+
+      // Wake anyone waiting for the writes to drain.
+      _num_writing--;
+      pthread_cond_broadcast(&_cond);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Run a write, retrying it if it fails in a way that may be temporary, and
+  // call its transaction back.
+  void write(CacheOperation* op, CassandraStore::Transaction* trx)
+  {
+    bool success = _cache->do_sync(op, trx->trail);
+    long backoff_ms = _retry_backoff_ms;
+
+    for (int retries = 0;
+         (!success) &&
+         (retries < _max_retries) &&
+         (op->get_result_code() != CassandraStore::INVALID_REQUEST) &&
+         (op->get_result_code() != CassandraStore::NOT_FOUND);
+         retries++)
+    {
+      LOG_DEBUG("Write-behind failed (%d: %s) - retrying in %ldms",
+                op->get_result_code(),
+                op->get_error_text().c_str(),
+                backoff_ms);
+      usleep(backoff_ms * 1000);
+      backoff_ms *= 2;
+
+      op->_cass_status = CassandraStore::OK;
+      op->_cass_error_text = "";
+      success = _cache->do_sync(op, trx->trail);
+    }
+
+    trx->stop_timer();
+
+    if (success)
+    {
+      trx->on_success(op);
+    }
+    else
+    {
+      LOG_ERROR("Failed to write to the cache: %d, %s",
+                op->get_result_code(),
+                op->get_error_text().c_str());
+      trx->on_failure(op);
+    }
+
+    delete trx; trx = NULL;
+    delete op; op = NULL;
+  }
+
+  Cache* _cache;
+  size_t _max_queue;
+  int _max_retries;
+  long _retry_backoff_ms;
+
+  std::vector<pthread_t> _threads;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+
+  // The following are all protected by _lock.
+  bool _terminated;
+  std::deque<Work> _queue;
+  unsigned int _num_writing;
+};
+
+//
+// Cache methods
+//
+
+Cache::Cache() :
+  CassandraStore::Store(KEYSPACE),
+  _reg_data_cache(NULL),
+  _negative_cache(NULL),
+  _stats(NULL),
+  _local_store(NULL),
+  _irs_table(false),
+  _irs_rows_seen(false),
+  _xml_compression_threshold(0),
+  _deletion_marker_ttl(0),
+  _in_flight_reads(),
+  _write_batcher(NULL),
+  _worker_pool(NULL),
+  _sharded_executor(NULL),
+  _hedger(NULL),
+  _node_selector(NULL),
+  _cass_hostnames(),
+  _cass_port(0),
+  _native_pool(NULL),
+  _native_port(0),
+  _write_behind(NULL),
+  _callback_pool(NULL)
+{
+  pthread_mutex_init(&_in_flight_reads_lock, NULL);
+
+  // Threads are only started once there are callbacks to make.
+  _callback_pool = new WorkerPool(this,
+                                  0,
+                                  MAX_CALLBACK_THREADS,
+                                  CALLBACK_IDLE_TIMEOUT_MS,
+                                  0,
+                                  false);
+}
+
+Cache::~Cache()
+{
+  delete _write_batcher; _write_batcher = NULL;
+  delete _write_behind; _write_behind = NULL;
+  delete _sharded_executor; _sharded_executor = NULL;
+  delete _worker_pool; _worker_pool = NULL;
+  delete _callback_pool; _callback_pool = NULL;
+  delete _hedger; _hedger = NULL;
+  delete _node_selector; _node_selector = NULL;
+  delete _native_pool; _native_pool = NULL;
+  delete _reg_data_cache; _reg_data_cache = NULL;
+  delete _negative_cache; _negative_cache = NULL;
+  pthread_mutex_destroy(&_in_flight_reads_lock);
+}
+
+void Cache::configure(const std::vector<std::string>& cass_hostnames,
+                      uint16_t cass_port,
+                      unsigned int num_threads,
+                      unsigned int max_queue,
+                      CommunicationMonitor* comm_monitor)
+{
+  CassandraStore::Store::configure(cass_hostnames.front(),
+                                   cass_port,
+                                   num_threads,
+                                   max_queue,
+                                   comm_monitor);
+
+  _cass_hostnames = cass_hostnames;
+  _cass_port = cass_port;
+
+  if (cass_hostnames.size() > 1)
+  {
+    LOG_STATUS("Spreading Cassandra requests over %zu nodes",
+               cass_hostnames.size());
+  }
+
+  configure_node_selector();
+}
+
+void Cache::configure_native_protocol(uint16_t port)
+{
+  LOG_STATUS("Using Cassandra's native protocol on port %d", port);
+
+  if (_native_pool == NULL)
+  {
+    _native_pool = new NativeConnectionPool();
+  }
+
+  _native_port = port;
+  configure_node_selector();
+}
+
+void Cache::configure_node_selector()
+{
+  delete _node_selector; _node_selector = NULL;
+
+  // Requests always go through the node selector over the native protocol,
+  // as the store's own clients are Thrift clients.
+  if ((_cass_hostnames.size() > 1) ||
+      ((_native_pool != NULL) && (!_cass_hostnames.empty())))
+  {
+    _node_selector = new NodeSelector(this,
+                                      _cass_hostnames,
+                                      (_native_pool != NULL) ? _native_port : _cass_port);
+  }
+}
+
+void Cache::configure_stats(StatsInterface* stats)
+{
+  _stats = stats;
+}
+
+void Cache::configure_reg_data_cache(size_t max_entries, long max_age_ms)
+{
+  delete _reg_data_cache; _reg_data_cache = NULL;
+
+  if ((max_entries > 0) && (max_age_ms > 0))
+  {
+    LOG_STATUS("Caching registration data for up to %zu public IDs for %ldms",
+               max_entries, max_age_ms);
+    _reg_data_cache = new RegDataCache(max_entries, max_age_ms);
+  }
+}
+
+void Cache::configure_negative_cache(size_t max_entries, long ttl_ms)
+{
+  delete _negative_cache; _negative_cache = NULL;
+
+  if ((max_entries > 0) && (ttl_ms > 0))
+  {
+    LOG_STATUS("Remembering up to %zu missing rows for %ldms",
+               max_entries, ttl_ms);
+    _negative_cache = new NegativeCache(max_entries, ttl_ms);
+  }
+}
+
+void Cache::configure_write_batching(long window_us, size_t max_columns)
+{
+  delete _write_batcher; _write_batcher = NULL;
+
+  if ((window_us > 0) && (max_columns > 0))
+  {
+    LOG_STATUS("Batching up to %zu columns over %ldus into each write",
+               max_columns, window_us);
+    _write_batcher = new WriteBatcher(this, window_us, max_columns);
+  }
+}
+
+void Cache::configure_worker_pool(unsigned int min_threads,
+                                 unsigned int max_threads,
+                                 long idle_timeout_ms,
+                                 long starvation_limit_ms)
+{
+  delete _worker_pool; _worker_pool = NULL;
+
+  if ((max_threads > 0) && (max_threads >= min_threads))
+  {
+    // Always keep at least one worker, so queued operations are run.
+    min_threads = std::max(min_threads, 1u);
+    LOG_STATUS("Running cache operations on %u to %u worker threads",
+               min_threads, max_threads);
+    _worker_pool = new WorkerPool(this,
+                                  min_threads,
+                                  max_threads,
+                                  idle_timeout_ms,
+                                  starvation_limit_ms);
+  }
+}
+
+bool Cache::configure_consistency(const std::string& operation,
+                                  const Consistency& consistency)
+{
+  bool known = false;
+
+  for (int ii = 0; ii < NUM_OPERATION_NAMES; ii++)
+  {
+    known = known || (OPERATION_NAMES[ii] == operation);
+  }
+
+  if (!known)
+  {
+    return false;
+  }
+
+  LOG_STATUS("%s operations use consistency level %d, retrying rows not found at %d",
+             operation.c_str(), consistency.level, consistency.not_found_level);
+  _consistency[operation] = consistency;
+  return true;
+}
+
+void Cache::configure_hedging(int percentile, int budget_percent)
+{
+  delete _hedger; _hedger = NULL;
+
+  if ((percentile > 0) && (percentile < 100) && (budget_percent > 0))
+  {
+    LOG_STATUS("Hedging reads slower than the %dth percentile, up to %d%% of reads",
+               percentile, budget_percent);
+    _hedger = new Hedger(this, percentile, budget_percent);
+  }
+}
+
+void Cache::configure_key_affinity(unsigned int num_shards)
+{
+  delete _sharded_executor; _sharded_executor = NULL;
+
+  if (num_shards > 0)
+  {
+    LOG_STATUS("Running cache operations on %u workers chosen by key",
+               num_shards);
+    _sharded_executor = new ShardedExecutor(this, num_shards);
+  }
+}
+
+void Cache::configure_write_behind(unsigned int threads,
+                                  size_t max_queue,
+                                  int max_retries,
+                                  long retry_backoff_ms)
+{
+  delete _write_behind; _write_behind = NULL;
+
+  if ((threads > 0) && (max_queue > 0))
+  {
+    LOG_STATUS("Writing up to %zu queued cache writes on %u threads",
+               max_queue, threads);
+    _write_behind = new WriteBehind(this,
+                                    threads,
+                                    max_queue,
+                                    max_retries,
+                                    retry_backoff_ms);
+  }
+}
+
+void Cache::configure_irs_table(bool enabled)
+{
+  if (enabled)
+  {
+    LOG_STATUS("Writing IMS subscriptions to the %s table", IRS.c_str());
+  }
+
+  _irs_table = enabled;
+}
+
+void Cache::configure_xml_compression(size_t threshold)
+{
+  if (threshold > 0)
+  {
+    LOG_STATUS("Compressing IMS subscriptions of %zu bytes or more", threshold);
+  }
+
+  _xml_compression_threshold = threshold;
+}
+
+void Cache::configure_deletion_markers(int32_t ttl_s)
+{
+  if (ttl_s > 0)
+  {
+    LOG_STATUS("Marking deleted IMPU, IMPI mapping and IRS columns for %ds rather than deleting them",
+               ttl_s);
+  }
+
+  _deletion_marker_ttl = ttl_s;
+}
+
+void Cache::configure_local_store(LocalStore* local_store)
+{
+  if (local_store != NULL)
+  {
+    LOG_STATUS("Using the local store in place of Cassandra");
+  }
+
+  _local_store = local_store;
+}
+
+/// Transaction for the reads made by Cache::warm_up.  Counts the reads in
+/// flight and the public IDs read.
+class WarmUpTransaction : public CassandraStore::Transaction
+{
+public:
+  struct Progress
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int in_flight;
+    size_t done;
+    size_t failed;
+  };
+
+  WarmUpTransaction(Progress* progress, size_t num_public_ids) :
+    CassandraStore::Transaction(0),
+    _progress(progress),
+    _num_public_ids(num_public_ids)
+  {}
+
+  void on_success(CassandraStore::Operation* op) { complete(true); }
+  void on_failure(CassandraStore::Operation* op) { complete(false); }
+
+private:
+  void complete(bool success)
+  {
+    pthread_mutex_lock(&_progress->lock);
+    _progress->in_flight--;
+    _progress->done += _num_public_ids;
+    if (!success)
+    {
+      _progress->failed += _num_public_ids;
+    }
+    pthread_cond_signal(&_progress->cond);
+    pthread_mutex_unlock(&_progress->lock);
+  }
+
+  Progress* _progress;
+  size_t _num_public_ids;
+};
+
+size_t Cache::warm_up(const std::vector<std::string>& public_ids,
+                      size_t batch_size,
+                      unsigned int max_in_flight)
+{
+  if (_reg_data_cache == NULL)
+  {
+    LOG_STATUS("Not warming up the cache, as the registration data cache is disabled");
+    return 0;
+  }
+
+  batch_size = std::max(batch_size, (size_t)1);
+  max_in_flight = std::max(max_in_flight, 1u);
+
+  LOG_STATUS("Warming up the cache with %zu public IDs", public_ids.size());
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  WarmUpTransaction::Progress progress;
+  pthread_mutex_init(&progress.lock, NULL);
+  pthread_cond_init(&progress.cond, NULL);
+  progress.in_flight = 0;
+  progress.done = 0;
+  progress.failed = 0;
+
+  size_t next_report = public_ids.size() / 10;
+
+  for (size_t batch_start = 0;
+       batch_start < public_ids.size();
+       batch_start += batch_size)
+  {
+    size_t batch_end = std::min(batch_start + batch_size, public_ids.size());
+
+    pthread_mutex_lock(&progress.lock);
+
+    while (progress.in_flight >= max_in_flight)
+    {
+      pthread_cond_wait(&progress.cond, &progress.lock);
+    }
+
+    progress.in_flight++;
+
+    if (progress.done >= next_report)
+    {
+      LOG_STATUS("Cache warm-up has read %zu of %zu public IDs",
+                 progress.done, public_ids.size());
+      next_report = progress.done + (public_ids.size() / 10);
+    }
+
+    pthread_mutex_unlock(&progress.lock);
+
+    // The read may complete (if its rows are already cached) before
+    // do_async returns, so the lock mustn't be held.
+    CassandraStore::Operation* op =
+      create_GetRegDataMulti(std::vector<std::string>(public_ids.begin() + batch_start,
+                                                      public_ids.begin() + batch_end));
+    CassandraStore::Transaction* trx =
+      new WarmUpTransaction(&progress, batch_end - batch_start);
+    do_async(op, trx);
+  }
+
+  pthread_mutex_lock(&progress.lock);
+
+  while (progress.in_flight > 0)
+  {
+    pthread_cond_wait(&progress.cond, &progress.lock);
+  }
+
+  pthread_mutex_unlock(&progress.lock);
+
+  pthread_cond_destroy(&progress.cond);
+  pthread_mutex_destroy(&progress.lock);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned long elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000) +
+                             ((end.tv_nsec - start.tv_nsec) / 1000000);
+
+  size_t cached = _reg_data_cache->size();
+
+  if (progress.failed > 0)
+  {
+    LOG_WARNING("Cache warm-up failed to read %zu public IDs", progress.failed);
+  }
+
+  LOG_STATUS("Cache warm-up took %lums - %zu public IDs cached",
+             elapsed_ms, cached);
+
+  return cached;
+}
+
+void Cache::get_hot_public_ids(std::vector<std::string>& public_ids)
+{
+  if (_reg_data_cache != NULL)
+  {
+    _reg_data_cache->public_ids(public_ids);
+  }
+}
+
+void Cache::stop()
+{
+  if (_hedger != NULL)
+  {
+    _hedger->stop();
+  }
+
+  if (_write_batcher != NULL)
+  {
+    _write_batcher->stop();
+  }
+
+  if (_write_behind != NULL)
+  {
+    _write_behind->stop();
+  }
+
+  if (_sharded_executor != NULL)
+  {
+    _sharded_executor->stop();
+  }
+
+  if (_worker_pool != NULL)
+  {
+    _worker_pool->stop();
+  }
+
+  _callback_pool->stop();
+
+  CassandraStore::Store::stop();
+}
+
+void Cache::do_async(CassandraStore::Operation*& op,
+                     CassandraStore::Transaction*& trx)
+{
+  CacheOperation* cache_op = dynamic_cast<CacheOperation*>(op);
+
+  if (cache_op != NULL)
+  {
+    cache_op->_cache = this;
+
+    if (cache_op->on_submit())
+    {
+      // The operation has been satisfied without going to Cassandra.  Its
+      // transaction is called back on another thread, as callers don't
+      // expect to be called back from within do_async.  That thread never
+      // goes to Cassandra, so the callback doesn't wait behind operations
+      // that do.
+      cache_op->_completed = true;
+      _callback_pool->add(op, trx);
+      trx = NULL;
+      op = NULL;
+      return;
+    }
+
+    if (coalesce_read(cache_op, trx))
+    {
+      // The in-flight read now owns the operation and transaction.
+      trx = NULL;
+      op = NULL;
+      return;
+    }
+
+    std::vector<CassandraStore::RowColumns> rows;
+    int64_t timestamp;
+    int32_t ttl;
+
+    if ((_write_batcher != NULL) &&
+        (cache_op->get_batchable_writes(rows, timestamp, ttl)))
+    {
+      // The batcher now owns the operation and transaction.  Time the
+      // transaction from now so its latency covers the batching window.
+      trx->start_timer();
+      _write_batcher->add(cache_op, trx, rows, timestamp, ttl);
+      trx = NULL;
+      op = NULL;
+      return;
+    }
+
+    if ((_write_behind != NULL) && (cache_op->_write_behind))
+    {
+      // Time the transaction from now so its latency covers the time it
+      // spends queued.
+      trx->start_timer();
+
+      if (_write_behind->add(cache_op, trx))
+      {
+        // The write-behind stage now owns the operation and transaction.
+        trx = NULL;
+        op = NULL;
+        return;
+      }
+
+      LOG_DEBUG("Write-behind queue is full - running write as normal");
+    }
+
+    if ((_hedger != NULL) && (cache_op->hedgeable()))
+    {
+      // The hedger now owns the operation and transaction.
+      _hedger->run(cache_op, trx);
+      trx = NULL;
+      op = NULL;
+      return;
+    }
+  }
+
+  dispatch(op, trx, true);
+}
+
+void Cache::dispatch(CassandraStore::Operation*& op,
+                     CassandraStore::Transaction*& trx,
+                     bool by_key)
+{
+  if ((_sharded_executor != NULL) && (by_key))
+  {
+    // The executor now owns the operation and transaction.
+    _sharded_executor->add(op, trx);
+    trx = NULL;
+    op = NULL;
+    return;
+  }
+
+  if (_worker_pool != NULL)
+  {
+    // The pool now owns the operation and transaction.
+    _worker_pool->add(op, trx);
+    trx = NULL;
+    op = NULL;
+    return;
+  }
+
+  CassandraStore::Store::do_async(op, trx);
+}
+
+bool Cache::do_sync(CassandraStore::Operation* op, SAS::TrailId trail)
+{
+  CacheOperation* cache_op = dynamic_cast<CacheOperation*>(op);
+  bool success;
+
+  if ((cache_op != NULL) && (cache_op->_completed))
+  {
+    // The operation was completed when it was submitted.
+    success = (op->get_result_code() == CassandraStore::OK);
+  }
+  else if ((cache_op != NULL) && (past_deadline(cache_op)))
+  {
+    // Whoever submitted the operation has given up on it, so don't spend
+    // any time on it.
+    LOG_DEBUG("Cache operation passed its deadline while queued - failing it");
+    cache_op->_cass_status = CassandraStore::RESOURCE_ERROR;
+    cache_op->_cass_error_text = "Deadline passed before operation was run";
+    success = false;
+
+    if (_stats != NULL)
+    {
+      _stats->incr_cache_expired_operations();
+    }
+  }
+  else if (_node_selector != NULL)
+  {
+    _node_selector->start_operation(cache_op);
+    success = CassandraStore::Store::do_sync(op, trail);
+
+    if ((cache_op != NULL) && (cache_op->_attempt_node != NULL))
+    {
+      cache_op->_attempt_node->store(-1);
+    }
+
+    _node_selector->end_operation(op->get_result_code() ==
+                                  CassandraStore::CONNECTION_ERROR);
+  }
+  else
+  {
+    success = CassandraStore::Store::do_sync(op, trail);
+  }
+
+  if ((cache_op != NULL) && (!cache_op->_in_flight_key.empty()))
+  {
+    complete_coalesced_reads(cache_op, success);
+  }
+
+  return success;
+}
+
+CassandraStore::ClientInterface* Cache::get_client()
+{
+  if (_local_store != NULL)
+  {
+    return _local_store;
+  }
+  else if (_node_selector != NULL)
+  {
+    return _node_selector->get_client();
+  }
+
+  return CassandraStore::Store::get_client();
+}
+
+void Cache::release_client()
+{
+  if (_node_selector != NULL)
+  {
+    _node_selector->release_client();
+  }
+  else if (_local_store == NULL)
+  {
+    CassandraStore::Store::release_client();
+  }
+}
+
+CassandraStore::ClientInterface* Cache::create_client(const std::string& hostname,
+                                                      uint16_t port)
+{
+  CassandraStore::ClientInterface* client;
+
+  if (_native_pool != NULL)
+  {
+    client = _native_pool->get_client(hostname, port);
+  }
+  else
+  {
+    boost::shared_ptr<apache::thrift::transport::TTransport> socket(
+      new apache::thrift::transport::TSocket(hostname, port));
+    boost::shared_ptr<apache::thrift::transport::TFramedTransport> transport(
+      new apache::thrift::transport::TFramedTransport(socket));
+    boost::shared_ptr<apache::thrift::protocol::TProtocol> protocol(
+      new apache::thrift::protocol::TBinaryProtocol(transport));
+    transport->open();
+
+    client = new CassandraStore::Client(protocol, transport);
+  }
+
+  try
+  {
+    client->set_keyspace(KEYSPACE);
+  }
+  catch (...)
+  {
+    delete client;
+    throw;
+  }
+
+  return client;
+}
+
+bool Cache::coalesce_read(CacheOperation* op, CassandraStore::Transaction* trx)
+{
+  std::string key = op->coalescing_key();
+
+  if (key.empty())
+  {
+    return false;
+  }
+
+  bool coalesced = false;
+
+  pthread_mutex_lock(&_in_flight_reads_lock);
+
+  std::map<std::string, CacheOperation*>::iterator in_flight =
+                                                    _in_flight_reads.find(key);
+  if (in_flight != _in_flight_reads.end())
+  {
+    // Time the attached transaction from now, so its latency covers the time
+    // it spends waiting for the in-flight read.
+    trx->start_timer();
+    in_flight->second->_coalesced.push_back(std::make_pair(op, trx));
+    coalesced = true;
+
+    // The in-flight read must not be dropped while the attached one still
+    // wants its result.
+    CacheOperation* in_flight_op = in_flight->second;
+    if ((in_flight_op->_deadline.tv_sec != 0) &&
+        ((op->_deadline.tv_sec == 0) ||
+         (op->_deadline.tv_sec > in_flight_op->_deadline.tv_sec) ||
+         ((op->_deadline.tv_sec == in_flight_op->_deadline.tv_sec) &&
+          (op->_deadline.tv_nsec > in_flight_op->_deadline.tv_nsec))))
+    {
+      in_flight_op->_deadline = op->_deadline;
+    }
+  }
+  else
+  {
+    _in_flight_reads[key] = op;
+    op->_in_flight_key = key;
+  }
+
+  pthread_mutex_unlock(&_in_flight_reads_lock);
+
+  if ((coalesced) && (_stats != NULL))
+  {
+    _stats->incr_cache_coalesced_reads();
+  }
+
+  return coalesced;
+}
+
+bool Cache::past_deadline(CacheOperation* op)
+{
+  // An operation's in-flight key is only set before it is queued, so can be
+  // checked without the lock, but its deadline can be pushed back by reads
+  // attaching to it.
+  bool in_flight = !op->_in_flight_key.empty();
+
+  if (in_flight)
+  {
+    pthread_mutex_lock(&_in_flight_reads_lock);
+  }
+
+  struct timespec deadline = op->_deadline;
+
+  if (in_flight)
+  {
+    pthread_mutex_unlock(&_in_flight_reads_lock);
+  }
+
+  if (deadline.tv_sec == 0)
+  {
+    return false;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return ((now.tv_sec > deadline.tv_sec) ||
+          ((now.tv_sec == deadline.tv_sec) &&
+           (now.tv_nsec >= deadline.tv_nsec)));
+}
+
+void Cache::complete_coalesced_reads(CacheOperation* op, bool success)
+{
+  CoalescedOperations coalesced;
+
+  pthread_mutex_lock(&_in_flight_reads_lock);
+
+  // The read may already have been replaced as the in-flight read for its key
+  // if the data was written since it started.
+  std::map<std::string, CacheOperation*>::iterator in_flight =
+                                         _in_flight_reads.find(op->_in_flight_key);
+  if ((in_flight != _in_flight_reads.end()) && (in_flight->second == op))
+  {
+    _in_flight_reads.erase(in_flight);
+  }
+
+  coalesced.swap(op->_coalesced);
+  op->_in_flight_key.clear();
+
+  pthread_mutex_unlock(&_in_flight_reads_lock);
+
+  for (CoalescedOperations::iterator it = coalesced.begin();
+       it != coalesced.end();
+       ++it)
+  {
+    CacheOperation* coalesced_op = it->first;
+    CassandraStore::Transaction* coalesced_trx = it->second;
+
+    coalesced_op->_cass_status = op->_cass_status;
+    coalesced_op->_cass_error_text = op->_cass_error_text;
+    coalesced_op->copy_result(*op);
+
+    coalesced_trx->stop_timer();
+
+    if (success)
+    {
+      coalesced_trx->on_success(coalesced_op);
+    }
+    else
+    {
+      coalesced_trx->on_failure(coalesced_op);
+    }
+
+    delete coalesced_trx; coalesced_trx = NULL;
+    delete coalesced_op; coalesced_op = NULL;
+  }
+}
+
+void Cache::stop_coalescing(const std::string& table,
+                            const std::vector<std::string>& keys)
+{
+  pthread_mutex_lock(&_in_flight_reads_lock);
+
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    // All the in-flight reads for a row share a key prefix.
+    std::string prefix = CacheOperation::make_coalescing_key(table, *key, "");
+
+    std::map<std::string, CacheOperation*>::iterator in_flight =
+                                              _in_flight_reads.lower_bound(prefix);
+    while ((in_flight != _in_flight_reads.end()) &&
+           (in_flight->first.compare(0, prefix.size(), prefix) == 0))
+    {
+      _in_flight_reads.erase(in_flight++);
+    }
+  }
+
+  pthread_mutex_unlock(&_in_flight_reads_lock);
+}
+
+void Cache::write_batch(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutations,
+                        ConsistencyLevel::type consistency_level,
+                        std::vector<std::pair<CacheOperation*,
+                                              CassandraStore::Transaction*> >& ops)
+{
+  LOG_DEBUG("Writing batch of %zu rows for %zu operations",
+            mutations.size(), ops.size());
+
+  BatchMutateOperation batch_op(mutations, consistency_level);
+  bool success = do_sync(&batch_op, ops.front().second->trail);
+
+  for (std::vector<std::pair<CacheOperation*,
+                             CassandraStore::Transaction*> >::iterator it =
+         ops.begin();
+       it != ops.end();
+       ++it)
+  {
+    CacheOperation* op = it->first;
+    CassandraStore::Transaction* trx = it->second;
+
+    op->_cass_status = batch_op.get_result_code();
+    op->_cass_error_text = batch_op.get_error_text();
+
+    trx->stop_timer();
+
+    if (success)
+    {
+      op->on_written();
+      trx->on_success(op);
+    }
+    else
+    {
+      trx->on_failure(op);
+    }
+
+    delete trx; trx = NULL;
+    delete op; op = NULL;
+  }
+}
+
+//
+// CacheOperation methods.
+//
+
+Cache::CacheOperation::
+CacheOperation() :
+  CassandraStore::Operation(),
+  _cache(NULL),
+  _in_flight_key(),
+  _write_behind(false),
+  _completed(false),
+  _attempt_node(NULL),
+  _other_attempt_node(NULL)
+{
+  _deadline.tv_sec = 0;
+  _deadline.tv_nsec = 0;
+}
+
+Cache::CacheOperation::
+~CacheOperation()
+{}
+
+void Cache::CacheOperation::set_deadline(const struct timespec& deadline)
+{
+  _deadline = deadline;
+}
+
+void Cache::CacheOperation::
+invalidate_reg_data(const std::vector<std::string>& public_ids)
+{
+  if ((_cache != NULL) && (_cache->_reg_data_cache != NULL))
+  {
+    _cache->_reg_data_cache->invalidate(public_ids);
+  }
+}
+
+std::string Cache::CacheOperation::
+make_coalescing_key(const std::string& table,
+                    const std::string& key,
+                    const std::string& columns)
+{
+  // Table names and keys never contain a NUL, so this can't be ambiguous.
+  std::string coalescing_key = table;
+  coalescing_key.append(1, '\0');
+  coalescing_key.append(key);
+  coalescing_key.append(1, '\0');
+  coalescing_key.append(columns);
+  return coalescing_key;
+}
+
+void Cache::CacheOperation::
+invalidate_in_flight(const std::string& table,
+                     const std::vector<std::string>& keys)
+{
+  if (_cache != NULL)
+  {
+    _cache->stop_coalescing(table, keys);
+  }
+}
+
+void Cache::CacheOperation::
+invalidate_absence(const std::string& table,
+                   const std::vector<std::string>& keys)
+{
+  if ((_cache != NULL) && (_cache->_negative_cache != NULL))
+  {
+    for (std::vector<std::string>::const_iterator key = keys.begin();
+         key != keys.end();
+         ++key)
+    {
+      _cache->_negative_cache->invalidate(table, *key);
+    }
+  }
+}
+
+bool Cache::CacheOperation::
+known_absent(const std::string& table,
+             const std::string& key,
+             uint64_t& generation)
+{
+  if ((_cache == NULL) || (_cache->_negative_cache == NULL))
+  {
+    return false;
+  }
+
+  if (_cache->_negative_cache->is_absent(table, key))
+  {
+    LOG_DEBUG("%s row %s is known not to exist", table.c_str(), key.c_str());
+    return true;
+  }
+
+  generation = _cache->_negative_cache->generation(table, key);
+  return false;
+}
+
+void Cache::CacheOperation::
+record_absence(const std::string& table,
+               const std::string& key,
+               uint64_t generation)
+{
+  if ((_cache != NULL) && (_cache->_negative_cache != NULL))
+  {
+    _cache->_negative_cache->record_absent(table, key, generation);
+  }
+}
+
+bool Cache::CacheOperation::use_irs_table() const
+{
+  return ((_cache != NULL) && (_cache->_irs_table));
+}
+
+bool Cache::CacheOperation::check_irs_ids() const
+{
+  return ((_cache != NULL) && ((_cache->_irs_table) || (_cache->_irs_rows_seen)));
+}
+
+// Find the ID of the IRS row that an IMPU row points at.
+//
+// @returns - The IRS ID, or an empty string if the row doesn't point at one.
+static std::string get_irs_id(const std::vector<ColumnOrSuperColumn>& columns)
+{
+  for (std::vector<ColumnOrSuperColumn>::const_iterator it = columns.begin();
+       it != columns.end();
+       ++it)
+  {
+    if (it->column.name == IRS_ID_COLUMN_NAME)
+    {
+      return it->column.value;
+    }
+  }
+
+  return "";
+}
+
+// Merge the columns of an IRS row into those of an IMPU row.  A column that
+// is in both rows is taken from whichever was written most recently, so
+// that data written under either layout is read correctly while the layout
+// is being changed.
+static void merge_columns(std::vector<ColumnOrSuperColumn>& columns,
+                          const std::vector<ColumnOrSuperColumn>& irs_columns)
+{
+  for (std::vector<ColumnOrSuperColumn>::const_iterator irs_column = irs_columns.begin();
+       irs_column != irs_columns.end();
+       ++irs_column)
+  {
+    std::vector<ColumnOrSuperColumn>::iterator column = columns.begin();
+
+    while ((column != columns.end()) &&
+           (column->column.name != irs_column->column.name))
+    {
+      ++column;
+    }
+
+    if (column == columns.end())
+    {
+      columns.push_back(*irs_column);
+    }
+    else if (column->column.timestamp < irs_column->column.timestamp)
+    {
+      *column = *irs_column;
+    }
+  }
+}
+
+void Cache::CacheOperation::
+merge_irs_columns(CassandraStore::ClientInterface* client,
+                  std::vector<ColumnOrSuperColumn>& columns,
+                  const std::vector<std::string>& names)
+{
+  std::string irs_id = get_irs_id(columns);
+
+  if (irs_id.empty())
+  {
+    return;
+  }
+
+  if (_cache != NULL)
+  {
+    _cache->_irs_rows_seen = true;
+  }
+
+  LOG_DEBUG("Issuing get for IRS %s", irs_id.c_str());
+
+  try
+  {
+    std::vector<ColumnOrSuperColumn> irs_columns;
+
+    if (names.empty())
+    {
+      ha_get_all_columns(client, IRS, irs_id, irs_columns);
+    }
+    else
+    {
+      ha_get_columns(client, IRS, irs_id, names, irs_columns);
+    }
+
+    merge_columns(columns, irs_columns);
+  }
+  catch(CassandraStore::RowNotFoundException& rnfe)
+  {
+    // The IRS row has expired or been deleted, so use whatever is in the
+    // IMPU row.
+    LOG_DEBUG("IRS %s not found", irs_id.c_str());
+  }
+}
+
+Cache::CacheOperation*
+Cache::CacheOperation::init_clone(CacheOperation* clone) const
+{
+  clone->_cache = _cache;
+  clone->_deadline = _deadline;
+  return clone;
+}
+
+bool Cache::CacheOperation::configured_consistency(Consistency& consistency) const
+{
+  if (_cache == NULL)
+  {
+    return false;
+  }
+
+  std::map<std::string, Consistency>::const_iterator it =
+                                              _cache->_consistency.find(name());
+
+  if (it == _cache->_consistency.end())
+  {
+    return false;
+  }
+
+  consistency = it->second;
+  return true;
+}
+
+// Read a slice of a row at the first of the specified consistency levels,
+// and again at the not-found level if the row wasn't found.
+//
+// @throws RowNotFoundException if the row still isn't found.
+static void get_slice_at(CassandraStore::ClientInterface* client,
+                         const std::string& column_family,
+                         const std::string& key,
+                         const SlicePredicate& sp,
+                         const Cache::Consistency& consistency,
+                         std::vector<ColumnOrSuperColumn>& columns)
+{
+  ColumnParent cparent;
+  cparent.column_family = column_family;
+
+  client->get_slice(columns, key, cparent, sp, consistency.level);
+
+  if ((columns.empty()) && (consistency.not_found_level != consistency.level))
+  {
+    LOG_DEBUG("%s row %s not found at consistency level %d - retrying at %d",
+              column_family.c_str(), key.c_str(),
+              consistency.level, consistency.not_found_level);
+
+    try
+    {
+      client->get_slice(columns, key, cparent, sp, consistency.not_found_level);
+    }
+    catch(UnavailableException& ue)
+    {
+      LOG_DEBUG("Not enough replicas for consistency level %d",
+                consistency.not_found_level);
+    }
+  }
+
+  if (columns.empty())
+  {
+    throw CassandraStore::RowNotFoundException(column_family, key);
+  }
+}
+
+// @returns - true if a column holds a deletion marker.
+static bool is_deletion_marker(const ColumnOrSuperColumn& column)
+{
+  return (column.column.value == DELETION_MARKER);
+}
+
+// Get the names of the columns a row of a column family always has, as
+// opposed to those (such as the IMPI associations of an IMPU) that depend on
+// what the row holds.
+static void fixed_column_names(const std::string& column_family,
+                               std::vector<std::string>& names)
+{
+  if ((column_family == IMPU) || (column_family == IRS))
+  {
+    names.push_back(IMS_SUB_XML_COLUMN_NAME);
+    names.push_back(IRS_SUMMARY_COLUMN_NAME);
+    names.push_back(PRIMARY_CCF_COLUMN_NAME);
+    names.push_back(SECONDARY_CCF_COLUMN_NAME);
+    names.push_back(PRIMARY_ECF_COLUMN_NAME);
+    names.push_back(SECONDARY_ECF_COLUMN_NAME);
+  }
+
+  if (column_family == IMPU)
+  {
+    names.push_back(REG_STATE_COLUMN_NAME);
+    names.push_back(IRS_ID_COLUMN_NAME);
+  }
+}
+
+// Build a predicate selecting the columns whose names start with a prefix.
+static SlicePredicate prefix_predicate(const std::string& prefix)
+{
+  SliceRange sr;
+  sr.start = prefix;
+  sr.finish = prefix + std::string(1, '\xFF');
+
+  SlicePredicate sp;
+  sp.slice_range = sr;
+  sp.__isset.slice_range = true;
+  return sp;
+}
+
+// Remove a prefix from the names of some columns.
+static void strip_prefix(const std::string& prefix,
+                         std::vector<ColumnOrSuperColumn>& columns)
+{
+  for (std::vector<ColumnOrSuperColumn>::iterator column = columns.begin();
+       column != columns.end();
+       ++column)
+  {
+    column->column.name = column->column.name.substr(prefix.length());
+  }
+}
+
+// Remove any columns holding deletion markers.
+static void drop_deletion_markers(std::vector<ColumnOrSuperColumn>& columns)
+{
+  std::vector<ColumnOrSuperColumn>::iterator end =
+    std::remove_if(columns.begin(), columns.end(), is_deletion_marker);
+  columns.erase(end, columns.end());
+}
 
+// Remove any columns of a row holding deletion markers.
 //
-// Cache methods
+// @throws RowNotFoundException if that leaves no columns, as the row was
+//         deleted.
+static void drop_deletion_markers(const std::string& column_family,
+                                  const std::string& key,
+                                  std::vector<ColumnOrSuperColumn>& columns)
+{
+  drop_deletion_markers(columns);
+
+  if (columns.empty())
+  {
+    throw CassandraStore::RowNotFoundException(column_family, key);
+  }
+}
+
+// Remove any columns of several rows holding deletion markers, and any rows
+// left with no columns.
 //
+// @throws RowNotFoundException if that leaves no rows.
+static void drop_deletion_markers(const std::string& column_family,
+                                  const std::vector<std::string>& keys,
+                                  std::map<std::string, std::vector<ColumnOrSuperColumn> >& columns)
+{
+  std::map<std::string, std::vector<ColumnOrSuperColumn> >::iterator row =
+    columns.begin();
+
+  while (row != columns.end())
+  {
+    drop_deletion_markers(row->second);
+
+    if (row->second.empty())
+    {
+      columns.erase(row++);
+    }
+    else
+    {
+      ++row;
+    }
+  }
+
+  if (columns.empty())
+  {
+    throw CassandraStore::RowNotFoundException(column_family, keys.front());
+  }
+}
+
+void Cache::CacheOperation::
+ha_get_columns(CassandraStore::ClientInterface* client,
+               const std::string& column_family,
+               const std::string& key,
+               const std::vector<std::string>& names,
+               std::vector<ColumnOrSuperColumn>& columns)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::ha_get_columns(client, column_family, key, names, columns);
+  }
+  else
+  {
+    SlicePredicate sp;
+    sp.column_names = names;
+    sp.__isset.column_names = true;
+    get_slice_at(client, column_family, key, sp, consistency, columns);
+  }
+
+  drop_deletion_markers(column_family, key, columns);
+}
+
+void Cache::CacheOperation::
+ha_get_all_columns(CassandraStore::ClientInterface* client,
+                   const std::string& column_family,
+                   const std::string& key,
+                   std::vector<ColumnOrSuperColumn>& columns)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::ha_get_all_columns(client, column_family, key, columns);
+  }
+  else
+  {
+    SliceRange sr;
+    sr.start = "";
+    sr.finish = "";
+
+    SlicePredicate sp;
+    sp.slice_range = sr;
+    sp.__isset.slice_range = true;
+    get_slice_at(client, column_family, key, sp, consistency, columns);
+  }
+
+  drop_deletion_markers(column_family, key, columns);
+}
+
+void Cache::CacheOperation::
+ha_get_columns_with_prefix(CassandraStore::ClientInterface* client,
+                           const std::string& column_family,
+                           const std::string& key,
+                           const std::string& prefix,
+                           std::vector<ColumnOrSuperColumn>& columns)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::ha_get_columns_with_prefix(client,
+                                                          column_family,
+                                                          key,
+                                                          prefix,
+                                                          columns);
+  }
+  else
+  {
+    get_slice_at(client, column_family, key, prefix_predicate(prefix), consistency, columns);
+    strip_prefix(prefix, columns);
+  }
+
+  drop_deletion_markers(column_family, key, columns);
+}
+
+void Cache::CacheOperation::
+ha_multiget_columns_with_prefix(CassandraStore::ClientInterface* client,
+                                const std::string& column_family,
+                                const std::vector<std::string>& keys,
+                                const std::string& prefix,
+                                std::map<std::string, std::vector<ColumnOrSuperColumn> >& columns)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::ha_multiget_columns_with_prefix(client,
+                                                               column_family,
+                                                               keys,
+                                                               prefix,
+                                                               columns);
+    drop_deletion_markers(column_family, keys, columns);
+    return;
+  }
+
+  ColumnParent cparent;
+  cparent.column_family = column_family;
+  SlicePredicate sp = prefix_predicate(prefix);
+
+  client->multiget_slice(columns, keys, cparent, sp, consistency.level);
+
+  if ((columns.empty()) && (consistency.not_found_level != consistency.level))
+  {
+    try
+    {
+      client->multiget_slice(columns, keys, cparent, sp, consistency.not_found_level);
+    }
+    catch(UnavailableException& ue)
+    {
+      LOG_DEBUG("Not enough replicas for consistency level %d",
+                consistency.not_found_level);
+    }
+  }
+
+  if (columns.empty())
+  {
+    throw CassandraStore::RowNotFoundException(column_family, keys.front());
+  }
+
+  for (std::map<std::string, std::vector<ColumnOrSuperColumn> >::iterator row =
+         columns.begin();
+       row != columns.end();
+       ++row)
+  {
+    strip_prefix(prefix, row->second);
+  }
+
+  drop_deletion_markers(column_family, keys, columns);
+}
+
+void Cache::CacheOperation::
+put_columns(CassandraStore::ClientInterface* client,
+            const std::string& column_family,
+            const std::vector<std::string>& keys,
+            const std::map<std::string, std::string>& columns,
+            int64_t timestamp,
+            int32_t ttl)
+{
+  std::vector<CassandraStore::RowColumns> to_put;
+
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    to_put.push_back(CassandraStore::RowColumns(column_family, *key, columns));
+  }
+
+  put_columns(client, to_put, timestamp, ttl);
+}
+
+void Cache::CacheOperation::
+put_columns(CassandraStore::ClientInterface* client,
+            const std::vector<CassandraStore::RowColumns>& to_put,
+            int64_t timestamp,
+            int32_t ttl)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::put_columns(client, to_put, timestamp, ttl);
+    return;
+  }
+
+  // Build the mutations in the same way as CassandraStore::put_columns.
+  std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutations;
+
+  for (std::vector<CassandraStore::RowColumns>::const_iterator row = to_put.begin();
+       row != to_put.end();
+       ++row)
+  {
+    std::vector<Mutation>& row_mutations = mutations[row->key][row->cf];
+
+    for (std::map<std::string, std::string>::const_iterator column = row->columns.begin();
+         column != row->columns.end();
+         ++column)
+    {
+      row_mutations.push_back(Mutation());
+      Mutation& mutation = row_mutations.back();
+      Column* col = &mutation.column_or_supercolumn.column;
+
+      col->name = column->first;
+      col->value = column->second;
+      col->__isset.value = true;
+      col->timestamp = timestamp;
+      col->__isset.timestamp = true;
+
+      if (ttl > 0)
+      {
+        col->ttl = ttl;
+        col->__isset.ttl = true;
+      }
+
+      mutation.column_or_supercolumn.__isset.column = true;
+      mutation.__isset.column_or_supercolumn = true;
+    }
+  }
+
+  client->batch_mutate(mutations, consistency.level);
+}
 
-Cache::Cache() : CassandraStore::Store(KEYSPACE) {}
+void Cache::CacheOperation::
+delete_row(CassandraStore::ClientInterface* client,
+           const std::string& column_family,
+           const std::string& key,
+           int64_t timestamp)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::delete_row(client, column_family, key, timestamp);
+    return;
+  }
+
+  ColumnPath cp;
+  cp.column_family = column_family;
+  client->remove(key, cp, timestamp, consistency.level);
+}
+
+void Cache::CacheOperation::
+delete_columns(CassandraStore::ClientInterface* client,
+               const std::vector<CassandraStore::RowColumns>& to_rm,
+               int64_t timestamp,
+               const std::map<std::string, std::vector<std::string> >& known_columns)
+{
+  if (_cache->_deletion_marker_ttl <= 0)
+  {
+    remove_columns(client, to_rm, timestamp);
+    return;
+  }
+
+  // Mark the deleted columns of IMPU, IMPI mapping and IRS rows.  Rows being
+  // deleted entirely aren't read to find out what columns they have, as
+  // that would hold up the delete; instead the columns they are known to
+  // have are marked.  Anything else, including rows with no known columns,
+  // is deleted as normal.
+  std::vector<CassandraStore::RowColumns> to_mark;
+  std::vector<CassandraStore::RowColumns> to_remove;
+
+  for (std::vector<CassandraStore::RowColumns>::const_iterator row = to_rm.begin();
+       row != to_rm.end();
+       ++row)
+  {
+    if ((row->cf != IMPU) && (row->cf != IMPI_MAPPING) && (row->cf != IRS))
+    {
+      to_remove.push_back(*row);
+      continue;
+    }
+
+    std::vector<std::string> names;
+
+    if (row->columns.empty())
+    {
+      fixed_column_names(row->cf, names);
+
+      std::map<std::string, std::vector<std::string> >::const_iterator known =
+        known_columns.find(row->cf);
+
+      if (known != known_columns.end())
+      {
+        names.insert(names.end(), known->second.begin(), known->second.end());
+      }
+    }
+    else
+    {
+      for (std::map<std::string, std::string>::const_iterator column = row->columns.begin();
+           column != row->columns.end();
+           ++column)
+      {
+        names.push_back(column->first);
+      }
+    }
+
+    if (names.empty())
+    {
+      LOG_DEBUG("No known columns to mark in %s row %s, so deleting it",
+                row->cf.c_str(), row->key.c_str());
+      to_remove.push_back(*row);
+    }
+    else
+    {
+      to_mark.push_back(CassandraStore::RowColumns(row->cf, row->key));
 
-Cache::~Cache() {}
+      for (std::vector<std::string>::const_iterator name = names.begin();
+           name != names.end();
+           ++name)
+      {
+        to_mark.back().columns[*name] = DELETION_MARKER;
+      }
+    }
+  }
+
+  if (!to_mark.empty())
+  {
+    put_columns(client, to_mark, timestamp, _cache->_deletion_marker_ttl);
+  }
+
+  if (!to_remove.empty())
+  {
+    remove_columns(client, to_remove, timestamp);
+  }
+}
+
+void Cache::CacheOperation::
+remove_columns(CassandraStore::ClientInterface* client,
+               const std::vector<CassandraStore::RowColumns>& to_rm,
+               int64_t timestamp)
+{
+  Consistency consistency;
+
+  if (!configured_consistency(consistency))
+  {
+    CassandraStore::Operation::delete_columns(client, to_rm, timestamp);
+    return;
+  }
 
+  // Rows with no columns listed are deleted entirely.  The others have just
+  // the listed columns deleted, in a single batch.
+  std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutations;
+
+  for (std::vector<CassandraStore::RowColumns>::const_iterator row = to_rm.begin();
+       row != to_rm.end();
+       ++row)
+  {
+    if (row->columns.empty())
+    {
+      delete_row(client, row->cf, row->key, timestamp);
+      continue;
+    }
+
+    Mutation mutation;
+    Deletion& deletion = mutation.deletion;
+    deletion.timestamp = timestamp;
+
+    for (std::map<std::string, std::string>::const_iterator column = row->columns.begin();
+         column != row->columns.end();
+         ++column)
+    {
+      deletion.predicate.column_names.push_back(column->first);
+    }
+
+    deletion.predicate.__isset.column_names = true;
+    deletion.__isset.predicate = true;
+    mutation.__isset.deletion = true;
+    mutations[row->key][row->cf].push_back(mutation);
+  }
+
+  if (!mutations.empty())
+  {
+    client->batch_mutate(mutations, consistency.level);
+  }
+}
+
+static void ha_multiget_columns(CassandraStore::ClientInterface* client,
+                                const std::string& column_family,
+                                const std::vector<std::string>& keys,
+                                const std::vector<std::string>& names,
+                                const Cache::Consistency& consistency,
+                                std::map<std::string, std::vector<ColumnOrSuperColumn> >& results);
 
 //
 // PutRegData methods.
@@ -90,7 +3579,7 @@ Cache::PutRegData::
 PutRegData(const std::string& public_id,
            const int64_t timestamp,
            const int32_t ttl):
-  CassandraStore::Operation(),
+  CacheOperation(),
   _public_ids(1, public_id),
   _timestamp(timestamp),
   _ttl(ttl)
@@ -100,7 +3589,7 @@ Cache::PutRegData::
 PutRegData(const std::vector<std::string>& public_ids,
            const int64_t timestamp,
            const int32_t ttl):
-  CassandraStore::Operation(),
+  CacheOperation(),
   _public_ids(public_ids),
   _timestamp(timestamp),
   _ttl(ttl)
@@ -113,6 +3602,7 @@ Cache::PutRegData::
 Cache::PutRegData& Cache::PutRegData::with_xml(const std::string& xml)
 {
   _columns[IMS_SUB_XML_COLUMN_NAME] = xml;
+  _columns[IRS_SUMMARY_COLUMN_NAME] = IRSSummary(xml).encode();
   return *this;
 }
 
@@ -188,18 +3678,177 @@ Cache::PutRegData& Cache::PutRegData::with_charging_addrs(const ChargingAddresse
   return *this;
 }
 
-bool Cache::PutRegData::perform(CassandraStore::ClientInterface* client,
-                                SAS::TrailId trail)
+bool Cache::PutRegData::on_submit()
+{
+  invalidate_reg_data(_public_ids);
+  invalidate_absence(IMPU, _public_ids);
+  invalidate_in_flight(IMPU, _public_ids);
+  return false;
+}
+
+bool Cache::PutRegData::get_batchable_writes(std::vector<CassandraStore::RowColumns>& rows,
+                                             int64_t& timestamp,
+                                             int32_t& ttl)
+{
+  if (checks_irs_ids())
+  {
+    return false;
+  }
+
+  get_writes(rows);
+  timestamp = _timestamp;
+  ttl = _ttl;
+  return true;
+}
+
+void Cache::PutRegData::get_writes(std::vector<CassandraStore::RowColumns>& rows)
 {
+  // _to_put already holds any IMPI mapping rows.
+  rows.assign(_to_put.begin(), _to_put.end());
+
+  std::map<std::string, std::string> impu_columns(_columns.begin(), _columns.end());
+  std::map<std::string, std::string>::iterator xml =
+                                     impu_columns.find(IMS_SUB_XML_COLUMN_NAME);
+
+  if ((xml != impu_columns.end()) &&
+      (_cache != NULL) &&
+      (_cache->_xml_compression_threshold > 0) &&
+      (xml->second.length() >= _cache->_xml_compression_threshold))
+  {
+    xml->second = ColumnCompression::compress(xml->second);
+  }
+
+  if ((use_irs_table()) &&
+      (_columns.find(IMS_SUB_XML_COLUMN_NAME) != _columns.end()))
+  {
+    // Write the IMS subscription and charging addresses once, keyed by the
+    // default public ID, and point each IMPU row at them.
+    const std::string& irs_id = _public_ids.front();
+    std::map<std::string, std::string> irs_columns;
+    const std::string* irs_column_names[] = {&IMS_SUB_XML_COLUMN_NAME,
+                                             &IRS_SUMMARY_COLUMN_NAME,
+                                             &PRIMARY_CCF_COLUMN_NAME,
+                                             &SECONDARY_CCF_COLUMN_NAME,
+                                             &PRIMARY_ECF_COLUMN_NAME,
+                                             &SECONDARY_ECF_COLUMN_NAME};
+
+    for (size_t ii = 0;
+         ii < sizeof(irs_column_names) / sizeof(irs_column_names[0]);
+         ii++)
+    {
+      std::map<std::string, std::string>::iterator column =
+                                       impu_columns.find(*irs_column_names[ii]);
+      if (column != impu_columns.end())
+      {
+        irs_columns.insert(*column);
+        impu_columns.erase(column);
+      }
+    }
+
+    impu_columns[IRS_ID_COLUMN_NAME] = irs_id;
+    rows.push_back(CassandraStore::RowColumns(IRS, irs_id, irs_columns));
+  }
+
   for (std::vector<std::string>::iterator row = _public_ids.begin();
        row != _public_ids.end();
        row++)
   {
-    _to_put.push_back(CassandraStore::RowColumns(IMPU, *row, _columns));
+    rows.push_back(CassandraStore::RowColumns(IMPU, *row, impu_columns));
+  }
+}
+
+bool Cache::PutRegData::checks_irs_ids() const
+{
+  // Only writes of the IMS subscription decide where it is kept.
+  return ((check_irs_ids()) &&
+          (_columns.find(IMS_SUB_XML_COLUMN_NAME) != _columns.end()));
+}
+
+void Cache::PutRegData::get_stale_irs_rows(CassandraStore::ClientInterface* client,
+                                           std::vector<CassandraStore::RowColumns>& to_delete)
+{
+  Consistency consistency;
+  configured_consistency(consistency);
+
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > results;
+  ha_multiget_columns(client,
+                      IMPU,
+                      _public_ids,
+                      std::vector<std::string>(1, IRS_ID_COLUMN_NAME),
+                      consistency,
+                      results);
+
+  // This write points the rows at the default public ID's "irs" row, or at
+  // nothing if the "irs" table isn't in use.
+  std::string new_irs_id = use_irs_table() ? _public_ids.front() : "";
+  std::set<std::string> public_ids(_public_ids.begin(), _public_ids.end());
+  std::set<std::string> stale_irs_ids;
+
+  for (std::vector<std::string>::const_iterator public_id = _public_ids.begin();
+       public_id != _public_ids.end();
+       ++public_id)
+  {
+    std::string irs_id = get_irs_id(results[*public_id]);
+
+    if ((irs_id.empty()) || (irs_id == new_irs_id))
+    {
+      continue;
+    }
+
+    if (new_irs_id.empty())
+    {
+      std::map<std::string, std::string> columns;
+      columns[IRS_ID_COLUMN_NAME] = "";
+      to_delete.push_back(CassandraStore::RowColumns(IMPU, *public_id, columns));
+    }
+
+    // An "irs" row keyed by one of this set's public IDs was written for this
+    // set under an old default public ID, so nothing else uses it.  Any
+    // other row belongs to another set, which some of these public IDs have
+    // moved out of.
+    if (public_ids.find(irs_id) != public_ids.end())
+    {
+      stale_irs_ids.insert(irs_id);
+    }
+  }
+
+  for (std::set<std::string>::const_iterator irs_id = stale_irs_ids.begin();
+       irs_id != stale_irs_ids.end();
+       ++irs_id)
+  {
+    LOG_DEBUG("Deleting out of date IRS %s", irs_id->c_str());
+    to_delete.push_back(CassandraStore::RowColumns(IRS, *irs_id));
+  }
+}
+
+void Cache::PutRegData::on_written()
+{
+  // Invalidate again now the write has landed, in case a read issued since
+  // submission has cached the old data.
+  invalidate_reg_data(_public_ids);
+  invalidate_absence(IMPU, _public_ids);
+}
+
+bool Cache::PutRegData::perform(CassandraStore::ClientInterface* client,
+                                SAS::TrailId trail)
+{
+  std::vector<CassandraStore::RowColumns> to_delete;
+
+  if (checks_irs_ids())
+  {
+    get_stale_irs_rows(client, to_delete);
+  }
+
+  std::vector<CassandraStore::RowColumns> to_put;
+  get_writes(to_put);
+  put_columns(client, to_put, _timestamp, _ttl);
+
+  if (!to_delete.empty())
+  {
+    delete_columns(client, to_delete, _timestamp);
   }
 
-  put_columns(client, _to_put, _timestamp, _ttl);
-
+  on_written();
   return true;
 }
 
@@ -212,7 +3861,7 @@ PutAssociatedPrivateID(const std::vector<std::string>& impus,
                        const std::string& impi,
                        const int64_t timestamp,
                        const int32_t ttl) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _impus(impus),
   _impi(impi),
   _timestamp(timestamp),
@@ -225,10 +3874,18 @@ Cache::PutAssociatedPrivateID::
 {}
 
 
-bool Cache::PutAssociatedPrivateID::perform(CassandraStore::ClientInterface* client,
-                                            SAS::TrailId trail)
+bool Cache::PutAssociatedPrivateID::on_submit()
+{
+  invalidate_reg_data(_impus);
+  invalidate_absence(IMPU, _impus);
+  invalidate_in_flight(IMPU, _impus);
+  return false;
+}
+
+bool Cache::PutAssociatedPrivateID::get_batchable_writes(std::vector<CassandraStore::RowColumns>& to_put,
+                                                         int64_t& timestamp,
+                                                         int32_t& ttl)
 {
-  std::vector<CassandraStore::RowColumns> to_put;
   std::map<std::string, std::string> impu_columns;
   std::map<std::string, std::string> impi_columns;
   impu_columns[IMPI_COLUMN_PREFIX + _impi] = "";
@@ -244,8 +3901,26 @@ bool Cache::PutAssociatedPrivateID::perform(CassandraStore::ClientInterface* cli
     to_put.push_back(CassandraStore::RowColumns(IMPU, *row, impu_columns));
   }
 
-  put_columns(client, to_put, _timestamp, _ttl);
+  timestamp = _timestamp;
+  ttl = _ttl;
+  return true;
+}
 
+void Cache::PutAssociatedPrivateID::on_written()
+{
+  // Invalidate again now the write has landed, in case a read issued since
+  // submission has cached the old IMPI list or recorded the rows as missing.
+  invalidate_reg_data(_impus);
+  invalidate_absence(IMPU, _impus);
+}
+
+bool Cache::PutAssociatedPrivateID::perform(CassandraStore::ClientInterface* client,
+                                            SAS::TrailId trail)
+{
+  std::vector<CassandraStore::RowColumns> to_put;
+  get_batchable_writes(to_put, _timestamp, _ttl);
+  put_columns(client, to_put, _timestamp, _ttl);
+  on_written();
   return true;
 }
 
@@ -259,7 +3934,7 @@ PutAssociatedPublicID(const std::string& private_id,
                       const std::string& assoc_public_id,
                       const int64_t timestamp,
                       const int32_t ttl) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_id(private_id),
   _assoc_public_id(assoc_public_id),
   _timestamp(timestamp),
@@ -272,15 +3947,44 @@ Cache::PutAssociatedPublicID::
 {}
 
 
-bool Cache::PutAssociatedPublicID::perform(CassandraStore::ClientInterface* client,
-                                           SAS::TrailId trail)
+bool Cache::PutAssociatedPublicID::on_submit()
+{
+  std::vector<std::string> keys(1, _private_id);
+  invalidate_absence(IMPI, keys);
+  invalidate_absence(IMPI_PUBLIC_IDS, keys);
+  invalidate_in_flight(IMPI, keys);
+  return false;
+}
+
+bool Cache::PutAssociatedPublicID::get_batchable_writes(std::vector<CassandraStore::RowColumns>& rows,
+                                                        int64_t& timestamp,
+                                                        int32_t& ttl)
 {
   std::map<std::string, std::string> columns;
   columns[ASSOC_PUBLIC_ID_COLUMN_PREFIX + _assoc_public_id] = "";
+  rows.push_back(CassandraStore::RowColumns(IMPI, _private_id, columns));
+
+  timestamp = _timestamp;
+  ttl = _ttl;
+  return true;
+}
 
+void Cache::PutAssociatedPublicID::on_written()
+{
+  // Invalidate again now the write has landed, in case a read issued since
+  // submission has recorded the row as missing.
   std::vector<std::string> keys(1, _private_id);
+  invalidate_absence(IMPI, keys);
+  invalidate_absence(IMPI_PUBLIC_IDS, keys);
+}
 
-  put_columns(client, IMPI, keys, columns, _timestamp, _ttl);
+bool Cache::PutAssociatedPublicID::perform(CassandraStore::ClientInterface* client,
+                                           SAS::TrailId trail)
+{
+  std::vector<CassandraStore::RowColumns> to_put;
+  get_batchable_writes(to_put, _timestamp, _ttl);
+  put_columns(client, to_put, _timestamp, _ttl);
+  on_written();
   return true;
 }
 
@@ -293,7 +3997,7 @@ PutAuthVector(const std::string& private_id,
               const DigestAuthVector& auth_vector,
               const int64_t timestamp,
               const int32_t ttl) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(1, private_id),
   _auth_vector(auth_vector),
   _timestamp(timestamp),
@@ -306,6 +4010,13 @@ Cache::PutAuthVector::
 {}
 
 
+bool Cache::PutAuthVector::on_submit()
+{
+  invalidate_absence(IMPI, _private_ids);
+  invalidate_in_flight(IMPI, _private_ids);
+  return false;
+}
+
 bool Cache::PutAuthVector::perform(CassandraStore::ClientInterface* client,
                                    SAS::TrailId trail)
 {
@@ -317,24 +4028,197 @@ bool Cache::PutAuthVector::perform(CassandraStore::ClientInterface* client,
                    CassandraStore::BOOLEAN_TRUE : CassandraStore::BOOLEAN_FALSE;
 
   put_columns(client, IMPI, _private_ids, columns, _timestamp, _ttl);
+
+  // Invalidate again now the write has landed, in case a read issued since
+  // submission has recorded the row as missing.
+  invalidate_absence(IMPI, _private_ids);
   return true;
 }
 
 
+// Parse the columns of an IMPU row into registration data.
+//
+// @param columns - The columns read from the row.
+// @param now     - The current time (as a Cassandra timestamp) used to work
+//                  out the columns' remaining TTLs.
+// @param data    - Filled in with the registration data.
+static void parse_reg_data(const std::vector<ColumnOrSuperColumn>& columns,
+                           int64_t now,
+                           RegDataCache::RegData& data)
+{
+  std::string summary;
+
+  for (std::vector<ColumnOrSuperColumn>::const_iterator it = columns.begin();
+       it != columns.end();
+       ++it)
+  {
+    if (it->column.name == IMS_SUB_XML_COLUMN_NAME)
+    {
+      if (!ColumnCompression::decode(it->column.value, data.xml))
+      {
+        LOG_WARNING("Failed to decompress IMS subscription XML");
+      }
+
+      // Cassandra timestamps are in microseconds (see
+      // generate_timestamp) but TTLs are in seconds, so divide the
+      // timestamps by a million.
+      if (it->column.ttl > 0)
+      {
+        data.xml_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
+      };
+      LOG_DEBUG("Retrieved XML column with TTL %d and value %s", data.xml_ttl, data.xml.c_str());
+    }
+    else if (it->column.name == IRS_SUMMARY_COLUMN_NAME)
+    {
+      summary = it->column.value;
+    }
+    else if (it->column.name == REG_STATE_COLUMN_NAME)
+    {
+      if (it->column.ttl > 0)
+      {
+        data.reg_state_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
+      };
+      if (it->column.value == CassandraStore::BOOLEAN_TRUE)
+      {
+        data.reg_state = RegistrationState::REGISTERED;
+        LOG_DEBUG("Retrieved is_registered column with value True and TTL %d",
+                  data.reg_state_ttl);
+      }
+      else if (it->column.value == CassandraStore::BOOLEAN_FALSE)
+      {
+        data.reg_state = RegistrationState::UNREGISTERED;
+        LOG_DEBUG("Retrieved is_registered column with value False and TTL %d",
+                  data.reg_state_ttl);
+      }
+      else if ((it->column.value == ""))
+      {
+        LOG_DEBUG("Retrieved is_registered column with empty value and TTL %d",
+                  data.reg_state_ttl);
+      }
+      else
+      {
+        LOG_WARNING("Registration state column has invalid value %d %s",
+                    it->column.value.c_str()[0],
+                    it->column.value.c_str());
+      };
+    }
+    else if (it->column.name.find(IMPI_COLUMN_PREFIX) == 0)
+    {
+      std::string impi = it->column.name.substr(IMPI_COLUMN_PREFIX.length());
+      data.impis.push_back(impi);
+    }
+    else if ((it->column.name == PRIMARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      data.charging_addrs.ccfs.push_front(it->column.value);
+      LOG_DEBUG("Retrived primary_ccf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == SECONDARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      data.charging_addrs.ccfs.push_back(it->column.value);
+      LOG_DEBUG("Retrived secondary_ccf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == PRIMARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      data.charging_addrs.ecfs.push_front(it->column.value);
+      LOG_DEBUG("Retrived primary_ecf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == SECONDARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      data.charging_addrs.ecfs.push_back(it->column.value);
+      LOG_DEBUG("Retrived secondary_ecf column with value %s",
+                it->column.value.c_str());
+    }
+  }
+
+  // If we're storing user data for this subscriber (i.e. there is
+  // XML), then by definition they cannot be in NOT_REGISTERED state
+  // - they must be in UNREGISTERED state.
+  if ((data.reg_state == RegistrationState::NOT_REGISTERED) && !data.xml.empty())
+  {
+    LOG_DEBUG("Found stored XML for subscriber, treating as UNREGISTERED state");
+    data.reg_state = RegistrationState::UNREGISTERED;
+  }
+
+  // Use the stored summary of the XML if it's there, and was written with
+  // the XML we've read.  Otherwise (for instance if the XML was written by
+  // an older version) build it from the XML.
+  if (!data.xml.empty())
+  {
+    if ((!data.summary.decode(summary)) || (!data.summary.matches(data.xml)))
+    {
+      LOG_DEBUG("No valid IRS summary stored - building it from the XML");
+      data.summary = IRSSummary(data.xml);
+    }
+  }
+}
+
+// Work out which columns of an IMPU row hold the requested parts of the
+// registration data.
+//
+// @param columns - A combination of Cache::RegDataColumns.
+// @param names   - Filled in with the names of the columns to read.
+//
+// @returns - false if the whole row must be read instead.
+static bool reg_data_column_names(int columns, std::vector<std::string>& names)
+{
+  // The associated IMPI columns can only be read as a range of columns,
+  // which can't be combined with reading named columns.
+  if ((columns & Cache::REG_DATA_IMPIS) ||
+      ((columns & Cache::REG_DATA_ALL) == Cache::REG_DATA_ALL))
+  {
+    return false;
+  }
+
+  if (columns & Cache::REG_DATA_XML)
+  {
+    names.push_back(IMS_SUB_XML_COLUMN_NAME);
+    names.push_back(IRS_SUMMARY_COLUMN_NAME);
+  }
+
+  if (columns & Cache::REG_DATA_REG_STATE)
+  {
+    names.push_back(REG_STATE_COLUMN_NAME);
+  }
+
+  if (columns & Cache::REG_DATA_CHARGING_ADDRS)
+  {
+    names.push_back(PRIMARY_CCF_COLUMN_NAME);
+    names.push_back(SECONDARY_CCF_COLUMN_NAME);
+    names.push_back(PRIMARY_ECF_COLUMN_NAME);
+    names.push_back(SECONDARY_ECF_COLUMN_NAME);
+  }
+
+  // The XML and charging addresses may be in an IRS row, so read the
+  // pointer to it as well.
+  if (columns & (Cache::REG_DATA_XML | Cache::REG_DATA_CHARGING_ADDRS))
+  {
+    names.push_back(IRS_ID_COLUMN_NAME);
+  }
+
+  return !names.empty();
+}
+
 //
 // GetRegData methods
 //
 
 Cache::GetRegData::
-GetRegData(const std::string& public_id) :
-  CassandraStore::Operation(),
+GetRegData(const std::string& public_id, int columns) :
+  CacheOperation(),
   _public_id(public_id),
+  _columns(columns),
   _xml(),
   _reg_state(RegistrationState::NOT_REGISTERED),
   _xml_ttl(0),
   _reg_state_ttl(0),
   _impis(),
-  _charging_addrs()
+  _charging_addrs(),
+  _irs_summary(),
+  _reg_data_cache_generation(0),
+  _negative_cache_generation(0)
 {}
 
 
@@ -343,6 +4227,74 @@ Cache::GetRegData::
 {}
 
 
+bool Cache::GetRegData::on_submit()
+{
+  if (known_absent(IMPU, _public_id, _negative_cache_generation))
+  {
+    // Leave the results in their default state, exactly as if the row had
+    // not been found in Cassandra.
+    return true;
+  }
+
+  RegDataCache* reg_data_cache = _cache->_reg_data_cache;
+
+  if (reg_data_cache == NULL)
+  {
+    return false;
+  }
+
+  RegDataCache::RegData data;
+
+  if (reg_data_cache->get(_public_id, data))
+  {
+    LOG_DEBUG("Found registration data for %s in local cache",
+              _public_id.c_str());
+    _xml = data.xml;
+    _xml_ttl = data.xml_ttl;
+    _reg_state = data.reg_state;
+    _reg_state_ttl = data.reg_state_ttl;
+    _impis.assign(data.impis.begin(), data.impis.end());
+    _charging_addrs = data.charging_addrs;
+    _irs_summary = data.summary;
+    return true;
+  }
+
+  _reg_data_cache_generation = reg_data_cache->generation(_public_id);
+  return false;
+}
+
+Cache::CacheOperation* Cache::GetRegData::clone() const
+{
+  GetRegData* clone = new GetRegData(_public_id, _columns);
+  clone->_reg_data_cache_generation = _reg_data_cache_generation;
+  clone->_negative_cache_generation = _negative_cache_generation;
+  return init_clone(clone);
+}
+
+std::string Cache::GetRegData::coalescing_key() const
+{
+  std::vector<std::string> names;
+
+  if (!reg_data_column_names(_columns, names))
+  {
+    return make_coalescing_key(IMPU, _public_id, "*");
+  }
+
+  return make_coalescing_key(IMPU, _public_id, boost::algorithm::join(names, "+"));
+}
+
+void Cache::GetRegData::copy_result(const CacheOperation& other)
+{
+  const GetRegData& get_reg_data = (const GetRegData&)other;
+  _xml = get_reg_data._xml;
+  _xml_ttl = get_reg_data._xml_ttl;
+  _reg_state = get_reg_data._reg_state;
+  _reg_state_ttl = get_reg_data._reg_state_ttl;
+  _impis = get_reg_data._impis;
+  _charging_addrs = get_reg_data._charging_addrs;
+  _irs_summary = get_reg_data._irs_summary;
+}
+
 bool Cache::GetRegData::perform(CassandraStore::ClientInterface* client,
                                 SAS::TrailId trail)
 {
@@ -350,156 +4302,394 @@ bool Cache::GetRegData::perform(CassandraStore::ClientInterface* client,
   LOG_DEBUG("Issuing get for key %s", _public_id.c_str());
   std::vector<ColumnOrSuperColumn> results;
 
-  try
+  std::vector<std::string> names;
+  bool whole_row = !reg_data_column_names(_columns, names);
+
+  try
+  {
+    if (whole_row)
+    {
+      ha_get_all_columns(client, IMPU, _public_id, results);
+      merge_irs_columns(client, results);
+    }
+    else
+    {
+      ha_get_columns(client, IMPU, _public_id, names, results);
+      merge_irs_columns(client, results, names);
+    }
+
+    RegDataCache::RegData data;
+    parse_reg_data(results, now, data);
+
+    _xml = data.xml;
+    _xml_ttl = data.xml_ttl;
+    _reg_state = data.reg_state;
+    _reg_state_ttl = data.reg_state_ttl;
+    _impis.assign(data.impis.begin(), data.impis.end());
+    _charging_addrs = data.charging_addrs;
+    _irs_summary = data.summary;
+
+    // Only complete registration data can go in the local cache.
+    if ((whole_row) &&
+        (_cache != NULL) &&
+        (_cache->_reg_data_cache != NULL))
+    {
+      _cache->_reg_data_cache->put(_public_id,
+                                   data,
+                                   _reg_data_cache_generation);
+    }
+  }
+  catch(CassandraStore::RowNotFoundException& rnfe)
+  {
+    // This is a valid state rather than an exceptional one, so we
+    // catch the exception and return success. Values ae left in the
+    // default state (NOT_REGISTERED and empty XML).  The row may still
+    // exist if only some of its columns were read.
+    if (whole_row)
+    {
+      record_absence(IMPU, _public_id, _negative_cache_generation);
+    }
+  }
+
+
+  return true;
+}
+
+void Cache::GetRegData::get_xml(std::string& xml, int32_t& ttl)
+{
+  xml = _xml;
+  ttl = _xml_ttl;
+}
+
+void Cache::GetRegData::get_associated_impis(std::vector<std::string>& associated_impis)
+{
+  associated_impis.assign(_impis.begin(), _impis.end());
+}
+
+
+void Cache::GetRegData::get_registration_state(RegistrationState& reg_state, int32_t& ttl)
+{
+  reg_state = _reg_state;
+  ttl = _reg_state_ttl;
+}
+
+
+void Cache::GetRegData::get_charging_addrs(ChargingAddresses& charging_addrs)
+{
+  charging_addrs = _charging_addrs;
+}
+
+void Cache::GetRegData::get_irs_summary(IRSSummary& summary)
+{
+  summary = _irs_summary;
+}
+
+
+void Cache::GetRegData::get_result(std::pair<RegistrationState, std::string>& result)
+{
+  RegistrationState state;
+  int32_t reg_ttl;
+  std::string xml;
+  int32_t xml_ttl;
+
+  get_registration_state(state, reg_ttl);
+  get_xml(xml, xml_ttl);
+  result.first = state;
+  result.second = xml;
+}
+
+
+void Cache::GetRegData::get_result(Cache::GetRegData::Result& result)
+{
+  int32_t unused_ttl;
+
+  get_registration_state(result.state, unused_ttl);
+  get_xml(result.xml, unused_ttl);
+  get_associated_impis(result.impis);
+  get_charging_addrs(result.charging_addrs);
+  get_irs_summary(result.summary);
+}
+
+
+//
+// GetRegDataMulti methods
+//
+
+Cache::GetRegDataMulti::
+GetRegDataMulti(const std::vector<std::string>& public_ids, int columns) :
+  CacheOperation(),
+  _public_ids(public_ids),
+  _columns(columns),
+  _reg_data(),
+  _reg_data_cache_generations(),
+  _negative_cache_generations()
+{}
+
+
+Cache::GetRegDataMulti::
+~GetRegDataMulti()
+{}
+
+
+bool Cache::GetRegDataMulti::on_submit()
+{
+  RegDataCache* reg_data_cache = _cache->_reg_data_cache;
+
+  for (std::vector<std::string>::const_iterator public_id = _public_ids.begin();
+       public_id != _public_ids.end();
+       ++public_id)
+  {
+    uint64_t negative_cache_generation = 0;
+    RegDataCache::RegData data;
+
+    if (known_absent(IMPU, *public_id, negative_cache_generation))
+    {
+      _reg_data[*public_id] = data;
+    }
+    else if ((reg_data_cache != NULL) && (reg_data_cache->get(*public_id, data)))
+    {
+      LOG_DEBUG("Found registration data for %s in local cache",
+                public_id->c_str());
+      _reg_data[*public_id] = data;
+    }
+    else
+    {
+      _negative_cache_generations[*public_id] = negative_cache_generation;
+      _reg_data_cache_generations[*public_id] =
+        (reg_data_cache != NULL) ? reg_data_cache->generation(*public_id) : 0;
+    }
+  }
+
+  // If every public ID was found locally there's nothing to read.
+  return _negative_cache_generations.empty();
+}
+
+// Read the named columns (or all the columns if there are no names) of
+// several rows at the specified consistency level.
+static void multiget_columns(CassandraStore::ClientInterface* client,
+                             const std::string& column_family,
+                             const std::vector<std::string>& keys,
+                             const std::vector<std::string>& names,
+                             ConsistencyLevel::type consistency_level,
+                             std::map<std::string, std::vector<ColumnOrSuperColumn> >& results)
+{
+  ColumnParent cparent;
+  cparent.column_family = column_family;
+
+  SlicePredicate sp;
+
+  if (names.empty())
+  {
+    SliceRange sr;
+    sr.start = "";
+    sr.finish = "";
+
+    sp.slice_range = sr;
+    sp.__isset.slice_range = true;
+  }
+  else
+  {
+    sp.column_names = names;
+    sp.__isset.column_names = true;
+  }
+
+  client->multiget_slice(results, keys, cparent, sp, consistency_level);
+}
+
+// Read the named columns (or all the columns if there are no names) of
+// several rows.  As for single row reads, any rows that aren't found at the
+// first consistency level may just not have been replicated yet, so those
+// are tried again at the not-found level.  Rows that still aren't found (or
+// have been deleted with deletion markers) have an empty set of columns in
+// the results.
+static void ha_multiget_columns(CassandraStore::ClientInterface* client,
+                                const std::string& column_family,
+                                const std::vector<std::string>& keys,
+                                const std::vector<std::string>& names,
+                                const Cache::Consistency& consistency,
+                                std::map<std::string, std::vector<ColumnOrSuperColumn> >& results)
+{
+  multiget_columns(client, column_family, keys, names, consistency.level, results);
+
+  std::vector<std::string> missing_keys;
+
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
   {
-    ha_get_all_columns(client, IMPU, _public_id, results);
-
-    for(std::vector<ColumnOrSuperColumn>::iterator it = results.begin(); it != results.end(); ++it)
+    if (results[*key].empty())
     {
-      if (it->column.name == IMS_SUB_XML_COLUMN_NAME)
-      {
-        _xml = it->column.value;
+      missing_keys.push_back(*key);
+    }
+  }
 
-        // Cassandra timestamps are in microseconds (see
-        // generate_timestamp) but TTLs are in seconds, so divide the
-        // timestamps by a million.
-        if (it->column.ttl > 0)
-        {
-          _xml_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
-        };
-        LOG_DEBUG("Retrieved XML column with TTL %d and value %s", _xml_ttl, _xml.c_str());
-      }
-      else if (it->column.name == REG_STATE_COLUMN_NAME)
-      {
-        if (it->column.ttl > 0)
-        {
-          _reg_state_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
-        };
-        if (it->column.value == CassandraStore::BOOLEAN_TRUE)
-        {
-          _reg_state = RegistrationState::REGISTERED;
-          LOG_DEBUG("Retrieved is_registered column with value True and TTL %d",
-                    _reg_state_ttl);
-        }
-        else if (it->column.value == CassandraStore::BOOLEAN_FALSE)
-        {
-          _reg_state = RegistrationState::UNREGISTERED;
-          LOG_DEBUG("Retrieved is_registered column with value False and TTL %d",
-                    _reg_state_ttl);
-        }
-        else if ((it->column.value == ""))
-        {
-          LOG_DEBUG("Retrieved is_registered column with empty value and TTL %d",
-                    _reg_state_ttl);
-        }
-        else
-        {
-          LOG_WARNING("Registration state column has invalid value %d %s",
-                      it->column.value.c_str()[0],
-                      it->column.value.c_str());
-        };
-      }
-      else if (it->column.name.find(IMPI_COLUMN_PREFIX) == 0)
-      {
-        std::string impi = it->column.name.substr(IMPI_COLUMN_PREFIX.length());
-        _impis.push_back(impi);
-      }
-      else if ((it->column.name == PRIMARY_CCF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ccfs.push_front(it->column.value);
-        LOG_DEBUG("Retrived primary_ccf column with value %s",
-                  it->column.value.c_str());
-      }
-      else if ((it->column.name == SECONDARY_CCF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ccfs.push_back(it->column.value);
-        LOG_DEBUG("Retrived secondary_ccf column with value %s",
-                  it->column.value.c_str());
-      }
-      else if ((it->column.name == PRIMARY_ECF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ecfs.push_front(it->column.value);
-        LOG_DEBUG("Retrived primary_ecf column with value %s",
-                  it->column.value.c_str());
-      }
-      else if ((it->column.name == SECONDARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+  if ((!missing_keys.empty()) &&
+      (consistency.not_found_level != consistency.level))
+  {
+    LOG_DEBUG("%d %s rows not found at consistency level %d - retrying at %d",
+              missing_keys.size(), column_family.c_str(),
+              consistency.level, consistency.not_found_level);
+
+    try
+    {
+      std::map<std::string, std::vector<ColumnOrSuperColumn> > quorum_results;
+      multiget_columns(client,
+                       column_family,
+                       missing_keys,
+                       names,
+                       consistency.not_found_level,
+                       quorum_results);
+
+      for (std::map<std::string, std::vector<ColumnOrSuperColumn> >::iterator it =
+             quorum_results.begin();
+           it != quorum_results.end();
+           ++it)
       {
-        _charging_addrs.ecfs.push_back(it->column.value);
-        LOG_DEBUG("Retrived secondary_ecf column with value %s",
-                  it->column.value.c_str());
+        results[it->first].swap(it->second);
       }
     }
-
-    // If we're storing user data for this subscriber (i.e. there is
-    // XML), then by definition they cannot be in NOT_REGISTERED state
-    // - they must be in UNREGISTERED state.
-    if ((_reg_state == RegistrationState::NOT_REGISTERED) && !_xml.empty())
+    catch(UnavailableException& ue)
     {
-      LOG_DEBUG("Found stored XML for subscriber, treating as UNREGISTERED state");
-      _reg_state = RegistrationState::UNREGISTERED;
+      // Not enough replicas are up to read at the higher level, so go with
+      // what we found at the first.
+      LOG_DEBUG("Not enough replicas for consistency level %d - using results at %d",
+                consistency.not_found_level, consistency.level);
     }
+  }
 
+  for (std::map<std::string, std::vector<ColumnOrSuperColumn> >::iterator row =
+         results.begin();
+       row != results.end();
+       ++row)
+  {
+    drop_deletion_markers(row->second);
   }
-  catch(CassandraStore::RowNotFoundException& rnfe)
+}
+
+bool Cache::GetRegDataMulti::perform(CassandraStore::ClientInterface* client,
+                                     SAS::TrailId trail)
+{
+  int64_t now = generate_timestamp();
+
+  // Work out which public IDs weren't found locally, removing any
+  // duplicates.  There's always at least one, as on_submit completes the
+  // operation if everything was found locally.
+  std::set<std::string> to_read;
+
+  for (std::vector<std::string>::const_iterator public_id = _public_ids.begin();
+       public_id != _public_ids.end();
+       ++public_id)
   {
-    // This is a valid state rather than an exceptional one, so we
-    // catch the exception and return success. Values ae left in the
-    // default state (NOT_REGISTERED and empty XML).
+    if (_reg_data.find(*public_id) == _reg_data.end())
+    {
+      to_read.insert(*public_id);
+    }
   }
 
+  std::vector<std::string> keys(to_read.begin(), to_read.end());
+  LOG_DEBUG("Issuing multiget for %d keys", keys.size());
 
-  return true;
-}
+  // Read the whole rows unless only some columns were requested.
+  std::vector<std::string> names;
+  bool whole_row = !reg_data_column_names(_columns, names);
 
-void Cache::GetRegData::get_xml(std::string& xml, int32_t& ttl)
-{
-  xml = _xml;
-  ttl = _xml_ttl;
-}
+  Consistency consistency;
+  configured_consistency(consistency);
 
-void Cache::GetRegData::get_associated_impis(std::vector<std::string>& associated_impis)
-{
-  associated_impis = _impis;
-}
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > results;
+  ha_multiget_columns(client, IMPU, keys, names, consistency, results);
 
+  // Read any IRS rows that the IMPU rows point at, again in one request.
+  std::set<std::string> irs_ids;
 
-void Cache::GetRegData::get_registration_state(RegistrationState& reg_state, int32_t& ttl)
-{
-  reg_state = _reg_state;
-  ttl = _reg_state_ttl;
-}
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    std::string irs_id = get_irs_id(results[*key]);
 
+    if (!irs_id.empty())
+    {
+      irs_ids.insert(irs_id);
+    }
+  }
 
-void Cache::GetRegData::get_charging_addrs(ChargingAddresses& charging_addrs)
-{
-  charging_addrs = _charging_addrs;
-}
+  if (!irs_ids.empty())
+  {
+    _cache->_irs_rows_seen = true;
+
+    std::map<std::string, std::vector<ColumnOrSuperColumn> > irs_results;
+    ha_multiget_columns(client,
+                        IRS,
+                        std::vector<std::string>(irs_ids.begin(), irs_ids.end()),
+                        names,
+                        consistency,
+                        irs_results);
+
+    for (std::vector<std::string>::const_iterator key = keys.begin();
+         key != keys.end();
+         ++key)
+    {
+      std::string irs_id = get_irs_id(results[*key]);
 
+      if (!irs_id.empty())
+      {
+        merge_columns(results[*key], irs_results[irs_id]);
+      }
+    }
+  }
 
-void Cache::GetRegData::get_result(std::pair<RegistrationState, std::string>& result)
-{
-  RegistrationState state;
-  int32_t reg_ttl;
-  std::string xml;
-  int32_t xml_ttl;
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    RegDataCache::RegData data;
 
-  get_registration_state(state, reg_ttl);
-  get_xml(xml, xml_ttl);
-  result.first = state;
-  result.second = xml;
-}
+    if (results[*key].empty())
+    {
+      // Leave the data in its default state (NOT_REGISTERED and empty XML),
+      // as GetRegData does.
+      if (whole_row)
+      {
+        record_absence(IMPU, *key, _negative_cache_generations[*key]);
+      }
+    }
+    else
+    {
+      parse_reg_data(results[*key], now, data);
 
+      if ((whole_row) &&
+          (_cache != NULL) &&
+          (_cache->_reg_data_cache != NULL))
+      {
+        _cache->_reg_data_cache->put(*key,
+                                     data,
+                                     _reg_data_cache_generations[*key]);
+      }
+    }
 
-void Cache::GetRegData::get_result(Cache::GetRegData::Result& result)
-{
-  int32_t unused_ttl;
+    _reg_data[*key] = data;
+  }
 
-  get_registration_state(result.state, unused_ttl);
-  get_xml(result.xml, unused_ttl);
-  get_associated_impis(result.impis);
-  get_charging_addrs(result.charging_addrs);
+  return true;
 }
 
+void Cache::GetRegDataMulti::get_result(std::map<std::string, GetRegData::Result>& results)
+{
+  results.clear();
+
+  for (RegDataMap::const_iterator it = _reg_data.begin();
+       it != _reg_data.end();
+       ++it)
+  {
+    GetRegData::Result& result = results[it->first];
+    result.xml = it->second.xml;
+    result.state = it->second.reg_state;
+    result.impis = it->second.impis;
+    result.charging_addrs = it->second.charging_addrs;
+    result.summary = it->second.summary;
+  }
+}
 
 //
 // GetAssociatedPublicIDs methods
@@ -507,17 +4697,19 @@ void Cache::GetRegData::get_result(Cache::GetRegData::Result& result)
 
 Cache::GetAssociatedPublicIDs::
 GetAssociatedPublicIDs(const std::string& private_id) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(1, private_id),
-  _public_ids()
+  _public_ids(),
+  _negative_cache_generations()
 {}
 
 
 Cache::GetAssociatedPublicIDs::
 GetAssociatedPublicIDs(const std::vector<std::string>& private_ids) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(private_ids),
-  _public_ids()
+  _public_ids(),
+  _negative_cache_generations()
 {}
 
 
@@ -526,6 +4718,50 @@ Cache::GetAssociatedPublicIDs::
 {}
 
 
+bool Cache::GetAssociatedPublicIDs::on_submit()
+{
+  for (std::vector<std::string>::const_iterator private_id = _private_ids.begin();
+       private_id != _private_ids.end();
+       ++private_id)
+  {
+    uint64_t negative_cache_generation = 0;
+
+    if (!known_absent(IMPI_PUBLIC_IDS, *private_id, negative_cache_generation))
+    {
+      _negative_cache_generations[*private_id] = negative_cache_generation;
+    }
+  }
+
+  // If none of the private IDs have public IDs the result is empty, and
+  // there's nothing to read.
+  return _negative_cache_generations.empty();
+}
+
+
+Cache::CacheOperation* Cache::GetAssociatedPublicIDs::clone() const
+{
+  return init_clone(new GetAssociatedPublicIDs(_private_ids));
+}
+
+std::string Cache::GetAssociatedPublicIDs::coalescing_key() const
+{
+  // Only lookups of a single private ID are coalesced, as that's what the
+  // vast majority of lookups are.
+  if (_private_ids.size() != 1)
+  {
+    return "";
+  }
+
+  return make_coalescing_key(IMPI,
+                             _private_ids.front(),
+                             ASSOC_PUBLIC_ID_COLUMN_PREFIX + "*");
+}
+
+void Cache::GetAssociatedPublicIDs::copy_result(const CacheOperation& other)
+{
+  _public_ids = ((const GetAssociatedPublicIDs&)other)._public_ids;
+}
+
 bool Cache::GetAssociatedPublicIDs::perform(CassandraStore::ClientInterface* client,
                                             SAS::TrailId trail)
 {
@@ -568,12 +4804,24 @@ bool Cache::GetAssociatedPublicIDs::perform(CassandraStore::ClientInterface* cli
   // are available to the handler.
   std::copy(public_ids.begin(), public_ids.end(), std::back_inserter(_public_ids));
 
+  // Remember which private IDs have no public IDs.
+  for (PooledGenerations::const_iterator generation =
+                                          _negative_cache_generations.begin();
+       generation != _negative_cache_generations.end();
+       ++generation)
+  {
+    if (columns[generation->first].empty())
+    {
+      record_absence(IMPI_PUBLIC_IDS, generation->first, generation->second);
+    }
+  }
+
   return true;
 }
 
 void Cache::GetAssociatedPublicIDs::get_result(std::vector<std::string>& ids)
 {
-  ids = _public_ids;
+  ids.assign(_public_ids.begin(), _public_ids.end());
 }
 
 //
@@ -582,19 +4830,24 @@ void Cache::GetAssociatedPublicIDs::get_result(std::vector<std::string>& ids)
 
 Cache::GetAssociatedPrimaryPublicIDs::
 GetAssociatedPrimaryPublicIDs(const std::string& private_id) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(1, private_id),
   _public_ids()
 {}
 
 Cache::GetAssociatedPrimaryPublicIDs::
 GetAssociatedPrimaryPublicIDs(const std::vector<std::string>& private_ids) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(private_ids),
   _public_ids()
 {}
 
 
+Cache::CacheOperation* Cache::GetAssociatedPrimaryPublicIDs::clone() const
+{
+  return init_clone(new GetAssociatedPrimaryPublicIDs(_private_ids));
+}
+
 bool Cache::GetAssociatedPrimaryPublicIDs::perform(CassandraStore::ClientInterface* client,
                                                    SAS::TrailId trail)
 {
@@ -636,7 +4889,7 @@ bool Cache::GetAssociatedPrimaryPublicIDs::perform(CassandraStore::ClientInterfa
 
 void Cache::GetAssociatedPrimaryPublicIDs::get_result(std::vector<std::string>& ids)
 {
-  ids = _public_ids;
+  ids.assign(_public_ids.begin(), _public_ids.end());
 }
 
 //
@@ -645,20 +4898,22 @@ void Cache::GetAssociatedPrimaryPublicIDs::get_result(std::vector<std::string>&
 
 Cache::GetAuthVector::
 GetAuthVector(const std::string& private_id) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_id(private_id),
   _public_id(""),
-  _auth_vector()
+  _auth_vector(),
+  _negative_cache_generation(0)
 {}
 
 
 Cache::GetAuthVector::
 GetAuthVector(const std::string& private_id,
               const std::string& public_id) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_id(private_id),
   _public_id(public_id),
-  _auth_vector()
+  _auth_vector(),
+  _negative_cache_generation(0)
 {}
 
 
@@ -667,6 +4922,37 @@ Cache::GetAuthVector::
 {}
 
 
+bool Cache::GetAuthVector::on_submit()
+{
+  if (known_absent(IMPI, _private_id, _negative_cache_generation))
+  {
+    _cass_status = CassandraStore::NOT_FOUND;
+    _cass_error_text = (boost::format("Private ID '%s' not found")
+                        % _private_id).str();
+    return true;
+  }
+
+  return false;
+}
+
+Cache::CacheOperation* Cache::GetAuthVector::clone() const
+{
+  GetAuthVector* clone = new GetAuthVector(_private_id, _public_id);
+  clone->_negative_cache_generation = _negative_cache_generation;
+  return init_clone(clone);
+}
+
+std::string Cache::GetAuthVector::coalescing_key() const
+{
+  // The columns read depend on the public ID being checked.
+  return make_coalescing_key(IMPI, _private_id, DIGEST_HA1_COLUMN_NAME + "+" + _public_id);
+}
+
+void Cache::GetAuthVector::copy_result(const CacheOperation& other)
+{
+  _auth_vector = ((const GetAuthVector&)other)._auth_vector;
+}
+
 bool Cache::GetAuthVector::perform(CassandraStore::ClientInterface* client,
                                    SAS::TrailId trail)
 {
@@ -695,7 +4981,18 @@ bool Cache::GetAuthVector::perform(CassandraStore::ClientInterface* client,
 
   LOG_DEBUG("Issuing cache query");
   std::vector<ColumnOrSuperColumn> results;
-  ha_get_columns(client, IMPI, _private_id, requested_columns, results);
+
+  try
+  {
+    ha_get_columns(client, IMPI, _private_id, requested_columns, results);
+  }
+  catch(CassandraStore::RowNotFoundException& rnfe)
+  {
+    // Remember that this private ID doesn't exist, then let the store report
+    // the failure as normal.
+    record_absence(IMPI, _private_id, _negative_cache_generation);
+    throw;
+  }
 
   for (std::vector<ColumnOrSuperColumn>::const_iterator it = results.begin();
        it != results.end();
@@ -765,7 +5062,7 @@ Cache::DeletePublicIDs::
 DeletePublicIDs(const std::string& public_id,
                 const std::vector<std::string>& impis,
                 int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _public_ids(1, public_id),
   _impis(impis),
   _timestamp(timestamp)
@@ -775,7 +5072,7 @@ Cache::DeletePublicIDs::
 DeletePublicIDs(const std::vector<std::string>& public_ids,
                 const std::vector<std::string>& impis,
                 int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _public_ids(public_ids),
   _impis(impis),
   _timestamp(timestamp)
@@ -786,6 +5083,13 @@ Cache::DeletePublicIDs::
 ~DeletePublicIDs()
 {}
 
+bool Cache::DeletePublicIDs::on_submit()
+{
+  invalidate_reg_data(_public_ids);
+  invalidate_in_flight(IMPU, _public_ids);
+  return false;
+}
+
 bool Cache::DeletePublicIDs::perform(CassandraStore::ClientInterface* client,
                                      SAS::TrailId trail)
 {
@@ -812,8 +5116,28 @@ bool Cache::DeletePublicIDs::perform(CassandraStore::ClientInterface* client,
     to_delete.push_back(CassandraStore::RowColumns(IMPI_MAPPING, *it, impi_columns_to_delete));
   }
 
+  // The IRS row goes too, including one left over from when the "irs" table
+  // was in use.
+  if (check_irs_ids())
+  {
+    to_delete.push_back(CassandraStore::RowColumns(IRS, primary_public_id));
+  }
+
+  // The IMPU rows have a column for each associated IMPI, as well as their
+  // fixed columns.
+  std::map<std::string, std::vector<std::string> > known_columns;
+  std::vector<std::string>& impu_columns = known_columns[IMPU];
+
+  for (std::vector<std::string>::const_iterator it = _impis.begin();
+       it != _impis.end();
+       ++it)
+  {
+    impu_columns.push_back(IMPI_COLUMN_PREFIX + *it);
+  }
+
   // Perform the batch deletion we've built up
-  delete_columns(client, to_delete, _timestamp);
+  delete_columns(client, to_delete, _timestamp, known_columns);
+  invalidate_reg_data(_public_ids);
 
   return true;
 }
@@ -824,7 +5148,7 @@ bool Cache::DeletePublicIDs::perform(CassandraStore::ClientInterface* client,
 
 Cache::DeletePrivateIDs::
 DeletePrivateIDs(const std::string& private_id, int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(1, private_id),
   _timestamp(timestamp)
 {}
@@ -832,7 +5156,7 @@ DeletePrivateIDs(const std::string& private_id, int64_t timestamp) :
 
 Cache::DeletePrivateIDs::
 DeletePrivateIDs(const std::vector<std::string>& private_ids, int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(private_ids),
   _timestamp(timestamp)
 {}
@@ -843,6 +5167,13 @@ Cache::DeletePrivateIDs::
 {}
 
 
+bool Cache::DeletePrivateIDs::on_submit()
+{
+  invalidate_absence(IMPI_PUBLIC_IDS, _private_ids);
+  invalidate_in_flight(IMPI, _private_ids);
+  return false;
+}
+
 bool Cache::DeletePrivateIDs::perform(CassandraStore::ClientInterface* client,
                                       SAS::TrailId trail)
 {
@@ -862,7 +5193,7 @@ bool Cache::DeletePrivateIDs::perform(CassandraStore::ClientInterface* client,
 
 Cache::DeleteIMPIMapping::
 DeleteIMPIMapping(const std::vector<std::string>& private_ids, int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _private_ids(private_ids),
   _timestamp(timestamp)
 {}
@@ -892,7 +5223,7 @@ Cache::DissociateImplicitRegistrationSetFromImpi::
 DissociateImplicitRegistrationSetFromImpi(const std::vector<std::string>& impus,
                                           const std::string& impi,
                                           int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _impus(impus),
   _timestamp(timestamp)
 {
@@ -903,12 +5234,19 @@ Cache::DissociateImplicitRegistrationSetFromImpi::
 DissociateImplicitRegistrationSetFromImpi(const std::vector<std::string>& impus,
                                           const std::vector<std::string>& impis,
                                           int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(),
   _impus(impus),
   _impis(impis),
   _timestamp(timestamp)
 {}
 
+bool Cache::DissociateImplicitRegistrationSetFromImpi::on_submit()
+{
+  invalidate_reg_data(_impus);
+  invalidate_in_flight(IMPU, _impus);
+  return false;
+}
+
 bool Cache::DissociateImplicitRegistrationSetFromImpi::perform(CassandraStore::ClientInterface* client,
                                                                SAS::TrailId trail)
 {
@@ -1001,8 +5339,163 @@ bool Cache::DissociateImplicitRegistrationSetFromImpi::perform(CassandraStore::C
     }
   }
 
+  if ((deleting_all_impis) && (check_irs_ids()))
+  {
+    to_delete.push_back(CassandraStore::RowColumns(IRS, primary_public_id));
+  }
+
+  // Any IMPU rows being deleted entirely have a column for each of the IMPIs
+  // just read, as well as their fixed columns.
+  std::map<std::string, std::vector<std::string> > known_columns;
+  std::vector<std::string>& impu_columns = known_columns[IMPU];
+
+  for (std::set<std::string>::const_iterator it = associated_impis_set.begin();
+       it != associated_impis_set.end();
+       ++it)
+  {
+    impu_columns.push_back(IMPI_COLUMN_PREFIX + *it);
+  }
+
   // Perform the batch deletion we've built up
-  delete_columns(client, to_delete, _timestamp);
+  delete_columns(client, to_delete, _timestamp, known_columns);
+  invalidate_reg_data(_impus);
+
+  return true;
+}
+
+//
+// ScanRows methods.
+//
+
+// The most columns read from each row.  No row in homestead's tables comes
+// anywhere near this.
+static const int32_t SCAN_MAX_COLUMNS = 10000;
+
+Cache::ScanRows::ScanRows(const std::string& table,
+                          int64_t start_token,
+                          int64_t end_token,
+                          int32_t max_rows) :
+  CacheOperation(),
+  _table(table),
+  _start_token(start_token),
+  _last_key(),
+  _end_token(end_token),
+  _max_rows(max_rows),
+  _rows(),
+  _more(false),
+  _last_row_key()
+{}
+
+Cache::ScanRows::ScanRows(const std::string& table,
+                          const std::string& last_key,
+                          int64_t end_token,
+                          int32_t max_rows) :
+  CacheOperation(),
+  _table(table),
+  _start_token(0),
+  _last_key(last_key),
+  _end_token(end_token),
+  _max_rows(max_rows),
+  _rows(),
+  _more(false),
+  _last_row_key()
+{}
+
+bool Cache::ScanRows::perform(CassandraStore::ClientInterface* client,
+                              SAS::TrailId trail)
+{
+  RangeScanInterface* scanner = dynamic_cast<RangeScanInterface*>(client);
+  CassandraStore::Client* thrift_client = dynamic_cast<CassandraStore::Client*>(client);
+  ThriftRangeScanner thrift_scanner(thrift_client);
+
+  if ((scanner == NULL) && (thrift_client != NULL))
+  {
+    scanner = &thrift_scanner;
+  }
+
+  if (scanner == NULL)
+  {
+    InvalidRequestException ire;
+    ire.why = "The store does not support range scans";
+    throw ire;
+  }
+
+  ColumnParent cparent;
+  cparent.column_family = _table;
+
+  SliceRange sr;
+  sr.start = "";
+  sr.finish = "";
+  sr.count = SCAN_MAX_COLUMNS;
+
+  SlicePredicate sp;
+  sp.slice_range = sr;
+  sp.__isset.slice_range = true;
+
+  std::ostringstream end_token;
+  end_token << _end_token;
+
+  KeyRange range;
+  range.__set_end_token(end_token.str());
+
+  // A page that carries on from a key starts with that key, so read an extra
+  // row to make up for dropping it.
+  if (_last_key.empty())
+  {
+    std::ostringstream start_token;
+    start_token << _start_token;
+    range.__set_start_token(start_token.str());
+    range.__set_count(_max_rows);
+  }
+  else
+  {
+    range.__set_start_key(_last_key);
+    range.__set_count(_max_rows + 1);
+  }
+
+  Consistency consistency;
+  configured_consistency(consistency);
+
+  std::vector<KeySlice> slices;
+  scanner->get_range_slices(slices, cparent, sp, range, consistency.level);
+  _more = (slices.size() >= (size_t)range.count);
+
+  for (std::vector<KeySlice>::const_iterator slice = slices.begin();
+       slice != slices.end();
+       ++slice)
+  {
+    if ((!_last_key.empty()) && (slice->key == _last_key))
+    {
+      continue;
+    }
+
+    _last_row_key = slice->key;
+
+    Row row;
+    row.key = slice->key;
+
+    for (std::vector<ColumnOrSuperColumn>::const_iterator column = slice->columns.begin();
+         column != slice->columns.end();
+         ++column)
+    {
+      if (!is_deletion_marker(*column))
+      {
+        row.columns[column->column.name] = column->column.value;
+      }
+    }
+
+    // Skip rows that have been deleted with deletion markers.
+    if (!row.columns.empty())
+    {
+      _rows.push_back(row);
+    }
+  }
 
+  LOG_DEBUG("Scanned %zu rows of %s", _rows.size(), _table.c_str());
   return true;
 }
+
+void Cache::ScanRows::get_result(std::vector<Row>& rows)
+{
+  rows = _rows;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file columncompression.cpp compression of large column values.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "columncompression.h"
+
+// The first byte of a compressed value, and the only format version so far.
+const static char COMPRESSED_MARKER = '\0';
+const static char FORMAT_ZLIB = '\x01';
+
+// Marker and version bytes, followed by the uncompressed length.
+const static size_t HEADER_LENGTH = 2 + sizeof(uint32_t);
+
+std::string ColumnCompression::compress(const std::string& value)
+{
+  uLongf compressed_len = compressBound(value.length());
+  std::string compressed(HEADER_LENGTH + compressed_len, '\0');
+
+  compressed[0] = COMPRESSED_MARKER;
+  compressed[1] = FORMAT_ZLIB;
+  uint32_t length = htonl(value.length());
+  memcpy(&compressed[2], &length, sizeof(length));
+
+  if ((::compress((Bytef*)&compressed[HEADER_LENGTH],
+                  &compressed_len,
+                  (const Bytef*)value.data(),
+                  value.length()) != Z_OK) ||
+      (HEADER_LENGTH + compressed_len >= value.length()))
+  {
+    return value;
+  }
+
+  compressed.resize(HEADER_LENGTH + compressed_len);
+  return compressed;
+}
+
+bool ColumnCompression::decode(const std::string& value, std::string& decoded)
+{
+  if ((value.empty()) || (value[0] != COMPRESSED_MARKER))
+  {
+    decoded = value;
+    return true;
+  }
+
+  if ((value.length() < HEADER_LENGTH) || (value[1] != FORMAT_ZLIB))
+  {
+    return false;
+  }
+
+  uint32_t length;
+  memcpy(&length, &value[2], sizeof(length));
+  uLongf decoded_len = ntohl(length);
+  decoded.assign(decoded_len, '\0');
+
+  if ((uncompress((Bytef*)&decoded[0],
+                  &decoded_len,
+                  (const Bytef*)&value[HEADER_LENGTH],
+                  value.length() - HEADER_LENGTH) != Z_OK) ||
+      (decoded_len != decoded.length()))
+  {
+    decoded.clear();
+    return false;
+  }
+
+  return true;
+}
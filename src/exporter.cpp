@@ -0,0 +1,312 @@
+/**
+ * @file exporter.cpp Streams the rows of the cache's tables out for auditing
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "exporter.h"
+#include "log.h"
+
+// How many times to try to read a page before giving up on a range.
+static const int MAX_PAGE_ATTEMPTS = 3;
+
+Exporter::Exporter(Cache* cache,
+                   unsigned int num_threads,
+                   int32_t page_size,
+                   unsigned long max_rows_per_sec) :
+  _cache(cache),
+  _num_threads((num_threads > 0) ? num_threads : 1),
+  _page_size((page_size > 0) ? page_size : 1),
+  _max_rows_per_sec(max_rows_per_sec)
+{
+  pthread_mutex_init(&_output_lock, NULL);
+  pthread_mutex_init(&_rate_lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &_paid_until);
+}
+
+Exporter::~Exporter()
+{
+  pthread_mutex_destroy(&_rate_lock);
+  pthread_mutex_destroy(&_output_lock);
+}
+
+bool Exporter::export_table(const std::string& table,
+                            std::ostream& output,
+                            size_t& rows)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  std::vector<std::pair<int64_t, int64_t> > ranges;
+  split_ring(_num_threads, ranges);
+
+  std::vector<Scan> scans(ranges.size());
+  std::vector<pthread_t> threads(ranges.size());
+  std::vector<bool> started(ranges.size(), false);
+
+  for (size_t ii = 0; ii < ranges.size(); ii++)
+  {
+    scans[ii].exporter = this;
+    scans[ii].table = table;
+    scans[ii].start_token = ranges[ii].first;
+    scans[ii].end_token = ranges[ii].second;
+    scans[ii].output = &output;
+    scans[ii].rows = 0;
+    scans[ii].success = false;
+
+    if (pthread_create(&threads[ii], NULL, scan_thread_entry, &scans[ii]) == 0)
+    {
+      started[ii] = true;
+    }
+    else
+    {
+      LOG_ERROR("Failed to start thread to export %s", table.c_str());
+    }
+  }
+
+  bool success = true;
+  rows = 0;
+
+  for (size_t ii = 0; ii < ranges.size(); ii++)
+  {
+    if (started[ii])
+    {
+      pthread_join(threads[ii], NULL);
+    }
+
+    success = success && started[ii] && scans[ii].success;
+    rows += scans[ii].rows;
+  }
+
+  output.flush();
+  success = success && output.good();
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned long elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000) +
+                             ((end.tv_nsec - start.tv_nsec) / 1000000);
+
+  LOG_STATUS("Exported %zu rows of %s in %lums%s",
+             rows, table.c_str(), elapsed_ms, success ? "" : " - incomplete");
+
+  return success;
+}
+
+std::string Exporter::encode(const std::string& data)
+{
+  static const char HEX[] = "0123456789ABCDEF";
+  std::string encoded;
+  encoded.reserve(data.size());
+
+  for (std::string::const_iterator c = data.begin(); c != data.end(); ++c)
+  {
+    unsigned char uc = (unsigned char)*c;
+
+    if ((uc <= ' ') || (uc >= 0x7F) || (uc == '=') || (uc == '%'))
+    {
+      encoded.push_back('%');
+      encoded.push_back(HEX[uc >> 4]);
+      encoded.push_back(HEX[uc & 0x0F]);
+    }
+    else
+    {
+      encoded.push_back(*c);
+    }
+  }
+
+  return encoded;
+}
+
+void Exporter::split_ring(unsigned int num_ranges,
+                          std::vector<std::pair<int64_t, int64_t> >& ranges)
+{
+  // The ring runs from just after the minimum token round to the maximum.
+  // Work in unsigned arithmetic, offset from the minimum token, to avoid
+  // overflow.
+  num_ranges = (num_ranges > 0) ? num_ranges : 1;
+  uint64_t width = UINT64_MAX / num_ranges;
+  uint64_t start = 0;
+
+  ranges.clear();
+
+  for (unsigned int ii = 0; ii < num_ranges; ii++)
+  {
+    uint64_t end = (ii == num_ranges - 1) ? UINT64_MAX : start + width;
+    ranges.push_back(std::make_pair((int64_t)(start + (uint64_t)INT64_MIN),
+                                    (int64_t)(end + (uint64_t)INT64_MIN)));
+    start = end;
+  }
+}
+
+void* Exporter::scan_thread_entry(void* scan)
+{
+  ((Scan*)scan)->exporter->scan((Scan*)scan);
+  return NULL;
+}
+
+void Exporter::scan(Scan* scan)
+{
+  std::string last_key;
+  bool more = true;
+  bool success = true;
+  std::string lines;
+
+  while ((more) && (success))
+  {
+    Cache::ScanRows* op = last_key.empty() ?
+      _cache->create_ScanRows(scan->table,
+                              scan->start_token,
+                              scan->end_token,
+                              _page_size) :
+      _cache->create_ScanRows(scan->table,
+                              last_key,
+                              scan->end_token,
+                              _page_size);
+
+    success = read_page(op, scan->table);
+
+    if (success)
+    {
+      std::vector<Cache::ScanRows::Row> rows;
+      op->get_result(rows);
+      more = op->more() && !op->last_row_key().empty();
+
+      lines.clear();
+
+      for (std::vector<Cache::ScanRows::Row>::const_iterator row = rows.begin();
+           row != rows.end();
+           ++row)
+      {
+        lines.append(encode(scan->table));
+        lines.push_back(' ');
+        lines.append(encode(row->key));
+
+        for (std::map<std::string, std::string>::const_iterator column =
+               row->columns.begin();
+             column != row->columns.end();
+             ++column)
+        {
+          lines.push_back(' ');
+          lines.append(encode(column->first));
+          lines.push_back('=');
+          lines.append(encode(column->second));
+        }
+
+        lines.push_back('\n');
+      }
+
+      pthread_mutex_lock(&_output_lock);
+      scan->output->write(lines.data(), lines.size());
+      success = scan->output->good();
+      pthread_mutex_unlock(&_output_lock);
+
+      if (!op->last_row_key().empty())
+      {
+        last_key = op->last_row_key();
+      }
+
+      scan->rows += rows.size();
+      throttle(rows.size());
+    }
+
+    delete op;
+  }
+
+  scan->success = success;
+}
+
+bool Exporter::read_page(Cache::ScanRows* op, const std::string& table)
+{
+  for (int attempt = 1; attempt <= MAX_PAGE_ATTEMPTS; attempt++)
+  {
+    if (_cache->do_sync(op, 0))
+    {
+      return true;
+    }
+
+    LOG_WARNING("Failed to read page of %s (attempt %d): %s",
+                table.c_str(), attempt, op->get_error_text().c_str());
+
+    if (op->get_result_code() == CassandraStore::INVALID_REQUEST)
+    {
+      // Trying again won't help.
+      break;
+    }
+
+    sleep(attempt);
+  }
+
+  return false;
+}
+
+void Exporter::throttle(size_t rows)
+{
+  if ((_max_rows_per_sec == 0) || (rows == 0))
+  {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&_rate_lock);
+
+  // Time spent idle doesn't earn credit for a later burst.
+  if ((_paid_until.tv_sec < now.tv_sec) ||
+      ((_paid_until.tv_sec == now.tv_sec) && (_paid_until.tv_nsec < now.tv_nsec)))
+  {
+    _paid_until = now;
+  }
+
+  uint64_t cost_ns = (rows * 1000000000ULL) / _max_rows_per_sec;
+  _paid_until.tv_sec += cost_ns / 1000000000ULL;
+  _paid_until.tv_nsec += cost_ns % 1000000000ULL;
+
+  if (_paid_until.tv_nsec >= 1000000000L)
+  {
+    _paid_until.tv_sec++;
+    _paid_until.tv_nsec -= 1000000000L;
+  }
+
+  struct timespec wake = _paid_until;
+
+  pthread_mutex_unlock(&_rate_lock);
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+  {
+  }
+}
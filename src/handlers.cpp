@@ -54,6 +54,7 @@ std::string HssCacheTask::_dest_host;
 std::string HssCacheTask::_server_name;
 Cx::Dictionary* HssCacheTask::_dict;
 Cache* HssCacheTask::_cache = NULL;
+long HssCacheTask::_cache_deadline_ms = 0;
 StatisticsManager* HssCacheTask::_stats_manager = NULL;
 
 const static HssCacheTask::StatsFlags DIGEST_STATS =
@@ -84,9 +85,43 @@ void HssCacheTask::configure_diameter(Diameter::Stack* diameter_stack,
   _dict = dict;
 }
 
-void HssCacheTask::configure_cache(Cache* cache)
+HssCacheTask::HssCacheTask(HttpStack::Request& req, SAS::TrailId trail) :
+  HttpStackUtils::Task(req, trail)
+{
+  long deadline_ms = _cache_deadline_ms;
+
+  // Sprout can tell us how long it will wait for its request, in which case
+  // there's no point running anything after that.
+  std::string header = req.header("X-Deadline");
+  if (!header.empty())
+  {
+    long header_ms = atol(header.c_str());
+    if ((header_ms > 0) && ((deadline_ms == 0) || (header_ms < deadline_ms)))
+    {
+      deadline_ms = header_ms;
+    }
+  }
+
+  _deadline.tv_sec = 0;
+  _deadline.tv_nsec = 0;
+
+  if (deadline_ms > 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &_deadline);
+    _deadline.tv_sec += deadline_ms / 1000;
+    _deadline.tv_nsec += (deadline_ms % 1000) * 1000000;
+    if (_deadline.tv_nsec >= 1000000000)
+    {
+      _deadline.tv_sec++;
+      _deadline.tv_nsec -= 1000000000;
+    }
+  }
+}
+
+void HssCacheTask::configure_cache(Cache* cache, long deadline_ms)
 {
   _cache = cache;
+  _cache_deadline_ms = deadline_ms;
 }
 
 void HssCacheTask::configure_stats(StatisticsManager* stats_manager)
@@ -94,6 +129,16 @@ void HssCacheTask::configure_stats(StatisticsManager* stats_manager)
   _stats_manager = stats_manager;
 }
 
+void HssCacheTask::set_deadline(CassandraStore::Operation* op)
+{
+  Cache::CacheOperation* cache_op = dynamic_cast<Cache::CacheOperation*>(op);
+
+  if ((cache_op != NULL) && (_deadline.tv_sec != 0))
+  {
+    cache_op->set_deadline(_deadline);
+  }
+}
+
 void HssCacheTask::on_diameter_timeout()
 {
   send_http_reply(HTTP_GATEWAY_TIMEOUT);
@@ -133,6 +178,7 @@ void ImpiTask::query_cache_av()
   event.add_var_param(_impu);
   SAS::report_event(event);
   CassandraStore::Operation* get_av = _cache->create_GetAuthVector(_impi, _impu);
+  set_deadline(get_av);
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpiTask::on_get_av_success,
@@ -205,6 +251,7 @@ void ImpiTask::query_cache_impu()
   event.add_var_param(_impi);
   SAS::report_event(event);
   CassandraStore::Operation* get_public_ids = _cache->create_GetAssociatedPublicIDs(_impi);
+  set_deadline(get_public_ids);
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpiTask::on_get_impu_success,
@@ -292,13 +339,15 @@ void ImpiTask::on_mar_response(Diameter::Message& rsp)
           event.add_var_param(_impi);
           event.add_var_param(_impu);
           SAS::report_event(event);
-          CassandraStore::Operation* put_public_id =
+          Cache::PutAssociatedPublicID* put_public_id =
             _cache->create_PutAssociatedPublicID(_impi,
                                                  _impu,
                                                  Cache::generate_timestamp(),
                                                  _cfg->impu_cache_ttl);
+          put_public_id->set_write_behind();
           CassandraStore::Transaction* tsx = new CacheTransaction;
-          _cache->do_async(put_public_id, tsx);
+          CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_public_id;
+          _cache->do_async(op, tsx);
         }
       }
       else if (sip_auth_scheme == _cfg->scheme_aka)
@@ -877,6 +926,7 @@ void ImpuRegDataTask::run()
   event.add_var_param(_impu);
   SAS::report_event(event);
   CassandraStore::Operation* get_reg_data = _cache->create_GetRegData(_impu);
+  set_deadline(get_reg_data);
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpuRegDataTask::on_get_reg_data_success,
@@ -905,11 +955,13 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
   Cache::GetRegData* get_reg_data = (Cache::GetRegData*)op;
   RegistrationState old_state;
   std::vector<std::string> associated_impis;
+  IRSSummary irs_summary;
   int32_t ttl = 0;
   get_reg_data->get_xml(_xml, ttl);
   get_reg_data->get_registration_state(old_state, ttl);
   get_reg_data->get_associated_impis(associated_impis);
   get_reg_data->get_charging_addrs(_charging_addrs);
+  get_reg_data->get_irs_summary(irs_summary);
   bool new_binding = false;
   LOG_DEBUG("TTL for this database record is %d, IMS Subscription XML is %s, registration state is %s, and the charging addresses are %s",
             ttl,
@@ -942,7 +994,7 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
   // we have a record of this binding.
   if (_impi.empty())
   {
-    _impi = XmlUtils::get_private_id(_xml);
+    _impi = irs_summary.private_id;
   }
   else if ((!_xml.empty()) &&
            ((associated_impis.empty()) ||
@@ -962,14 +1014,15 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
       LOG_DEBUG("Associating private identity %s to IRS for %s",
                 _impi.c_str(),
                 _impu.c_str());
-      std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
-      CassandraStore::Operation* put_associated_private_id =
-        _cache->create_PutAssociatedPrivateID(public_ids,
+      Cache::PutAssociatedPrivateID* put_associated_private_id =
+        _cache->create_PutAssociatedPrivateID(irs_summary.public_ids,
                                               _impi,
                                               Cache::generate_timestamp(),
                                               (2 * _cfg->hss_reregistration_time));
+      put_associated_private_id->set_write_behind();
       CassandraStore::Transaction* tsx = new CacheTransaction;
-      _cache->do_async(put_associated_private_id, tsx);
+      CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_associated_private_id;
+      _cache->do_async(op, tsx);
     }
 
     if (_type == RequestType::REG)
@@ -995,6 +1048,13 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
         }
         else
         {
+          // Have the HSS re-registration made in the background before
+          // this IRS's next REGISTER would have to wait for it.
+          if (_cfg->reregistration_scheduler != NULL)
+          {
+            _cfg->reregistration_scheduler->registered(_impu, _impi, ttl);
+          }
+
           // No state changes are required for a re-register if we're
           // not notifying a HSS - just respond.
           send_reply();
@@ -1337,6 +1397,7 @@ void ImpuRegDataTask::put_in_cache()
       put_reg_data->with_charging_addrs(_charging_addrs);
     }
 
+    put_reg_data->set_write_behind();
     CassandraStore::Transaction* tsx = new CacheTransaction;
     CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
     _cache->do_async(op, tsx);
@@ -1355,6 +1416,11 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
   // has no bindings for it.
   if (is_deregistration_request(_type))
   {
+    if (_cfg->reregistration_scheduler != NULL)
+    {
+      _cfg->reregistration_scheduler->deregistered(_impu);
+    }
+
     SAS::Event event(this->trail(), SASEvent::REG_DATA_HSS_SUCCESS, 0);
     SAS::report_event(event);
     std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
@@ -1375,12 +1441,14 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
       std::string associated_private_ids_str = boost::algorithm::join(associated_private_ids, ", ");
       event.add_var_param(associated_private_ids_str);
       SAS::report_event(event);
-      CassandraStore::Operation* delete_public_id =
+      Cache::DeletePublicIDs* delete_public_id =
         _cache->create_DeletePublicIDs(public_ids,
                                        associated_private_ids,
                                        Cache::generate_timestamp());
+      delete_public_id->set_write_behind();
       CassandraStore::Transaction* tsx = new CacheTransaction;
-      _cache->do_async(delete_public_id, tsx);
+      CassandraStore::Operation*& op = (CassandraStore::Operation*&)delete_public_id;
+      _cache->do_async(op, tsx);
     }
   }
 
@@ -1398,6 +1466,14 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
         LOG_DEBUG("Getting User-Data from SAA for cache");
         saa.user_data(_xml);
         put_in_cache();
+
+        if ((_type == RequestType::REG) &&
+            (_cfg->reregistration_scheduler != NULL))
+        {
+          _cfg->reregistration_scheduler->registered(_impu,
+                                                     _impi,
+                                                     2 * _cfg->hss_reregistration_time);
+        }
       }
       send_reply();
       break;
@@ -1446,6 +1522,7 @@ void ImpuIMSSubscriptionTask::run()
 
   LOG_DEBUG("Try to find IMS Subscription information in the cache");
   CassandraStore::Operation* get_reg_data = _cache->create_GetRegData(_impu);
+  set_deadline(get_reg_data);
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpuRegDataTask::on_get_reg_data_success,
@@ -1468,6 +1545,162 @@ void ImpuIMSSubscriptionTask::send_reply()
   }
 }
 
+void ImpuRegDataTask::BackgroundReregisterer::reregister(const std::string& impu,
+                                                          const std::string& impi)
+{
+  BackgroundReregistration* reregistration =
+    new BackgroundReregistration(_cfg, impu, impi);
+  reregistration->run();
+}
+
+ImpuRegDataTask::BackgroundReregistration::
+BackgroundReregistration(const Config* cfg,
+                         const std::string& impu,
+                         const std::string& impi) :
+  _cfg(cfg),
+  _impu(impu),
+  _impi(impi),
+  _trail(SAS::new_trail(0))
+{}
+
+void ImpuRegDataTask::BackgroundReregistration::run()
+{
+  // Only re-register the IRS if it is still registered - it may have been
+  // deregistered (for example by an RTR) since it was scheduled.  Only the
+  // registration state is needed for that, so don't read the XML.
+  Cache::GetRegData* get_reg_data =
+    _cache->create_GetRegData(_impu, Cache::REG_DATA_REG_STATE);
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(this,
+                         &BackgroundReregistration::on_get_reg_data_success,
+                         &BackgroundReregistration::on_get_reg_data_failure);
+  CassandraStore::Operation*& op = (CassandraStore::Operation*&)get_reg_data;
+  _cache->do_async(op, tsx);
+}
+
+void ImpuRegDataTask::BackgroundReregistration::
+on_get_reg_data_success(CassandraStore::Operation* op)
+{
+  Cache::GetRegData* get_reg_data = (Cache::GetRegData*)op;
+  RegistrationState state;
+  int32_t ttl = 0;
+  get_reg_data->get_registration_state(state, ttl);
+
+  if (state != RegistrationState::REGISTERED)
+  {
+    LOG_DEBUG("%s is no longer registered - not re-registering", _impu.c_str());
+    _cfg->reregistration_scheduler->deregistered(_impu);
+    complete(true);
+    return;
+  }
+
+  LOG_DEBUG("Sending background re-registration for %s to HSS", _impu.c_str());
+  Cx::ServerAssignmentRequest sar(_dict,
+                                  _diameter_stack,
+                                  _dest_host,
+                                  _dest_realm,
+                                  _impi,
+                                  _impu,
+                                  _server_name,
+                                  Cx::ServerAssignmentType::RE_REGISTRATION);
+  DiameterTransaction* tsx =
+    new DiameterTransaction(_dict,
+                            this,
+                            SUBSCRIPTION_STATS,
+                            &BackgroundReregistration::on_sar_response,
+                            &BackgroundReregistration::on_sar_timeout);
+  sar.send(tsx, _cfg->diameter_timeout_ms);
+}
+
+void ImpuRegDataTask::BackgroundReregistration::
+on_get_reg_data_failure(CassandraStore::Operation* op,
+                        CassandraStore::ResultCode error,
+                        std::string& text)
+{
+  LOG_DEBUG("Failed to read registration data for %s - rc %d", _impu.c_str(), error);
+  complete(false);
+}
+
+void ImpuRegDataTask::BackgroundReregistration::on_sar_response(Diameter::Message& rsp)
+{
+  Cx::ServerAssignmentAnswer saa(rsp);
+  int32_t result_code = 0;
+  saa.result_code(result_code);
+
+  std::string xml;
+  std::vector<std::string> public_ids;
+
+  if (result_code == 2001)
+  {
+    saa.user_data(xml);
+    public_ids = XmlUtils::get_public_ids(xml);
+  }
+
+  if (public_ids.empty())
+  {
+    LOG_INFO("Background re-registration of %s failed with result code %d",
+             _impu.c_str(), result_code);
+
+    // Try again later if the HSS was too busy, but otherwise leave it to the
+    // next REGISTER to sort out.
+    if (result_code != DIAMETER_TOO_BUSY)
+    {
+      _cfg->reregistration_scheduler->deregistered(_impu);
+    }
+
+    complete(false);
+    return;
+  }
+
+  ChargingAddresses charging_addrs;
+  saa.charging_addrs(charging_addrs);
+
+  std::vector<std::string> associated_private_ids;
+  if (!_impi.empty())
+  {
+    associated_private_ids.push_back(_impi);
+  }
+  std::string xml_impi = XmlUtils::get_private_id(xml);
+  if ((!xml_impi.empty()) && (xml_impi != _impi))
+  {
+    associated_private_ids.push_back(xml_impi);
+  }
+
+  // Cache the refreshed data exactly as a re-registration on the request
+  // path would.
+  Cache::PutRegData* put_reg_data =
+    _cache->create_PutRegData(public_ids,
+                              Cache::generate_timestamp(),
+                              2 * _cfg->hss_reregistration_time);
+  put_reg_data->with_xml(xml)
+               .with_reg_state(RegistrationState::REGISTERED)
+               .with_charging_addrs(charging_addrs);
+
+  if (!associated_private_ids.empty())
+  {
+    put_reg_data->with_associated_impis(associated_private_ids);
+  }
+
+  put_reg_data->set_write_behind();
+  CassandraStore::Transaction* tsx = new CacheTransaction;
+  CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
+  _cache->do_async(op, tsx);
+
+  complete(true);
+}
+
+void ImpuRegDataTask::BackgroundReregistration::on_sar_timeout()
+{
+  LOG_INFO("Background re-registration of %s timed out", _impu.c_str());
+  complete(false);
+}
+
+void ImpuRegDataTask::BackgroundReregistration::complete(bool success)
+{
+  _cfg->reregistration_scheduler->reregistration_complete(_impu, success);
+  delete this;
+}
+
 void RegistrationTerminationTask::run()
 {
   // Save off the deregistration reason and all private and public
@@ -1572,26 +1805,82 @@ void RegistrationTerminationTask::get_assoc_primary_public_ids_failure(Cassandra
 
 void RegistrationTerminationTask::get_registration_sets()
 {
-  // This function issues a GetRegData cache request for a public identity
-  // on the list of IMPUs and then removes that public identity from the list. It
-  // should get called again after the cache response by the callback functions.
-  // Once there are no public identities remaining, it deletes the registrations.
-  if (!_impus.empty())
+  // This function issues a single GetRegDataMulti cache request for all the
+  // public identities on the list of IMPUs.  The callback then deletes the
+  // registrations.
+  for (std::vector<std::string>::const_iterator impu = _impus.begin();
+       impu != _impus.end();
+       ++impu)
   {
-    std::string impu = _impus.back();
-    _impus.pop_back();
-    LOG_DEBUG("Finding registration set for public identity %s", impu.c_str());
     SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA, 0);
-    event.add_var_param(impu);
+    event.add_var_param(*impu);
     SAS::report_event(event);
-    CassandraStore::Operation* get_reg_data = _cfg->cache->create_GetRegData(impu);
-    CassandraStore::Transaction* tsx =
-      new CacheTransaction(this,
-                           &RegistrationTerminationTask::get_registration_set_success,
-                           &RegistrationTerminationTask::get_registration_set_failure);
-    _cfg->cache->do_async(get_reg_data, tsx);
   }
-  else if (_registration_sets.empty())
+
+  std::string impus_str = boost::algorithm::join(_impus, ", ");
+  LOG_DEBUG("Finding registration sets for public identities %s",
+            impus_str.c_str());
+  // We only need the IMS subscriptions, and the associated private
+  // identities if we're going to deregister those too.
+  int columns = Cache::REG_DATA_XML;
+
+  if ((_deregistration_reason == SERVER_CHANGE) ||
+      (_deregistration_reason == NEW_SERVER_ASSIGNED))
+  {
+    columns |= Cache::REG_DATA_IMPIS;
+  }
+
+  CassandraStore::Operation* get_reg_data =
+    _cfg->cache->create_GetRegDataMulti(_impus, columns);
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(this,
+                         &RegistrationTerminationTask::get_registration_sets_success,
+                         &RegistrationTerminationTask::get_registration_sets_failure);
+  _cfg->cache->do_async(get_reg_data, tsx);
+}
+
+void RegistrationTerminationTask::get_registration_sets_success(CassandraStore::Operation* op)
+{
+  Cache::GetRegDataMulti* get_reg_data_result = (Cache::GetRegDataMulti*)op;
+  std::map<std::string, Cache::GetRegData::Result> results;
+  get_reg_data_result->get_result(results);
+
+  // Work through the public identities in the same order as we used to look
+  // them up one at a time (last first), so the registration sets are in a
+  // consistent order.
+  for (std::vector<std::string>::const_reverse_iterator impu = _impus.rbegin();
+       impu != _impus.rend();
+       ++impu)
+  {
+    const Cache::GetRegData::Result& result = results[*impu];
+    SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA_SUCCESS, 0);
+    event.add_compressed_param(result.xml, &SASEvent::PROFILE_SERVICE_PROFILE);
+    SAS::report_event(event);
+
+    // Add the list of public identities in the IMS subscription to
+    // the list of registration sets..
+    if (!result.summary.public_ids.empty())
+    {
+      _registration_sets.push_back(result.summary.public_ids);
+    }
+
+    if ((_deregistration_reason == SERVER_CHANGE) ||
+        (_deregistration_reason == NEW_SERVER_ASSIGNED))
+    {
+      // GetRegData also returns a list of associated private
+      // identities. Save these off.
+      std::string associated_impis_str = boost::algorithm::join(result.impis, ", ");
+      LOG_DEBUG("GetRegData returned associated identites: %s",
+                associated_impis_str.c_str());
+      _impis.insert(_impis.end(),
+                    result.impis.begin(),
+                    result.impis.end());
+    }
+  }
+
+  _impus.clear();
+
+  if (_registration_sets.empty())
   {
     LOG_DEBUG("No registered IMPUs to deregister found");
     SAS::Event event(this->trail(), SASEvent::NO_IMPU_DEREG, 0);
@@ -1612,46 +1901,9 @@ void RegistrationTerminationTask::get_registration_sets()
   }
 }
 
-void RegistrationTerminationTask::get_registration_set_success(CassandraStore::Operation* op)
-{
-  Cache::GetRegData* get_reg_data_result = (Cache::GetRegData*)op;
-  std::string ims_sub;
-  int32_t temp;
-  get_reg_data_result->get_xml(ims_sub, temp);
-  SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA_SUCCESS, 0);
-  event.add_compressed_param(ims_sub, &SASEvent::PROFILE_SERVICE_PROFILE);
-  SAS::report_event(event);
-
-  // Add the list of public identities in the IMS subscription to
-  // the list of registration sets..
-  std::vector<std::string> public_ids = XmlUtils::get_public_ids(ims_sub);
-  if (!public_ids.empty())
-  {
-    _registration_sets.push_back(public_ids);
-  }
-
-  if ((_deregistration_reason == SERVER_CHANGE) ||
-      (_deregistration_reason == NEW_SERVER_ASSIGNED))
-  {
-    // GetRegData also returns a list of associated private
-    // identities. Save these off.
-    std::vector<std::string> associated_impis;
-    get_reg_data_result->get_associated_impis(associated_impis);
-    std::string associated_impis_str = boost::algorithm::join(associated_impis, ", ");
-    LOG_DEBUG("GetRegData returned associated identites: %s",
-              associated_impis_str.c_str());
-    _impis.insert(_impis.end(),
-                  associated_impis.begin(),
-                  associated_impis.end());
-  }
-
-  // Call back into get_registration_sets
-  get_registration_sets();
-}
-
-void RegistrationTerminationTask::get_registration_set_failure(CassandraStore::Operation* op,
-                                                               CassandraStore::ResultCode error,
-                                                               std::string& text)
+void RegistrationTerminationTask::get_registration_sets_failure(CassandraStore::Operation* op,
+                                                                CassandraStore::ResultCode error,
+                                                                std::string& text)
 {
   LOG_DEBUG("Failed to get a registration set - report failure to HSS");
   SAS::Event event(this->trail(), SASEvent::DEREG_FAIL, 0);
@@ -1766,10 +2018,12 @@ void RegistrationTerminationTask::dissociate_implicit_registration_sets()
     std::string impis_str = boost::algorithm::join(_impis, ", ");
     event.add_var_param(impis_str);
     SAS::report_event(event);
-    CassandraStore::Operation* dissociate_reg_set =
+    Cache::DissociateImplicitRegistrationSetFromImpi* dissociate_reg_set =
       _cfg->cache->create_DissociateImplicitRegistrationSetFromImpi(*i, _impis, Cache::generate_timestamp());
+    dissociate_reg_set->set_write_behind();
     CassandraStore::Transaction* tsx = new CacheTransaction;
-    _cfg->cache->do_async(dissociate_reg_set, tsx);
+    CassandraStore::Operation*& op = (CassandraStore::Operation*&)dissociate_reg_set;
+    _cfg->cache->do_async(op, tsx);
   }
 }
 
@@ -1782,10 +2036,12 @@ void RegistrationTerminationTask::delete_impi_mappings()
   SAS::Event event(this->trail(), SASEvent::CACHE_DELETE_IMPI_MAP, 0);
   event.add_var_param(_impis_str);
   SAS::report_event(event);
-  CassandraStore::Operation* delete_impis =
+  Cache::DeleteIMPIMapping* delete_impis =
     _cfg->cache->create_DeleteIMPIMapping(_impis, Cache::generate_timestamp());
+  delete_impis->set_write_behind();
   CassandraStore::Transaction* tsx = new CacheTransaction;
-  _cfg->cache->do_async(delete_impis, tsx);
+  CassandraStore::Operation*& op = (CassandraStore::Operation*&)delete_impis;
+  _cfg->cache->do_async(op, tsx);
 }
 
 void RegistrationTerminationTask::send_rta(const std::string result_code)
@@ -0,0 +1,166 @@
+/**
+ * @file irssummary.cpp summary of the identities in an IMS subscription.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "irssummary.h"
+#include "xmlutils.h"
+
+// Encoded summaries start with a format version, followed by the hash of
+// the XML (8 bytes), the private ID, the number of public IDs (4 bytes) and
+// the public IDs.  Strings are encoded as a 4 byte length followed by the
+// string.  All integers are in network byte order.
+const static char SUMMARY_VERSION = '\x01';
+
+static void encode_int(std::string& out, uint64_t value, int bytes)
+{
+  for (int ii = bytes - 1; ii >= 0; ii--)
+  {
+    out.push_back((char)((value >> (ii * 8)) & 0xff));
+  }
+}
+
+static bool decode_int(const std::string& in, size_t& pos, int bytes, uint64_t& value)
+{
+  if (in.length() - pos < (size_t)bytes)
+  {
+    return false;
+  }
+
+  value = 0;
+  for (int ii = 0; ii < bytes; ii++)
+  {
+    value = (value << 8) | (unsigned char)in[pos++];
+  }
+
+  return true;
+}
+
+static void encode_string(std::string& out, const std::string& value)
+{
+  encode_int(out, value.length(), 4);
+  out.append(value);
+}
+
+static bool decode_string(const std::string& in, size_t& pos, std::string& value)
+{
+  uint64_t length;
+
+  if ((!decode_int(in, pos, 4, length)) || (in.length() - pos < length))
+  {
+    return false;
+  }
+
+  value = in.substr(pos, length);
+  pos += length;
+  return true;
+}
+
+IRSSummary::IRSSummary(const std::string& xml) :
+  public_ids(),
+  private_id(),
+  xml_hash(hash(xml))
+{
+  if (!xml.empty())
+  {
+    public_ids = XmlUtils::get_public_ids(xml);
+    private_id = XmlUtils::get_private_id(xml);
+  }
+}
+
+std::string IRSSummary::encode() const
+{
+  std::string out(1, SUMMARY_VERSION);
+  encode_int(out, xml_hash, 8);
+  encode_string(out, private_id);
+  encode_int(out, public_ids.size(), 4);
+
+  for (std::vector<std::string>::const_iterator public_id = public_ids.begin();
+       public_id != public_ids.end();
+       ++public_id)
+  {
+    encode_string(out, *public_id);
+  }
+
+  return out;
+}
+
+bool IRSSummary::decode(const std::string& value)
+{
+  size_t pos = 1;
+  uint64_t num_public_ids;
+  IRSSummary summary;
+
+  if ((value.empty()) ||
+      (value[0] != SUMMARY_VERSION) ||
+      (!decode_int(value, pos, 8, summary.xml_hash)) ||
+      (!decode_string(value, pos, summary.private_id)) ||
+      (!decode_int(value, pos, 4, num_public_ids)))
+  {
+    return false;
+  }
+
+  for (uint64_t ii = 0; ii < num_public_ids; ii++)
+  {
+    std::string public_id;
+
+    if (!decode_string(value, pos, public_id))
+    {
+      return false;
+    }
+
+    summary.public_ids.push_back(public_id);
+  }
+
+  if (pos != value.length())
+  {
+    return false;
+  }
+
+  *this = summary;
+  return true;
+}
+
+uint64_t IRSSummary::hash(const std::string& xml)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (std::string::const_iterator it = xml.begin(); it != xml.end(); ++it)
+  {
+    hash ^= (unsigned char)*it;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
@@ -0,0 +1,1260 @@
+/**
+ * @file localstore.cpp embedded storage for the cache's tables.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <set>
+
+#include "localstore.h"
+#include "log.h"
+
+using namespace org::apache::cassandra;
+
+// Snapshots are written out in chunks of about this size.
+static const size_t SNAPSHOT_WRITE_SIZE = 1024 * 1024;
+
+// Flush a directory's entries to disk, so that files renamed into it stay
+// renamed after a crash.
+static bool sync_directory(const std::string& directory)
+{
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  bool success = (fd >= 0) && (fsync(fd) == 0);
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+
+  return success;
+}
+
+LocalStore::LocalStore(const std::string& directory,
+                       long snapshot_interval_ms,
+                       bool read_only,
+                       bool sync_writes) :
+  _directory(directory),
+  _snapshot_path(directory + "/snapshot"),
+  _log_path(directory + "/log"),
+  _lock_path(directory + "/lock"),
+  _snapshot_interval_ms(snapshot_interval_ms),
+  _read_only(read_only),
+  _sync_writes(sync_writes),
+  _lock_fd(-1),
+  _tables(),
+  _log_fd(-1),
+  _log_length(0),
+  _written_seq(0),
+  _synced_seq(0),
+  _syncing(false),
+  _snapshot_thread_running(false),
+  _terminated(false)
+{
+  pthread_rwlock_init(&_lock, NULL);
+  pthread_mutex_init(&_sync_lock, NULL);
+  pthread_cond_init(&_sync_cond, NULL);
+  pthread_mutex_init(&_snapshot_lock, NULL);
+  pthread_mutex_init(&_thread_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_thread_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+LocalStore::~LocalStore()
+{
+  if ((_log_fd >= 0) || (_lock_fd >= 0))
+  {
+    stop();
+  }
+
+  pthread_cond_destroy(&_thread_cond);
+  pthread_mutex_destroy(&_thread_lock);
+  pthread_mutex_destroy(&_snapshot_lock);
+  pthread_cond_destroy(&_sync_cond);
+  pthread_mutex_destroy(&_sync_lock);
+  pthread_rwlock_destroy(&_lock);
+}
+
+bool LocalStore::start()
+{
+  size_t valid_length;
+  int read_fd = -1;
+
+  if (_read_only)
+  {
+    // Stop the process using the store swapping in a new snapshot (and
+    // emptying the log) between reading the snapshot and reading the log.
+    // The log is never replaced, so its lock is used for this.  If there's
+    // no log, nothing has used the store since its last snapshot.
+    read_fd = open(_log_path.c_str(), O_RDONLY);
+
+    if (read_fd >= 0)
+    {
+      flock(read_fd, LOCK_SH);
+    }
+  }
+  else
+  {
+    _lock_fd = open(_lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if ((_lock_fd < 0) || (flock(_lock_fd, LOCK_EX | LOCK_NB) != 0))
+    {
+      LOG_ERROR("Failed to lock local store %s (is another process using it?): %s",
+                _directory.c_str(), strerror(errno));
+
+      if (_lock_fd >= 0)
+      {
+        close(_lock_fd);
+        _lock_fd = -1;
+      }
+
+      return false;
+    }
+  }
+
+  pthread_rwlock_wrlock(&_lock);
+
+  bool success = load(_snapshot_path, valid_length);
+
+  // Snapshots are renamed into place once they have been written, so one
+  // that doesn't end in a complete record is corrupt.
+  struct stat st;
+  if ((success) &&
+      (stat(_snapshot_path.c_str(), &st) == 0) &&
+      ((size_t)st.st_size != valid_length))
+  {
+    success = false;
+  }
+
+  if (!success)
+  {
+    LOG_ERROR("Failed to load local store snapshot %s", _snapshot_path.c_str());
+  }
+  else
+  {
+    success = load(_log_path, valid_length);
+
+    if (!success)
+    {
+      LOG_ERROR("Failed to read local store log %s", _log_path.c_str());
+    }
+  }
+
+  if (read_fd >= 0)
+  {
+    // A record being written to the log while it was read is left for the
+    // process using the store to complete.
+    close(read_fd);
+  }
+
+  if ((success) && (!_read_only))
+  {
+    // The log is read as well as written, to copy what's written to it while
+    // a snapshot is being taken.
+    _log_fd = open(_log_path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+
+    if (_log_fd < 0)
+    {
+      LOG_ERROR("Failed to open local store log %s: %s",
+                _log_path.c_str(), strerror(errno));
+      success = false;
+    }
+    else
+    {
+      if ((fstat(_log_fd, &st) == 0) && ((size_t)st.st_size > valid_length))
+      {
+        // The last write to the log was cut short (by a crash, say), so
+        // throw it away rather than appending after it.
+        LOG_WARNING("Discarding incomplete record at the end of %s",
+                    _log_path.c_str());
+        if (ftruncate(_log_fd, valid_length) != 0)
+        {
+          LOG_ERROR("Failed to truncate local store log: %s", strerror(errno));
+          close(_log_fd);
+          _log_fd = -1;
+          success = false;
+        }
+      }
+
+      _log_length = valid_length;
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if ((success) && (!_read_only) && (_snapshot_interval_ms > 0))
+  {
+    _terminated = false;
+    _snapshot_thread_running =
+      (pthread_create(&_snapshot_thread, NULL, snapshot_thread_entry, this) == 0);
+
+    if (!_snapshot_thread_running)
+    {
+      LOG_ERROR("Failed to start local store snapshot thread");
+    }
+  }
+
+  return success;
+}
+
+void LocalStore::stop()
+{
+  if (_snapshot_thread_running)
+  {
+    pthread_mutex_lock(&_thread_lock);
+    _terminated = true;
+    pthread_cond_signal(&_thread_cond);
+    pthread_mutex_unlock(&_thread_lock);
+
+    pthread_join(_snapshot_thread, NULL);
+    _snapshot_thread_running = false;
+  }
+
+  if (_log_fd >= 0)
+  {
+    snapshot();
+    close(_log_fd);
+    _log_fd = -1;
+  }
+
+  if (_lock_fd >= 0)
+  {
+    close(_lock_fd);
+    _lock_fd = -1;
+  }
+}
+
+bool LocalStore::snapshot()
+{
+  if (_read_only)
+  {
+    LOG_ERROR("Can't write a snapshot of read-only local store %s",
+              _directory.c_str());
+    return false;
+  }
+
+  pthread_mutex_lock(&_snapshot_lock);
+
+  purge_expired();
+
+  // Copy the tables, and note how much of the log the copy includes, with
+  // writes held off.  Writes can carry on while the copy is written out, as
+  // they are kept in the log when the snapshot is swapped in.
+  pthread_rwlock_rdlock(&_lock);
+  std::map<std::string, Table> tables = _tables;
+  size_t log_length = _log_length;
+  pthread_rwlock_unlock(&_lock);
+
+  std::string tmp_path = _snapshot_path + ".tmp";
+  bool success = write_snapshot(tables, tmp_path);
+  tables.clear();
+
+  if (success)
+  {
+    pthread_rwlock_wrlock(&_lock);
+    success = install_snapshot(tmp_path, log_length);
+    pthread_rwlock_unlock(&_lock);
+  }
+
+  if (!success)
+  {
+    LOG_ERROR("Failed to write local store snapshot %s: %s",
+              tmp_path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+  }
+
+  pthread_mutex_unlock(&_snapshot_lock);
+
+  return success;
+}
+
+bool LocalStore::write_snapshot(const std::map<std::string, Table>& tables,
+                                const std::string& path)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool success = (fd >= 0);
+  size_t num_rows = 0;
+
+  std::string buffer;
+  std::vector<Change> changes;
+
+  for (std::map<std::string, Table>::const_iterator table = tables.begin();
+       (success) && (table != tables.end());
+       ++table)
+  {
+    for (Table::const_iterator row = table->second.begin();
+         (success) && (row != table->second.end());
+         ++row)
+    {
+      changes.clear();
+
+      for (Row::const_iterator column = row->second.begin();
+           column != row->second.end();
+           ++column)
+      {
+        Change change;
+        change.type = Change::PUT_COLUMN;
+        change.table = table->first;
+        change.key = row->first.second;
+        change.name = column->first;
+        change.column = column->second;
+        changes.push_back(change);
+      }
+
+      std::string record;
+      encode(changes, record);
+      buffer.append(record);
+      num_rows++;
+
+      if (buffer.size() >= SNAPSHOT_WRITE_SIZE)
+      {
+        success = (::write(fd, buffer.data(), buffer.size()) == (ssize_t)buffer.size());
+        buffer.clear();
+      }
+    }
+  }
+
+  if ((success) && (!buffer.empty()))
+  {
+    success = (::write(fd, buffer.data(), buffer.size()) == (ssize_t)buffer.size());
+  }
+
+  if (fd >= 0)
+  {
+    success = (fsync(fd) == 0) && success;
+    success = (close(fd) == 0) && success;
+  }
+
+  if (success)
+  {
+    LOG_DEBUG("Wrote local store snapshot of %zu rows", num_rows);
+  }
+
+  return success;
+}
+
+bool LocalStore::install_snapshot(const std::string& path, size_t log_length)
+{
+  bool success = true;
+  std::string new_log_path = _log_path + ".tmp";
+  int new_log_fd = -1;
+  std::string tail;
+
+  if (_log_fd >= 0)
+  {
+    // Copy what has been logged since the snapshot's contents were copied
+    // to a new log, which replaces the current one once the snapshot is in
+    // place.
+    tail.resize(_log_length - log_length);
+    success = (pread(_log_fd, &tail[0], tail.size(), log_length) == (ssize_t)tail.size());
+
+    if (success)
+    {
+      new_log_fd = open(new_log_path.c_str(),
+                        O_RDWR | O_APPEND | O_CREAT | O_TRUNC,
+                        0644);
+      success = (new_log_fd >= 0) &&
+                (::write(new_log_fd, tail.data(), tail.size()) == (ssize_t)tail.size()) &&
+                (fsync(new_log_fd) == 0);
+    }
+
+    // Wait for any read-only copies of the store to finish loading before
+    // swapping the snapshot and log in.
+    flock(_log_fd, LOCK_EX);
+  }
+
+  if (success)
+  {
+    success = (rename(path.c_str(), _snapshot_path.c_str()) == 0);
+  }
+
+  // The new snapshot must reach disk before the new log does.  Otherwise a
+  // crash could leave the old snapshot with the new log, losing every write
+  // between them.  The reverse is safe, as replaying the old log on top of
+  // the new snapshot has the same result as replaying the new one.
+  if (success)
+  {
+    success = sync_directory(_directory);
+  }
+
+  if ((success) && (new_log_fd >= 0))
+  {
+    if ((rename(new_log_path.c_str(), _log_path.c_str()) == 0) &&
+        (sync_directory(_directory)))
+    {
+      // Wait for any flush of the old log to finish before closing it.
+      pthread_mutex_lock(&_sync_lock);
+
+      while (_syncing)
+      {
+        pthread_cond_wait(&_sync_cond, &_sync_lock);
+      }
+
+      close(_log_fd);
+      _log_fd = new_log_fd;
+      new_log_fd = -1;
+      _log_length = tail.size();
+
+      // Every write so far is in the snapshot or the new log, both of which
+      // have been flushed.
+      _synced_seq = _written_seq;
+      pthread_cond_broadcast(&_sync_cond);
+      pthread_mutex_unlock(&_sync_lock);
+    }
+    else
+    {
+      // The snapshot is in place, so the old log can carry on being used.
+      LOG_ERROR("Failed to replace local store log %s: %s",
+                _log_path.c_str(), strerror(errno));
+    }
+  }
+
+  if (new_log_fd >= 0)
+  {
+    close(new_log_fd);
+    unlink(new_log_path.c_str());
+  }
+
+  if (_log_fd >= 0)
+  {
+    flock(_log_fd, LOCK_UN);
+  }
+
+  return success;
+}
+
+void LocalStore::batch_mutate(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+                              const ConsistencyLevel::type consistency_level)
+{
+  std::vector<Change> changes;
+  int64_t now = now_s();
+
+  for (std::map<std::string, std::map<std::string, std::vector<Mutation> > >::const_iterator key = mutation_map.begin();
+       key != mutation_map.end();
+       ++key)
+  {
+    for (std::map<std::string, std::vector<Mutation> >::const_iterator table = key->second.begin();
+         table != key->second.end();
+         ++table)
+    {
+      for (std::vector<Mutation>::const_iterator mutation = table->second.begin();
+           mutation != table->second.end();
+           ++mutation)
+      {
+        Change change;
+        change.table = table->first;
+        change.key = key->first;
+
+        if (mutation->__isset.column_or_supercolumn)
+        {
+          const org::apache::cassandra::Column& column =
+                                        mutation->column_or_supercolumn.column;
+          change.type = Change::PUT_COLUMN;
+          change.name = column.name;
+          change.column.value = column.value;
+          change.column.timestamp = column.timestamp;
+          change.column.expiry_s =
+            ((column.__isset.ttl) && (column.ttl > 0)) ? now + column.ttl : 0;
+          changes.push_back(change);
+        }
+        else if (mutation->__isset.deletion)
+        {
+          const Deletion& deletion = mutation->deletion;
+          change.column.timestamp = deletion.timestamp;
+
+          if (!deletion.__isset.predicate)
+          {
+            change.type = Change::DELETE_ROW;
+            changes.push_back(change);
+          }
+          else if (deletion.predicate.__isset.column_names)
+          {
+            change.type = Change::DELETE_COLUMN;
+
+            for (std::vector<std::string>::const_iterator name =
+                   deletion.predicate.column_names.begin();
+                 name != deletion.predicate.column_names.end();
+                 ++name)
+            {
+              change.name = *name;
+              changes.push_back(change);
+            }
+          }
+          else
+          {
+            // Cassandra doesn't support deleting ranges of columns either.
+            InvalidRequestException ire;
+            ire.why = "Deletion of a range of columns is not supported";
+            throw ire;
+          }
+        }
+      }
+    }
+  }
+
+  write(changes);
+}
+
+void LocalStore::get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                           const std::string& key,
+                           const ColumnParent& column_parent,
+                           const SlicePredicate& predicate,
+                           const ConsistencyLevel::type consistency_level)
+{
+  int64_t now = now_s();
+
+  pthread_rwlock_rdlock(&_lock);
+
+  std::map<std::string, Table>::const_iterator table =
+                                       _tables.find(column_parent.column_family);
+  if (table != _tables.end())
+  {
+    Table::const_iterator row = table->second.find(row_key(key));
+    if (row != table->second.end())
+    {
+      select(row->second, predicate, now, _return);
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+void LocalStore::multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                                const std::vector<std::string>& keys,
+                                const ColumnParent& column_parent,
+                                const SlicePredicate& predicate,
+                                const ConsistencyLevel::type consistency_level)
+{
+  int64_t now = now_s();
+
+  pthread_rwlock_rdlock(&_lock);
+
+  std::map<std::string, Table>::const_iterator table =
+                                       _tables.find(column_parent.column_family);
+
+  // As with Cassandra, every key is in the results, with no columns if the
+  // row doesn't exist.
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    std::vector<ColumnOrSuperColumn>& columns = _return[*key];
+
+    if (table != _tables.end())
+    {
+      Table::const_iterator row = table->second.find(row_key(*key));
+      if (row != table->second.end())
+      {
+        select(row->second, predicate, now, columns);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+void LocalStore::remove(const std::string& key,
+                        const ColumnPath& column_path,
+                        const int64_t timestamp,
+                        const ConsistencyLevel::type consistency_level)
+{
+  Change change;
+  change.table = column_path.column_family;
+  change.key = key;
+  change.column.timestamp = timestamp;
+
+  if (column_path.__isset.column)
+  {
+    change.type = Change::DELETE_COLUMN;
+    change.name = column_path.column;
+  }
+  else
+  {
+    change.type = Change::DELETE_ROW;
+  }
+
+  write(std::vector<Change>(1, change));
+}
+
+void LocalStore::get_range_slices(std::vector<KeySlice>& _return,
+                                  const ColumnParent& column_parent,
+                                  const SlicePredicate& predicate,
+                                  const KeyRange& range,
+                                  const ConsistencyLevel::type consistency_level)
+{
+  if ((range.__isset.start_key == range.__isset.start_token) ||
+      (!range.__isset.end_token))
+  {
+    // Scans by key aren't supported, as keys aren't stored in order.
+    InvalidRequestException ire;
+    ire.why = "A range must have a start key or token, and an end token";
+    throw ire;
+  }
+
+  int64_t end_token = strtoll(range.end_token.c_str(), NULL, 10);
+  int64_t now = now_s();
+
+  pthread_rwlock_rdlock(&_lock);
+
+  std::map<std::string, Table>::const_iterator table =
+                                       _tables.find(column_parent.column_family);
+
+  if (table != _tables.end())
+  {
+    Table::const_iterator row;
+
+    if (range.__isset.start_key)
+    {
+      row = table->second.lower_bound(row_key(range.start_key));
+    }
+    else
+    {
+      int64_t start_token = strtoll(range.start_token.c_str(), NULL, 10);
+      row = table->second.upper_bound(RowKey(start_token, std::string()));
+
+      // Skip any other keys with the start token.
+      while ((row != table->second.end()) && (row->first.first == start_token))
+      {
+        ++row;
+      }
+    }
+
+    for (;
+         (row != table->second.end()) &&
+         (row->first.first <= end_token) &&
+         (_return.size() < (size_t)range.count);
+         ++row)
+    {
+      KeySlice slice;
+      slice.key = row->first.second;
+      select(row->second, predicate, now, slice.columns);
+
+      // Leave out rows whose columns have all expired.
+      if (!slice.columns.empty())
+      {
+        _return.push_back(slice);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+int64_t LocalStore::token(const std::string& key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (std::string::const_iterator c = key.begin(); c != key.end(); ++c)
+  {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ULL;
+  }
+
+  // As with Cassandra, the minimum token is reserved to mark the start of the
+  // ring, so is never the token of a key.
+  int64_t token = (int64_t)hash;
+  return (token == INT64_MIN) ? INT64_MAX : token;
+}
+
+size_t LocalStore::num_rows(const std::string& column_family)
+{
+  size_t rows = 0;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  std::map<std::string, Table>::const_iterator table = _tables.find(column_family);
+  if (table != _tables.end())
+  {
+    rows = table->second.size();
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return rows;
+}
+
+void LocalStore::write(const std::vector<Change>& changes)
+{
+  if (changes.empty())
+  {
+    return;
+  }
+
+  std::string record;
+  encode(changes, record);
+
+  pthread_rwlock_wrlock(&_lock);
+
+  bool logged = (_log_fd >= 0);
+  size_t written = 0;
+
+  while ((logged) && (written < record.size()))
+  {
+    ssize_t rc = ::write(_log_fd, record.data() + written, record.size() - written);
+
+    if (rc > 0)
+    {
+      written += rc;
+    }
+    else if ((rc < 0) && (errno != EINTR))
+    {
+      LOG_ERROR("Failed to write to local store log: %s", strerror(errno));
+      logged = false;
+    }
+  }
+
+  uint64_t seq = 0;
+
+  if (logged)
+  {
+    _log_length += record.size();
+    apply(changes);
+
+    pthread_mutex_lock(&_sync_lock);
+    seq = ++_written_seq;
+    pthread_mutex_unlock(&_sync_lock);
+  }
+  else if ((_log_fd >= 0) && (written > 0))
+  {
+    // Cut off the part of the record that was written, so that records
+    // logged after it can be read back.
+    if (ftruncate(_log_fd, _log_length) != 0)
+    {
+      LOG_ERROR("Failed to truncate local store log: %s", strerror(errno));
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if ((logged) && (_sync_writes))
+  {
+    logged = sync(seq);
+  }
+
+  if (!logged)
+  {
+    // The write can't be made durable, so report the store as unavailable.
+    // If it was logged but the log couldn't be flushed, it has been applied
+    // already, as it may yet reach disk.
+    throw UnavailableException();
+  }
+}
+
+bool LocalStore::sync(uint64_t seq)
+{
+  bool success = true;
+
+  pthread_mutex_lock(&_sync_lock);
+
+  while ((success) && (_synced_seq < seq))
+  {
+    if (_syncing)
+    {
+      // Another thread is flushing the log, and will have flushed this write
+      // too unless it was logged after the flush started.
+      pthread_cond_wait(&_sync_cond, &_sync_lock);
+    }
+    else
+    {
+      // Flush every write logged so far, on behalf of all the threads
+      // waiting for them.
+      _syncing = true;
+      uint64_t target_seq = _written_seq;
+      int fd = _log_fd;
+      pthread_mutex_unlock(&_sync_lock);
+
+      success = (fdatasync(fd) == 0);
+
+      if (!success)
+      {
+        LOG_ERROR("Failed to flush local store log: %s", strerror(errno));
+      }
+
+      pthread_mutex_lock(&_sync_lock);
+      _syncing = false;
+
+      if ((success) && (_synced_seq < target_seq))
+      {
+        _synced_seq = target_seq;
+      }
+
+      pthread_cond_broadcast(&_sync_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_sync_lock);
+
+  return success;
+}
+
+void LocalStore::apply(const std::vector<Change>& changes)
+{
+  for (std::vector<Change>::const_iterator change = changes.begin();
+       change != changes.end();
+       ++change)
+  {
+    if (change->type == Change::PUT_COLUMN)
+    {
+      Row& row = _tables[change->table][row_key(change->key)];
+      Row::iterator column = row.find(change->name);
+
+      // As in Cassandra, the column with the latest timestamp wins.
+      if ((column == row.end()) ||
+          (column->second.timestamp <= change->column.timestamp))
+      {
+        row[change->name] = change->column;
+      }
+    }
+    else
+    {
+      std::map<std::string, Table>::iterator table = _tables.find(change->table);
+      if (table == _tables.end())
+      {
+        continue;
+      }
+
+      Table::iterator row = table->second.find(row_key(change->key));
+      if (row == table->second.end())
+      {
+        continue;
+      }
+
+      // Only delete columns that were written before the deletion.
+      Row::iterator column;
+      Row::iterator end;
+
+      if (change->type == Change::DELETE_COLUMN)
+      {
+        column = row->second.find(change->name);
+        end = (column == row->second.end()) ? column : std::next(column);
+      }
+      else
+      {
+        column = row->second.begin();
+        end = row->second.end();
+      }
+
+      while (column != end)
+      {
+        if (column->second.timestamp <= change->column.timestamp)
+        {
+          row->second.erase(column++);
+        }
+        else
+        {
+          ++column;
+        }
+      }
+
+      if (row->second.empty())
+      {
+        table->second.erase(row);
+      }
+    }
+  }
+}
+
+void LocalStore::select(const Row& row,
+                        const SlicePredicate& predicate,
+                        int64_t now_s,
+                        std::vector<ColumnOrSuperColumn>& columns)
+{
+  std::vector<Row::const_iterator> selected;
+
+  if (predicate.__isset.column_names)
+  {
+    // Results are in column name order, whatever order they were asked for
+    // in.
+    std::set<std::string> names(predicate.column_names.begin(),
+                                predicate.column_names.end());
+
+    for (std::set<std::string>::const_iterator name = names.begin();
+         name != names.end();
+         ++name)
+    {
+      Row::const_iterator column = row.find(*name);
+      if (column != row.end())
+      {
+        selected.push_back(column);
+      }
+    }
+  }
+  else
+  {
+    const SliceRange& range = predicate.slice_range;
+
+    if (!range.reversed)
+    {
+      for (Row::const_iterator column = range.start.empty() ?
+                                          row.begin() :
+                                          row.lower_bound(range.start);
+           (column != row.end()) &&
+           ((range.finish.empty()) || (column->first <= range.finish));
+           ++column)
+      {
+        selected.push_back(column);
+      }
+    }
+    else
+    {
+      // Reversed ranges start at the highest column name.
+      Row::const_iterator column = range.start.empty() ?
+                                     row.end() :
+                                     row.upper_bound(range.start);
+      while ((column != row.begin()) &&
+             ((range.finish.empty()) || (std::prev(column)->first >= range.finish)))
+      {
+        --column;
+        selected.push_back(column);
+      }
+    }
+  }
+
+  int32_t count = predicate.__isset.column_names ? (int32_t)selected.size() :
+                                                   predicate.slice_range.count;
+
+  for (std::vector<Row::const_iterator>::const_iterator column = selected.begin();
+       (column != selected.end()) && (count > 0);
+       ++column)
+  {
+    if (((*column)->second.expiry_s != 0) &&
+        ((*column)->second.expiry_s <= now_s))
+    {
+      continue;
+    }
+
+    org::apache::cassandra::Column thrift_column;
+    thrift_column.__set_name((*column)->first);
+    thrift_column.__set_value((*column)->second.value);
+    thrift_column.__set_timestamp((*column)->second.timestamp);
+
+    ColumnOrSuperColumn csc;
+    csc.__set_column(thrift_column);
+    columns.push_back(csc);
+    count--;
+  }
+}
+
+void LocalStore::purge_expired()
+{
+  int64_t now = now_s();
+
+  pthread_rwlock_wrlock(&_lock);
+
+  for (std::map<std::string, Table>::iterator table = _tables.begin();
+       table != _tables.end();
+       ++table)
+  {
+    for (Table::iterator row = table->second.begin();
+         row != table->second.end();)
+    {
+      for (Row::iterator column = row->second.begin();
+           column != row->second.end();)
+      {
+        if ((column->second.expiry_s != 0) && (column->second.expiry_s <= now))
+        {
+          row->second.erase(column++);
+        }
+        else
+        {
+          ++column;
+        }
+      }
+
+      if (row->second.empty())
+      {
+        row = table->second.erase(row);
+      }
+      else
+      {
+        ++row;
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+// Helpers for building and parsing records.
+static void append_uint32(std::string& data, uint32_t value)
+{
+  data.append((const char*)&value, sizeof(value));
+}
+
+static void append_int64(std::string& data, int64_t value)
+{
+  data.append((const char*)&value, sizeof(value));
+}
+
+static void append_string(std::string& data, const std::string& value)
+{
+  append_uint32(data, value.size());
+  data.append(value);
+}
+
+static bool read_uint32(const char*& data, const char* end, uint32_t& value)
+{
+  if ((size_t)(end - data) < sizeof(value))
+  {
+    return false;
+  }
+
+  memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return true;
+}
+
+static bool read_int64(const char*& data, const char* end, int64_t& value)
+{
+  if ((size_t)(end - data) < sizeof(value))
+  {
+    return false;
+  }
+
+  memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return true;
+}
+
+static bool read_string(const char*& data, const char* end, std::string& value)
+{
+  uint32_t length;
+
+  if ((!read_uint32(data, end, length)) || ((size_t)(end - data) < length))
+  {
+    return false;
+  }
+
+  value.assign(data, length);
+  data += length;
+  return true;
+}
+
+void LocalStore::encode(const std::vector<Change>& changes, std::string& record)
+{
+  std::string body;
+
+  for (std::vector<Change>::const_iterator change = changes.begin();
+       change != changes.end();
+       ++change)
+  {
+    body.push_back((char)change->type);
+    append_string(body, change->table);
+    append_string(body, change->key);
+
+    if (change->type != Change::DELETE_ROW)
+    {
+      append_string(body, change->name);
+    }
+
+    if (change->type == Change::PUT_COLUMN)
+    {
+      append_string(body, change->column.value);
+      append_int64(body, change->column.expiry_s);
+    }
+
+    append_int64(body, change->column.timestamp);
+  }
+
+  record.clear();
+  append_uint32(record, body.size());
+  append_uint32(record, crc32(0, (const Bytef*)body.data(), body.size()));
+  record.append(body);
+}
+
+bool LocalStore::decode(const char* data,
+                        size_t length,
+                        size_t& consumed,
+                        std::vector<Change>& changes)
+{
+  const char* pos = data;
+  const char* end = data + length;
+  uint32_t body_length;
+  uint32_t checksum;
+
+  if ((!read_uint32(pos, end, body_length)) ||
+      (!read_uint32(pos, end, checksum)) ||
+      ((size_t)(end - pos) < body_length) ||
+      (crc32(0, (const Bytef*)pos, body_length) != checksum))
+  {
+    return false;
+  }
+
+  end = pos + body_length;
+
+  while (pos < end)
+  {
+    Change change;
+    change.type = (Change::Type)*(pos++);
+    change.column.expiry_s = 0;
+
+    if ((change.type != Change::PUT_COLUMN) &&
+        (change.type != Change::DELETE_COLUMN) &&
+        (change.type != Change::DELETE_ROW))
+    {
+      return false;
+    }
+
+    if ((!read_string(pos, end, change.table)) ||
+        (!read_string(pos, end, change.key)) ||
+        ((change.type != Change::DELETE_ROW) &&
+         (!read_string(pos, end, change.name))) ||
+        ((change.type == Change::PUT_COLUMN) &&
+         ((!read_string(pos, end, change.column.value)) ||
+          (!read_int64(pos, end, change.column.expiry_s)))) ||
+        (!read_int64(pos, end, change.column.timestamp)))
+    {
+      return false;
+    }
+
+    changes.push_back(change);
+  }
+
+  consumed = end - data;
+  return true;
+}
+
+bool LocalStore::load(const std::string& path, size_t& valid_length)
+{
+  valid_length = 0;
+
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    // Nothing has been written yet.
+    return (errno == ENOENT);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  if (st.st_size == 0)
+  {
+    close(fd);
+    return true;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+
+  size_t num_records = 0;
+  std::vector<Change> changes;
+  size_t consumed;
+
+  while ((valid_length < (size_t)st.st_size) &&
+         (decode((const char*)data + valid_length,
+                 st.st_size - valid_length,
+                 consumed,
+                 changes)))
+  {
+    apply(changes);
+    changes.clear();
+    valid_length += consumed;
+    num_records++;
+  }
+
+  munmap(data, st.st_size);
+
+  LOG_STATUS("Loaded %zu records from %s", num_records, path.c_str());
+
+  return true;
+}
+
+void* LocalStore::snapshot_thread_entry(void* store)
+{
+  ((LocalStore*)store)->snapshot_thread();
+  return NULL;
+}
+
+void LocalStore::snapshot_thread()
+{
+  pthread_mutex_lock(&_thread_lock);
+
+  while (!_terminated)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_MONOTONIC, &wake);
+    wake.tv_sec += _snapshot_interval_ms / 1000;
+    wake.tv_nsec += (_snapshot_interval_ms % 1000) * 1000000;
+    if (wake.tv_nsec >= 1000000000)
+    {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000;
+    }
+
+    int rc = 0;
+    while ((!_terminated) && (rc != ETIMEDOUT))
+    {
+      rc = pthread_cond_timedwait(&_thread_cond, &_thread_lock, &wake);
+    }
+
+    if (!_terminated)
+    {
+      pthread_mutex_unlock(&_thread_lock);
+      snapshot();
+      pthread_mutex_lock(&_thread_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_thread_lock);
+}
+
+int64_t LocalStore::now_s()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec;
+}
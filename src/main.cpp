@@ -37,6 +37,7 @@
 #include <getopt.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <fstream>
 
 #include "accesslogger.h"
 #include "log.h"
@@ -47,6 +48,8 @@
 #include "handlers.h"
 #include "logger.h"
 #include "cache.h"
+#include "bulkprovisioner.h"
+#include "exporter.h"
 #include "saslogger.h"
 #include "sas.h"
 #include "sasevent.h"
@@ -67,6 +70,7 @@ struct options
   unsigned short http_port;
   int http_threads;
   std::string cassandra;
+  bool cassandra_native;
   std::string dest_realm;
   std::string dest_host;
   int max_peers;
@@ -83,11 +87,37 @@ struct options
   std::string log_directory;
   int log_level;
   int cache_threads;
+  int cache_threads_max;
+  int cache_shards;
+  std::map<std::string, Cache::Consistency> cache_consistency;
+  int cache_hedge_percentile;
+  int cache_hedge_budget;
+  int deletion_marker_ttl;
+  int write_behind_threads;
+  int write_behind_queue_size;
+  int cache_deadline_ms;
+  std::string local_store_dir;
+  int local_store_snapshot_interval_ms;
+  bool local_store_sync;
+  std::string warm_up_file;
+  std::string hot_keys_file;
+  std::string bulk_provision_file;
+  std::string export_file;
+  int export_rate;
+  int reregistration_lead_time;
   std::string sas_server;
   std::string sas_system_name;
   int diameter_timeout_ms;
   int target_latency_us;
   bool alarms_enabled;
+  int reg_data_cache_size;
+  int reg_data_cache_max_age_ms;
+  int negative_cache_size;
+  int negative_cache_ttl_ms;
+  int write_batch_window_us;
+  int write_batch_max_size;
+  bool irs_table;
+  int xml_compression_threshold;
 };
 
 // Enum for option types not assigned short-forms
@@ -99,7 +129,34 @@ enum OptionTypes
   SAS_CONFIG,
   DIAMETER_TIMEOUT_MS,
   ALARMS_ENABLED,
-  DNS_SERVER
+  DNS_SERVER,
+  REG_DATA_CACHE_SIZE,
+  REG_DATA_CACHE_MAX_AGE_MS,
+  NEGATIVE_CACHE_SIZE,
+  NEGATIVE_CACHE_TTL_MS,
+  WRITE_BATCH_WINDOW_US,
+  WRITE_BATCH_MAX_SIZE,
+  IRS_TABLE,
+  XML_COMPRESSION_THRESHOLD,
+  CACHE_THREADS_MAX,
+  CACHE_SHARDS,
+  CACHE_CONSISTENCY,
+  CACHE_HEDGE_PERCENTILE,
+  CACHE_HEDGE_BUDGET,
+  DELETION_MARKER_TTL,
+  WRITE_BEHIND_THREADS,
+  WRITE_BEHIND_QUEUE_SIZE,
+  CACHE_DEADLINE_MS,
+  LOCAL_STORE_DIR,
+  LOCAL_STORE_SNAPSHOT_INTERVAL_MS,
+  LOCAL_STORE_SYNC,
+  WARM_UP_FILE,
+  HOT_KEYS_FILE,
+  BULK_PROVISION_FILE,
+  EXPORT_FILE,
+  EXPORT_RATE,
+  REREGISTRATION_LEAD_TIME,
+  CASSANDRA_PROTOCOL
 };
 
 const static struct option long_opt[] =
@@ -113,6 +170,7 @@ const static struct option long_opt[] =
   {"http-threads",            required_argument, NULL, 't'},
   {"cache-threads",           required_argument, NULL, 'u'},
   {"cassandra",               required_argument, NULL, 'S'},
+  {"cassandra-protocol",      required_argument, NULL, CASSANDRA_PROTOCOL},
   {"dest-realm",              required_argument, NULL, 'D'},
   {"dest-host",               required_argument, NULL, 'd'},
   {"max-peers",               required_argument, NULL, 'p'},
@@ -127,6 +185,32 @@ const static struct option long_opt[] =
   {"sas",                     required_argument, NULL, SAS_CONFIG},
   {"diameter-timeout-ms",     required_argument, NULL, DIAMETER_TIMEOUT_MS},
   {"alarms-enabled",          no_argument,       NULL, ALARMS_ENABLED},
+  {"reg-data-cache-size",     required_argument, NULL, REG_DATA_CACHE_SIZE},
+  {"reg-data-cache-max-age-ms", required_argument, NULL, REG_DATA_CACHE_MAX_AGE_MS},
+  {"negative-cache-size",     required_argument, NULL, NEGATIVE_CACHE_SIZE},
+  {"negative-cache-ttl-ms",   required_argument, NULL, NEGATIVE_CACHE_TTL_MS},
+  {"write-batch-window-us",   required_argument, NULL, WRITE_BATCH_WINDOW_US},
+  {"write-batch-max-size",    required_argument, NULL, WRITE_BATCH_MAX_SIZE},
+  {"irs-table",               no_argument,       NULL, IRS_TABLE},
+  {"xml-compression-threshold", required_argument, NULL, XML_COMPRESSION_THRESHOLD},
+  {"cache-threads-max",       required_argument, NULL, CACHE_THREADS_MAX},
+  {"cache-shards",            required_argument, NULL, CACHE_SHARDS},
+  {"cache-consistency",       required_argument, NULL, CACHE_CONSISTENCY},
+  {"cache-hedge-percentile",  required_argument, NULL, CACHE_HEDGE_PERCENTILE},
+  {"cache-hedge-budget",      required_argument, NULL, CACHE_HEDGE_BUDGET},
+  {"deletion-marker-ttl",     required_argument, NULL, DELETION_MARKER_TTL},
+  {"write-behind-threads",    required_argument, NULL, WRITE_BEHIND_THREADS},
+  {"write-behind-queue-size", required_argument, NULL, WRITE_BEHIND_QUEUE_SIZE},
+  {"cache-deadline-ms",       required_argument, NULL, CACHE_DEADLINE_MS},
+  {"local-store-dir",         required_argument, NULL, LOCAL_STORE_DIR},
+  {"local-store-snapshot-interval-ms", required_argument, NULL, LOCAL_STORE_SNAPSHOT_INTERVAL_MS},
+  {"local-store-sync",        required_argument, NULL, LOCAL_STORE_SYNC},
+  {"warm-up-file",            required_argument, NULL, WARM_UP_FILE},
+  {"hot-keys-file",           required_argument, NULL, HOT_KEYS_FILE},
+  {"bulk-provision",          required_argument, NULL, BULK_PROVISION_FILE},
+  {"export",                  required_argument, NULL, EXPORT_FILE},
+  {"export-rate",             required_argument, NULL, EXPORT_RATE},
+  {"reregistration-lead-time", required_argument, NULL, REREGISTRATION_LEAD_TIME},
   {"log-file",                required_argument, NULL, 'F'},
   {"log-level",               required_argument, NULL, 'L'},
   {"help",                    no_argument,       NULL, 'h'},
@@ -147,7 +231,77 @@ void usage(void)
        " -H, --http <address>       Set HTTP bind address (default: 0.0.0.0)\n"
        " -t, --http-threads N       Number of HTTP threads (default: 1)\n"
        " -u, --cache-threads N      Number of cache threads (default: 10)\n"
-       " -S, --cassandra <address>  Set the IP address or FQDN of the Cassandra database (default: localhost)"
+       "     --cache-threads-max N  Maximum number of cache threads.  If set, cache requests\n"
+       "                            are run in priority order, and the number of cache threads\n"
+       "                            grows and shrinks between --cache-threads and this with the\n"
+       "                            load (default: 0 - fixed number of threads, first come first\n"
+       "                            served)\n"
+       "     --cache-shards N       Run cache requests on N threads, each with its own queue,\n"
+       "                            choosing the thread by subscriber so that requests for one\n"
+       "                            subscriber run one at a time and in order.  Requests that\n"
+       "                            don't need to wait for others still run on the threads set\n"
+       "                            by --cache-threads and --cache-threads-max (default: 0 - off)\n"
+       "     --cache-consistency <operation>=<level>[/<not found level>]\n"
+       "                            Cassandra consistency level for one type of cache operation,\n"
+       "                            such as GetRegData=LOCAL_ONE/LOCAL_QUORUM.  Reads of rows\n"
+       "                            that aren't found are retried at the not found level, if\n"
+       "                            given.  May be repeated (default: all operations write at\n"
+       "                            ONE, and read at ONE retrying at QUORUM)\n"
+       "     --cache-hedge-percentile N\n"
+       "                            Send a second copy of a cache read that has taken longer\n"
+       "                            than the Nth percentile of recent reads, and use whichever\n"
+       "                            answers first (default: 0 - off)\n"
+       "     --cache-hedge-budget N Maximum number of hedged reads, as a percentage of all\n"
+       "                            cache reads (default: 5)\n"
+       "     --deletion-marker-ttl N\n"
+       "                            On deregistration, overwrite IMPU, IMPI mapping and IRS\n"
+       "                            columns with markers that expire after N seconds, rather\n"
+       "                            than deleting them (default: 0 - delete them)\n"
+       "     --write-behind-threads N\n"
+       "                            Number of threads writing cache updates that nothing waits\n"
+       "                            for, such as mapping and registration data updates\n"
+       "                            (default: 0 - run these writes on the cache threads)\n"
+       "     --write-behind-queue-size N\n"
+       "                            Maximum number of writes waiting for a write-behind thread.\n"
+       "                            Further writes run on the cache threads (default: 1000)\n"
+       "     --cache-deadline-ms N  Longest a cache request made for an HTTP request can be\n"
+       "                            queued for before it is failed without being run.  A\n"
+       "                            shorter X-Deadline header on the HTTP request overrides\n"
+       "                            this (default: 0 - only X-Deadline headers apply)\n"
+       "     --local-store-dir <directory>\n"
+       "                            Keep the cache's tables in an embedded store in this\n"
+       "                            directory rather than in Cassandra.  Intended for small\n"
+       "                            deployments without an HSS (default: use Cassandra)\n"
+       "     --local-store-snapshot-interval-ms N\n"
+       "                            How often the embedded store writes a snapshot of its\n"
+       "                            contents (default: 300000)\n"
+       "     --local-store-sync <always|never>\n"
+       "                            Whether the embedded store flushes each write to disk\n"
+       "                            before acknowledging it.  With never, writes survive\n"
+       "                            homestead crashing but not a power cut (default: always)\n"
+       "     --warm-up-file <file>  File listing public IDs (one per line) whose registration\n"
+       "                            data is read into the cache before requests are accepted\n"
+       "     --hot-keys-file <file> File that the public IDs in the registration data cache\n"
+       "                            are saved to on shutdown.  If there is no --warm-up-file,\n"
+       "                            these are read into the cache on start up\n"
+       "     --bulk-provision <file>\n"
+       "                            Write the subscribers in the file (one JSON object per line)\n"
+       "                            to the cache and then exit, rather than running as a server\n"
+       "     --export <file>        Write every row of the impu and impi tables to the file and\n"
+       "                            then exit, rather than running as a server.  With\n"
+       "                            --local-store-dir, a copy of the store is read, so this can\n"
+       "                            be run alongside the server using the store\n"
+       "     --export-rate N        Maximum number of rows per second to read when exporting\n"
+       "                            (default: 1000, 0 - unlimited)\n"
+       " -S, --cassandra <address>[,<address>...]\n"
+       "                            Set the IP addresses or FQDNs of the Cassandra nodes.  If\n"
+       "                            several are given, each request goes to the node with the\n"
+       "                            lowest recent latency (default: localhost)\n"
+       "     --cassandra-protocol <thrift|native>\n"
+       "                            Protocol used to talk to Cassandra.  Over the native\n"
+       "                            protocol, all the cache threads share one connection to each\n"
+       "                            node, and the rows of a multi-row read are read in parallel\n"
+       "                            (default: thrift)\n"
        " -D, --dest-realm <name>    Set Destination-Realm on Cx messages\n"
        " -d, --dest-host <name>     Set Destination-Host on Cx messages\n"
        " -p, --max-peers N          Number of peers to connect to (default: 2)\n"
@@ -156,6 +310,10 @@ void usage(void)
        "                            IMPU cache time-to-live in seconds (default: 0)\n"
        " -I, --hss-reregistration-time <secs>\n"
        "                            How often a RE_REGISTRATION SAR should be sent to the HSS in seconds (default: 1800)\n"
+       "     --reregistration-lead-time <secs>\n"
+       "                            How long before a REGISTER would have to re-register with\n"
+       "                            the HSS to do it in the background (default: 60, 0 - only\n"
+       "                            re-register when a REGISTER needs it)\n"
        " -j, --http-sprout-name <name>\n"
        "                            Set HTTP address to send deregistration information from RTRs\n"
        "     --scheme-unknown <string>\n"
@@ -172,6 +330,29 @@ void usage(void)
        "                            specified SAS is disabled\n"
        "     --diameter-timeout-ms  Length of time (in ms) before timing out a Diameter request to the HSS\n"
        "     --alarms-enabled       Whether SNMP alarms are enabled (default: false)\n"
+       "     --reg-data-cache-size N\n"
+       "                            Number of public IDs whose registration data is cached in\n"
+       "                            memory in front of Cassandra (default: 0 - disabled)\n"
+       "     --reg-data-cache-max-age-ms <msecs>\n"
+       "                            Maximum time registration data is served from memory before\n"
+       "                            being re-read from Cassandra (default: 5000)\n"
+       "     --negative-cache-size N\n"
+       "                            Number of unknown public and private IDs to remember, so\n"
+       "                            that repeated lookups don't go to Cassandra (default: 10000)\n"
+       "     --negative-cache-ttl-ms <msecs>\n"
+       "                            How long to remember that a public or private ID is unknown\n"
+       "                            (default: 0 - disabled)\n"
+       "     --write-batch-window-us <usecs>\n"
+       "                            How long to hold cache writes so that they can be sent to\n"
+       "                            Cassandra together (default: 0 - disabled)\n"
+       "     --write-batch-max-size N\n"
+       "                            Number of columns at which a batch of cache writes is sent\n"
+       "                            without waiting for the window to end (default: 100)\n"
+       "     --irs-table            Store each IMS subscription once per implicit registration\n"
+       "                            set rather than once per public ID (default: false)\n"
+       "     --xml-compression-threshold N\n"
+       "                            Size in bytes above which IMS subscriptions are compressed\n"
+       "                            before being written to Cassandra (default: 0 - disabled)\n"
        " -F, --log-file <directory>\n"
        "                            Log to file in specified directory\n"
        " -L, --log-level N          Set log level to N (default: 4)\n"
@@ -207,6 +388,76 @@ int init_logging_options(int argc, char**argv, struct options& options)
   return 0;
 }
 
+// Parse the name of a Cassandra consistency level.
+//
+// @returns - false if the name is not recognised.
+static bool parse_consistency_level(const std::string& name,
+                                    org::apache::cassandra::ConsistencyLevel::type& level)
+{
+  const static struct
+  {
+    const char* name;
+    org::apache::cassandra::ConsistencyLevel::type level;
+  } LEVELS[] =
+  {
+    {"ANY", org::apache::cassandra::ConsistencyLevel::ANY},
+    {"ONE", org::apache::cassandra::ConsistencyLevel::ONE},
+    {"TWO", org::apache::cassandra::ConsistencyLevel::TWO},
+    {"THREE", org::apache::cassandra::ConsistencyLevel::THREE},
+    {"QUORUM", org::apache::cassandra::ConsistencyLevel::QUORUM},
+    {"ALL", org::apache::cassandra::ConsistencyLevel::ALL},
+    {"LOCAL_ONE", org::apache::cassandra::ConsistencyLevel::LOCAL_ONE},
+    {"LOCAL_QUORUM", org::apache::cassandra::ConsistencyLevel::LOCAL_QUORUM},
+    {"EACH_QUORUM", org::apache::cassandra::ConsistencyLevel::EACH_QUORUM},
+  };
+
+  for (size_t ii = 0; ii < sizeof(LEVELS) / sizeof(LEVELS[0]); ii++)
+  {
+    if (name == LEVELS[ii].name)
+    {
+      level = LEVELS[ii].level;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Parse a --cache-consistency option of the form
+// <operation>=<level>[/<not found level>].
+//
+// @returns - false if the option is malformed.
+static bool parse_cache_consistency(const std::string& spec,
+                                    std::string& operation,
+                                    Cache::Consistency& consistency)
+{
+  std::vector<std::string> parts;
+  Utils::split_string(spec, '=', parts, 0, true);
+
+  if (parts.size() != 2)
+  {
+    return false;
+  }
+
+  operation = parts[0];
+
+  std::vector<std::string> levels;
+  Utils::split_string(parts[1], '/', levels, 0, true);
+
+  if ((levels.size() < 1) ||
+      (levels.size() > 2) ||
+      (!parse_consistency_level(levels[0], consistency.level)))
+  {
+    return false;
+  }
+
+  // Reads aren't retried unless a level to retry them at is given.
+  consistency.not_found_level = consistency.level;
+
+  return ((levels.size() == 1) ||
+          (parse_consistency_level(levels[1], consistency.not_found_level)));
+}
+
 int init_options(int argc, char**argv, struct options& options)
 {
   int opt;
@@ -261,6 +512,20 @@ int init_options(int argc, char**argv, struct options& options)
       options.cassandra = std::string(optarg);
       break;
 
+    case CASSANDRA_PROTOCOL:
+      if (std::string(optarg) == "native")
+      {
+        options.cassandra_native = true;
+      }
+      else if (std::string(optarg) != "thrift")
+      {
+        fprintf(stdout, "Invalid --cassandra-protocol option %s\n", optarg);
+        return -1;
+      }
+
+      LOG_INFO("Cassandra protocol: %s", optarg);
+      break;
+
     case 'D':
       LOG_INFO("Destination realm: %s", optarg);
       options.dest_realm = std::string(optarg);
@@ -350,6 +615,156 @@ int init_options(int argc, char**argv, struct options& options)
       options.dns_server = std::string(optarg);
       break;
 
+    case REG_DATA_CACHE_SIZE:
+      LOG_INFO("Registration data cache size: %s", optarg);
+      options.reg_data_cache_size = atoi(optarg);
+      break;
+
+    case REG_DATA_CACHE_MAX_AGE_MS:
+      LOG_INFO("Registration data cache maximum age: %s", optarg);
+      options.reg_data_cache_max_age_ms = atoi(optarg);
+      break;
+
+    case NEGATIVE_CACHE_SIZE:
+      LOG_INFO("Negative cache size: %s", optarg);
+      options.negative_cache_size = atoi(optarg);
+      break;
+
+    case NEGATIVE_CACHE_TTL_MS:
+      LOG_INFO("Negative cache TTL: %s", optarg);
+      options.negative_cache_ttl_ms = atoi(optarg);
+      break;
+
+    case WRITE_BATCH_WINDOW_US:
+      LOG_INFO("Write batch window: %s", optarg);
+      options.write_batch_window_us = atoi(optarg);
+      break;
+
+    case WRITE_BATCH_MAX_SIZE:
+      LOG_INFO("Write batch maximum size: %s", optarg);
+      options.write_batch_max_size = atoi(optarg);
+      break;
+
+    case IRS_TABLE:
+      LOG_INFO("Storing IMS subscriptions per implicit registration set");
+      options.irs_table = true;
+      break;
+
+    case XML_COMPRESSION_THRESHOLD:
+      LOG_INFO("XML compression threshold: %s", optarg);
+      options.xml_compression_threshold = atoi(optarg);
+      break;
+
+    case CACHE_THREADS_MAX:
+      LOG_INFO("Maximum cache threads: %s", optarg);
+      options.cache_threads_max = atoi(optarg);
+      break;
+
+    case CACHE_SHARDS:
+      LOG_INFO("Cache shards: %s", optarg);
+      options.cache_shards = atoi(optarg);
+      break;
+
+    case CACHE_CONSISTENCY:
+      {
+        std::string operation;
+        Cache::Consistency consistency;
+
+        if (!parse_cache_consistency(std::string(optarg), operation, consistency))
+        {
+          fprintf(stdout, "Invalid --cache-consistency option %s\n", optarg);
+          return -1;
+        }
+
+        LOG_INFO("Cache consistency: %s", optarg);
+        options.cache_consistency[operation] = consistency;
+      }
+      break;
+
+    case CACHE_HEDGE_PERCENTILE:
+      LOG_INFO("Cache hedge percentile: %s", optarg);
+      options.cache_hedge_percentile = atoi(optarg);
+      break;
+
+    case CACHE_HEDGE_BUDGET:
+      LOG_INFO("Cache hedge budget: %s%%", optarg);
+      options.cache_hedge_budget = atoi(optarg);
+      break;
+
+    case DELETION_MARKER_TTL:
+      LOG_INFO("Deletion marker TTL: %ss", optarg);
+      options.deletion_marker_ttl = atoi(optarg);
+      break;
+
+    case WRITE_BEHIND_THREADS:
+      LOG_INFO("Write-behind threads: %s", optarg);
+      options.write_behind_threads = atoi(optarg);
+      break;
+
+    case WRITE_BEHIND_QUEUE_SIZE:
+      LOG_INFO("Write-behind queue size: %s", optarg);
+      options.write_behind_queue_size = atoi(optarg);
+      break;
+
+    case CACHE_DEADLINE_MS:
+      LOG_INFO("Cache deadline: %sms", optarg);
+      options.cache_deadline_ms = atoi(optarg);
+      break;
+
+    case LOCAL_STORE_DIR:
+      LOG_INFO("Local store directory: %s", optarg);
+      options.local_store_dir = std::string(optarg);
+      break;
+
+    case LOCAL_STORE_SNAPSHOT_INTERVAL_MS:
+      LOG_INFO("Local store snapshot interval: %sms", optarg);
+      options.local_store_snapshot_interval_ms = atoi(optarg);
+      break;
+
+    case LOCAL_STORE_SYNC:
+      if (std::string(optarg) == "never")
+      {
+        options.local_store_sync = false;
+      }
+      else if (std::string(optarg) != "always")
+      {
+        fprintf(stdout, "Invalid --local-store-sync option %s\n", optarg);
+        return -1;
+      }
+
+      LOG_INFO("Local store sync: %s", optarg);
+      break;
+
+    case WARM_UP_FILE:
+      LOG_INFO("Warm-up file: %s", optarg);
+      options.warm_up_file = std::string(optarg);
+      break;
+
+    case HOT_KEYS_FILE:
+      LOG_INFO("Hot keys file: %s", optarg);
+      options.hot_keys_file = std::string(optarg);
+      break;
+
+    case BULK_PROVISION_FILE:
+      LOG_INFO("Bulk provisioning file: %s", optarg);
+      options.bulk_provision_file = std::string(optarg);
+      break;
+
+    case EXPORT_FILE:
+      LOG_INFO("Export file: %s", optarg);
+      options.export_file = std::string(optarg);
+      break;
+
+    case REREGISTRATION_LEAD_TIME:
+      LOG_INFO("Re-registration lead time: %ss", optarg);
+      options.reregistration_lead_time = atoi(optarg);
+      break;
+
+    case EXPORT_RATE:
+      LOG_INFO("Export rate: %s rows per second", optarg);
+      options.export_rate = atoi(optarg);
+      break;
+
     case 'F':
     case 'L':
       // Ignore F and L - these are handled by init_logging_options
@@ -368,6 +783,51 @@ int init_options(int argc, char**argv, struct options& options)
   return 0;
 }
 
+// Read a list of public IDs, one per line, from a file.
+//
+// @returns - false if the file could not be read.
+static bool read_public_ids(const std::string& path,
+                            std::vector<std::string>& public_ids)
+{
+  std::ifstream file(path.c_str());
+
+  if (!file.is_open())
+  {
+    return false;
+  }
+
+  std::string line;
+
+  while (std::getline(file, line))
+  {
+    if (!line.empty())
+    {
+      public_ids.push_back(line);
+    }
+  }
+
+  return true;
+}
+
+// Write a list of public IDs, one per line, to a file.
+//
+// @returns - false if the file could not be written.
+static bool write_public_ids(const std::string& path,
+                             const std::vector<std::string>& public_ids)
+{
+  std::ofstream file(path.c_str(), std::ios::trunc);
+
+  for (std::vector<std::string>::const_iterator public_id = public_ids.begin();
+       public_id != public_ids.end();
+       ++public_id)
+  {
+    file << *public_id << std::endl;
+  }
+
+  file.close();
+  return !file.fail();
+}
+
 static sem_t term_sem;
 
 // Signal handler that triggers homestead termination.
@@ -415,7 +875,25 @@ int main(int argc, char**argv)
   options.http_port = 8888;
   options.http_threads = 1;
   options.cache_threads = 10;
+  options.cache_threads_max = 0;
+  options.cache_shards = 0;
+  options.cache_hedge_percentile = 0;
+  options.cache_hedge_budget = 5;
+  options.deletion_marker_ttl = 0;
+  options.write_behind_threads = 0;
+  options.write_behind_queue_size = 1000;
+  options.cache_deadline_ms = 0;
+  options.local_store_dir = "";
+  options.local_store_snapshot_interval_ms = 300000;
+  options.local_store_sync = true;
+  options.warm_up_file = "";
+  options.hot_keys_file = "";
+  options.bulk_provision_file = "";
+  options.export_file = "";
+  options.export_rate = 1000;
+  options.reregistration_lead_time = 60;
   options.cassandra = "localhost";
+  options.cassandra_native = false;
   options.dest_realm = "";
   options.dest_host = "dest-host.unknown";
   options.max_peers = 2;
@@ -434,6 +912,14 @@ int main(int argc, char**argv)
   options.diameter_timeout_ms = 200;
   options.target_latency_us = 100000;
   options.alarms_enabled = false;
+  options.reg_data_cache_size = 0;
+  options.reg_data_cache_max_age_ms = 5000;
+  options.negative_cache_size = 10000;
+  options.negative_cache_ttl_ms = 0;
+  options.write_batch_window_us = 0;
+  options.write_batch_max_size = 100;
+  options.irs_table = false;
+  options.xml_compression_threshold = 0;
 
   if (init_logging_options(argc, argv, options) != 0)
   {
@@ -517,9 +1003,92 @@ int main(int argc, char**argv)
   DnsCachedResolver* dns_resolver = new DnsCachedResolver(options.dns_server);
   HttpResolver* http_resolver = new HttpResolver(dns_resolver, af);
 
+  // Load the embedded store, if the cache is to use one in place of
+  // Cassandra.
+  LocalStore* local_store = NULL;
+
+  if (!options.local_store_dir.empty())
+  {
+    // An export only reads the store, which may be in use by a server, so
+    // it loads a read-only copy rather than taking the store over.
+    bool read_only = ((!options.export_file.empty()) &&
+                      (options.bulk_provision_file.empty()));
+    local_store = new LocalStore(options.local_store_dir,
+                                 options.local_store_snapshot_interval_ms,
+                                 read_only,
+                                 options.local_store_sync);
+
+    if (!local_store->start())
+    {
+      LOG_ERROR("Failed to load local store from %s",
+                options.local_store_dir.c_str());
+      exit(2);
+    }
+  }
+
   Cache* cache = Cache::get_instance();
   cache->initialize();
-  cache->configure(options.cassandra, 9160, options.cache_threads, 0, cassandra_comm_monitor);
+  // If the cache has its own worker pool, the store's thread pool is never
+  // used, so only give it a single thread.  Sharded workers don't replace
+  // it, as requests that mustn't wait behind others for their subscriber
+  // still run on it.
+  bool cache_worker_pool = ((options.cache_threads_max > 0) &&
+                            (options.cache_threads_max >= options.cache_threads));
+  std::vector<std::string> cassandra_nodes;
+  Utils::split_string(options.cassandra, ',', cassandra_nodes, 0, true);
+  if (cassandra_nodes.empty())
+  {
+    LOG_ERROR("No Cassandra nodes in --cassandra option");
+    exit(2);
+  }
+  cache->configure(cassandra_nodes,
+                   9160,
+                   cache_worker_pool ? 1 : options.cache_threads,
+                   0,
+                   cassandra_comm_monitor);
+  if (options.cassandra_native)
+  {
+    cache->configure_native_protocol(9042);
+  }
+  cache->configure_reg_data_cache(options.reg_data_cache_size,
+                                  options.reg_data_cache_max_age_ms);
+  cache->configure_negative_cache(options.negative_cache_size,
+                                  options.negative_cache_ttl_ms);
+  // Bulk provisioning writes far more than it reads, so always batch its
+  // writes.
+  int write_batch_window_us = options.write_batch_window_us;
+
+  if ((!options.bulk_provision_file.empty()) && (write_batch_window_us <= 0))
+  {
+    write_batch_window_us = 1000;
+  }
+
+  cache->configure_write_batching(write_batch_window_us,
+                                  options.write_batch_max_size);
+  cache->configure_irs_table(options.irs_table);
+  cache->configure_xml_compression(options.xml_compression_threshold);
+  cache->configure_worker_pool(options.cache_threads, options.cache_threads_max);
+  cache->configure_key_affinity(options.cache_shards);
+
+  for (std::map<std::string, Cache::Consistency>::const_iterator consistency =
+         options.cache_consistency.begin();
+       consistency != options.cache_consistency.end();
+       ++consistency)
+  {
+    if (!cache->configure_consistency(consistency->first, consistency->second))
+    {
+      LOG_ERROR("Unknown cache operation %s in --cache-consistency option",
+                consistency->first.c_str());
+      exit(2);
+    }
+  }
+  cache->configure_hedging(options.cache_hedge_percentile,
+                           options.cache_hedge_budget);
+  cache->configure_deletion_markers(options.deletion_marker_ttl);
+  cache->configure_write_behind(options.write_behind_threads,
+                                options.write_behind_queue_size);
+  cache->configure_local_store(local_store);
+  cache->configure_stats(stats_manager);
 
   // Test the connection to Cassandra before starting the store.
   CassandraStore::ResultCode rc = cache->connection_test();
@@ -536,6 +1105,75 @@ int main(int argc, char**argv)
     exit(2);
   }
 
+  if (!options.bulk_provision_file.empty())
+  {
+    std::ifstream input(options.bulk_provision_file.c_str());
+
+    if (!input.is_open())
+    {
+      LOG_ERROR("Failed to open bulk provisioning file %s",
+                options.bulk_provision_file.c_str());
+      exit(2);
+    }
+
+    BulkProvisioner provisioner(cache, options.cache_threads);
+    BulkProvisioner::Stats stats;
+    bool success = provisioner.provision(input, stats);
+
+    cache->stop();
+    cache->wait_stopped();
+    delete local_store; local_store = NULL;
+
+    exit(success ? 0 : 1);
+  }
+
+  if (!options.export_file.empty())
+  {
+    std::ofstream output(options.export_file.c_str());
+
+    if (!output.is_open())
+    {
+      LOG_ERROR("Failed to open export file %s", options.export_file.c_str());
+      exit(2);
+    }
+
+    Exporter exporter(cache,
+                      options.cache_threads,
+                      100,
+                      (options.export_rate > 0) ? options.export_rate : 0);
+    size_t impu_rows = 0;
+    size_t impi_rows = 0;
+    bool success = (exporter.export_table("impu", output, impu_rows) &&
+                    exporter.export_table("impi", output, impi_rows));
+
+    cache->stop();
+    cache->wait_stopped();
+    delete local_store; local_store = NULL;
+
+    exit(success ? 0 : 1);
+  }
+
+  // Read the subscribers that are likely to be busy into the cache before
+  // accepting any requests, so that they don't all start with a read from
+  // Cassandra.
+  std::string warm_up_file = !options.warm_up_file.empty() ?
+                               options.warm_up_file : options.hot_keys_file;
+
+  if (!warm_up_file.empty())
+  {
+    std::vector<std::string> public_ids;
+
+    if (read_public_ids(warm_up_file, public_ids))
+    {
+      cache->warm_up(public_ids, 100, options.cache_threads);
+    }
+    else
+    {
+      LOG_WARNING("Failed to read public IDs to warm up the cache from %s",
+                  warm_up_file.c_str());
+    }
+  }
+
   HttpConnection* http = new HttpConnection(options.sprout_http_name,
                                             false,
                                             http_resolver,
@@ -581,7 +1219,7 @@ int main(int argc, char**argv)
                                    options.dest_host == "0.0.0.0" ? "" : options.dest_host,
                                    options.server_name,
                                    dict);
-  HssCacheTask::configure_cache(cache);
+  HssCacheTask::configure_cache(cache, options.cache_deadline_ms);
   HssCacheTask::configure_stats(stats_manager);
 
   // We should only query the cache for AV information if there is no HSS.  If there is an HSS, we
@@ -600,6 +1238,23 @@ int main(int argc, char**argv)
   ImpuRegDataTask::Config impu_handler_config(hss_configured, options.hss_reregistration_time, options.diameter_timeout_ms);
   ImpuIMSSubscriptionTask::Config impu_handler_config_old(hss_configured, options.hss_reregistration_time, options.diameter_timeout_ms);
 
+  // Re-register subscribers with the HSS in the background, so that
+  // REGISTERs can be answered from the cache.
+  ImpuRegDataTask::BackgroundReregisterer* reregisterer = NULL;
+  ReregistrationScheduler* reregistration_scheduler = NULL;
+
+  if ((hss_configured) && (options.reregistration_lead_time > 0))
+  {
+    reregisterer = new ImpuRegDataTask::BackgroundReregisterer(&impu_handler_config);
+    reregistration_scheduler =
+      new ReregistrationScheduler(reregisterer,
+                                  options.hss_reregistration_time,
+                                  options.reregistration_lead_time);
+    impu_handler_config.reregistration_scheduler = reregistration_scheduler;
+    impu_handler_config_old.reregistration_scheduler = reregistration_scheduler;
+    reregistration_scheduler->start();
+  }
+
   HttpStackUtils::PingHandler ping_handler;
   HttpStackUtils::SpawningHandler<ImpiDigestTask, ImpiTask::Config> impi_digest_handler(&impi_handler_config);
   HttpStackUtils::SpawningHandler<ImpiAvTask, ImpiTask::Config> impi_av_handler(&impi_handler_config);
@@ -672,9 +1327,35 @@ int main(int argc, char**argv)
     LOG_ERROR("Failed to stop HttpStack stack - function %s, rc %d", e._func, e._rc);
   }
 
+  if (reregistration_scheduler != NULL)
+  {
+    reregistration_scheduler->stop();
+  }
+
+  // Save the subscribers in the cache, to warm it up with when restarting.
+  if (!options.hot_keys_file.empty())
+  {
+    std::vector<std::string> public_ids;
+    cache->get_hot_public_ids(public_ids);
+
+    if (write_public_ids(options.hot_keys_file, public_ids))
+    {
+      LOG_STATUS("Saved %zu hot public IDs to %s",
+                 public_ids.size(), options.hot_keys_file.c_str());
+    }
+    else
+    {
+      LOG_ERROR("Failed to save hot public IDs to %s",
+                options.hot_keys_file.c_str());
+    }
+  }
+
   cache->stop();
   cache->wait_stopped();
 
+  // Stopping the local store writes out a final snapshot.
+  delete local_store; local_store = NULL;
+
   try
   {
     diameter_stack->stop();
@@ -684,6 +1365,9 @@ int main(int argc, char**argv)
   {
     LOG_ERROR("Failed to stop Diameter stack - function %s, rc %d", e._func, e._rc);
   }
+  // Any background re-registrations have now finished.
+  delete reregistration_scheduler; reregistration_scheduler = NULL;
+  delete reregisterer; reregisterer = NULL;
   delete dict; dict = NULL;
   delete ppr_config; ppr_config = NULL;
   delete rtr_config; rtr_config = NULL;
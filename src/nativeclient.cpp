@@ -0,0 +1,1514 @@
+/**
+ * @file nativeclient.cpp Client for Cassandra's native binary protocol.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+#include "nativeclient.h"
+#include "log.h"
+
+using namespace org::apache::cassandra;
+
+// Frame header fields.
+static const uint8_t REQUEST_VERSION = 0x03;
+static const uint8_t RESPONSE_VERSION = 0x83;
+static const size_t HEADER_SIZE = 9;
+static const uint32_t MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+// Opcodes.
+static const uint8_t OP_ERROR = 0x00;
+static const uint8_t OP_STARTUP = 0x01;
+static const uint8_t OP_READY = 0x02;
+static const uint8_t OP_QUERY = 0x07;
+static const uint8_t OP_PREPARE = 0x09;
+static const uint8_t OP_EXECUTE = 0x0A;
+static const uint8_t OP_BATCH = 0x0D;
+
+// Kinds of result.
+static const int32_t RESULT_ROWS = 0x0002;
+static const int32_t RESULT_PREPARED = 0x0004;
+
+// Flags on a rows result.
+static const int32_t ROWS_GLOBAL_TABLES_SPEC = 0x0001;
+static const int32_t ROWS_HAS_MORE_PAGES = 0x0002;
+static const int32_t ROWS_NO_METADATA = 0x0004;
+
+// Flags on a query or execute request.
+static const uint8_t QUERY_VALUES = 0x01;
+static const uint8_t QUERY_SKIP_METADATA = 0x02;
+static const uint8_t QUERY_PAGE_SIZE = 0x04;
+static const uint8_t QUERY_PAGING_STATE = 0x08;
+
+// Batch types, and kinds of statement in a batch.
+static const uint8_t BATCH_UNLOGGED = 0x01;
+static const uint8_t BATCH_PREPARED = 0x01;
+
+// Error codes.
+static const int32_t ERROR_SERVER = 0x0000;
+static const int32_t ERROR_UNAVAILABLE = 0x1000;
+static const int32_t ERROR_OVERLOADED = 0x1001;
+static const int32_t ERROR_BOOTSTRAPPING = 0x1002;
+static const int32_t ERROR_WRITE_TIMEOUT = 0x1100;
+static const int32_t ERROR_READ_TIMEOUT = 0x1200;
+static const int32_t ERROR_UNPREPARED = 0x2500;
+
+//
+// Encoding and decoding of the protocol's types.
+//
+
+static void put_byte(std::string& out, uint8_t value)
+{
+  out.push_back((char)value);
+}
+
+static void put_short(std::string& out, uint16_t value)
+{
+  out.push_back((char)(value >> 8));
+  out.push_back((char)(value & 0xFF));
+}
+
+static void put_int(std::string& out, int32_t value)
+{
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    out.push_back((char)(((uint32_t)value >> shift) & 0xFF));
+  }
+}
+
+// A [string] or [short bytes].
+static void put_string(std::string& out, const std::string& value)
+{
+  put_short(out, value.size());
+  out.append(value);
+}
+
+// A [long string] or [bytes].
+static void put_long_string(std::string& out, const std::string& value)
+{
+  put_int(out, value.size());
+  out.append(value);
+}
+
+static void throw_malformed()
+{
+  InvalidRequestException ire;
+  ire.why = "Malformed response from Cassandra";
+  throw ire;
+}
+
+// Reads the protocol's types from the body of a response.  Throws
+// InvalidRequestException if the body is too short.
+class Decoder
+{
+public:
+  Decoder(const std::string& data) : _data(data), _pos(0) {}
+
+  uint8_t get_byte()
+  {
+    check(1);
+    return (uint8_t)_data[_pos++];
+  }
+
+  uint16_t get_short()
+  {
+    uint16_t value = get_byte();
+    return (value << 8) | get_byte();
+  }
+
+  int32_t get_int()
+  {
+    uint32_t value = 0;
+
+    for (int ii = 0; ii < 4; ii++)
+    {
+      value = (value << 8) | get_byte();
+    }
+
+    return (int32_t)value;
+  }
+
+  // A [string] or [short bytes].
+  std::string get_string()
+  {
+    return get_raw(get_short());
+  }
+
+  // A [bytes].
+  //
+  // @returns - false if the value is null.
+  bool get_bytes(std::string& value)
+  {
+    int32_t length = get_int();
+
+    if (length < 0)
+    {
+      value.clear();
+      return false;
+    }
+
+    value = get_raw(length);
+    return true;
+  }
+
+  // Skip over an [option] describing a column's type.
+  void skip_option()
+  {
+    uint16_t id = get_short();
+
+    switch (id)
+    {
+    case 0x0000:
+      // Custom type, named by a Java class.
+      get_string();
+      break;
+
+    case 0x0020:
+    case 0x0022:
+      // List or set.
+      skip_option();
+      break;
+
+    case 0x0021:
+      // Map.
+      skip_option();
+      skip_option();
+      break;
+
+    case 0x0030:
+      {
+        // User defined type.
+        get_string();
+        get_string();
+        uint16_t num_fields = get_short();
+
+        for (uint16_t ii = 0; ii < num_fields; ii++)
+        {
+          get_string();
+          skip_option();
+        }
+      }
+      break;
+
+    case 0x0031:
+      {
+        // Tuple.
+        uint16_t num_types = get_short();
+
+        for (uint16_t ii = 0; ii < num_types; ii++)
+        {
+          skip_option();
+        }
+      }
+      break;
+
+    default:
+      // Native types have no more to them.
+      break;
+    }
+  }
+
+  // @returns - the number of bytes left to read.
+  size_t remaining() const { return _data.size() - _pos; }
+
+private:
+  std::string get_raw(size_t length)
+  {
+    check(length);
+    std::string value = _data.substr(_pos, length);
+    _pos += length;
+    return value;
+  }
+
+  void check(size_t length)
+  {
+    if (remaining() < length)
+    {
+      throw_malformed();
+    }
+  }
+
+  const std::string& _data;
+  size_t _pos;
+};
+
+static uint16_t consistency(ConsistencyLevel::type level)
+{
+  switch (level)
+  {
+  case ConsistencyLevel::ANY:          return 0x0000;
+  case ConsistencyLevel::ONE:          return 0x0001;
+  case ConsistencyLevel::TWO:          return 0x0002;
+  case ConsistencyLevel::THREE:        return 0x0003;
+  case ConsistencyLevel::QUORUM:       return 0x0004;
+  case ConsistencyLevel::ALL:          return 0x0005;
+  case ConsistencyLevel::LOCAL_QUORUM: return 0x0006;
+  case ConsistencyLevel::EACH_QUORUM:  return 0x0007;
+  case ConsistencyLevel::SERIAL:       return 0x0008;
+  case ConsistencyLevel::LOCAL_SERIAL: return 0x0009;
+  case ConsistencyLevel::LOCAL_ONE:    return 0x000A;
+  default:                             return 0x0001;
+  }
+}
+
+static bool write_all(int fd, const std::string& data)
+{
+  size_t written = 0;
+
+  while (written < data.size())
+  {
+    ssize_t rc = ::send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+
+    if (rc > 0)
+    {
+      written += rc;
+    }
+    else if ((rc < 0) && (errno != EINTR))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool read_all(int fd, char* data, size_t length)
+{
+  size_t read = 0;
+
+  while (read < length)
+  {
+    ssize_t rc = ::recv(fd, data + read, length - read, 0);
+
+    if (rc > 0)
+    {
+      read += rc;
+    }
+    else if ((rc == 0) || (errno != EINTR))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//
+// NativeConnection methods.
+//
+
+NativeConnection::Request::Request(uint8_t _opcode, const std::string& _body) :
+  opcode(_opcode),
+  body(_body),
+  done(false),
+  failed(false),
+  response_opcode(0),
+  response()
+{
+  pthread_cond_init(&cond, NULL);
+}
+
+NativeConnection::Request::~Request()
+{
+  pthread_cond_destroy(&cond);
+}
+
+NativeConnection::NativeConnection(const std::string& hostname, uint16_t port) :
+  _hostname(hostname),
+  _port(port),
+  _fd(-1),
+  _receive_thread_running(false),
+  _connected(false),
+  _streams(MAX_STREAM + 1, (Request*)NULL),
+  _free_streams(),
+  _prepared(),
+  _keyspace()
+{
+  pthread_mutex_init(&_write_lock, NULL);
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_stream_cond, NULL);
+
+  // Streams are taken from the back, so hand out the lowest first.
+  for (int stream = MAX_STREAM; stream >= 0; stream--)
+  {
+    _free_streams.push_back(stream);
+  }
+}
+
+NativeConnection::~NativeConnection()
+{
+  if (_fd >= 0)
+  {
+    shutdown(_fd, SHUT_RDWR);
+  }
+
+  if (_receive_thread_running)
+  {
+    pthread_join(_receive_thread, NULL);
+  }
+
+  if (_fd >= 0)
+  {
+    close(_fd);
+  }
+
+  pthread_cond_destroy(&_stream_cond);
+  pthread_mutex_destroy(&_lock);
+  pthread_mutex_destroy(&_write_lock);
+}
+
+void NativeConnection::connect()
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  std::ostringstream port;
+  port << _port;
+
+  struct addrinfo* addrs = NULL;
+  int rc = getaddrinfo(_hostname.c_str(), port.str().c_str(), &hints, &addrs);
+
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to resolve Cassandra node %s: %s",
+              _hostname.c_str(), gai_strerror(rc));
+    throw apache::thrift::transport::TTransportException();
+  }
+
+  for (struct addrinfo* addr = addrs; (addr != NULL) && (_fd < 0); addr = addr->ai_next)
+  {
+    _fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+    if ((_fd >= 0) && (::connect(_fd, addr->ai_addr, addr->ai_addrlen) != 0))
+    {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  freeaddrinfo(addrs);
+
+  if (_fd < 0)
+  {
+    LOG_ERROR("Failed to connect to Cassandra node %s:%d: %s",
+              _hostname.c_str(), _port, strerror(errno));
+    throw apache::thrift::transport::TTransportException();
+  }
+
+  int one = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(_fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+  pthread_mutex_lock(&_lock);
+  _connected = true;
+  pthread_mutex_unlock(&_lock);
+
+  _receive_thread_running =
+    (pthread_create(&_receive_thread, NULL, receive_thread_entry, this) == 0);
+
+  if (!_receive_thread_running)
+  {
+    LOG_ERROR("Failed to start receive thread for Cassandra node %s",
+              _hostname.c_str());
+    fail();
+    throw apache::thrift::transport::TTransportException();
+  }
+
+  std::string body;
+  put_short(body, 1);
+  put_string(body, "CQL_VERSION");
+  put_string(body, "3.0.0");
+
+  std::string response;
+
+  if (run(OP_STARTUP, body, response) != OP_READY)
+  {
+    // The node wants us to authenticate, which isn't supported.
+    LOG_ERROR("Cassandra node %s requires authentication", _hostname.c_str());
+    fail();
+    throw apache::thrift::transport::TTransportException();
+  }
+
+  LOG_DEBUG("Connected to Cassandra node %s:%d over the native protocol",
+            _hostname.c_str(), _port);
+}
+
+bool NativeConnection::is_connected()
+{
+  pthread_mutex_lock(&_lock);
+  bool connected = _connected;
+  pthread_mutex_unlock(&_lock);
+  return connected;
+}
+
+void NativeConnection::use_keyspace(const std::string& keyspace)
+{
+  pthread_mutex_lock(&_lock);
+  bool current = (_keyspace == keyspace);
+  pthread_mutex_unlock(&_lock);
+
+  if (current)
+  {
+    return;
+  }
+
+  std::string body;
+  put_long_string(body, "USE \"" + keyspace + "\"");
+  put_short(body, consistency(ConsistencyLevel::ONE));
+  put_byte(body, 0);
+
+  std::string response;
+  run(OP_QUERY, body, response);
+
+  // Statements are prepared against the keyspace in use at the time.
+  pthread_mutex_lock(&_lock);
+  _keyspace = keyspace;
+  _prepared.clear();
+  pthread_mutex_unlock(&_lock);
+}
+
+void NativeConnection::execute(const std::vector<Statement>& statements,
+                               ConsistencyLevel::type consistency_level,
+                               std::vector<Result>& results)
+{
+  results.clear();
+  results.resize(statements.size());
+
+  std::vector<size_t> to_run;
+
+  for (size_t ii = 0; ii < statements.size(); ii++)
+  {
+    to_run.push_back(ii);
+  }
+
+  // Statements are run again once if the node has forgotten that they were
+  // prepared (because it has restarted, say).
+  for (int attempt = 0; !to_run.empty(); attempt++)
+  {
+    std::vector<std::string> ids;
+
+    for (size_t ii = 0; ii < to_run.size(); ii++)
+    {
+      ids.push_back(prepared_id(statements[to_run[ii]].query));
+    }
+
+    std::vector<Request*> requests;
+
+    for (size_t ii = 0; ii < to_run.size(); ii++)
+    {
+      const Statement& statement = statements[to_run[ii]];
+      uint8_t flags = QUERY_VALUES | QUERY_SKIP_METADATA;
+      flags |= (statement.page_size > 0) ? QUERY_PAGE_SIZE : 0;
+      flags |= (!statement.paging_state.empty()) ? QUERY_PAGING_STATE : 0;
+
+      std::string body;
+      put_string(body, ids[ii]);
+      put_short(body, consistency(consistency_level));
+      put_byte(body, flags);
+      put_short(body, statement.values.size());
+
+      for (std::vector<std::string>::const_iterator value = statement.values.begin();
+           value != statement.values.end();
+           ++value)
+      {
+        put_long_string(body, *value);
+      }
+
+      if (flags & QUERY_PAGE_SIZE)
+      {
+        put_int(body, statement.page_size);
+      }
+
+      if (flags & QUERY_PAGING_STATE)
+      {
+        put_long_string(body, statement.paging_state);
+      }
+
+      requests.push_back(new Request(OP_EXECUTE, body));
+    }
+
+    send(requests);
+    wait(requests);
+
+    // Take the responses before decoding any of them, so the requests are
+    // all deleted even if one can't be decoded.
+    std::vector<size_t> unprepared;
+    std::vector<size_t> succeeded;
+    std::vector<std::string> responses;
+    bool failed = false;
+    std::string error;
+
+    for (size_t ii = 0; ii < requests.size(); ii++)
+    {
+      Request* request = requests[ii];
+
+      if (request->failed)
+      {
+        failed = true;
+      }
+      else if ((attempt == 0) &&
+               (is_unprepared(request->response_opcode, request->response)))
+      {
+        forget_prepared(statements[to_run[ii]].query);
+        unprepared.push_back(to_run[ii]);
+      }
+      else if (request->response_opcode == OP_ERROR)
+      {
+        error = error.empty() ? request->response : error;
+      }
+      else
+      {
+        succeeded.push_back(to_run[ii]);
+        responses.push_back("");
+        responses.back().swap(request->response);
+      }
+
+      delete request;
+    }
+
+    if (failed)
+    {
+      throw apache::thrift::transport::TTransportException();
+    }
+    else if (!error.empty())
+    {
+      throw_error(error);
+    }
+
+    for (size_t ii = 0; ii < succeeded.size(); ii++)
+    {
+      decode_result(responses[ii], results[succeeded[ii]]);
+    }
+
+    to_run.swap(unprepared);
+  }
+}
+
+void NativeConnection::execute(const Statement& statement,
+                               ConsistencyLevel::type consistency_level,
+                               Result& result)
+{
+  std::vector<Statement> statements(1, statement);
+  std::vector<Result> results;
+  execute(statements, consistency_level, results);
+  result = results.front();
+}
+
+void NativeConnection::batch(const std::vector<Statement>& statements,
+                             ConsistencyLevel::type consistency_level)
+{
+  for (int attempt = 0; ; attempt++)
+  {
+    std::string body;
+    put_byte(body, BATCH_UNLOGGED);
+    put_short(body, statements.size());
+
+    for (std::vector<Statement>::const_iterator statement = statements.begin();
+         statement != statements.end();
+         ++statement)
+    {
+      put_byte(body, BATCH_PREPARED);
+      put_string(body, prepared_id(statement->query));
+      put_short(body, statement->values.size());
+
+      for (std::vector<std::string>::const_iterator value = statement->values.begin();
+           value != statement->values.end();
+           ++value)
+      {
+        put_long_string(body, *value);
+      }
+    }
+
+    put_short(body, consistency(consistency_level));
+    put_byte(body, 0);
+
+    std::string response;
+    uint8_t opcode = exchange(OP_BATCH, body, response);
+
+    if ((attempt == 0) && (is_unprepared(opcode, response)))
+    {
+      // The error only identifies one of the statements, so prepare them
+      // all again.
+      for (std::vector<Statement>::const_iterator statement = statements.begin();
+           statement != statements.end();
+           ++statement)
+      {
+        forget_prepared(statement->query);
+      }
+
+      continue;
+    }
+
+    if (opcode == OP_ERROR)
+    {
+      throw_error(response);
+    }
+
+    return;
+  }
+}
+
+std::string NativeConnection::bigint(int64_t value)
+{
+  std::string data;
+
+  for (int shift = 56; shift >= 0; shift -= 8)
+  {
+    data.push_back((char)(((uint64_t)value >> shift) & 0xFF));
+  }
+
+  return data;
+}
+
+std::string NativeConnection::int_value(int32_t value)
+{
+  std::string data;
+  put_int(data, value);
+  return data;
+}
+
+int64_t NativeConnection::get_bigint(const std::string& data)
+{
+  uint64_t value = 0;
+
+  for (size_t ii = 0; (ii < data.size()) && (ii < 8); ii++)
+  {
+    value = (value << 8) | (uint8_t)data[ii];
+  }
+
+  return (int64_t)value;
+}
+
+int32_t NativeConnection::get_int_value(const std::string& data)
+{
+  return (int32_t)get_bigint(data);
+}
+
+void NativeConnection::send(std::vector<Request*>& requests)
+{
+  for (std::vector<Request*>::iterator request = requests.begin();
+       request != requests.end();
+       ++request)
+  {
+    pthread_mutex_lock(&_lock);
+
+    while ((_connected) && (_free_streams.empty()))
+    {
+      pthread_cond_wait(&_stream_cond, &_lock);
+    }
+
+    if (!_connected)
+    {
+      (*request)->failed = true;
+      (*request)->done = true;
+      pthread_mutex_unlock(&_lock);
+      continue;
+    }
+
+    int16_t stream = _free_streams.back();
+    _free_streams.pop_back();
+    _streams[stream] = *request;
+
+    pthread_mutex_unlock(&_lock);
+
+    std::string frame;
+    put_byte(frame, REQUEST_VERSION);
+    put_byte(frame, 0);
+    put_short(frame, stream);
+    put_byte(frame, (*request)->opcode);
+    put_long_string(frame, (*request)->body);
+
+    pthread_mutex_lock(&_write_lock);
+    bool written = write_all(_fd, frame);
+    pthread_mutex_unlock(&_write_lock);
+
+    if (!written)
+    {
+      fail();
+    }
+  }
+}
+
+void NativeConnection::wait(std::vector<Request*>& requests)
+{
+  pthread_mutex_lock(&_lock);
+
+  for (std::vector<Request*>::iterator request = requests.begin();
+       request != requests.end();
+       ++request)
+  {
+    while (!(*request)->done)
+    {
+      pthread_cond_wait(&(*request)->cond, &_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+uint8_t NativeConnection::exchange(uint8_t opcode,
+                                   const std::string& body,
+                                   std::string& response)
+{
+  Request request(opcode, body);
+  std::vector<Request*> requests(1, &request);
+  send(requests);
+  wait(requests);
+
+  if (request.failed)
+  {
+    throw apache::thrift::transport::TTransportException();
+  }
+
+  response.swap(request.response);
+  return request.response_opcode;
+}
+
+uint8_t NativeConnection::run(uint8_t opcode,
+                              const std::string& body,
+                              std::string& response)
+{
+  uint8_t response_opcode = exchange(opcode, body, response);
+
+  if (response_opcode == OP_ERROR)
+  {
+    throw_error(response);
+  }
+
+  return response_opcode;
+}
+
+std::string NativeConnection::prepared_id(const std::string& query)
+{
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, std::string>::const_iterator prepared = _prepared.find(query);
+  bool found = (prepared != _prepared.end());
+  std::string id = found ? prepared->second : "";
+  pthread_mutex_unlock(&_lock);
+
+  if (!found)
+  {
+    std::string body;
+    put_long_string(body, query);
+
+    std::string response;
+    run(OP_PREPARE, body, response);
+
+    Decoder decoder(response);
+
+    if (decoder.get_int() != RESULT_PREPARED)
+    {
+      throw_malformed();
+    }
+
+    id = decoder.get_string();
+
+    pthread_mutex_lock(&_lock);
+    _prepared[query] = id;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  return id;
+}
+
+void NativeConnection::forget_prepared(const std::string& query)
+{
+  pthread_mutex_lock(&_lock);
+  _prepared.erase(query);
+  pthread_mutex_unlock(&_lock);
+}
+
+void NativeConnection::throw_error(const std::string& body)
+{
+  Decoder decoder(body);
+  int32_t code = decoder.get_int();
+  std::string message = decoder.get_string();
+
+  LOG_DEBUG("Cassandra returned error 0x%04x: %s", code, message.c_str());
+
+  switch (code)
+  {
+  case ERROR_SERVER:
+  case ERROR_UNAVAILABLE:
+  case ERROR_OVERLOADED:
+  case ERROR_BOOTSTRAPPING:
+    {
+      UnavailableException ue;
+      throw ue;
+    }
+
+  case ERROR_WRITE_TIMEOUT:
+  case ERROR_READ_TIMEOUT:
+    {
+      TimedOutException te;
+      throw te;
+    }
+
+  default:
+    {
+      InvalidRequestException ire;
+      ire.why = message;
+      throw ire;
+    }
+  }
+}
+
+bool NativeConnection::is_unprepared(uint8_t opcode, const std::string& body)
+{
+  if ((opcode != OP_ERROR) || (body.size() < 4))
+  {
+    return false;
+  }
+
+  Decoder decoder(body);
+  return (decoder.get_int() == ERROR_UNPREPARED);
+}
+
+void NativeConnection::decode_result(const std::string& body, Result& result)
+{
+  Decoder decoder(body);
+  result.rows.clear();
+  result.paging_state.clear();
+
+  if (decoder.get_int() != RESULT_ROWS)
+  {
+    return;
+  }
+
+  int32_t flags = decoder.get_int();
+  int32_t num_columns = decoder.get_int();
+
+  if ((num_columns < 0) || ((size_t)num_columns > decoder.remaining()))
+  {
+    throw_malformed();
+  }
+
+  if (flags & ROWS_HAS_MORE_PAGES)
+  {
+    decoder.get_bytes(result.paging_state);
+  }
+
+  if (!(flags & ROWS_NO_METADATA))
+  {
+    bool global = (flags & ROWS_GLOBAL_TABLES_SPEC);
+
+    if (global)
+    {
+      decoder.get_string();
+      decoder.get_string();
+    }
+
+    for (int32_t ii = 0; ii < num_columns; ii++)
+    {
+      if (!global)
+      {
+        decoder.get_string();
+        decoder.get_string();
+      }
+
+      decoder.get_string();
+      decoder.skip_option();
+    }
+  }
+
+  int32_t num_rows = decoder.get_int();
+
+  for (int32_t ii = 0; ii < num_rows; ii++)
+  {
+    result.rows.push_back(Row(num_columns));
+    Row& row = result.rows.back();
+
+    for (int32_t jj = 0; jj < num_columns; jj++)
+    {
+      row[jj].null = !decoder.get_bytes(row[jj].data);
+    }
+  }
+}
+
+void NativeConnection::fail()
+{
+  pthread_mutex_lock(&_lock);
+
+  bool was_connected = _connected;
+  _connected = false;
+
+  for (size_t stream = 0; stream < _streams.size(); stream++)
+  {
+    Request* request = _streams[stream];
+
+    if (request != NULL)
+    {
+      request->failed = true;
+      request->done = true;
+      pthread_cond_signal(&request->cond);
+      _streams[stream] = NULL;
+      _free_streams.push_back(stream);
+    }
+  }
+
+  pthread_cond_broadcast(&_stream_cond);
+  pthread_mutex_unlock(&_lock);
+
+  // Wake the receive thread, if it is still waiting for responses.
+  if (_fd >= 0)
+  {
+    shutdown(_fd, SHUT_RDWR);
+  }
+
+  if (was_connected)
+  {
+    LOG_WARNING("Lost connection to Cassandra node %s:%d",
+                _hostname.c_str(), _port);
+  }
+}
+
+void* NativeConnection::receive_thread_entry(void* connection)
+{
+  ((NativeConnection*)connection)->receive_loop();
+  return NULL;
+}
+
+void NativeConnection::receive_loop()
+{
+  while (true)
+  {
+    char header[HEADER_SIZE];
+
+    if (!read_all(_fd, header, HEADER_SIZE))
+    {
+      break;
+    }
+
+    uint8_t version = header[0];
+    int16_t stream = (int16_t)(((uint8_t)header[2] << 8) | (uint8_t)header[3]);
+    uint8_t opcode = header[4];
+    uint32_t length = ((uint32_t)(uint8_t)header[5] << 24) |
+                      ((uint32_t)(uint8_t)header[6] << 16) |
+                      ((uint32_t)(uint8_t)header[7] << 8) |
+                      (uint32_t)(uint8_t)header[8];
+
+    if ((version != RESPONSE_VERSION) || (length > MAX_FRAME_SIZE))
+    {
+      LOG_ERROR("Unexpected frame from Cassandra node %s (version 0x%02x, length %u)",
+                _hostname.c_str(), version, length);
+      break;
+    }
+
+    std::string body(length, '\0');
+
+    if ((length > 0) && (!read_all(_fd, &body[0], length)))
+    {
+      break;
+    }
+
+    if (stream < 0)
+    {
+      // An event, which we don't register for.
+      continue;
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    Request* request = _streams[stream];
+
+    if (request != NULL)
+    {
+      _streams[stream] = NULL;
+      _free_streams.push_back(stream);
+      pthread_cond_signal(&_stream_cond);
+
+      request->response_opcode = opcode;
+      request->response.swap(body);
+      request->done = true;
+      pthread_cond_signal(&request->cond);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  fail();
+}
+
+//
+// NativeClient methods.
+//
+
+NativeClient::NativeClient(boost::shared_ptr<NativeConnection> connection) :
+  _connection(connection)
+{}
+
+NativeClient::~NativeClient()
+{}
+
+void NativeClient::set_keyspace(const std::string& keyspace)
+{
+  _connection->use_keyspace(keyspace);
+}
+
+void NativeClient::batch_mutate(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+                                const ConsistencyLevel::type consistency_level)
+{
+  std::vector<NativeConnection::Statement> statements;
+
+  for (std::map<std::string, std::map<std::string, std::vector<Mutation> > >::const_iterator key = mutation_map.begin();
+       key != mutation_map.end();
+       ++key)
+  {
+    for (std::map<std::string, std::vector<Mutation> >::const_iterator cf = key->second.begin();
+         cf != key->second.end();
+         ++cf)
+    {
+      for (std::vector<Mutation>::const_iterator mutation = cf->second.begin();
+           mutation != cf->second.end();
+           ++mutation)
+      {
+        if (mutation->__isset.column_or_supercolumn)
+        {
+          const Column& column = mutation->column_or_supercolumn.column;
+          NativeConnection::Statement statement;
+          statement.query = "INSERT INTO " + table(cf->first) +
+                            " (key, column1, value) VALUES (?, ?, ?)"
+                            " USING TTL ? AND TIMESTAMP ?";
+          statement.values.push_back(key->first);
+          statement.values.push_back(column.name);
+          statement.values.push_back(column.value);
+          statement.values.push_back(
+            NativeConnection::int_value(column.__isset.ttl ? column.ttl : 0));
+          statement.values.push_back(NativeConnection::bigint(column.timestamp));
+          statements.push_back(statement);
+        }
+        else if (mutation->__isset.deletion)
+        {
+          const Deletion& deletion = mutation->deletion;
+
+          if (!deletion.__isset.predicate)
+          {
+            NativeConnection::Statement statement;
+            statement.query = "DELETE FROM " + table(cf->first) +
+                              " USING TIMESTAMP ? WHERE key = ?";
+            statement.values.push_back(NativeConnection::bigint(deletion.timestamp));
+            statement.values.push_back(key->first);
+            statements.push_back(statement);
+          }
+          else if (deletion.predicate.__isset.column_names)
+          {
+            for (std::vector<std::string>::const_iterator name = deletion.predicate.column_names.begin();
+                 name != deletion.predicate.column_names.end();
+                 ++name)
+            {
+              NativeConnection::Statement statement;
+              statement.query = "DELETE FROM " + table(cf->first) +
+                                " USING TIMESTAMP ? WHERE key = ? AND column1 = ?";
+              statement.values.push_back(NativeConnection::bigint(deletion.timestamp));
+              statement.values.push_back(key->first);
+              statement.values.push_back(*name);
+              statements.push_back(statement);
+            }
+          }
+          else
+          {
+            // Thrift doesn't support this either.
+            InvalidRequestException ire;
+            ire.why = "Deleting a range of columns is not supported";
+            throw ire;
+          }
+        }
+      }
+    }
+  }
+
+  if (!statements.empty())
+  {
+    _connection->batch(statements, consistency_level);
+  }
+}
+
+void NativeClient::get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                             const std::string& key,
+                             const ColumnParent& column_parent,
+                             const SlicePredicate& predicate,
+                             const ConsistencyLevel::type consistency_level)
+{
+  _return.clear();
+
+  NativeConnection::Statement statement;
+
+  if (!select_statement(column_parent.column_family, key, predicate, statement))
+  {
+    return;
+  }
+
+  NativeConnection::Result result;
+  _connection->execute(statement, consistency_level, result);
+
+  for (std::vector<NativeConnection::Row>::const_iterator row = result.rows.begin();
+       row != result.rows.end();
+       ++row)
+  {
+    ColumnOrSuperColumn column;
+    to_column(*row, 0, column);
+    _return.push_back(column);
+  }
+}
+
+void NativeClient::multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                                  const std::vector<std::string>& keys,
+                                  const ColumnParent& column_parent,
+                                  const SlicePredicate& predicate,
+                                  const ConsistencyLevel::type consistency_level)
+{
+  _return.clear();
+
+  // Read each row on its own stream, all at once.  As with Thrift, every key
+  // is in the result, even if its row doesn't exist.
+  std::vector<NativeConnection::Statement> statements;
+  std::vector<std::string> statement_keys;
+
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    _return[*key].clear();
+
+    NativeConnection::Statement statement;
+
+    if (select_statement(column_parent.column_family, *key, predicate, statement))
+    {
+      statements.push_back(statement);
+      statement_keys.push_back(*key);
+    }
+  }
+
+  std::vector<NativeConnection::Result> results;
+  _connection->execute(statements, consistency_level, results);
+
+  for (size_t ii = 0; ii < results.size(); ii++)
+  {
+    std::vector<ColumnOrSuperColumn>& columns = _return[statement_keys[ii]];
+
+    for (std::vector<NativeConnection::Row>::const_iterator row = results[ii].rows.begin();
+         row != results[ii].rows.end();
+         ++row)
+    {
+      ColumnOrSuperColumn column;
+      to_column(*row, 0, column);
+      columns.push_back(column);
+    }
+  }
+}
+
+void NativeClient::remove(const std::string& key,
+                          const ColumnPath& column_path,
+                          const int64_t timestamp,
+                          const ConsistencyLevel::type consistency_level)
+{
+  NativeConnection::Statement statement;
+  statement.query = "DELETE FROM " + table(column_path.column_family) +
+                    " USING TIMESTAMP ? WHERE key = ?";
+  statement.values.push_back(NativeConnection::bigint(timestamp));
+  statement.values.push_back(key);
+
+  if (column_path.__isset.column)
+  {
+    statement.query += " AND column1 = ?";
+    statement.values.push_back(column_path.column);
+  }
+
+  NativeConnection::Result result;
+  _connection->execute(statement, consistency_level, result);
+}
+
+void NativeClient::get_range_slices(std::vector<KeySlice>& _return,
+                                    const ColumnParent& column_parent,
+                                    const SlicePredicate& predicate,
+                                    const KeyRange& range,
+                                    const ConsistencyLevel::type consistency_level)
+{
+  _return.clear();
+
+  if ((!range.__isset.end_token) ||
+      ((!range.__isset.start_token) && (!range.__isset.start_key)))
+  {
+    InvalidRequestException ire;
+    ire.why = "Only ranges of tokens can be scanned";
+    throw ire;
+  }
+
+  NativeConnection::Statement statement;
+  statement.query = "SELECT key, column1, value, writetime(value), ttl(value) FROM " +
+                    table(column_parent.column_family) + " WHERE ";
+
+  if (range.__isset.start_key)
+  {
+    statement.query += "token(key) >= token(?)";
+    statement.values.push_back(range.start_key);
+  }
+  else
+  {
+    statement.query += "token(key) > ?";
+    statement.values.push_back(
+      NativeConnection::bigint(strtoll(range.start_token.c_str(), NULL, 10)));
+  }
+
+  statement.query += " AND token(key) <= ?";
+  statement.values.push_back(
+    NativeConnection::bigint(strtoll(range.end_token.c_str(), NULL, 10)));
+  statement.page_size = SCAN_PAGE_SIZE;
+
+  size_t max_columns = predicate.__isset.slice_range ?
+                         (size_t)std::max(predicate.slice_range.count, 0) :
+                         std::numeric_limits<size_t>::max();
+
+  // Each CQL row is a column, so read pages until the row after the last one
+  // wanted starts, or the range runs out.
+  bool done = false;
+
+  while (!done)
+  {
+    NativeConnection::Result result;
+    _connection->execute(statement, consistency_level, result);
+
+    for (std::vector<NativeConnection::Row>::const_iterator row = result.rows.begin();
+         (!done) && (row != result.rows.end());
+         ++row)
+    {
+      if (row->size() < 5)
+      {
+        throw_malformed();
+      }
+
+      if ((_return.empty()) || (_return.back().key != (*row)[0].data))
+      {
+        if (_return.size() >= (size_t)std::max(range.count, 0))
+        {
+          done = true;
+          continue;
+        }
+
+        KeySlice slice;
+        slice.key = (*row)[0].data;
+        _return.push_back(slice);
+      }
+
+      KeySlice& slice = _return.back();
+
+      if ((selects(predicate, (*row)[1].data)) &&
+          (slice.columns.size() < max_columns))
+      {
+        ColumnOrSuperColumn column;
+        to_column(*row, 1, column);
+        slice.columns.push_back(column);
+      }
+    }
+
+    done = done || result.paging_state.empty();
+    statement.paging_state = result.paging_state;
+  }
+}
+
+bool NativeClient::select_statement(const std::string& column_family,
+                                    const std::string& key,
+                                    const SlicePredicate& predicate,
+                                    NativeConnection::Statement& statement)
+{
+  statement.query = "SELECT column1, value, writetime(value), ttl(value) FROM " +
+                    table(column_family) + " WHERE key = ?";
+  statement.values.push_back(key);
+
+  if (predicate.__isset.column_names)
+  {
+    if (predicate.column_names.empty())
+    {
+      return false;
+    }
+
+    statement.query += " AND column1 IN (";
+
+    for (size_t ii = 0; ii < predicate.column_names.size(); ii++)
+    {
+      statement.query += (ii == 0) ? "?" : ", ?";
+      statement.values.push_back(predicate.column_names[ii]);
+    }
+
+    statement.query += ")";
+  }
+  else if (predicate.__isset.slice_range)
+  {
+    const SliceRange& range = predicate.slice_range;
+
+    if (range.count <= 0)
+    {
+      return false;
+    }
+
+    // A reversed range starts from its highest column.
+    const std::string& lowest = range.reversed ? range.finish : range.start;
+    const std::string& highest = range.reversed ? range.start : range.finish;
+
+    if (!lowest.empty())
+    {
+      statement.query += " AND column1 >= ?";
+      statement.values.push_back(lowest);
+    }
+
+    if (!highest.empty())
+    {
+      statement.query += " AND column1 <= ?";
+      statement.values.push_back(highest);
+    }
+
+    if (range.reversed)
+    {
+      statement.query += " ORDER BY column1 DESC";
+    }
+
+    std::ostringstream limit;
+    limit << " LIMIT " << range.count;
+    statement.query += limit.str();
+  }
+
+  return true;
+}
+
+void NativeClient::to_column(const NativeConnection::Row& row,
+                             size_t first,
+                             ColumnOrSuperColumn& column)
+{
+  if (row.size() < first + 4)
+  {
+    throw_malformed();
+  }
+
+  Column col;
+  col.__set_name(row[first].data);
+  col.__set_value(row[first + 1].data);
+
+  if (!row[first + 2].null)
+  {
+    col.__set_timestamp(NativeConnection::get_bigint(row[first + 2].data));
+  }
+
+  if (!row[first + 3].null)
+  {
+    col.__set_ttl(NativeConnection::get_int_value(row[first + 3].data));
+  }
+
+  column.__set_column(col);
+}
+
+bool NativeClient::selects(const SlicePredicate& predicate,
+                           const std::string& name)
+{
+  if (predicate.__isset.column_names)
+  {
+    return (std::find(predicate.column_names.begin(),
+                      predicate.column_names.end(),
+                      name) != predicate.column_names.end());
+  }
+  else if (predicate.__isset.slice_range)
+  {
+    const SliceRange& range = predicate.slice_range;
+    const std::string& lowest = range.reversed ? range.finish : range.start;
+    const std::string& highest = range.reversed ? range.start : range.finish;
+    return (((lowest.empty()) || (name >= lowest)) &&
+            ((highest.empty()) || (name <= highest)));
+  }
+
+  return true;
+}
+
+std::string NativeClient::table(const std::string& column_family)
+{
+  return "\"" + column_family + "\"";
+}
+
+//
+// NativeConnectionPool methods.
+//
+
+NativeConnectionPool::NativeConnectionPool() :
+  _connections()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+NativeConnectionPool::~NativeConnectionPool()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+CassandraStore::ClientInterface* NativeConnectionPool::get_client(const std::string& hostname,
+                                                                  uint16_t port)
+{
+  pthread_mutex_lock(&_lock);
+
+  boost::shared_ptr<NativeConnection>& connection =
+                                      _connections[std::make_pair(hostname, port)];
+
+  if ((connection.get() == NULL) || (!connection->is_connected()))
+  {
+    // Any clients still using the old connection keep it until they are
+    // deleted.
+    connection.reset(new NativeConnection(hostname, port));
+
+    try
+    {
+      connection->connect();
+    }
+    catch (...)
+    {
+      connection.reset();
+      pthread_mutex_unlock(&_lock);
+      throw;
+    }
+  }
+
+  CassandraStore::ClientInterface* client = new NativeClient(connection);
+
+  pthread_mutex_unlock(&_lock);
+
+  return client;
+}
@@ -0,0 +1,206 @@
+/**
+ * @file negativecache.cpp cache of identities known not to exist.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "negativecache.h"
+#include "log.h"
+
+NegativeCache::NegativeCache(size_t max_entries,
+                             long ttl_ms,
+                             int num_shards) :
+  _shards(),
+  _max_entries_per_shard((max_entries + num_shards - 1) / num_shards),
+  _ttl_ms(ttl_ms)
+{
+  for (int ii = 0; ii < num_shards; ii++)
+  {
+    Shard* shard = new Shard();
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->generation = 0;
+    _shards.push_back(shard);
+  }
+}
+
+NegativeCache::~NegativeCache()
+{
+  for (std::vector<Shard*>::iterator shard = _shards.begin();
+       shard != _shards.end();
+       ++shard)
+  {
+    pthread_mutex_destroy(&(*shard)->lock);
+    delete *shard;
+  }
+}
+
+bool NegativeCache::is_absent(const std::string& table, const std::string& key)
+{
+  bool absent = false;
+  std::string id = row_id(table, key);
+  Shard& shard = shard_for(id);
+
+  pthread_mutex_lock(&shard.lock);
+
+  std::unordered_map<std::string, Entry>::iterator entry = shard.entries.find(id);
+  if (entry != shard.entries.end())
+  {
+    if (now_ms() < entry->second.expiry_ms)
+    {
+      absent = true;
+    }
+    else
+    {
+      remove_entry(shard, entry);
+    }
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return absent;
+}
+
+uint64_t NegativeCache::generation(const std::string& table,
+                                   const std::string& key)
+{
+  Shard& shard = shard_for(row_id(table, key));
+
+  pthread_mutex_lock(&shard.lock);
+  uint64_t generation = shard.generation;
+  pthread_mutex_unlock(&shard.lock);
+
+  return generation;
+}
+
+bool NegativeCache::record_absent(const std::string& table,
+                                  const std::string& key,
+                                  uint64_t generation)
+{
+  bool recorded = false;
+  std::string id = row_id(table, key);
+  Shard& shard = shard_for(id);
+
+  pthread_mutex_lock(&shard.lock);
+
+  if (generation == shard.generation)
+  {
+    std::unordered_map<std::string, Entry>::iterator entry = shard.entries.find(id);
+    if (entry != shard.entries.end())
+    {
+      remove_entry(shard, entry);
+    }
+
+    if (shard.entries.size() >= _max_entries_per_shard)
+    {
+      // Forget the oldest absence to make room.
+      remove_entry(shard, shard.entries.find(shard.order.front()));
+    }
+
+    Entry& new_entry = shard.entries[id];
+    new_entry.expiry_ms = now_ms() + _ttl_ms;
+    new_entry.position = shard.order.insert(shard.order.end(), id);
+    recorded = true;
+  }
+  else
+  {
+    LOG_DEBUG("Not recording absence of %s row %s - invalidated during read",
+              table.c_str(), key.c_str());
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return recorded;
+}
+
+void NegativeCache::invalidate(const std::string& table, const std::string& key)
+{
+  std::string id = row_id(table, key);
+  Shard& shard = shard_for(id);
+
+  pthread_mutex_lock(&shard.lock);
+
+  shard.generation++;
+
+  std::unordered_map<std::string, Entry>::iterator entry = shard.entries.find(id);
+  if (entry != shard.entries.end())
+  {
+    remove_entry(shard, entry);
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+}
+
+size_t NegativeCache::size()
+{
+  size_t size = 0;
+
+  for (std::vector<Shard*>::iterator shard = _shards.begin();
+       shard != _shards.end();
+       ++shard)
+  {
+    pthread_mutex_lock(&(*shard)->lock);
+    size += (*shard)->entries.size();
+    pthread_mutex_unlock(&(*shard)->lock);
+  }
+
+  return size;
+}
+
+std::string NegativeCache::row_id(const std::string& table,
+                                  const std::string& key)
+{
+  // Column family names never contain a NUL, so this can't be ambiguous.
+  return table + std::string(1, '\0') + key;
+}
+
+NegativeCache::Shard& NegativeCache::shard_for(const std::string& id)
+{
+  size_t hash = std::hash<std::string>()(id);
+  return *_shards[hash % _shards.size()];
+}
+
+void NegativeCache::remove_entry(Shard& shard,
+                                 std::unordered_map<std::string, Entry>::iterator entry)
+{
+  shard.order.erase(entry->second.position);
+  shard.entries.erase(entry);
+}
+
+unsigned long NegativeCache::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
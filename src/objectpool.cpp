@@ -0,0 +1,254 @@
+/**
+ * @file objectpool.cpp per-thread pools of small, short-lived objects.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <new>
+#include <string.h>
+#include <pthread.h>
+
+#include "objectpool.h"
+
+const size_t ObjectPool::GRANULARITY;
+const size_t ObjectPool::MAX_POOLED_SIZE;
+const size_t ObjectPool::MAX_FREE_PER_CLASS;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+void* ObjectPool::allocate(size_t size)
+{
+  ThreadState* state = thread_state();
+
+  if ((size == 0) || (size > MAX_POOLED_SIZE))
+  {
+    state->stats.heap_allocations++;
+    return ::operator new(size);
+  }
+
+  size_t size_class = (size - 1) / GRANULARITY;
+  state->refs++;
+
+  if ((state->free[size_class] != NULL) ||
+      (take_remote_blocks(state, size_class)))
+  {
+    FreeBlock* block = state->free[size_class];
+    state->free[size_class] = block->next;
+    state->num_free[size_class]--;
+    state->stats.pool_allocations++;
+    return block;
+  }
+
+  // Allocate the whole size class so that the block can be reused for any
+  // object in it.
+  state->stats.heap_allocations++;
+  BlockHeader* header =
+    (BlockHeader*)::operator new(sizeof(BlockHeader) +
+                                 (size_class + 1) * GRANULARITY);
+  header->owner = state;
+  return header + 1;
+}
+
+void ObjectPool::release(void* ptr, size_t size)
+{
+  if (ptr == NULL)
+  {
+    return;
+  }
+
+  if ((size == 0) || (size > MAX_POOLED_SIZE))
+  {
+    ::operator delete(ptr);
+    return;
+  }
+
+  size_t size_class = (size - 1) / GRANULARITY;
+  ThreadState* owner = ((BlockHeader*)ptr - 1)->owner;
+  FreeBlock* block = (FreeBlock*)ptr;
+
+  if (owner == (ThreadState*)pthread_getspecific(thread_key))
+  {
+    // The block belongs to this thread, so can go straight back on its free
+    // list, if there's room.
+    if (owner->num_free[size_class] >= MAX_FREE_PER_CLASS)
+    {
+      ::operator delete((BlockHeader*)ptr - 1);
+    }
+    else
+    {
+      block->next = owner->free[size_class];
+      owner->free[size_class] = block;
+      owner->num_free[size_class]++;
+    }
+  }
+  else if (owner->exited.load())
+  {
+    // The owner has gone, so there's no-one to reuse the block.
+    ::operator delete((BlockHeader*)ptr - 1);
+  }
+  else
+  {
+    // Queue the block for the owner.  If the owner exits before taking it,
+    // it is freed along with the owner's state.
+    block->next = owner->remote_free[size_class].load(std::memory_order_relaxed);
+    while (!owner->remote_free[size_class].compare_exchange_weak(block->next,
+                                                                 block,
+                                                                 std::memory_order_release,
+                                                                 std::memory_order_relaxed))
+    {
+    }
+  }
+
+  release_ref(owner);
+}
+
+ObjectPool::Stats ObjectPool::thread_stats()
+{
+  ThreadState* state = thread_state();
+  Stats stats = state->stats;
+  stats.outstanding = state->refs.load() - 1;
+  return stats;
+}
+
+void ObjectPool::trim()
+{
+  ThreadState* state = thread_state();
+
+  for (size_t ii = 0; ii < NUM_CLASSES; ii++)
+  {
+    free_list(state->remote_free[ii].exchange(NULL, std::memory_order_acquire));
+  }
+
+  free_blocks(state);
+}
+
+ObjectPool::ThreadState* ObjectPool::thread_state()
+{
+  pthread_once(&thread_key_once, &ObjectPool::create_key);
+
+  ThreadState* state = (ThreadState*)pthread_getspecific(thread_key);
+
+  if (state == NULL)
+  {
+    // Released by the key's destructor when the thread exits.
+    state = new ThreadState;
+    memset(state->free, 0, sizeof(state->free));
+    memset(state->num_free, 0, sizeof(state->num_free));
+    memset(&state->stats, 0, sizeof(state->stats));
+    for (size_t ii = 0; ii < NUM_CLASSES; ii++)
+    {
+      state->remote_free[ii].store(NULL);
+    }
+    state->refs.store(1);
+    state->exited.store(false);
+    pthread_setspecific(thread_key, state);
+  }
+
+  return state;
+}
+
+void ObjectPool::delete_thread_state(void* ptr)
+{
+  ThreadState* state = (ThreadState*)ptr;
+
+  // Blocks this thread owns that are still in use are freed to the heap from
+  // now on.  Any that were queued before this are freed below, or when the
+  // last of them is released.
+  state->exited.store(true);
+  free_blocks(state);
+  for (size_t ii = 0; ii < NUM_CLASSES; ii++)
+  {
+    free_list(state->remote_free[ii].exchange(NULL, std::memory_order_acquire));
+  }
+  release_ref(state);
+}
+
+void ObjectPool::release_ref(ThreadState* state)
+{
+  if (state->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    // The owning thread has exited and all its blocks have been freed, so
+    // nothing else can touch the state.
+    for (size_t ii = 0; ii < NUM_CLASSES; ii++)
+    {
+      free_list(state->remote_free[ii].exchange(NULL, std::memory_order_acquire));
+    }
+    delete state;
+  }
+}
+
+bool ObjectPool::take_remote_blocks(ThreadState* state, size_t size_class)
+{
+  FreeBlock* block =
+    state->remote_free[size_class].exchange(NULL, std::memory_order_acquire);
+
+  while ((block != NULL) && (state->num_free[size_class] < MAX_FREE_PER_CLASS))
+  {
+    FreeBlock* next = block->next;
+    block->next = state->free[size_class];
+    state->free[size_class] = block;
+    state->num_free[size_class]++;
+    block = next;
+  }
+
+  // Anything left over doesn't fit on the free list.
+  free_list(block);
+
+  return (state->free[size_class] != NULL);
+}
+
+void ObjectPool::free_blocks(ThreadState* state)
+{
+  for (size_t ii = 0; ii < NUM_CLASSES; ii++)
+  {
+    free_list(state->free[ii]);
+    state->free[ii] = NULL;
+    state->num_free[ii] = 0;
+  }
+}
+
+void ObjectPool::free_list(FreeBlock* block)
+{
+  while (block != NULL)
+  {
+    FreeBlock* next = block->next;
+    ::operator delete((BlockHeader*)block - 1);
+    block = next;
+  }
+}
+
+void ObjectPool::create_key()
+{
+  pthread_key_create(&thread_key, &ObjectPool::delete_thread_state);
+}
@@ -0,0 +1,258 @@
+/**
+ * @file regdatacache.cpp in-process cache of registration data.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "regdatacache.h"
+#include "log.h"
+
+RegDataCache::RegDataCache(size_t max_entries,
+                           long max_age_ms,
+                           int num_shards) :
+  _shards(),
+  _max_entries_per_shard((max_entries + num_shards - 1) / num_shards),
+  _max_age_ms(max_age_ms)
+{
+  for (int ii = 0; ii < num_shards; ii++)
+  {
+    Shard* shard = new Shard();
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->generation = 0;
+    _shards.push_back(shard);
+  }
+}
+
+RegDataCache::~RegDataCache()
+{
+  for (std::vector<Shard*>::iterator shard = _shards.begin();
+       shard != _shards.end();
+       ++shard)
+  {
+    pthread_mutex_destroy(&(*shard)->lock);
+    delete *shard;
+  }
+}
+
+bool RegDataCache::get(const std::string& public_id, RegData& data)
+{
+  bool found = false;
+  Shard& shard = shard_for(public_id);
+  unsigned long now = now_ms();
+
+  pthread_mutex_lock(&shard.lock);
+
+  std::unordered_map<std::string, Entry>::iterator entry =
+                                                 shard.entries.find(public_id);
+  if (entry != shard.entries.end())
+  {
+    if (now < entry->second.expiry_ms)
+    {
+      // Move the entry to the most-recently used end of the list.
+      shard.lru.splice(shard.lru.end(), shard.lru, entry->second.lru_position);
+
+      data = entry->second.data;
+      int32_t age_s = (now - entry->second.stored_ms) / 1000;
+
+      if (data.xml_ttl > 0)
+      {
+        data.xml_ttl -= age_s;
+      }
+
+      if (data.reg_state_ttl > 0)
+      {
+        data.reg_state_ttl -= age_s;
+      }
+
+      found = true;
+    }
+    else
+    {
+      LOG_DEBUG("Cached registration data for %s has expired",
+                public_id.c_str());
+      remove_entry(shard, entry);
+    }
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return found;
+}
+
+uint64_t RegDataCache::generation(const std::string& public_id)
+{
+  Shard& shard = shard_for(public_id);
+
+  pthread_mutex_lock(&shard.lock);
+  uint64_t generation = shard.generation;
+  pthread_mutex_unlock(&shard.lock);
+
+  return generation;
+}
+
+bool RegDataCache::put(const std::string& public_id,
+                       const RegData& data,
+                       uint64_t generation)
+{
+  bool stored = false;
+  Shard& shard = shard_for(public_id);
+  unsigned long now = now_ms();
+
+  // Never hold the data for longer than the columns will live in Cassandra.
+  unsigned long expiry_ms = now + _max_age_ms;
+
+  if ((data.xml_ttl > 0) && (now + data.xml_ttl * 1000UL < expiry_ms))
+  {
+    expiry_ms = now + data.xml_ttl * 1000UL;
+  }
+
+  if ((data.reg_state_ttl > 0) &&
+      (now + data.reg_state_ttl * 1000UL < expiry_ms))
+  {
+    expiry_ms = now + data.reg_state_ttl * 1000UL;
+  }
+
+  pthread_mutex_lock(&shard.lock);
+
+  if (generation == shard.generation)
+  {
+    std::unordered_map<std::string, Entry>::iterator entry =
+                                                 shard.entries.find(public_id);
+    if (entry != shard.entries.end())
+    {
+      remove_entry(shard, entry);
+    }
+
+    if (shard.entries.size() >= _max_entries_per_shard)
+    {
+      // Evict the least recently used entry to make room.
+      remove_entry(shard, shard.entries.find(shard.lru.front()));
+    }
+
+    Entry& new_entry = shard.entries[public_id];
+    new_entry.data = data;
+    new_entry.stored_ms = now;
+    new_entry.expiry_ms = expiry_ms;
+    new_entry.lru_position = shard.lru.insert(shard.lru.end(), public_id);
+    stored = true;
+  }
+  else
+  {
+    LOG_DEBUG("Not caching registration data for %s - invalidated during read",
+              public_id.c_str());
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return stored;
+}
+
+void RegDataCache::invalidate(const std::string& public_id)
+{
+  Shard& shard = shard_for(public_id);
+
+  pthread_mutex_lock(&shard.lock);
+
+  shard.generation++;
+
+  std::unordered_map<std::string, Entry>::iterator entry =
+                                                 shard.entries.find(public_id);
+  if (entry != shard.entries.end())
+  {
+    remove_entry(shard, entry);
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+}
+
+void RegDataCache::invalidate(const std::vector<std::string>& public_ids)
+{
+  for (std::vector<std::string>::const_iterator public_id = public_ids.begin();
+       public_id != public_ids.end();
+       ++public_id)
+  {
+    invalidate(*public_id);
+  }
+}
+
+size_t RegDataCache::size()
+{
+  size_t size = 0;
+
+  for (std::vector<Shard*>::iterator shard = _shards.begin();
+       shard != _shards.end();
+       ++shard)
+  {
+    pthread_mutex_lock(&(*shard)->lock);
+    size += (*shard)->entries.size();
+    pthread_mutex_unlock(&(*shard)->lock);
+  }
+
+  return size;
+}
+
+void RegDataCache::public_ids(std::vector<std::string>& public_ids)
+{
+  for (std::vector<Shard*>::iterator shard = _shards.begin();
+       shard != _shards.end();
+       ++shard)
+  {
+    pthread_mutex_lock(&(*shard)->lock);
+    public_ids.insert(public_ids.end(),
+                      (*shard)->lru.rbegin(),
+                      (*shard)->lru.rend());
+    pthread_mutex_unlock(&(*shard)->lock);
+  }
+}
+
+RegDataCache::Shard& RegDataCache::shard_for(const std::string& public_id)
+{
+  size_t hash = std::hash<std::string>()(public_id);
+  return *_shards[hash % _shards.size()];
+}
+
+void RegDataCache::remove_entry(Shard& shard,
+                                std::unordered_map<std::string, Entry>::iterator entry)
+{
+  shard.lru.erase(entry->second.lru_position);
+  shard.entries.erase(entry);
+}
+
+unsigned long RegDataCache::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
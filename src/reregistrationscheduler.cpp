@@ -0,0 +1,333 @@
+/**
+ * @file reregistrationscheduler.cpp Re-registers subscribers with the HSS ahead of time
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "reregistrationscheduler.h"
+#include "log.h"
+
+// How long to wait before retrying a re-registration that failed.
+static const uint64_t RETRY_INTERVAL_MS = 10000;
+
+// How long the thread sleeps for when nothing is scheduled.
+static const long IDLE_WAIT_MS = 1000;
+
+ReregistrationScheduler::ReregistrationScheduler(Reregisterer* reregisterer,
+                                                 int reregistration_time_s,
+                                                 int lead_time_s,
+                                                 unsigned int max_in_flight) :
+  _reregisterer(reregisterer),
+  _reregistration_time_s(reregistration_time_s),
+  _lead_time_s(lead_time_s),
+  _max_in_flight((max_in_flight > 0) ? max_in_flight : 1),
+  _entries(),
+  _due(),
+  _in_flight(0),
+  _thread_running(false),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+ReregistrationScheduler::~ReregistrationScheduler()
+{
+  stop();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ReregistrationScheduler::start()
+{
+  _terminated = false;
+  _thread_running = (pthread_create(&_thread, NULL, thread_entry, this) == 0);
+
+  if (!_thread_running)
+  {
+    LOG_ERROR("Failed to start re-registration scheduler thread");
+  }
+
+  return _thread_running;
+}
+
+void ReregistrationScheduler::stop()
+{
+  if (_thread_running)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+    _thread_running = false;
+  }
+}
+
+void ReregistrationScheduler::registered(const std::string& impu,
+                                         const std::string& impi,
+                                         int32_t ttl_s)
+{
+  if (ttl_s <= 0)
+  {
+    // The data never expires (because there's no HSS), so there's nothing to
+    // refresh.
+    return;
+  }
+
+  uint64_t now = now_ms();
+  int64_t delay_s = (int64_t)ttl_s - _reregistration_time_s - _lead_time_s;
+
+  pthread_mutex_lock(&_lock);
+
+  Entry& entry = _entries[impu];
+  entry.impi = impi;
+
+  if (entry.in_flight)
+  {
+    // The re-registration that's in progress will refresh the data, so just
+    // remember to track the IRS again once it completes.
+    entry.rearmed = true;
+  }
+  else
+  {
+    entry.expires_ms = now + ((uint64_t)ttl_s * 1000);
+    schedule(impu, entry, now + ((delay_s > 0) ? (uint64_t)delay_s * 1000 : 0));
+    pthread_cond_signal(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ReregistrationScheduler::deregistered(const std::string& impu)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entry>::iterator entry = _entries.find(impu);
+
+  if (entry != _entries.end())
+  {
+    if (entry->second.in_flight)
+    {
+      // Let the re-registration finish, but don't track the IRS afterwards.
+      entry->second.rearmed = false;
+      entry->second.expires_ms = 0;
+    }
+    else
+    {
+      unschedule(impu, entry->second);
+      _entries.erase(entry);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ReregistrationScheduler::reregistration_complete(const std::string& impu,
+                                                      bool success)
+{
+  uint64_t now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+
+  _in_flight--;
+
+  std::map<std::string, Entry>::iterator entry = _entries.find(impu);
+
+  if (entry != _entries.end())
+  {
+    entry->second.in_flight = false;
+
+    if ((success) && (entry->second.rearmed))
+    {
+      // The data has just been cached for twice the re-registration time.
+      entry->second.expires_ms = now + (uint64_t)_reregistration_time_s * 2000;
+      int64_t delay_s = (int64_t)_reregistration_time_s - _lead_time_s;
+      schedule(impu,
+               entry->second,
+               now + ((delay_s > 0) ? (uint64_t)delay_s * 1000 : 0));
+    }
+    else if ((!success) && (now + RETRY_INTERVAL_MS < entry->second.expires_ms))
+    {
+      LOG_DEBUG("Retrying re-registration of %s", impu.c_str());
+      schedule(impu, entry->second, now + RETRY_INTERVAL_MS);
+    }
+    else
+    {
+      _entries.erase(entry);
+    }
+  }
+
+  // Another re-registration can now be started.
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t ReregistrationScheduler::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _entries.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+long ReregistrationScheduler::run_due()
+{
+  uint64_t now = now_ms();
+  std::vector<std::pair<std::string, std::string> > due;
+
+  pthread_mutex_lock(&_lock);
+
+  while ((!_due.empty()) &&
+         (_due.begin()->first <= now) &&
+         (_in_flight < _max_in_flight))
+  {
+    std::string impu = _due.begin()->second;
+    _due.erase(_due.begin());
+
+    Entry& entry = _entries[impu];
+    entry.in_flight = true;
+    entry.rearmed = false;
+    _in_flight++;
+    due.push_back(std::make_pair(impu, entry.impi));
+  }
+
+  long wait_ms = -1;
+
+  if ((!_due.empty()) && (_in_flight < _max_in_flight))
+  {
+    wait_ms = (_due.begin()->first > now) ? (long)(_due.begin()->first - now) : 0;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  // The reregisterer may complete synchronously, so must be called without
+  // the lock held.
+  for (std::vector<std::pair<std::string, std::string> >::const_iterator irs = due.begin();
+       irs != due.end();
+       ++irs)
+  {
+    LOG_DEBUG("Re-registering %s with the HSS ahead of time", irs->first.c_str());
+    _reregisterer->reregister(irs->first, irs->second);
+  }
+
+  return wait_ms;
+}
+
+void ReregistrationScheduler::schedule(const std::string& impu,
+                                       Entry& entry,
+                                       uint64_t due_ms)
+{
+  if (!entry.in_flight)
+  {
+    unschedule(impu, entry);
+  }
+
+  entry.due_ms = due_ms;
+  entry.in_flight = false;
+  entry.rearmed = false;
+  _due.insert(std::make_pair(due_ms, impu));
+}
+
+void ReregistrationScheduler::unschedule(const std::string& impu,
+                                         const Entry& entry)
+{
+  std::pair<DueIndex::iterator, DueIndex::iterator> range =
+                                                 _due.equal_range(entry.due_ms);
+
+  for (DueIndex::iterator due = range.first; due != range.second; ++due)
+  {
+    if (due->second == impu)
+    {
+      _due.erase(due);
+      break;
+    }
+  }
+}
+
+void* ReregistrationScheduler::thread_entry(void* scheduler)
+{
+  ((ReregistrationScheduler*)scheduler)->thread();
+  return NULL;
+}
+
+void ReregistrationScheduler::thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    pthread_mutex_unlock(&_lock);
+    long wait_ms = run_due();
+    pthread_mutex_lock(&_lock);
+
+    if ((wait_ms < 0) || (wait_ms > IDLE_WAIT_MS))
+    {
+      wait_ms = IDLE_WAIT_MS;
+    }
+
+    if ((!_terminated) && (wait_ms > 0))
+    {
+      struct timespec wake;
+      clock_gettime(CLOCK_MONOTONIC, &wake);
+      wake.tv_sec += wait_ms / 1000;
+      wake.tv_nsec += (wait_ms % 1000) * 1000000;
+      if (wake.tv_nsec >= 1000000000)
+      {
+        wake.tv_sec++;
+        wake.tv_nsec -= 1000000000;
+      }
+
+      // Woken early if anything is scheduled or completes.
+      pthread_cond_timedwait(&_cond, &_lock, &wake);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t ReregistrationScheduler::now_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
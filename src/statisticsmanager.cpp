@@ -44,6 +44,17 @@ const static std::string known_stats[] = {
   "H_cache_latency_us",
   "H_incoming_requests",
   "H_rejected_overload",
+  "H_cache_coalesced_reads",
+  "H_cache_worker_threads",
+  "H_cache_queue_depth",
+  "H_cache_high_priority_queue_wait_us",
+  "H_cache_normal_priority_queue_wait_us",
+  "H_cache_low_priority_queue_wait_us",
+  "H_cache_write_behind_backlog",
+  "H_cache_write_behind_age_us",
+  "H_cache_expired_operations",
+  "H_cache_shard_imbalance",
+  "H_cache_hedged_reads",
 };
 
 const static int num_known_stats = sizeof(known_stats) / sizeof(std::string);
@@ -56,7 +67,37 @@ StatisticsManager::StatisticsManager(long poll_timeout_ms) :
   H_hss_subscription_latency_us("H_hss_subscription_latency_us", &lvc),
   H_cache_latency_us("H_cache_latency_us", &lvc),
   H_incoming_requests("H_incoming_requests", &lvc),
-  H_rejected_overload("H_rejected_overload", &lvc)
+  H_rejected_overload("H_rejected_overload", &lvc),
+  H_cache_coalesced_reads("H_cache_coalesced_reads", &lvc),
+  H_cache_worker_threads("H_cache_worker_threads", &lvc),
+  H_cache_queue_depth("H_cache_queue_depth", &lvc),
+  H_cache_high_priority_queue_wait_us("H_cache_high_priority_queue_wait_us", &lvc),
+  H_cache_normal_priority_queue_wait_us("H_cache_normal_priority_queue_wait_us", &lvc),
+  H_cache_low_priority_queue_wait_us("H_cache_low_priority_queue_wait_us", &lvc),
+  H_cache_write_behind_backlog("H_cache_write_behind_backlog", &lvc),
+  H_cache_write_behind_age_us("H_cache_write_behind_age_us", &lvc),
+  H_cache_expired_operations("H_cache_expired_operations", &lvc),
+  H_cache_shard_imbalance("H_cache_shard_imbalance", &lvc),
+  H_cache_hedged_reads("H_cache_hedged_reads", &lvc)
 {}
 
+void StatisticsManager::update_cache_queue_wait_us(Cache::Priority priority,
+                                                   unsigned long wait_us)
+{
+  switch (priority)
+  {
+  case Cache::PRIORITY_HIGH:
+    update_H_cache_high_priority_queue_wait_us(wait_us);
+    break;
+
+  case Cache::PRIORITY_LOW:
+    update_H_cache_low_priority_queue_wait_us(wait_us);
+    break;
+
+  default:
+    update_H_cache_normal_priority_queue_wait_us(wait_us);
+    break;
+  }
+}
+
 StatisticsManager::~StatisticsManager() {}
@@ -0,0 +1,252 @@
+/**
+ * @file bulkprovisioner_test.cpp UT for bulk provisioning.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sstream>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+#include "mockcommunicationmonitor.h"
+
+#include "bulkprovisioner.h"
+#include "localstore.h"
+
+using ::testing::NiceMock;
+
+static const std::string XML =
+  "<IMSSubscription><ServiceProfile>"
+  "<PublicIdentity><Identity>sip:kermit@example.com</Identity></PublicIdentity>"
+  "<PublicIdentity><Identity>tel:+15551234</Identity></PublicIdentity>"
+  "</ServiceProfile></IMSSubscription>";
+
+// Build a line of input for a subscriber.
+static std::string line(const std::string& impi,
+                        const std::string& impus = "")
+{
+  std::string result = "{\"impi\": \"" + impi + "\", "
+                       "\"ha1\": \"hash\", "
+                       "\"realm\": \"example.com\", ";
+
+  if (!impus.empty())
+  {
+    result += "\"impus\": " + impus + ", ";
+  }
+
+  result += "\"xml\": \"" + XML + "\"}";
+  return result;
+}
+
+TEST(BulkProvisionerParseTest, Valid)
+{
+  BulkProvisioner::Subscriber subscriber;
+  std::string error;
+  EXPECT_TRUE(BulkProvisioner::parse(line("kermit@example.com",
+                                          "[\"tel:+15551234\"]"),
+                                     subscriber,
+                                     error));
+  EXPECT_EQ("kermit@example.com", subscriber.impi);
+  EXPECT_EQ("hash", subscriber.ha1);
+  EXPECT_EQ("example.com", subscriber.realm);
+  EXPECT_EQ(XML, subscriber.xml);
+  ASSERT_EQ(1u, subscriber.impus.size());
+  EXPECT_EQ("tel:+15551234", subscriber.impus[0]);
+}
+
+// The public IDs default to those in the IMS subscription.
+TEST(BulkProvisionerParseTest, DefaultPublicIDs)
+{
+  BulkProvisioner::Subscriber subscriber;
+  std::string error;
+  EXPECT_TRUE(BulkProvisioner::parse(line("kermit@example.com"),
+                                     subscriber,
+                                     error));
+  ASSERT_EQ(2u, subscriber.impus.size());
+  EXPECT_EQ("sip:kermit@example.com", subscriber.impus[0]);
+  EXPECT_EQ("tel:+15551234", subscriber.impus[1]);
+}
+
+TEST(BulkProvisionerParseTest, Invalid)
+{
+  const std::string lines[] = {
+    "not json",
+    "[\"an\", \"array\"]",
+    "{\"ha1\": \"hash\", \"realm\": \"example.com\", \"xml\": \"" + XML + "\"}",
+    "{\"impi\": \"kermit\", \"ha1\": 1, \"realm\": \"example.com\", \"xml\": \"" + XML + "\"}",
+    "{\"impi\": \"kermit\", \"ha1\": \"hash\", \"realm\": \"example.com\", \"xml\": \"<howdy>\"}",
+    line("kermit@example.com", "\"sip:kermit@example.com\""),
+    line("kermit@example.com", "[1]"),
+    line("kermit@example.com", "[\"sip:gonzo@example.com\"]"),
+  };
+
+  for (size_t ii = 0; ii < sizeof(lines) / sizeof(lines[0]); ii++)
+  {
+    BulkProvisioner::Subscriber subscriber;
+    std::string error;
+    EXPECT_FALSE(BulkProvisioner::parse(lines[ii], subscriber, error)) << lines[ii];
+    EXPECT_NE("", error) << lines[ii];
+  }
+}
+
+/// Fixture for tests that provision subscribers into a cache backed by a
+/// local store.
+class BulkProvisionerTest : public testing::Test
+{
+public:
+  BulkProvisionerTest()
+  {
+    char dir[] = "/tmp/bulkprovisioner_test.XXXXXX";
+    _dir = mkdtemp(dir);
+    _store = new LocalStore(_dir, 0);
+    _store->start();
+
+    _cache.initialize();
+    _cache.configure("localhost", 1234, 2, 0, &_cm);
+    _cache.configure_local_store(_store);
+    _cache.start();
+  }
+
+  virtual ~BulkProvisionerTest()
+  {
+    _cache.stop();
+    _cache.wait_stopped();
+    delete _store;
+    unlink((_dir + "/log").c_str());
+    unlink((_dir + "/snapshot").c_str());
+    unlink((_dir + "/lock").c_str());
+    rmdir(_dir.c_str());
+  }
+
+  std::string get_xml(const std::string& impu)
+  {
+    Cache::GetRegData* get_reg_data = _cache.create_GetRegData(impu);
+    _cache.do_sync(get_reg_data, 0);
+    std::string xml;
+    int32_t ttl;
+    get_reg_data->get_xml(xml, ttl);
+    delete get_reg_data;
+    return xml;
+  }
+
+  std::vector<std::string> get_impus(const std::string& impi)
+  {
+    Cache::GetAssociatedPublicIDs* get_impus =
+      _cache.create_GetAssociatedPublicIDs(impi);
+    _cache.do_sync(get_impus, 0);
+    std::vector<std::string> impus;
+    get_impus->get_result(impus);
+    delete get_impus;
+    return impus;
+  }
+
+  std::string _dir;
+  LocalStore* _store;
+  Cache _cache;
+  NiceMock<MockCommunicationMonitor> _cm;
+};
+
+TEST_F(BulkProvisionerTest, Provision)
+{
+  std::stringstream input;
+  input << line("kermit@example.com") << std::endl
+        << std::endl
+        << "not json" << std::endl
+        << line("gonzo@example.com", "[\"tel:+15551234\"]") << std::endl;
+
+  BulkProvisioner provisioner(&_cache);
+  BulkProvisioner::Stats stats;
+  EXPECT_FALSE(provisioner.provision(input, stats));
+
+  EXPECT_EQ(3u, stats.lines);
+  EXPECT_EQ(1u, stats.invalid);
+  EXPECT_EQ(2u, stats.written);
+  EXPECT_EQ(0u, stats.failed);
+
+  EXPECT_EQ(XML, get_xml("sip:kermit@example.com"));
+  EXPECT_EQ(XML, get_xml("tel:+15551234"));
+  EXPECT_EQ(2u, get_impus("kermit@example.com").size());
+  EXPECT_EQ(1u, get_impus("gonzo@example.com").size());
+
+  Cache::GetAuthVector* get_av = _cache.create_GetAuthVector("kermit@example.com");
+  EXPECT_TRUE(_cache.do_sync(get_av, 0));
+  DigestAuthVector av;
+  get_av->get_result(av);
+  delete get_av;
+  EXPECT_EQ("hash", av.ha1);
+  EXPECT_EQ("example.com", av.realm);
+}
+
+// Many more subscribers than can be queued or in flight are all written.
+TEST_F(BulkProvisionerTest, Backpressure)
+{
+  std::stringstream input;
+
+  for (int ii = 0; ii < 200; ii++)
+  {
+    std::stringstream impi;
+    impi << "user" << ii << "@example.com";
+    input << line(impi.str()) << std::endl;
+  }
+
+  BulkProvisioner provisioner(&_cache, 2, 1, 1);
+  BulkProvisioner::Stats stats;
+  EXPECT_TRUE(provisioner.provision(input, stats));
+
+  EXPECT_EQ(200u, stats.lines);
+  EXPECT_EQ(200u, stats.written);
+  EXPECT_EQ(2u, get_impus("user199@example.com").size());
+}
+
+// Subscribers whose writes fail are counted.
+TEST_F(BulkProvisionerTest, WriteFailure)
+{
+  // The local store fails writes if it can't log them.
+  close(_store->_log_fd);
+  _store->_log_fd = -1;
+
+  std::stringstream input;
+  input << line("kermit@example.com") << std::endl;
+
+  BulkProvisioner provisioner(&_cache);
+  BulkProvisioner::Stats stats;
+  EXPECT_FALSE(provisioner.provision(input, stats));
+
+  EXPECT_EQ(1u, stats.lines);
+  EXPECT_EQ(0u, stats.written);
+  EXPECT_EQ(1u, stats.failed);
+}
@@ -47,6 +47,7 @@
 #include "cass_test_utils.h"
 
 #include <cache.h>
+#include "columncompression.h"
 
 using ::testing::PrintToString;
 using ::testing::Return;
@@ -59,11 +60,16 @@ using ::testing::Matcher;
 using ::testing::MatcherInterface;
 using ::testing::MatchResultListener;
 using ::testing::Invoke;
+using ::testing::InvokeWithoutArgs;
 using ::testing::AllOf;
 using ::testing::DoAll;
 using ::testing::Gt;
 using ::testing::Lt;
 using ::testing::NiceMock;
+using ::testing::SaveArg;
+using ::testing::AnyNumber;
+using ::testing::AtLeast;
+using ::testing::InSequence;
 
 using namespace CassTestUtils;
 
@@ -79,6 +85,7 @@ const ChargingAddresses NO_CHARGING_ADDRS(NO_CFS, NO_CFS);
 const ChargingAddresses FULL_CHARGING_ADDRS(CCFS, ECFS);
 const ChargingAddresses CCFS_CHARGING_ADDRS(CCFS, ECF);
 const ChargingAddresses ECFS_CHARGING_ADDRS(CCF, ECFS);
+const std::string DELETION_MARKER("\0homestead-deleted", 18);
 
 // The class under test.
 //
@@ -92,6 +99,54 @@ public:
   MOCK_METHOD0(release_client, void());
 };
 
+class MockCacheStats : public Cache::StatsInterface
+{
+public:
+  MOCK_METHOD0(incr_cache_coalesced_reads, void());
+  MOCK_METHOD1(update_cache_worker_threads, void(unsigned long threads));
+  MOCK_METHOD1(update_cache_queue_depth, void(unsigned long depth));
+  MOCK_METHOD2(update_cache_queue_wait_us, void(Cache::Priority priority,
+                                                unsigned long wait_us));
+  MOCK_METHOD1(update_cache_write_behind_backlog, void(unsigned long depth));
+  MOCK_METHOD1(update_cache_write_behind_age_us, void(unsigned long age_us));
+  MOCK_METHOD0(incr_cache_expired_operations, void());
+  MOCK_METHOD1(update_cache_shard_imbalance, void(unsigned long percent));
+  MOCK_METHOD0(incr_cache_hedged_reads, void());
+};
+
+// Helper that holds a cache thread inside a Thrift call until the test
+// releases it, so that the test can submit more requests while the call is
+// in flight.
+class ThriftCallBlocker
+{
+public:
+  ThriftCallBlocker()
+  {
+    sem_init(&_entered, 0, 0);
+    sem_init(&_released, 0, 0);
+  }
+
+  ~ThriftCallBlocker()
+  {
+    sem_destroy(&_entered);
+    sem_destroy(&_released);
+  }
+
+  // Called on the cache thread.
+  void block()
+  {
+    sem_post(&_entered);
+    sem_wait(&_released);
+  }
+
+  void wait_for_call() { sem_wait(&_entered); }
+  void release() { sem_post(&_released); }
+
+private:
+  sem_t _entered;
+  sem_t _released;
+};
+
 //
 // TEST FIXTURES.
 //
@@ -261,6 +316,7 @@ TEST_F(CacheRequestTest, PutRegDataMainline)
 
   std::map<std::string, std::string> impu_columns;
   impu_columns["ims_subscription_xml"] = "<xml>";
+  impu_columns["irs_summary"] = IRSSummary("<xml>").encode();
   impu_columns["is_registered"] = "\x01";
   impu_columns["primary_ccf"] = "ccf1";
   impu_columns["secondary_ccf"] = "ccf2";
@@ -282,6 +338,215 @@ TEST_F(CacheRequestTest, PutRegDataMainline)
   execute_trx((CassandraStore::Operation*)put_reg_data, trx);
 }
 
+// With the IRS table enabled, the XML and charging addresses are written
+// once, keyed by the default public ID, and the IMPU rows point at them.
+TEST_F(CacheRequestTest, PutRegDataIrsTable)
+{
+  _cache.configure_irs_table(true);
+
+  std::vector<std::string> ids = {"kermit", "robin"};
+  TestTransaction *trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData(ids, 1000, 300);
+  put_reg_data->with_xml("<xml>")
+               .with_reg_state(RegistrationState::REGISTERED)
+               .with_associated_impis(IMPIS)
+               .with_charging_addrs(FULL_CHARGING_ADDRS);
+
+  std::vector<CassandraStore::RowColumns> expected;
+
+  std::map<std::string, std::string> irs_columns;
+  irs_columns["ims_subscription_xml"] = "<xml>";
+  irs_columns["irs_summary"] = IRSSummary("<xml>").encode();
+  irs_columns["primary_ccf"] = "ccf1";
+  irs_columns["secondary_ccf"] = "ccf2";
+  irs_columns["primary_ecf"] = "ecf1";
+  irs_columns["secondary_ecf"] = "ecf2";
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["is_registered"] = "\x01";
+  impu_columns["associated_impi__somebody@example.com"] = "";
+  impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::string> impi_columns;
+  impi_columns["associated_primary_impu__kermit"] = "";
+
+  expected.push_back(CassandraStore::RowColumns("irs", "kermit", irs_columns));
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit", impu_columns));
+  expected.push_back(CassandraStore::RowColumns("impu", "robin", impu_columns));
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "somebody@example.com", impi_columns));
+
+  // The IMPU rows are read first to find what they point at.  They don't
+  // exist yet, so there's nothing to delete.
+  EXPECT_CALL(_client, multiget_slice(_, ids, ColumnPathForTable("impu"), _, _))
+    .Times(AtLeast(1));
+  EXPECT_CALL(_client,
+              batch_mutate(MutationMap(expected), _));
+  EXPECT_CALL(_client, remove(_, _, _, _)).Times(0);
+  EXPECT_CALL(*trx, on_success(_));
+  EXPECT_CALL(_cm, inform_success(_));
+
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx);
+}
+
+// When the default public ID of a set changes, its IMPU rows are pointed at
+// the new default's IRS row, and the old default's IRS row is deleted.
+TEST_F(CacheRequestTest, PutRegDataIrsTableDefaultIdChanged)
+{
+  _cache.configure_irs_table(true);
+
+  std::vector<std::string> ids = {"robin", "kermit"};
+  TestTransaction *trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData(ids, 1000, 300);
+  put_reg_data->with_xml("<xml>");
+
+  std::map<std::string, std::string> old_impu_columns;
+  old_impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > impu_slice;
+  make_slice(impu_slice["kermit"], old_impu_columns);
+  make_slice(impu_slice["robin"], old_impu_columns);
+
+  EXPECT_CALL(_client, multiget_slice(_, ids, ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+
+  std::map<std::string, std::string> irs_columns;
+  irs_columns["ims_subscription_xml"] = "<xml>";
+  irs_columns["irs_summary"] = IRSSummary("<xml>").encode();
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["irs_id"] = "robin";
+
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("irs", "robin", irs_columns));
+  expected.push_back(CassandraStore::RowColumns("impu", "robin", impu_columns));
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit", impu_columns));
+
+  EXPECT_CALL(_client, batch_mutate(MutationMap(expected), _));
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("irs"), 1000, _));
+  EXPECT_CALL(*trx, on_success(_));
+  EXPECT_CALL(_cm, inform_success(_));
+
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx);
+}
+
+// Once IMPU rows pointing at IRS rows have been seen, writing XML with the
+// IRS table turned off removes the pointers and the set's IRS row.
+TEST_F(CacheRequestTest, PutRegDataIrsTableTurnedOff)
+{
+  _cache._irs_rows_seen = true;
+
+  std::vector<std::string> ids = {"kermit", "robin"};
+  TestTransaction *trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData(ids, 1000, 300);
+  put_reg_data->with_xml("<xml>");
+
+  std::map<std::string, std::string> old_impu_columns;
+  old_impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > impu_slice;
+  make_slice(impu_slice["kermit"], old_impu_columns);
+  make_slice(impu_slice["robin"], old_impu_columns);
+
+  EXPECT_CALL(_client, multiget_slice(_, ids, ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["ims_subscription_xml"] = "<xml>";
+  impu_columns["irs_summary"] = IRSSummary("<xml>").encode();
+
+  std::vector<CassandraStore::RowColumns> expected_puts;
+  expected_puts.push_back(CassandraStore::RowColumns("impu", "kermit", impu_columns));
+  expected_puts.push_back(CassandraStore::RowColumns("impu", "robin", impu_columns));
+
+  std::map<std::string, std::string> irs_id_column;
+  irs_id_column["irs_id"] = "";
+
+  std::vector<CassandraStore::RowColumns> expected_deletes;
+  expected_deletes.push_back(CassandraStore::RowColumns("impu", "kermit", irs_id_column));
+  expected_deletes.push_back(CassandraStore::RowColumns("impu", "robin", irs_id_column));
+
+  EXPECT_CALL(_client, batch_mutate(MutationMap(expected_puts), _));
+  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected_deletes), _));
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("irs"), 1000, _));
+  EXPECT_CALL(*trx, on_success(_));
+  EXPECT_CALL(_cm, inform_success(_));
+
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx);
+}
+
+// Until then, writes don't read the IMPU rows first.
+TEST_F(CacheRequestTest, PutRegDataNoIrsRowsSeen)
+{
+  TestTransaction *trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData("kermit", 1000, 300);
+  put_reg_data->with_xml("<xml>");
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["ims_subscription_xml"] = "<xml>";
+  impu_columns["irs_summary"] = IRSSummary("<xml>").encode();
+
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, _)).Times(0);
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impu", "kermit", impu_columns), _));
+  EXPECT_CALL(*trx, on_success(_));
+  EXPECT_CALL(_cm, inform_success(_));
+
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx);
+}
+
+// Updates without XML (e.g. charging addresses from a PPR) don't know which
+// IRS row to write to, so are written to the IMPU rows.
+TEST_F(CacheRequestTest, PutRegDataIrsTableNoXml)
+{
+  _cache.configure_irs_table(true);
+
+  TestTransaction *trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData("kermit", 1000, 300);
+  put_reg_data->with_charging_addrs(FULL_CHARGING_ADDRS);
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["primary_ccf"] = "ccf1";
+  impu_columns["secondary_ccf"] = "ccf2";
+  impu_columns["primary_ecf"] = "ecf1";
+  impu_columns["secondary_ecf"] = "ecf2";
+
+  EXPECT_CALL(_client,
+              batch_mutate(MutationMap("impu", "kermit", impu_columns), _));
+  EXPECT_CALL(*trx, on_success(_));
+  EXPECT_CALL(_cm, inform_success(_));
+
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx);
+}
+
+// XML is compressed if it's over the configured threshold.
+TEST_F(CacheRequestTest, PutRegDataCompressedXml)
+{
+  _cache.configure_xml_compression(100);
+  std::string xml = "<xml>" + std::string(1000, 'x') + "</xml>";
+
+  TestTransaction *trx1 = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData("kermit", 1000);
+  put_reg_data->with_xml(xml);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = ColumnCompression::compress(xml);
+  columns["irs_summary"] = IRSSummary(xml).encode();
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impu", "kermit", columns), _));
+  EXPECT_CALL(*trx1, on_success(_));
+  EXPECT_CALL(_cm, inform_success(_)).Times(2);
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx1);
+
+  // Smaller XML is written as it is.
+  TestTransaction *trx2 = make_trx();
+  put_reg_data = _cache.create_PutRegData("kermit", 1000);
+  put_reg_data->with_xml("<xml/>");
+
+  columns["ims_subscription_xml"] = "<xml/>";
+  columns["irs_summary"] = IRSSummary("<xml/>").encode();
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impu", "kermit", columns), _));
+  EXPECT_CALL(*trx2, on_success(_));
+  execute_trx((CassandraStore::Operation*)put_reg_data, trx2);
+}
+
 TEST_F(CacheRequestTest, PutRegDataUnregistered)
 {
   TestTransaction *trx = make_trx();
@@ -295,6 +560,7 @@ TEST_F(CacheRequestTest, PutRegDataUnregistered)
 
   std::map<std::string, std::string> columns;
   columns["ims_subscription_xml"] = "<xml>";
+  columns["irs_summary"] = IRSSummary("<xml>").encode();
   columns["is_registered"] = std::string("\x00", 1);
   columns["primary_ccf"] = "ccf1";
   columns["secondary_ccf"] = "ccf2";
@@ -329,6 +595,7 @@ TEST_F(CacheRequestTest, NoTTLOnPut)
 
   std::map<std::string, std::string> columns;
   columns["ims_subscription_xml"] = "<xml>";
+  columns["irs_summary"] = IRSSummary("<xml>").encode();
   columns["is_registered"] = "\x01";
   columns["primary_ccf"] = "ccf";
   columns["secondary_ccf"] = "";
@@ -367,6 +634,7 @@ TEST_F(CacheRequestTest, PutRegDataMultipleIDs)
 
   std::map<std::string, std::string> columns;
   columns["ims_subscription_xml"] = "<xml>";
+  columns["irs_summary"] = IRSSummary("<xml>").encode();
   columns["is_registered"] = "\x01";
   columns["primary_ccf"] = "";
   columns["secondary_ccf"] = "";
@@ -431,6 +699,7 @@ TEST_F(CacheRequestTest, PutRegDataNoChargingAddresses)
 
   std::map<std::string, std::string> columns;
   columns["ims_subscription_xml"] = "<xml>";
+  columns["irs_summary"] = IRSSummary("<xml>").encode();
 
   expected.push_back(CassandraStore::RowColumns("impu", "kermit", columns));
   expected.push_back(CassandraStore::RowColumns("impu", "miss piggy", columns));
@@ -663,6 +932,101 @@ TEST_F(CacheRequestTest, DeletePublicId)
 }
 
 
+// Build the columns written over a whole row of a column family that is
+// deleted with deletion markers enabled: the columns the row always has,
+// plus some others.
+static std::map<std::string, std::string>
+  marked_row_columns(const std::string& column_family,
+                     const std::vector<std::string>& others = std::vector<std::string>())
+{
+  std::vector<std::string> names = {"ims_subscription_xml",
+                                    "irs_summary",
+                                    "primary_ccf",
+                                    "secondary_ccf",
+                                    "primary_ecf",
+                                    "secondary_ecf"};
+
+  if (column_family == "impu")
+  {
+    names.push_back("is_registered");
+    names.push_back("irs_id");
+  }
+
+  names.insert(names.end(), others.begin(), others.end());
+
+  std::map<std::string, std::string> columns;
+
+  for (std::vector<std::string>::const_iterator name = names.begin();
+       name != names.end();
+       ++name)
+  {
+    columns[*name] = DELETION_MARKER;
+  }
+
+  return columns;
+}
+
+// With deletion markers enabled, the columns the IMPU row always has and its
+// IMPI association columns are overwritten with markers, without reading the
+// row, as is the IMPI mapping column.
+TEST_F(CacheRequestTest, DeletePublicIdWithDeletionMarkers)
+{
+  _cache.configure_deletion_markers(10);
+
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_DeletePublicIDs("kermit", IMPIS, 1000);
+
+  std::map<std::string, std::string> marked_impi_columns;
+  marked_impi_columns["associated_primary_impu__kermit"] = DELETION_MARKER;
+
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit",
+    marked_row_columns("impu", {"associated_impi__somebody@example.com"})));
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "somebody@example.com", marked_impi_columns));
+
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _)).Times(0);
+  EXPECT_CALL(_client, batch_mutate(MutationMap(expected), _));
+  EXPECT_CALL(_client, remove(_, _, _, _)).Times(0);
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
+
+
+// The IRS row is marked too.
+TEST_F(CacheRequestTest, DeletePublicIdsIrsTableWithDeletionMarkers)
+{
+  _cache.configure_irs_table(true);
+  _cache.configure_deletion_markers(10);
+
+  std::vector<std::string> ids = {"kermit", "robin"};
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_DeletePublicIDs(ids, IMPIS, 1000);
+
+  std::map<std::string, std::string> marked_impi_columns;
+  marked_impi_columns["associated_primary_impu__kermit"] = DELETION_MARKER;
+
+  std::vector<std::string> impi_columns = {"associated_impi__somebody@example.com"};
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit",
+                                                marked_row_columns("impu", impi_columns)));
+  expected.push_back(CassandraStore::RowColumns("impu", "robin",
+                                                marked_row_columns("impu", impi_columns)));
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "somebody@example.com", marked_impi_columns));
+  expected.push_back(CassandraStore::RowColumns("irs", "kermit",
+                                                marked_row_columns("irs")));
+
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _)).Times(0);
+  EXPECT_CALL(_client, batch_mutate(MutationMap(expected), _));
+  EXPECT_CALL(_client, remove(_, _, _, _)).Times(0);
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
+
+
 TEST_F(CacheRequestTest, DeleteMultiPublicIds)
 {
   std::vector<CassandraStore::RowColumns> expected;
@@ -694,6 +1058,34 @@ TEST_F(CacheRequestTest, DeleteMultiPublicIds)
 }
 
 
+TEST_F(CacheRequestTest, DeletePublicIdsIrsTable)
+{
+  _cache.configure_irs_table(true);
+
+  std::vector<CassandraStore::RowColumns> expected;
+
+  std::vector<std::string> ids = {"kermit", "robin"};
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_DeletePublicIDs(ids, IMPIS, 1000);
+
+  // The IMPU rows and the IRS row (keyed by the first public ID) are deleted
+  // entirely.
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("impu"), 1000, _));
+  EXPECT_CALL(_client, remove("robin", ColumnPathForTable("impu"), 1000, _));
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("irs"), 1000, _));
+
+  std::map<std::string, std::string> deleted_impi_columns;
+  deleted_impi_columns["associated_primary_impu__kermit"] = "";
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "somebody@example.com", deleted_impi_columns));
+
+  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected), _));
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
+
+
 TEST_F(CacheRequestTest, DeletePrivateId)
 {
   TestTransaction *trx = make_trx();
@@ -749,6 +1141,23 @@ TEST_F(CacheRequestTest, DeleteIMPIMappings)
   execute_trx(op, trx);
 }
 
+// The columns of a whole IMPI mapping row aren't known, so it is deleted as
+// normal even with deletion markers enabled, rather than read first.
+TEST_F(CacheRequestTest, DeleteIMPIMappingsWithDeletionMarkers)
+{
+  _cache.configure_deletion_markers(10);
+
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_DeleteIMPIMapping({"kermit"}, 1000);
+
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _)).Times(0);
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("impi_mapping"), 1000, _));
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
+
 
 
 TEST_F(CacheRequestTest, DeletesHaveConsistencyLevelOne)
@@ -800,10 +1209,17 @@ TEST_F(CacheRequestTest, GetRegDataMainline)
   EXPECT_EQ(ECFS, rec.result.charging_addrs.ecfs);
 }
 
-TEST_F(CacheRequestTest, GetRegDataTTL)
+// The stored IRS summary is used if it was written with the XML.
+TEST_F(CacheRequestTest, GetRegDataStoredSummary)
 {
+  IRSSummary summary;
+  summary.public_ids.push_back("sip:kermit@example.com");
+  summary.private_id = "kermit@example.com";
+  summary.xml_hash = IRSSummary::hash("<howdy>");
+
   std::map<std::string, std::string> columns;
-  columns["is_registered"] = "\x01";
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["irs_summary"] = summary.encode();
 
   std::vector<cass::ColumnOrSuperColumn> slice;
   make_slice(slice, columns);
@@ -812,140 +1228,2056 @@ TEST_F(CacheRequestTest, GetRegDataTTL)
   RecordingTransaction* trx = make_rec_trx(&rec);
   CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
 
-  EXPECT_CALL(_client, get_slice(_,
-                                 "kermit",
-                                 ColumnPathForTable("impu"),
-                                 AllColumns(),
-                                 _))
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("impu"), _, _))
     .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(summary.public_ids, rec.result.summary.public_ids);
+  EXPECT_EQ("kermit@example.com", rec.result.summary.private_id);
+}
+
+// If the stored IRS summary doesn't match the XML (or there isn't one), the
+// summary is built from the XML.
+TEST_F(CacheRequestTest, GetRegDataStaleSummary)
+{
+  std::string xml = "<IMSSubscription><PrivateID>gonzo@example.com</PrivateID>"
+                    "<ServiceProfile><PublicIdentity><Identity>sip:gonzo@example.com"
+                    "</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
+
+  IRSSummary summary;
+  summary.private_id = "kermit@example.com";
+  summary.xml_hash = IRSSummary::hash("<howdy>");
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = xml;
+  columns["irs_summary"] = summary.encode();
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("gonzo");
 
+  EXPECT_CALL(_client, get_slice(_, "gonzo", ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(slice));
   EXPECT_CALL(*trx, on_success(_))
     .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
   execute_trx(op, trx);
 
-  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
-  EXPECT_EQ("", rec.result.xml);
-  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+  std::vector<std::string> expected_public_ids = {"sip:gonzo@example.com"};
+  EXPECT_EQ(expected_public_ids, rec.result.summary.public_ids);
+  EXPECT_EQ("gonzo@example.com", rec.result.summary.private_id);
 }
 
-TEST_F(CacheRequestTest, GetRegDataUnregistered)
+TEST_F(CacheRequestTest, GetRegDataCompressedXml)
 {
+  std::string xml = "<xml>" + std::string(1000, 'x') + "</xml>";
+
   std::map<std::string, std::string> columns;
-  columns["ims_subscription_xml"] = "<howdy>";
-  columns["is_registered"] = std::string("\x00", 1);
-  columns["associated_impi__somebody@example.com"] = "";
+  columns["ims_subscription_xml"] = ColumnCompression::compress(xml);
+  columns["is_registered"] = "\x01";
 
   std::vector<cass::ColumnOrSuperColumn> slice;
-  // Test with a TTL of 3600
-  make_slice(slice, columns, 3600);
+  make_slice(slice, columns);
 
   ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
   RecordingTransaction* trx = make_rec_trx(&rec);
   CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
 
-  EXPECT_CALL(_client, get_slice(_,
-                                 "kermit",
-                                 ColumnPathForTable("impu"),
-                                 AllColumns(),
-                                 _))
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("impu"), _, _))
     .WillOnce(SetArgReferee<0>(slice));
-
   EXPECT_CALL(*trx, on_success(_))
     .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
   execute_trx(op, trx);
 
-  EXPECT_EQ(RegistrationState::UNREGISTERED, rec.result.state);
-  EXPECT_EQ("<howdy>", rec.result.xml);
-  EXPECT_EQ(IMPIS, rec.result.impis);
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+  EXPECT_EQ(xml, rec.result.xml);
+}
+
+// XML that can't be decompressed is treated as missing.
+TEST_F(CacheRequestTest, GetRegDataCorruptCompressedXml)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = std::string("\0\x01\0\0\0\x10garbage", 13);
+  columns["is_registered"] = "\x01";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+  EXPECT_EQ("", rec.result.xml);
+}
+
+TEST_F(CacheRequestTest, GetRegDataTTL)
+{
+  std::map<std::string, std::string> columns;
+  columns["is_registered"] = "\x01";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+  EXPECT_EQ("", rec.result.xml);
+  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+}
+
+TEST_F(CacheRequestTest, GetRegDataUnregistered)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = std::string("\x00", 1);
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  // Test with a TTL of 3600
+  make_slice(slice, columns, 3600);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::UNREGISTERED, rec.result.state);
+  EXPECT_EQ("<howdy>", rec.result.xml);
+  EXPECT_EQ(IMPIS, rec.result.impis);
+}
+
+// If we have User-Data XML, but no explicit registration state, that should
+// still be treated as unregistered state.
+
+TEST_F(CacheRequestTest, GetRegDataNoRegState)
+{
+  std::vector<std::string> requested_columns;
+  requested_columns.push_back("ims_subscription_xml");
+  requested_columns.push_back("is_registered");
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::UNREGISTERED, rec.result.state);
+  EXPECT_EQ("<howdy>", rec.result.xml);
+  EXPECT_EQ(IMPIS, rec.result.impis);
+
+}
+
+// Invalid registration state is treated as NOT_REGISTERED
+
+TEST_F(CacheRequestTest, GetRegDataInvalidRegState)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "";
+  columns["is_registered"] = "\x03";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result.state);
+  EXPECT_EQ("", rec.result.xml);
+  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+}
+
+
+TEST_F(CacheRequestTest, GetRegDataNotFound)
+{
+  CassandraStore::Operation* op =
+    _cache.create_GetRegData("kermit");
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ("", rec.result.xml);
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result.state);
+  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+}
+
+// A row whose columns all hold deletion markers is treated as not found,
+// without reading it again at a higher consistency level.
+TEST_F(CacheRequestTest, GetRegDataDeletionMarkers)
+{
+  CassandraStore::Operation* op =
+    _cache.create_GetRegData("kermit");
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = DELETION_MARKER;
+  columns["is_registered"] = DELETION_MARKER;
+  columns["associated_impi__somebody@example.com"] = DELETION_MARKER;
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ("", rec.result.xml);
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result.state);
+  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+}
+
+// Repeated reads of the same IMPU are served from the registration data
+// cache when it is enabled.
+TEST_F(CacheRequestTest, GetRegDataFromLocalCache)
+{
+  _cache.configure_reg_data_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+  columns["primary_ccf"] = "ccf";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(1)
+    .WillOnce(SetArgReferee<0>(slice));
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+    RecordingTransaction* trx = make_rec_trx(&rec);
+    CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+    EXPECT_CALL(*trx, on_success(_))
+      .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+    execute_trx(op, trx);
+
+    EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+    EXPECT_EQ("<howdy>", rec.result.xml);
+    EXPECT_EQ(IMPIS, rec.result.impis);
+    EXPECT_EQ(CCF, rec.result.charging_addrs.ccfs);
+  }
+}
+
+// Writing registration data for an IMPU invalidates the cached copy.
+TEST_F(CacheRequestTest, PutRegDataInvalidatesLocalCache)
+{
+  _cache.configure_reg_data_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(2)
+    .WillRepeatedly(SetArgReferee<0>(slice));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  TestTransaction* put_trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData("kermit", 1000);
+  put_reg_data->with_xml("<howdy>");
+  EXPECT_CALL(*put_trx, on_success(_));
+  execute_trx((CassandraStore::Operation*)put_reg_data, put_trx);
+
+  trx = make_rec_trx(&rec);
+  op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+}
+
+// Associating a private ID with an IMPU invalidates the cached copy, so the
+// new IMPI is seen by the next read.
+TEST_F(CacheRequestTest, PutAssociatedPrivateIDInvalidatesLocalCache)
+{
+  _cache.configure_reg_data_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> old_slice;
+  make_slice(old_slice, columns);
+
+  columns["associated_impi__newbie@example.com"] = "";
+  std::vector<cass::ColumnOrSuperColumn> new_slice;
+  make_slice(new_slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(old_slice))
+    .WillOnce(SetArgReferee<0>(new_slice));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_EQ(IMPIS, rec.result.impis);
+
+  TestTransaction* put_trx = make_trx();
+  op = _cache.create_PutAssociatedPrivateID({"kermit"},
+                                            "newbie@example.com",
+                                            1000);
+  EXPECT_CALL(*put_trx, on_success(_));
+  execute_trx(op, put_trx);
+
+  trx = make_rec_trx(&rec);
+  op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  std::vector<std::string> expected_impis = {"newbie@example.com",
+                                             "somebody@example.com"};
+  EXPECT_EQ(expected_impis, rec.result.impis);
+}
+
+// Deleting an IMPU invalidates the cached copy.
+TEST_F(CacheRequestTest, DeletePublicIDsInvalidatesLocalCache)
+{
+  _cache.configure_reg_data_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(slice))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+  EXPECT_CALL(_client, remove("kermit", _, 1000, _));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_EQ("<howdy>", rec.result.xml);
+
+  TestTransaction* del_trx = make_trx();
+  op = _cache.create_DeletePublicIDs("kermit", IMPIS, 1000);
+  EXPECT_CALL(*del_trx, on_success(_));
+  execute_trx(op, del_trx);
+
+  trx = make_rec_trx(&rec);
+  op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_EQ("", rec.result.xml);
+}
+
+// Repeated reads of an IMPU that doesn't exist only go to Cassandra once
+// when the negative cache is enabled.
+TEST_F(CacheRequestTest, GetRegDataNotFoundNegativelyCached)
+{
+  _cache.configure_negative_cache(100, 60000);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(1)
+    .WillOnce(SetArgReferee<0>(empty_slice));
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+    RecordingTransaction* trx = make_rec_trx(&rec);
+    CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+
+    EXPECT_CALL(*trx, on_success(_))
+      .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+    execute_trx(op, trx);
+
+    EXPECT_EQ("", rec.result.xml);
+    EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result.state);
+    EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+  }
+}
+
+// Writing to an IMPU clears any record that it doesn't exist.
+TEST_F(CacheRequestTest, PutRegDataInvalidatesNegativeCache)
+{
+  _cache.configure_negative_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(empty_slice))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_EQ("", rec.result.xml);
+
+  TestTransaction* put_trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData("kermit", 1000);
+  put_reg_data->with_xml("<howdy>");
+  EXPECT_CALL(*put_trx, on_success(_));
+  execute_trx((CassandraStore::Operation*)put_reg_data, put_trx);
+
+  trx = make_rec_trx(&rec);
+  op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_EQ("<howdy>", rec.result.xml);
+}
+
+// Repeated lookups of an IMPI that doesn't exist fail without going to
+// Cassandra after the first, until the IMPI is written.
+TEST_F(CacheRequestTest, GetAuthVectorNotFoundNegativelyCached)
+{
+  _cache.configure_negative_cache(100, 60000);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(2)
+    .WillRepeatedly(SetArgReferee<0>(empty_slice));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    TestTransaction* trx = make_trx();
+    CassandraStore::Operation* op = _cache.create_GetAuthVector("kermit");
+    EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+    execute_trx(op, trx);
+  }
+
+  TestTransaction* put_trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_PutAssociatedPublicID("kermit", "sip:kermit@example.com", 1000);
+  EXPECT_CALL(*put_trx, on_success(_));
+  execute_trx(op, put_trx);
+
+  TestTransaction* trx = make_trx();
+  op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  execute_trx(op, trx);
+}
+
+// Once an IMPI has been found to have no public IDs, lookups of its public
+// IDs return an empty list without going to Cassandra until one is added.
+TEST_F(CacheRequestTest, GetAssocPublicIDsNegativelyCached)
+{
+  _cache.configure_negative_cache(100, 60000);
+
+  std::vector<std::string> impis = {"kermit"};
+  ResultRecorder<Cache::GetAssociatedPublicIDs, std::vector<std::string>> rec;
+
+  EXPECT_CALL(_client, multiget_slice(_, impis, ColumnPathForTable("impi"), _, _))
+    .WillRepeatedly(SetArgReferee<0>(empty_slice_multiget));
+
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetAssociatedPublicIDs("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_TRUE(rec.result.empty());
+  Mock::VerifyAndClearExpectations(&_client);
+
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, _)).Times(0);
+
+  trx = make_rec_trx(&rec);
+  op = _cache.create_GetAssociatedPublicIDs("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_TRUE(rec.result.empty());
+  Mock::VerifyAndClearExpectations(&_client);
+
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  TestTransaction* put_trx = make_trx();
+  op = _cache.create_PutAssociatedPublicID("kermit", "gonzo", 1000);
+  EXPECT_CALL(*put_trx, on_success(_));
+  execute_trx(op, put_trx);
+
+  std::map<std::string, std::string> columns;
+  columns["public_id_gonzo"] = "";
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  make_slice(slice["kermit"], columns);
+  EXPECT_CALL(_client, multiget_slice(_, impis, ColumnPathForTable("impi"), _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  trx = make_rec_trx(&rec);
+  op = _cache.create_GetAssociatedPublicIDs("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  std::vector<std::string> expected_ids = {"gonzo"};
+  EXPECT_EQ(expected_ids, rec.result);
+}
+
+// An operation that is answered locally is still called back on a worker
+// thread, rather than from within do_async.
+TEST_F(CacheRequestTest, LocalAnswerNotCalledBackInline)
+{
+  _cache.configure_negative_cache(100, 60000);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+
+  TestTransaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  execute_trx(op, trx);
+
+  pthread_t callback_thread = pthread_self();
+  trx = make_trx();
+  op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)))
+    .WillOnce(InvokeWithoutArgs([&callback_thread]()
+                                { callback_thread = pthread_self(); }));
+  execute_trx(op, trx);
+
+  EXPECT_FALSE(pthread_equal(pthread_self(), callback_thread));
+}
+
+// An operation that is answered locally is called back even while every
+// thread that goes to Cassandra is busy.
+TEST_F(CacheRequestTest, LocalAnswerNotQueuedBehindCassandra)
+{
+  _cache.configure_negative_cache(100, 60000);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+
+  TestTransaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  execute_trx(op, trx);
+
+  // Hold the store's only thread in a read of another row.
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, "gonzo", _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(empty_slice)));
+
+  TestTransaction* blocked_trx = make_trx();
+  op = _cache.create_GetAuthVector("gonzo");
+  EXPECT_CALL(*blocked_trx, on_failure(_));
+  CassandraStore::Transaction* trx_ptr = blocked_trx;
+  _cache.do_async(op, trx_ptr);
+  blocker.wait_for_call();
+
+  trx = make_trx();
+  op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  execute_trx(op, trx);
+
+  blocker.release();
+  wait();
+}
+
+// A read for an IMPU that is submitted while an identical read is in flight
+// shares that read's result.
+TEST_F(CacheRequestTest, GetRegDataCoalesced)
+{
+  MockCacheStats stats;
+  _cache.configure_stats(&stats);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(1)
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(slice)));
+  EXPECT_CALL(stats, incr_cache_coalesced_reads()).Times(1);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec1;
+  CassandraStore::Transaction* trx1 = make_rec_trx(&rec1);
+  CassandraStore::Operation* op1 = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*(RecordingTransaction*)trx1, on_success(_))
+    .WillOnce(Invoke((RecordingTransaction*)trx1,
+                     &RecordingTransaction::record_result));
+  _cache.do_async(op1, trx1);
+  blocker.wait_for_call();
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec2;
+  CassandraStore::Transaction* trx2 = make_rec_trx(&rec2);
+  CassandraStore::Operation* op2 = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*(RecordingTransaction*)trx2, on_success(_))
+    .WillOnce(Invoke((RecordingTransaction*)trx2,
+                     &RecordingTransaction::record_result));
+  _cache.do_async(op2, trx2);
+
+  blocker.release();
+  wait();
+  wait();
+
+  EXPECT_EQ("<howdy>", rec1.result.xml);
+  EXPECT_EQ(RegistrationState::REGISTERED, rec1.result.state);
+  EXPECT_EQ("<howdy>", rec2.result.xml);
+  EXPECT_EQ(RegistrationState::REGISTERED, rec2.result.state);
+
+  _cache.configure_stats(NULL);
+}
+
+// A read submitted after a write to the same IMPU is not coalesced with a
+// read that started before the write.
+TEST_F(CacheRequestTest, GetRegDataNotCoalescedAfterWrite)
+{
+  MockCacheStats stats;
+  _cache.configure_stats(&stats);
+
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(empty_slice)))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  EXPECT_CALL(stats, incr_cache_coalesced_reads()).Times(0);
+
+  CassandraStore::Transaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  _cache.do_async(op, trx);
+  blocker.wait_for_call();
+
+  trx = make_trx();
+  Cache::PutRegData* put_reg_data = _cache.create_PutRegData("kermit", 1000);
+  put_reg_data->with_xml("<howdy>");
+  op = put_reg_data;
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  _cache.do_async(op, trx);
+
+  trx = make_trx();
+  op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  _cache.do_async(op, trx);
+
+  blocker.release();
+  wait();
+  wait();
+  wait();
+
+  _cache.configure_stats(NULL);
+}
+
+// When the in-flight read fails, the reads coalesced with it fail too.
+TEST_F(CacheRequestTest, GetAuthVectorCoalescedFailure)
+{
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(1)
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(empty_slice)));
+
+  CassandraStore::Transaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*(TestTransaction*)trx,
+              on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  _cache.do_async(op, trx);
+  blocker.wait_for_call();
+
+  trx = make_trx();
+  op = _cache.create_GetAuthVector("kermit");
+  EXPECT_CALL(*(TestTransaction*)trx,
+              on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  _cache.do_async(op, trx);
+
+  blocker.release();
+  wait();
+  wait();
+}
+
+TEST_F(CacheRequestTest, GetAssocPublicIDsCoalesced)
+{
+  std::map<std::string, std::string> columns;
+  columns["public_id_gonzo"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> inner_slice;
+  make_slice(inner_slice, columns);
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  slice["kermit"] = inner_slice;
+
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, _))
+    .Times(1)
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(slice)));
+
+  ResultRecorder<Cache::GetAssociatedPublicIDs, std::vector<std::string>> rec1;
+  CassandraStore::Transaction* trx1 = make_rec_trx(&rec1);
+  CassandraStore::Operation* op1 = _cache.create_GetAssociatedPublicIDs("kermit");
+  EXPECT_CALL(*(RecordingTransaction*)trx1, on_success(_))
+    .WillOnce(Invoke((RecordingTransaction*)trx1,
+                     &RecordingTransaction::record_result));
+  _cache.do_async(op1, trx1);
+  blocker.wait_for_call();
+
+  ResultRecorder<Cache::GetAssociatedPublicIDs, std::vector<std::string>> rec2;
+  CassandraStore::Transaction* trx2 = make_rec_trx(&rec2);
+  CassandraStore::Operation* op2 = _cache.create_GetAssociatedPublicIDs("kermit");
+  EXPECT_CALL(*(RecordingTransaction*)trx2, on_success(_))
+    .WillOnce(Invoke((RecordingTransaction*)trx2,
+                     &RecordingTransaction::record_result));
+  _cache.do_async(op2, trx2);
+
+  blocker.release();
+  wait();
+  wait();
+
+  std::vector<std::string> expected_ids(1, "gonzo");
+  EXPECT_EQ(expected_ids, rec1.result);
+  EXPECT_EQ(expected_ids, rec2.result);
+}
+
+// Reads the registration data for several IMPUs with a single multiget.
+TEST_F(CacheRequestTest, GetRegDataMulti)
+{
+  std::map<std::string, std::string> kermit_columns;
+  kermit_columns["ims_subscription_xml"] = "<kermit>";
+  kermit_columns["is_registered"] = "\x01";
+  kermit_columns["associated_impi__somebody@example.com"] = "";
+
+  std::map<std::string, std::string> gonzo_columns;
+  gonzo_columns["ims_subscription_xml"] = "<gonzo>";
+  gonzo_columns["primary_ccf"] = "ccf";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  make_slice(slice["kermit"], kermit_columns);
+  make_slice(slice["gonzo"], gonzo_columns);
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo", "kermit"};
+  std::vector<std::string> keys = {"gonzo", "kermit"};
+
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      keys,
+                                      ColumnPathForTable("impu"),
+                                      AllColumns(),
+                                      cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  ResultRecorder<Cache::GetRegDataMulti,
+                 std::map<std::string, Cache::GetRegData::Result> > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegDataMulti(public_ids);
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(2u, rec.result.size());
+  EXPECT_EQ("<kermit>", rec.result["kermit"].xml);
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result["kermit"].state);
+  EXPECT_EQ(IMPIS, rec.result["kermit"].impis);
+  EXPECT_EQ("<gonzo>", rec.result["gonzo"].xml);
+  EXPECT_EQ(RegistrationState::UNREGISTERED, rec.result["gonzo"].state);
+  EXPECT_EQ(CCF, rec.result["gonzo"].charging_addrs.ccfs);
+}
+
+// Once an operation has been freed, the next operation of the same type
+// reuses its memory rather than going to the heap.
+TEST_F(CacheRequestTest, OperationsAllocatedFromPool)
+{
+  ObjectPool::trim();
+
+  ObjectPool::Stats before = ObjectPool::thread_stats();
+  delete _cache.create_GetRegData("kermit");
+  ObjectPool::Stats first = ObjectPool::thread_stats();
+  delete _cache.create_GetRegData("gonzo");
+  ObjectPool::Stats second = ObjectPool::thread_stats();
+
+  EXPECT_EQ(1u, first.heap_allocations - before.heap_allocations);
+  EXPECT_EQ(0u, first.pool_allocations - before.pool_allocations);
+  EXPECT_EQ(0u, second.heap_allocations - first.heap_allocations);
+  EXPECT_EQ(1u, second.pool_allocations - first.pool_allocations);
+}
+
+// Operations are allocated on the thread that submits them, but freed on a
+// cache thread.  Their memory (and that of the containers in them) goes back
+// to the submitting thread, so once that thread has made a request, later
+// requests don't go to the heap at all.
+TEST_F(CacheRequestTest, RequestsAllocatedFromPool)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, batch_mutate(_, _)).Times(3);
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(3)
+    .WillRepeatedly(SetArgReferee<0>(slice));
+
+  ObjectPool::trim();
+  uint64_t heap_allocations[3];
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    ObjectPool::Stats before = ObjectPool::thread_stats();
+
+    TestTransaction* trx = make_trx();
+    Cache::PutRegData* put_op = _cache.create_PutRegData("kermit", 1000);
+    put_op->with_xml("<howdy>").with_reg_state(RegistrationState::REGISTERED);
+    CassandraStore::Operation* op = put_op;
+    EXPECT_CALL(*trx, on_success(_));
+    execute_trx(op, trx);
+
+    trx = make_trx();
+    op = _cache.create_GetRegData("kermit");
+    EXPECT_CALL(*trx, on_success(_));
+    execute_trx(op, trx);
+
+    // The cache thread frees the operations just after the transactions.
+    for (int jj = 0;
+         (jj < 1000) &&
+         (ObjectPool::thread_stats().outstanding > before.outstanding);
+         jj++)
+    {
+      usleep(1000);
+    }
+    EXPECT_EQ(before.outstanding, ObjectPool::thread_stats().outstanding);
+
+    heap_allocations[ii] =
+      ObjectPool::thread_stats().heap_allocations - before.heap_allocations;
+  }
+
+  EXPECT_LT(0u, heap_allocations[0]);
+  EXPECT_EQ(0u, heap_allocations[1]);
+  EXPECT_EQ(0u, heap_allocations[2]);
+}
+
+// IMPUs that aren't found at consistency level ONE are retried at QUORUM.
+TEST_F(CacheRequestTest, GetRegDataMultiRetryAtQuorum)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  make_slice(slice["kermit"], columns);
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > quorum_slice;
+  make_slice(quorum_slice["gonzo"], columns);
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo", "animal"};
+  std::vector<std::string> keys = {"animal", "gonzo", "kermit"};
+  std::vector<std::string> missing_keys = {"animal", "gonzo"};
+
+  EXPECT_CALL(_client, multiget_slice(_, keys, _, _, cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(_client, multiget_slice(_, missing_keys, _, _, cass::ConsistencyLevel::QUORUM))
+    .WillOnce(SetArgReferee<0>(quorum_slice));
+
+  ResultRecorder<Cache::GetRegDataMulti,
+                 std::map<std::string, Cache::GetRegData::Result> > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegDataMulti(public_ids);
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(3u, rec.result.size());
+  EXPECT_EQ("<howdy>", rec.result["kermit"].xml);
+  EXPECT_EQ("<howdy>", rec.result["gonzo"].xml);
+  EXPECT_EQ("", rec.result["animal"].xml);
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result["animal"].state);
+}
+
+// Operations use the consistency levels configured for their type, and only
+// retry rows that aren't found if configured to.
+TEST_F(CacheRequestTest, ConfiguredReadConsistency)
+{
+  EXPECT_TRUE(_cache.configure_consistency(
+                "GetRegData",
+                Cache::Consistency(cass::ConsistencyLevel::LOCAL_ONE,
+                                   cass::ConsistencyLevel::LOCAL_QUORUM)));
+  EXPECT_TRUE(_cache.configure_consistency(
+                "GetAuthVector",
+                Cache::Consistency(cass::ConsistencyLevel::LOCAL_ONE,
+                                   cass::ConsistencyLevel::LOCAL_ONE)));
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  {
+    InSequence s;
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, cass::ConsistencyLevel::LOCAL_ONE))
+      .WillOnce(SetArgReferee<0>(empty_slice));
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, cass::ConsistencyLevel::LOCAL_QUORUM))
+      .WillOnce(SetArgReferee<0>(slice));
+  }
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ("<howdy>", rec.result.xml);
+
+  EXPECT_CALL(_client, get_slice(_, "gonzo", _, _, cass::ConsistencyLevel::LOCAL_ONE))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+
+  TestTransaction* trx2 = make_trx();
+  op = _cache.create_GetAuthVector("gonzo");
+  EXPECT_CALL(*trx2, on_failure(OperationHasResult(CassandraStore::NOT_FOUND)));
+  execute_trx(op, trx2);
+}
+
+// Writes are made at the level configured for their type of operation.
+TEST_F(CacheRequestTest, ConfiguredWriteConsistency)
+{
+  EXPECT_TRUE(_cache.configure_consistency(
+                "PutAssociatedPublicID",
+                Cache::Consistency(cass::ConsistencyLevel::ANY)));
+  EXPECT_FALSE(_cache.configure_consistency("PutKermit", Cache::Consistency()));
+
+  EXPECT_CALL(_client, batch_mutate(_, cass::ConsistencyLevel::ANY));
+
+  TestTransaction* trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_PutAssociatedPublicID("kermit@example.com", "sip:kermit@example.com", 1000, 300);
+  EXPECT_CALL(*trx, on_success(_));
+  execute_trx(op, trx);
+}
+
+// If a QUORUM read isn't possible, the results at ONE are used.
+TEST_F(CacheRequestTest, GetRegDataMultiQuorumUnavailable)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  make_slice(slice["kermit"], columns);
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo"};
+  cass::UnavailableException ue;
+
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, cass::ConsistencyLevel::QUORUM))
+    .WillOnce(Throw(ue));
+
+  ResultRecorder<Cache::GetRegDataMulti,
+                 std::map<std::string, Cache::GetRegData::Result> > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegDataMulti(public_ids);
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(2u, rec.result.size());
+  EXPECT_EQ("<howdy>", rec.result["kermit"].xml);
+  EXPECT_EQ("", rec.result["gonzo"].xml);
+}
+
+// IMPUs found in the local caches aren't read from Cassandra, and those
+// that are read are added to the local caches.
+TEST_F(CacheRequestTest, GetRegDataMultiLocalCaches)
+{
+  _cache.configure_reg_data_cache(100, 60000);
+  _cache.configure_negative_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  make_slice(slice["kermit"], columns);
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo"};
+
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, cass::ConsistencyLevel::QUORUM))
+    .WillOnce(SetArgReferee<0>(empty_slice_multiget));
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    ResultRecorder<Cache::GetRegDataMulti,
+                   std::map<std::string, Cache::GetRegData::Result> > rec;
+    RecordingTransaction* trx = make_rec_trx(&rec);
+    CassandraStore::Operation* op = _cache.create_GetRegDataMulti(public_ids);
+    EXPECT_CALL(*trx, on_success(_))
+      .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+    execute_trx(op, trx);
+
+    ASSERT_EQ(2u, rec.result.size());
+    EXPECT_EQ("<howdy>", rec.result["kermit"].xml);
+    EXPECT_EQ("", rec.result["gonzo"].xml);
+  }
+}
+
+// An IMPU row that points at an IRS row takes its XML and charging
+// addresses from the IRS row.
+TEST_F(CacheRequestTest, GetRegDataIrsTable)
+{
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["is_registered"] = "\x01";
+  impu_columns["associated_impi__somebody@example.com"] = "";
+  impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::string> irs_columns;
+  irs_columns["ims_subscription_xml"] = "<howdy>";
+  irs_columns["primary_ccf"] = "ccf1";
+  irs_columns["secondary_ccf"] = "ccf2";
+
+  std::vector<cass::ColumnOrSuperColumn> impu_slice;
+  make_slice(impu_slice, impu_columns);
+  std::vector<cass::ColumnOrSuperColumn> irs_slice;
+  make_slice(irs_slice, irs_columns);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "robin",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("irs"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(irs_slice));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("robin");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+  EXPECT_EQ("<howdy>", rec.result.xml);
+  EXPECT_EQ(IMPIS, rec.result.impis);
+  EXPECT_EQ(CCFS, rec.result.charging_addrs.ccfs);
+}
+
+// Where the IMPU and IRS rows both have a column, the most recently written
+// one is used.
+TEST_F(CacheRequestTest, GetRegDataIrsTableMergeByTimestamp)
+{
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["ims_subscription_xml"] = "<impu>";
+  impu_columns["primary_ccf"] = "impu_ccf";
+  impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::string> irs_columns;
+  irs_columns["ims_subscription_xml"] = "<irs>";
+  irs_columns["primary_ccf"] = "irs_ccf";
+
+  std::vector<cass::ColumnOrSuperColumn> impu_slice;
+  make_slice(impu_slice, impu_columns);
+  std::vector<cass::ColumnOrSuperColumn> irs_slice;
+  make_slice(irs_slice, irs_columns);
+
+  // The XML was last written to the IMPU row, and the CCF to the IRS row.
+  for (std::vector<cass::ColumnOrSuperColumn>::iterator it = impu_slice.begin();
+       it != impu_slice.end();
+       ++it)
+  {
+    it->column.timestamp = (it->column.name == "primary_ccf") ? 1000 : 3000;
+  }
+
+  for (std::vector<cass::ColumnOrSuperColumn>::iterator it = irs_slice.begin();
+       it != irs_slice.end();
+       ++it)
+  {
+    it->column.timestamp = 2000;
+  }
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("irs"), _, _))
+    .WillOnce(SetArgReferee<0>(irs_slice));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  const std::deque<std::string> irs_ccf = {"irs_ccf"};
+  EXPECT_EQ("<impu>", rec.result.xml);
+  EXPECT_EQ(irs_ccf, rec.result.charging_addrs.ccfs);
+}
+
+// If the IRS row has gone, the IMPU row is used on its own.
+TEST_F(CacheRequestTest, GetRegDataIrsRowNotFound)
+{
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["is_registered"] = "\x01";
+  impu_columns["irs_id"] = "kermit";
+
+  std::vector<cass::ColumnOrSuperColumn> impu_slice;
+  make_slice(impu_slice, impu_columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("irs"), _, _))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+  EXPECT_EQ("", rec.result.xml);
+}
+
+// GetRegDataMulti reads all the IRS rows that its IMPU rows point at in one
+// request.
+TEST_F(CacheRequestTest, GetRegDataMultiIrsTable)
+{
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["is_registered"] = "\x01";
+  impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::string> gonzo_columns;
+  gonzo_columns["ims_subscription_xml"] = "<gonzo>";
+
+  std::map<std::string, std::string> irs_columns;
+  irs_columns["ims_subscription_xml"] = "<kermit>";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > impu_slice;
+  make_slice(impu_slice["kermit"], impu_columns);
+  make_slice(impu_slice["robin"], impu_columns);
+  make_slice(impu_slice["gonzo"], gonzo_columns);
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > irs_slice;
+  make_slice(irs_slice["kermit"], irs_columns);
+
+  std::vector<std::string> public_ids = {"kermit", "robin", "gonzo"};
+  std::vector<std::string> impu_keys = {"gonzo", "kermit", "robin"};
+  std::vector<std::string> irs_keys = {"kermit"};
+
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      impu_keys,
+                                      ColumnPathForTable("impu"),
+                                      AllColumns(),
+                                      cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      irs_keys,
+                                      ColumnPathForTable("irs"),
+                                      AllColumns(),
+                                      cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(irs_slice));
+
+  ResultRecorder<Cache::GetRegDataMulti,
+                 std::map<std::string, Cache::GetRegData::Result> > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegDataMulti(public_ids);
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(3u, rec.result.size());
+  EXPECT_EQ("<kermit>", rec.result["kermit"].xml);
+  EXPECT_EQ("<kermit>", rec.result["robin"].xml);
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result["robin"].state);
+  EXPECT_EQ("<gonzo>", rec.result["gonzo"].xml);
+}
+
+// Only the requested columns are read.
+TEST_F(CacheRequestTest, GetRegDataRegStateOnly)
+{
+  std::map<std::string, std::string> columns;
+  columns["is_registered"] = "\x01";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  std::vector<std::string> requested_columns = {"is_registered"};
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op =
+    _cache.create_GetRegData("kermit", Cache::REG_DATA_REG_STATE);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 SpecificColumns(requested_columns),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result.state);
+  EXPECT_EQ("", rec.result.xml);
+}
+
+// The associated IMPIs can't be read as named columns, so requesting them
+// reads the whole row.
+TEST_F(CacheRequestTest, GetRegDataImpisReadsWholeRow)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op =
+    _cache.create_GetRegData("kermit", Cache::REG_DATA_XML | Cache::REG_DATA_IMPIS);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ("<howdy>", rec.result.xml);
+  EXPECT_EQ(IMPIS, rec.result.impis);
+}
+
+// Only the XML columns are read, from both the IMPU and IRS rows.
+TEST_F(CacheRequestTest, GetRegDataMultiXmlOnly)
+{
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["irs_id"] = "kermit";
+
+  std::map<std::string, std::string> irs_columns;
+  irs_columns["ims_subscription_xml"] = "<kermit>";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > impu_slice;
+  make_slice(impu_slice["kermit"], impu_columns);
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > irs_slice;
+  make_slice(irs_slice["kermit"], irs_columns);
+
+  std::vector<std::string> public_ids = {"kermit"};
+  std::vector<std::string> requested_columns = {"ims_subscription_xml",
+                                                "irs_summary",
+                                                "irs_id"};
+
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      public_ids,
+                                      ColumnPathForTable("impu"),
+                                      SpecificColumns(requested_columns),
+                                      cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      public_ids,
+                                      ColumnPathForTable("irs"),
+                                      SpecificColumns(requested_columns),
+                                      cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(irs_slice));
+
+  ResultRecorder<Cache::GetRegDataMulti,
+                 std::map<std::string, Cache::GetRegData::Result> > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op =
+    _cache.create_GetRegDataMulti(public_ids, Cache::REG_DATA_XML);
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(1u, rec.result.size());
+  EXPECT_EQ("<kermit>", rec.result["kermit"].xml);
+}
+
+// Warming up the cache reads the public IDs in batches into the
+// registration data cache, so that later reads don't go to Cassandra.
+TEST_F(CacheRequestTest, WarmUp)
+{
+  _cache.configure_reg_data_cache(100, 60000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice1;
+  make_slice(slice1["kermit"], columns);
+  make_slice(slice1["gonzo"], columns);
+
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice2;
+  make_slice(slice2["robin"], columns);
+
+  std::vector<std::string> batch1 = {"gonzo", "kermit"};
+  std::vector<std::string> batch2 = {"robin"};
+
+  EXPECT_CALL(_client, multiget_slice(_, batch1, ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(slice1));
+  EXPECT_CALL(_client, multiget_slice(_, batch2, ColumnPathForTable("impu"), _, _))
+    .WillOnce(SetArgReferee<0>(slice2));
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo", "robin"};
+  EXPECT_EQ(3u, _cache.warm_up(public_ids, 2, 1));
+
+  std::vector<std::string> hot_public_ids;
+  _cache.get_hot_public_ids(hot_public_ids);
+  EXPECT_EQ(3u, hot_public_ids.size());
+
+  // The data is now read without going to Cassandra.
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _)).Times(0);
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("robin");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+  EXPECT_EQ("<howdy>", rec.result.xml);
+}
+
+// There's nothing to warm up if the registration data cache is disabled.
+TEST_F(CacheRequestTest, WarmUpDisabled)
+{
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, _)).Times(0);
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo", "robin"};
+  EXPECT_EQ(0u, _cache.warm_up(public_ids));
+}
+
+// The worker pool adds a thread when every thread is busy, and removes it
+// again once it has been idle for the idle timeout.
+TEST_F(CacheRequestTest, WorkerPoolGrowsAndShrinks)
+{
+  _cache.configure_worker_pool(1, 3, 20);
+
+  MockCacheStats stats;
+  _cache.configure_stats(&stats);
+  unsigned long threads = 0;
+  EXPECT_CALL(stats, update_cache_worker_threads(_))
+    .WillRepeatedly(SaveArg<0>(&threads));
+  EXPECT_CALL(stats, update_cache_queue_depth(_)).Times(AnyNumber());
+  EXPECT_CALL(stats, update_cache_queue_wait_us(_, _)).Times(AnyNumber());
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  // Each read is held in Cassandra until the test releases it, so the reads
+  // are only all in flight at once if the pool has grown to three threads.
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _))
+    .Times(3)
+    .WillRepeatedly(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                          SetArgReferee<0>(slice)));
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo", "robin"};
+
+  for (std::vector<std::string>::iterator public_id = public_ids.begin();
+       public_id != public_ids.end();
+       ++public_id)
+  {
+    CassandraStore::Transaction* trx = make_trx();
+    CassandraStore::Operation* op = _cache.create_GetRegData(*public_id);
+    EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+    _cache.do_async(op, trx);
+    blocker.wait_for_call();
+  }
+
+  EXPECT_EQ(3u, threads);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    blocker.release();
+    wait();
+  }
+
+  // Once the extra threads have been idle for the timeout they exit, so the
+  // next read finds the pool back at its minimum size.
+  usleep(200000);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+  CassandraStore::Transaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  _cache.do_async(op, trx);
+  wait();
+
+  EXPECT_EQ(1u, threads);
+
+  _cache.configure_stats(NULL);
+}
+
+// Queues a low priority write and then a high priority read behind a read
+// that is held in Cassandra, on a pool with a single worker.  The order in
+// which they are run is checked by the caller's expectations.
+static void queue_behind_blocked_read(CacheRequestTest* test,
+                                      ThriftCallBlocker& blocker)
+{
+  CassandraStore::Transaction* trx = test->make_trx();
+  CassandraStore::Operation* op = test->_cache.create_GetRegData("kermit");
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  test->_cache.do_async(op, trx);
+  blocker.wait_for_call();
+
+  DigestAuthVector av;
+  av.ha1 = "somehash";
+  trx = test->make_trx();
+  op = test->_cache.create_PutAuthVector("gonzo", av, 1000);
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  test->_cache.do_async(op, trx);
+
+  trx = test->make_trx();
+  op = test->_cache.create_GetRegData("robin");
+  EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+  test->_cache.do_async(op, trx);
+
+  blocker.release();
+  test->wait();
+  test->wait();
+  test->wait();
+}
+
+// Higher priority operations are run before lower priority ones.
+TEST_F(CacheRequestTest, WorkerPoolRunsHighPriorityFirst)
+{
+  _cache.configure_worker_pool(1, 1, 10000, 10000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ThriftCallBlocker blocker;
+  {
+    InSequence s;
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+      .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                      SetArgReferee<0>(slice)));
+    EXPECT_CALL(_client, get_slice(_, "robin", _, _, _))
+      .WillOnce(SetArgReferee<0>(slice));
+    EXPECT_CALL(_client, batch_mutate(_, _));
+  }
+
+  queue_behind_blocked_read(this, blocker);
+}
+
+// An operation that has been queued for longer than the starvation limit is
+// run before higher priority ones.
+TEST_F(CacheRequestTest, WorkerPoolRunsStarvedOperations)
+{
+  _cache.configure_worker_pool(1, 1, 10000, 0);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ThriftCallBlocker blocker;
+  {
+    InSequence s;
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+      .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                      SetArgReferee<0>(slice)));
+    EXPECT_CALL(_client, batch_mutate(_, _));
+    EXPECT_CALL(_client, get_slice(_, "robin", _, _, _))
+      .WillOnce(SetArgReferee<0>(slice));
+  }
+
+  queue_behind_blocked_read(this, blocker);
+}
+
+// With key affinity, each worker runs operations in the order they were
+// queued rather than by priority, so that operations on a key stay in order.
+TEST_F(CacheRequestTest, KeyAffinityRunsInOrder)
+{
+  _cache.configure_key_affinity(1);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ThriftCallBlocker blocker;
+  {
+    InSequence s;
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+      .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                      SetArgReferee<0>(slice)));
+    EXPECT_CALL(_client, batch_mutate(_, _));
+    EXPECT_CALL(_client, get_slice(_, "robin", _, _, _))
+      .WillOnce(SetArgReferee<0>(slice));
+  }
+
+  queue_behind_blocked_read(this, blocker);
+}
+
+// Operations on one key always run on the same worker, and the imbalance
+// this causes is reported.
+TEST_F(CacheRequestTest, KeyAffinityReportsImbalance)
+{
+  _cache.configure_key_affinity(2);
+
+  MockCacheStats stats;
+  _cache.configure_stats(&stats);
+  EXPECT_CALL(stats, update_cache_worker_threads(2)).Times(1000);
+  EXPECT_CALL(stats, update_cache_queue_depth(_)).Times(AnyNumber());
+  EXPECT_CALL(stats, update_cache_queue_wait_us(_, _)).Times(AnyNumber());
+  EXPECT_CALL(stats, update_cache_shard_imbalance(200));
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .Times(1000)
+    .WillRepeatedly(SetArgReferee<0>(slice));
+
+  for (int ii = 0; ii < 1000; ii++)
+  {
+    CassandraStore::Transaction* trx = make_trx();
+    CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+    EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+    _cache.do_async(op, trx);
+    wait();
+  }
+
+  _cache.configure_stats(NULL);
+}
+
+// A read that is much slower than recent reads is hedged, and completed with
+// the result of the hedge.
+TEST_F(CacheRequestTest, SlowReadHedged)
+{
+  _cache.configure_worker_pool(2, 2);
+  _cache.configure_hedging(50, 100);
+
+  MockCacheStats stats;
+  _cache.configure_stats(&stats);
+  EXPECT_CALL(stats, update_cache_worker_threads(_)).Times(AnyNumber());
+  EXPECT_CALL(stats, update_cache_queue_depth(_)).Times(AnyNumber());
+  EXPECT_CALL(stats, update_cache_queue_wait_us(_, _)).Times(AnyNumber());
+  EXPECT_CALL(stats, incr_cache_hedged_reads()).Times(1);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  // Reads aren't hedged until enough have completed to know how long they
+  // usually take.
+  EXPECT_CALL(_client, get_slice(_, "gonzo", _, _, _))
+    .Times(64)
+    .WillRepeatedly(SetArgReferee<0>(slice));
+
+  for (int ii = 0; ii < 64; ii++)
+  {
+    CassandraStore::Transaction* trx = make_trx();
+    CassandraStore::Operation* op = _cache.create_GetRegData("gonzo");
+    EXPECT_CALL(*(TestTransaction*)trx, on_success(_));
+    _cache.do_async(op, trx);
+    wait();
+  }
+
+  // The first read of kermit is held in Cassandra, so the hedged read
+  // completes the transaction.
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(slice)))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result > rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  CassandraStore::Transaction* _trx = trx;
+  _cache.do_async(op, _trx);
+  wait();
+
+  EXPECT_EQ("<howdy>", rec.result.xml);
+
+  blocker.wait_for_call();
+  blocker.release();
+  _cache.stop();
+  _cache.configure_stats(NULL);
+}
+
+// Get a deadline the specified number of milliseconds from now (which can be
+// negative for one that has already passed).
+static struct timespec deadline_from_now(long ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  long long ns = ((long long)deadline.tv_sec * 1000000000LL) +
+                 deadline.tv_nsec + (ms * 1000000LL);
+  deadline.tv_sec = ns / 1000000000LL;
+  deadline.tv_nsec = ns % 1000000000LL;
+  return deadline;
+}
+
+// An operation whose deadline has passed is failed without being run.
+TEST_F(CacheRequestTest, ExpiredOperationNotRun)
+{
+  MockCacheStats stats;
+  _cache.configure_stats(&stats);
+
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _)).Times(0);
+  EXPECT_CALL(stats, incr_cache_expired_operations()).Times(1);
+
+  TestTransaction* trx = make_trx();
+  Cache::GetRegData* get_reg_data = _cache.create_GetRegData("kermit");
+  get_reg_data->set_deadline(deadline_from_now(-1));
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::RESOURCE_ERROR)));
+
+  CassandraStore::Operation* op = get_reg_data;
+  CassandraStore::Transaction* _trx = trx;
+  _cache.do_async(op, _trx);
+  wait();
+
+  _cache.configure_stats(NULL);
+}
+
+// An operation is run as normal if it is dequeued before its deadline.
+TEST_F(CacheRequestTest, OperationRunBeforeDeadline)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  TestTransaction* trx = make_trx();
+  Cache::GetRegData* get_reg_data = _cache.create_GetRegData("kermit");
+  get_reg_data->set_deadline(deadline_from_now(10000));
+  EXPECT_CALL(*trx, on_success(_));
+
+  CassandraStore::Operation* op = get_reg_data;
+  CassandraStore::Transaction* _trx = trx;
+  _cache.do_async(op, _trx);
+  wait();
+}
+
+// A read whose deadline has passed is still run if a read without a deadline
+// has been attached to it.
+TEST_F(CacheRequestTest, CoalescedReadExtendsDeadline)
+{
+  _cache.configure_worker_pool(1, 1, 10000, 10000);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, get_slice(_, "gonzo", _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block),
+                    SetArgReferee<0>(slice)));
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  // Hold the only worker so that the reads of kermit are queued.
+  TestTransaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetRegData("gonzo");
+  EXPECT_CALL(*trx, on_success(_));
+  CassandraStore::Transaction* _trx = trx;
+  _cache.do_async(op, _trx);
+  blocker.wait_for_call();
+
+  TestTransaction* trx1 = make_trx();
+  Cache::GetRegData* get_reg_data = _cache.create_GetRegData("kermit");
+  get_reg_data->set_deadline(deadline_from_now(-1));
+  EXPECT_CALL(*trx1, on_success(_));
+  CassandraStore::Operation* op1 = get_reg_data;
+  CassandraStore::Transaction* _trx1 = trx1;
+  _cache.do_async(op1, _trx1);
+
+  TestTransaction* trx2 = make_trx();
+  CassandraStore::Operation* op2 = _cache.create_GetRegData("kermit");
+  EXPECT_CALL(*trx2, on_success(_));
+  CassandraStore::Transaction* _trx2 = trx2;
+  _cache.do_async(op2, _trx2);
+
+  blocker.release();
+  wait();
+  wait();
+  wait();
+}
+
+TEST_F(CacheRequestTest, WriteBatchSentWhenFull)
+{
+  // The window is longer than wait() allows, so the batch must be sent
+  // because it is full.
+  _cache.configure_write_batching(10000000, 2);
+
+  std::map<std::string, std::string> columns;
+  columns["public_id_kermit"] = "";
+  columns["public_id_gonzo"] = "";
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impi", "somebody", columns), _))
+    .Times(1);
+  EXPECT_CALL(_cm, inform_success(_));
+
+  TestTransaction* trx1 = make_trx();
+  TestTransaction* trx2 = make_trx();
+  EXPECT_CALL(*trx1, on_success(_));
+  EXPECT_CALL(*trx2, on_success(_));
+
+  CassandraStore::Operation* op1 =
+    _cache.create_PutAssociatedPublicID("somebody", "kermit", 1000);
+  CassandraStore::Operation* op2 =
+    _cache.create_PutAssociatedPublicID("somebody", "gonzo", 1000);
+  CassandraStore::Transaction* _trx1 = trx1;
+  CassandraStore::Transaction* _trx2 = trx2;
+  _cache.do_async(op1, _trx1);
+  _cache.do_async(op2, _trx2);
+
+  wait();
+  wait();
+}
+
+TEST_F(CacheRequestTest, WriteBatchKeepsLatestWrite)
+{
+  _cache.configure_write_batching(100000, 100);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<new>";
+  columns["irs_summary"] = IRSSummary("<new>").encode();
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impu", "kermit", columns, 2000), _))
+    .Times(1);
+  EXPECT_CALL(_cm, inform_success(_));
+
+  TestTransaction* trx1 = make_trx();
+  TestTransaction* trx2 = make_trx();
+  EXPECT_CALL(*trx1, on_success(_));
+  EXPECT_CALL(*trx2, on_success(_));
+
+  // The second write has an older timestamp, so loses to the first.
+  Cache::PutRegData* put1 = _cache.create_PutRegData("kermit", 2000);
+  put1->with_xml("<new>");
+  Cache::PutRegData* put2 = _cache.create_PutRegData("kermit", 1000);
+  put2->with_xml("<old>");
+
+  CassandraStore::Operation* op1 = put1;
+  CassandraStore::Operation* op2 = put2;
+  CassandraStore::Transaction* _trx1 = trx1;
+  CassandraStore::Transaction* _trx2 = trx2;
+  _cache.do_async(op1, _trx1);
+  _cache.do_async(op2, _trx2);
+
+  wait();
+  wait();
+}
+
+TEST_F(CacheRequestTest, WriteBatchFailure)
+{
+  _cache.configure_write_batching(100000, 100);
+
+  cass::InvalidRequestException ire;
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(Throw(ire));
+  EXPECT_CALL(_cm, inform_success(_));
+
+  TestTransaction* trx1 = make_trx();
+  TestTransaction* trx2 = make_trx();
+  EXPECT_CALL(*trx1, on_failure(OperationHasResult(CassandraStore::INVALID_REQUEST)));
+  EXPECT_CALL(*trx2, on_failure(OperationHasResult(CassandraStore::INVALID_REQUEST)));
+
+  CassandraStore::Operation* op1 =
+    _cache.create_PutAssociatedPrivateID({"kermit"}, "somebody", 1000);
+  CassandraStore::Operation* op2 =
+    _cache.create_PutAssociatedPublicID("somebody", "kermit", 1000);
+  CassandraStore::Transaction* _trx1 = trx1;
+  CassandraStore::Transaction* _trx2 = trx2;
+  _cache.do_async(op1, _trx1);
+  _cache.do_async(op2, _trx2);
+
+  wait();
+  wait();
 }
 
-// If we have User-Data XML, but no explicit registration state, that should
-// still be treated as unregistered state.
-
-TEST_F(CacheRequestTest, GetRegDataNoRegState)
+// Batched writes are made at the consistency level configured for them, and
+// only batched with writes at the same level.
+TEST_F(CacheRequestTest, WriteBatchConsistency)
 {
-  std::vector<std::string> requested_columns;
-  requested_columns.push_back("ims_subscription_xml");
-  requested_columns.push_back("is_registered");
+  EXPECT_TRUE(_cache.configure_consistency(
+                "PutAssociatedPublicID",
+                Cache::Consistency(cass::ConsistencyLevel::LOCAL_QUORUM,
+                                   cass::ConsistencyLevel::LOCAL_QUORUM)));
+  _cache.configure_write_batching(100000, 100);
 
   std::map<std::string, std::string> columns;
-  columns["ims_subscription_xml"] = "<howdy>";
-  columns["is_registered"] = "";
-  columns["associated_impi__somebody@example.com"] = "";
-
-  std::vector<cass::ColumnOrSuperColumn> slice;
-  make_slice(slice, columns);
+  columns["public_id_kermit"] = "";
+  columns["public_id_gonzo"] = "";
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impi", "somebody", columns),
+                                    cass::ConsistencyLevel::LOCAL_QUORUM))
+    .Times(1);
+  EXPECT_CALL(_client, batch_mutate(_, cass::ConsistencyLevel::ONE))
+    .Times(1);
+  EXPECT_CALL(_cm, inform_success(_)).Times(2);
+
+  TestTransaction* trx1 = make_trx();
+  TestTransaction* trx2 = make_trx();
+  TestTransaction* trx3 = make_trx();
+  EXPECT_CALL(*trx1, on_success(_));
+  EXPECT_CALL(*trx2, on_success(_));
+  EXPECT_CALL(*trx3, on_success(_));
+
+  CassandraStore::Operation* op1 =
+    _cache.create_PutAssociatedPublicID("somebody", "kermit", 1000);
+  CassandraStore::Operation* op2 =
+    _cache.create_PutAssociatedPrivateID({"kermit"}, "somebody", 1000);
+  CassandraStore::Operation* op3 =
+    _cache.create_PutAssociatedPublicID("somebody", "gonzo", 1000);
+  CassandraStore::Transaction* _trx1 = trx1;
+  CassandraStore::Transaction* _trx2 = trx2;
+  CassandraStore::Transaction* _trx3 = trx3;
+  _cache.do_async(op1, _trx1);
+  _cache.do_async(op2, _trx2);
+  _cache.do_async(op3, _trx3);
+
+  wait();
+  wait();
+  wait();
+}
 
-  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
-  RecordingTransaction* trx = make_rec_trx(&rec);
-  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+TEST_F(CacheRequestTest, WriteBatchSentOnStop)
+{
+  _cache.configure_write_batching(10000000, 100);
 
-  EXPECT_CALL(_client, get_slice(_,
-                                 "kermit",
-                                 ColumnPathForTable("impu"),
-                                 AllColumns(),
-                                 _))
-    .WillOnce(SetArgReferee<0>(slice));
+  std::map<std::string, std::string> columns;
+  columns["public_id_kermit"] = "";
+  EXPECT_CALL(_client, batch_mutate(MutationMap("impi", "somebody", columns), _))
+    .Times(1);
+  EXPECT_CALL(_cm, inform_success(_));
 
-  EXPECT_CALL(*trx, on_success(_))
-    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
-  execute_trx(op, trx);
+  TestTransaction* trx = make_trx();
+  EXPECT_CALL(*trx, on_success(_));
 
-  EXPECT_EQ(RegistrationState::UNREGISTERED, rec.result.state);
-  EXPECT_EQ("<howdy>", rec.result.xml);
-  EXPECT_EQ(IMPIS, rec.result.impis);
+  CassandraStore::Operation* op =
+    _cache.create_PutAssociatedPublicID("somebody", "kermit", 1000);
+  CassandraStore::Transaction* _trx = trx;
+  _cache.do_async(op, _trx);
 
+  // Stopping the cache writes the batch without waiting for the window.
+  _cache.stop();
+  wait();
 }
 
-// Invalid registration state is treated as NOT_REGISTERED
+// Submit a write that nothing waits for.
+static void write_behind(CacheRequestTest* test, TestTransaction* trx)
+{
+  Cache::PutAssociatedPublicID* put =
+    test->_cache.create_PutAssociatedPublicID("somebody", "kermit", 1000);
+  put->set_write_behind();
+  CassandraStore::Operation*& op = (CassandraStore::Operation*&)put;
+  CassandraStore::Transaction* _trx = trx;
+  test->_cache.do_async(op, _trx);
+}
 
-TEST_F(CacheRequestTest, GetRegDataInvalidRegState)
+// A write-behind write that fails is retried.
+TEST_F(CacheRequestTest, WriteBehindRetries)
 {
-  std::map<std::string, std::string> columns;
-  columns["ims_subscription_xml"] = "";
-  columns["is_registered"] = "\x03";
+  _cache.configure_write_behind(1, 10, 3, 1);
 
-  std::vector<cass::ColumnOrSuperColumn> slice;
-  make_slice(slice, columns);
+  EXPECT_CALL(_client, batch_mutate(_, _))
+    .WillOnce(Throw(cass::UnavailableException()))
+    .WillOnce(Return());
 
-  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result> rec;
-  RecordingTransaction* trx = make_rec_trx(&rec);
-  CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+  TestTransaction* trx = make_trx();
+  EXPECT_CALL(*trx, on_success(_));
+  write_behind(this, trx);
+  wait();
+}
 
-  EXPECT_CALL(_client, get_slice(_,
-                                 "kermit",
-                                 ColumnPathForTable("impu"),
-                                 AllColumns(),
-                                 _))
-    .WillOnce(SetArgReferee<0>(slice));
+// A write-behind write is failed once it has been retried the maximum
+// number of times.
+TEST_F(CacheRequestTest, WriteBehindRetriesExhausted)
+{
+  _cache.configure_write_behind(1, 10, 2, 1);
 
-  EXPECT_CALL(*trx, on_success(_))
-    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
-  execute_trx(op, trx);
+  EXPECT_CALL(_client, batch_mutate(_, _))
+    .Times(3)
+    .WillRepeatedly(Throw(cass::UnavailableException()));
 
-  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result.state);
-  EXPECT_EQ("", rec.result.xml);
-  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+  TestTransaction* trx = make_trx();
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::RESOURCE_ERROR)));
+  write_behind(this, trx);
+  wait();
 }
 
+// Invalid requests will never succeed, so aren't retried.
+TEST_F(CacheRequestTest, WriteBehindInvalidRequestNotRetried)
+{
+  _cache.configure_write_behind(1, 10, 3, 1);
 
-TEST_F(CacheRequestTest, GetRegDataNotFound)
+  cass::InvalidRequestException ire;
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(Throw(ire));
+
+  TestTransaction* trx = make_trx();
+  EXPECT_CALL(*trx, on_failure(OperationHasResult(CassandraStore::INVALID_REQUEST)));
+  write_behind(this, trx);
+  wait();
+}
+
+// Once the write-behind queue is full, writes are run in the same way as
+// other operations.
+TEST_F(CacheRequestTest, WriteBehindQueueFull)
 {
-  CassandraStore::Operation* op =
-    _cache.create_GetRegData("kermit");
-  ResultRecorder<Cache::GetRegData, Cache::GetRegData::Result > rec;
-  RecordingTransaction* trx = make_rec_trx(&rec);
+  _cache.configure_write_behind(1, 1);
 
-  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
-    .WillOnce(SetArgReferee<0>(empty_slice));
+  ThriftCallBlocker blocker;
+  EXPECT_CALL(_client, batch_mutate(_, _))
+    .WillOnce(InvokeWithoutArgs(&blocker, &ThriftCallBlocker::block))
+    .WillRepeatedly(Return());
+
+  // The first write holds the write-behind thread and the second fills the
+  // queue.
+  TestTransaction* trx1 = make_trx();
+  TestTransaction* trx2 = make_trx();
+  TestTransaction* trx3 = make_trx();
+  EXPECT_CALL(*trx1, on_success(_));
+  EXPECT_CALL(*trx2, on_success(_));
+  EXPECT_CALL(*trx3, on_success(_));
+
+  write_behind(this, trx1);
+  blocker.wait_for_call();
+  write_behind(this, trx2);
+
+  // The third write completes while the write-behind thread is held.
+  write_behind(this, trx3);
+  wait();
+
+  blocker.release();
+  wait();
+  wait();
+}
 
-  EXPECT_CALL(*trx, on_success(_))
-    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
-  execute_trx(op, trx);
+// Stopping the cache waits for queued write-behind writes to be written.
+TEST_F(CacheRequestTest, WriteBehindDrainedOnStop)
+{
+  _cache.configure_write_behind(1, 10);
 
-  EXPECT_EQ("", rec.result.xml);
-  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result.state);
-  EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
+  EXPECT_CALL(_client, batch_mutate(_, _))
+    .Times(2)
+    .WillRepeatedly(InvokeWithoutArgs([]() { usleep(20000); }));
+
+  TestTransaction* trx1 = make_trx();
+  TestTransaction* trx2 = make_trx();
+  EXPECT_CALL(*trx1, on_success(_));
+  EXPECT_CALL(*trx2, on_success(_));
+  write_behind(this, trx1);
+  write_behind(this, trx2);
+
+  _cache.stop();
+  EXPECT_EQ(0, sem_trywait(&_sem));
+  EXPECT_EQ(0, sem_trywait(&_sem));
 }
 
 TEST_F(CacheRequestTest, GetAuthVectorAllColsReturned)
@@ -1439,6 +3771,7 @@ TEST_F(CacheLatencyTest, PutRecordsLatency)
 
   std::map<std::string, std::string> columns;
   columns["ims_subscription_xml"] = "<xml>";
+  columns["irs_summary"] = IRSSummary("<xml>").encode();
 
   EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(AdvanceTimeMs(12));
   EXPECT_CALL(*trx, on_success(_)).WillOnce(CheckLatency(trx, 12));
@@ -1649,6 +3982,88 @@ TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromImpiCausingDeletio
   execute_trx(op, trx);
 }
 
+TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromImpiCausingDeletionIrsTable)
+{
+  _cache.configure_irs_table(true);
+
+  std::vector<CassandraStore::RowColumns> expected;
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["associated_impi__gonzo"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> impu_slice;
+  make_slice(impu_slice, impu_columns);
+
+  std::map<std::string, std::string> impi_columns;
+  impi_columns["associated_primary_impu__kermit"] = "";
+
+  TestTransaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_DissociateImplicitRegistrationSetFromImpi({"kermit", "robin"}, "gonzo", 1000);
+
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "gonzo", impi_columns));
+
+  EXPECT_CALL(_client,
+              get_slice(_,
+                        "kermit",
+                        ColumnPathForTable("impu"),
+                        ColumnsWithPrefix("associated_impi__"),
+                        _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+
+  // The IRS row goes along with the IMPU rows.
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("impu"), 1000, _));
+  EXPECT_CALL(_client, remove("robin", ColumnPathForTable("impu"), 1000, _));
+  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("irs"), 1000, _));
+
+  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected), _));
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
+
+// With deletion markers enabled, the IMPU rows are marked with a column for
+// each IMPI read, along with the IRS row.
+TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromImpiCausingDeletionWithDeletionMarkers)
+{
+  _cache.configure_irs_table(true);
+  _cache.configure_deletion_markers(10);
+
+  std::map<std::string, std::string> impu_columns;
+  impu_columns["associated_impi__gonzo"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> impu_slice;
+  make_slice(impu_slice, impu_columns);
+
+  std::map<std::string, std::string> marked_impi_columns;
+  marked_impi_columns["associated_primary_impu__kermit"] = DELETION_MARKER;
+
+  TestTransaction* trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_DissociateImplicitRegistrationSetFromImpi({"kermit", "robin"}, "gonzo", 1000);
+
+  EXPECT_CALL(_client,
+              get_slice(_,
+                        "kermit",
+                        ColumnPathForTable("impu"),
+                        ColumnsWithPrefix("associated_impi__"),
+                        _))
+    .WillOnce(SetArgReferee<0>(impu_slice));
+
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "gonzo", marked_impi_columns));
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit",
+    marked_row_columns("impu", {"associated_impi__gonzo"})));
+  expected.push_back(CassandraStore::RowColumns("impu", "robin",
+    marked_row_columns("impu", {"associated_impi__gonzo"})));
+  expected.push_back(CassandraStore::RowColumns("irs", "kermit",
+                                                marked_row_columns("irs")));
+
+  EXPECT_CALL(_client, batch_mutate(MutationMap(expected), _));
+  EXPECT_CALL(_client, remove(_, _, _, _)).Times(0);
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
+
 TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromWrongImpi)
 {
   std::vector<CassandraStore::RowColumns> expected;
@@ -1701,3 +4116,265 @@ TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromWrongImpi)
 }
 
 
+
+//
+// Multiple Cassandra nodes.
+//
+
+// Client that passes requests on to another client, so that the cache can
+// own (and delete) the clients it connects without deleting the mocks.
+class ForwardingClient : public CassandraStore::ClientInterface
+{
+public:
+  ForwardingClient(CassandraStore::ClientInterface* target) : _target(target) {}
+  virtual ~ForwardingClient() {}
+
+  void set_keyspace(const std::string& keyspace)
+  {
+    _target->set_keyspace(keyspace);
+  }
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > >& mutation_map,
+                    const cass::ConsistencyLevel::type consistency_level)
+  {
+    _target->batch_mutate(mutation_map, consistency_level);
+  }
+  void get_slice(std::vector<cass::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const cass::ColumnParent& column_parent,
+                 const cass::SlicePredicate& predicate,
+                 const cass::ConsistencyLevel::type consistency_level)
+  {
+    _target->get_slice(_return, key, column_parent, predicate, consistency_level);
+  }
+  void multiget_slice(std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const cass::ColumnParent& column_parent,
+                      const cass::SlicePredicate& predicate,
+                      const cass::ConsistencyLevel::type consistency_level)
+  {
+    _target->multiget_slice(_return, keys, column_parent, predicate, consistency_level);
+  }
+  void remove(const std::string& key,
+              const cass::ColumnPath& column_path,
+              const int64_t timestamp,
+              const cass::ConsistencyLevel::type consistency_level)
+  {
+    _target->remove(key, column_path, timestamp, consistency_level);
+  }
+
+private:
+  CassandraStore::ClientInterface* _target;
+};
+
+// Cache that connects to a mock client for each node.
+class MultiNodeTestCache : public Cache
+{
+public:
+  CassandraStore::ClientInterface* create_client(const std::string& hostname,
+                                                 uint16_t port)
+  {
+    _ports[hostname] = port;
+    return new ForwardingClient(_clients[hostname]);
+  }
+
+  std::map<std::string, CassandraStore::ClientInterface*> _clients;
+  std::map<std::string, uint16_t> _ports;
+};
+
+class CacheNodeSelectionTest : public ::testing::Test
+{
+public:
+  CacheNodeSelectionTest()
+  {
+    cwtest_completely_control_time();
+
+    _cache._clients["node1"] = &_client1;
+    _cache._clients["node2"] = &_client2;
+
+    std::vector<std::string> nodes = {"node1", "node2"};
+    _cache.initialize();
+    _cache.configure(nodes, 9160, 1);
+
+    std::map<std::string, std::string> columns;
+    columns["ims_subscription_xml"] = "<howdy>";
+    make_slice(_slice, columns);
+  }
+
+  virtual ~CacheNodeSelectionTest() { cwtest_reset_time(); }
+
+  // Read registration data on the test thread.
+  bool read()
+  {
+    CassandraStore::Operation* op = _cache.create_GetRegData("kermit");
+    bool success = _cache.do_sync(op, 0);
+    delete op; op = NULL;
+    return success;
+  }
+
+  MultiNodeTestCache _cache;
+  MockCassandraClient _client1;
+  MockCassandraClient _client2;
+  std::vector<cass::ColumnOrSuperColumn> _slice;
+};
+
+TEST_F(CacheNodeSelectionTest, PrefersFasterNode)
+{
+  // Both nodes are tried, and then everything goes to the faster one.
+  EXPECT_CALL(_client1, get_slice(_, "kermit", _, _, _))
+    .WillOnce(DoAll(AdvanceTimeMs(50), SetArgReferee<0>(_slice)));
+  EXPECT_CALL(_client2, get_slice(_, "kermit", _, _, _))
+    .Times(9)
+    .WillRepeatedly(DoAll(AdvanceTimeMs(1), SetArgReferee<0>(_slice)));
+
+  for (int ii = 0; ii < 10; ii++)
+  {
+    EXPECT_TRUE(read());
+  }
+}
+
+TEST_F(CacheNodeSelectionTest, FailingNodeLeftOut)
+{
+  // Each failed read is tried twice (reconnecting in between).  After three
+  // failed reads the node isn't used until a second has passed.
+  apache::thrift::transport::TTransportException te;
+  EXPECT_CALL(_client1, get_slice(_, "kermit", _, _, _))
+    .Times(8)
+    .WillRepeatedly(Throw(te));
+  EXPECT_CALL(_client2, get_slice(_, "kermit", _, _, _))
+    .WillOnce(DoAll(AdvanceTimeMs(1), SetArgReferee<0>(_slice)));
+
+  EXPECT_FALSE(read());
+  EXPECT_FALSE(read());
+  EXPECT_FALSE(read());
+  EXPECT_TRUE(read());
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_FALSE(read());
+}
+
+// Over the native protocol, even a single node is used through clients the
+// cache creates itself, connected to the native port.
+TEST(CacheNativeProtocolTest, SingleNode)
+{
+  MultiNodeTestCache cache;
+  MockCassandraClient client;
+  cache._clients["node1"] = &client;
+  cache.initialize();
+  cache.configure(std::vector<std::string>(1, "node1"), 9160, 1);
+  cache.configure_native_protocol(9042);
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+  EXPECT_CALL(client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  CassandraStore::Operation* op = cache.create_GetRegData("kermit");
+  EXPECT_TRUE(cache.do_sync(op, 0));
+  delete op; op = NULL;
+
+  EXPECT_EQ(9042, cache._ports["node1"]);
+}
+
+// Fixture for hedging reads across several nodes.  Time isn't controlled, as
+// reads are only hedged once they have taken longer than recent reads.
+class CacheNodeHedgingTest : public ::testing::Test
+{
+public:
+  CacheNodeHedgingTest()
+  {
+    sem_init(&_sem, 0, 0);
+    _reads_held = 0;
+
+    _cache._clients["node1"] = &_client1;
+    _cache._clients["node2"] = &_client2;
+
+    std::vector<std::string> nodes = {"node1", "node2"};
+    _cache.initialize();
+    _cache.configure(nodes, 9160, 2);
+    _cache.configure_hedging(50, 100);
+    _cache.start();
+
+    std::map<std::string, std::string> columns;
+    columns["ims_subscription_xml"] = "<howdy>";
+    make_slice(_slice, columns);
+  }
+
+  virtual ~CacheNodeHedgingTest()
+  {
+    _cache.stop();
+    _cache.wait_stopped();
+    sem_destroy(&_sem);
+  }
+
+  // Read registration data and wait for the read to succeed.
+  void read(const std::string& public_id)
+  {
+    TestTransaction* trx = new TestTransaction(&_sem);
+    EXPECT_CALL(*trx, on_success(_));
+    CassandraStore::Transaction* _trx = trx;
+    CassandraStore::Operation* op = _cache.create_GetRegData(public_id);
+    _cache.do_async(op, _trx);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    ASSERT_EQ(0, sem_timedwait(&_sem, &ts));
+  }
+
+  MultiNodeTestCache _cache;
+  MockCassandraClient _client1;
+  MockCassandraClient _client2;
+  std::vector<cass::ColumnOrSuperColumn> _slice;
+  sem_t _sem;
+
+  // Hold the first read that calls this in Cassandra until the blocker is
+  // released.
+  void hold_first_read()
+  {
+    if (_reads_held++ == 0)
+    {
+      _blocker.block();
+    }
+  }
+
+  // Outlive the cache's threads, which may still be using them when the
+  // test finishes.
+  ThriftCallBlocker _blocker;
+  std::atomic<int> _reads_held;
+};
+
+TEST_F(CacheNodeHedgingTest, HedgeSentToOtherNode)
+{
+  // Reads aren't hedged until enough have completed to know how long they
+  // usually take.  node1 is faster, so after the first couple of reads they
+  // mostly go there, and it is still the best node with a read in flight on
+  // it.  Neither node is slow enough to be left out.
+  EXPECT_CALL(_client1, get_slice(_, "gonzo", _, _, _))
+    .WillRepeatedly(DoAll(InvokeWithoutArgs([]() { usleep(10000); }),
+                          SetArgReferee<0>(_slice)));
+  EXPECT_CALL(_client2, get_slice(_, "gonzo", _, _, _))
+    .WillRepeatedly(DoAll(InvokeWithoutArgs([]() { usleep(25000); }),
+                          SetArgReferee<0>(_slice)));
+
+  for (int ii = 0; ii < 64; ii++)
+  {
+    read("gonzo");
+  }
+
+  // Whichever attempt at reading kermit starts first is held in Cassandra,
+  // so the other completes the transaction.  Each node is read once, so the
+  // two attempts went to different nodes.
+  EXPECT_CALL(_client1, get_slice(_, "kermit", _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(this, &CacheNodeHedgingTest::hold_first_read),
+                    SetArgReferee<0>(_slice)));
+  EXPECT_CALL(_client2, get_slice(_, "kermit", _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(this, &CacheNodeHedgingTest::hold_first_read),
+                    SetArgReferee<0>(_slice)));
+
+  read("kermit");
+
+  _blocker.wait_for_call();
+  _blocker.release();
+}
@@ -0,0 +1,120 @@
+/**
+ * @file columncompression_test.cpp UT for column compression.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+
+#include "columncompression.h"
+
+/// Fixture for ColumnCompressionTest.
+class ColumnCompressionTest : public testing::Test
+{
+public:
+  ColumnCompressionTest()
+  {
+    // Build some XML that compresses well, as IMS subscriptions do.
+    _xml = "<IMSSubscription>";
+    for (int ii = 0; ii < 50; ii++)
+    {
+      _xml += "<InitialFilterCriteria><Priority>1</Priority>"
+              "<ApplicationServer><ServerName>sip:as.example.com</ServerName>"
+              "</ApplicationServer></InitialFilterCriteria>";
+    }
+    _xml += "</IMSSubscription>";
+  }
+
+  std::string _xml;
+};
+
+TEST_F(ColumnCompressionTest, RoundTrip)
+{
+  std::string compressed = ColumnCompression::compress(_xml);
+  EXPECT_LT(compressed.length(), _xml.length());
+  EXPECT_EQ('\0', compressed[0]);
+
+  std::string decoded;
+  EXPECT_TRUE(ColumnCompression::decode(compressed, decoded));
+  EXPECT_EQ(_xml, decoded);
+}
+
+TEST_F(ColumnCompressionTest, IncompressibleValueNotCompressed)
+{
+  EXPECT_EQ("<xml/>", ColumnCompression::compress("<xml/>"));
+}
+
+TEST_F(ColumnCompressionTest, UncompressedValues)
+{
+  // Values written before compression was enabled are read as they are.
+  std::string decoded;
+  EXPECT_TRUE(ColumnCompression::decode(_xml, decoded));
+  EXPECT_EQ(_xml, decoded);
+  EXPECT_TRUE(ColumnCompression::decode("", decoded));
+  EXPECT_EQ("", decoded);
+}
+
+TEST_F(ColumnCompressionTest, UnknownVersion)
+{
+  std::string compressed = ColumnCompression::compress(_xml);
+  compressed[1] = '\x02';
+
+  std::string decoded;
+  EXPECT_FALSE(ColumnCompression::decode(compressed, decoded));
+}
+
+TEST_F(ColumnCompressionTest, TruncatedHeader)
+{
+  std::string decoded;
+  EXPECT_FALSE(ColumnCompression::decode(std::string("\0\x01\0", 3), decoded));
+}
+
+TEST_F(ColumnCompressionTest, CorruptData)
+{
+  std::string compressed = ColumnCompression::compress(_xml);
+
+  std::string decoded;
+  EXPECT_FALSE(ColumnCompression::decode(compressed.substr(0, compressed.length() - 4),
+                                         decoded));
+  EXPECT_EQ("", decoded);
+}
+
+TEST_F(ColumnCompressionTest, WrongLength)
+{
+  // The data decompresses, but not to the length in the header.
+  std::string compressed = ColumnCompression::compress(_xml);
+  compressed[5]++;
+
+  std::string decoded;
+  EXPECT_FALSE(ColumnCompression::decode(compressed, decoded));
+}
@@ -0,0 +1,288 @@
+/**
+ * @file exporter_test.cpp UT for the table exporter
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sstream>
+#include <set>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+#include "cass_test_utils.h"
+#include "mockcommunicationmonitor.h"
+
+#include "exporter.h"
+#include "localstore.h"
+
+using namespace org::apache::cassandra;
+using ::testing::NiceMock;
+using ::testing::Return;
+using namespace CassTestUtils;
+
+TEST(ExporterEncodeTest, Encode)
+{
+  EXPECT_EQ("sip:kermit@example.com", Exporter::encode("sip:kermit@example.com"));
+  EXPECT_EQ("a%20b%3Dc%25d%0A%01%FF", Exporter::encode("a b=c%d\n\x01\xff"));
+  EXPECT_EQ("", Exporter::encode(""));
+}
+
+// The ranges cover the whole ring, without overlapping.
+TEST(ExporterSplitRingTest, SplitRing)
+{
+  std::vector<std::pair<int64_t, int64_t> > ranges;
+
+  Exporter::split_ring(1, ranges);
+  ASSERT_EQ(1u, ranges.size());
+  EXPECT_EQ(INT64_MIN, ranges[0].first);
+  EXPECT_EQ(INT64_MAX, ranges[0].second);
+
+  Exporter::split_ring(7, ranges);
+  ASSERT_EQ(7u, ranges.size());
+  EXPECT_EQ(INT64_MIN, ranges.front().first);
+  EXPECT_EQ(INT64_MAX, ranges.back().second);
+
+  for (size_t ii = 0; ii < ranges.size(); ii++)
+  {
+    EXPECT_LT(ranges[ii].first, ranges[ii].second);
+
+    if (ii > 0)
+    {
+      EXPECT_EQ(ranges[ii - 1].second, ranges[ii].first);
+    }
+  }
+}
+
+/// Fixture for tests that export tables from a cache backed by a local
+/// store.
+class ExporterTest : public testing::Test
+{
+public:
+  ExporterTest()
+  {
+    char dir[] = "/tmp/exporter_test.XXXXXX";
+    _dir = mkdtemp(dir);
+    _store = new LocalStore(_dir, 0);
+    _store->start();
+
+    _cache.initialize();
+    _cache.configure("localhost", 1234, 2, 0, &_cm);
+    _cache.configure_local_store(_store);
+    _cache.start();
+  }
+
+  virtual ~ExporterTest()
+  {
+    _cache.stop();
+    _cache.wait_stopped();
+    delete _store;
+    unlink((_dir + "/log").c_str());
+    unlink((_dir + "/snapshot").c_str());
+    unlink((_dir + "/lock").c_str());
+    rmdir(_dir.c_str());
+  }
+
+  void put_impus(int count)
+  {
+    for (int ii = 0; ii < count; ii++)
+    {
+      std::stringstream impu;
+      impu << "sip:user" << ii << "@example.com";
+      Cache::PutRegData* put_reg_data = _cache.create_PutRegData(impu.str(), 1);
+      put_reg_data->with_xml("<howdy>");
+      EXPECT_TRUE(_cache.do_sync(put_reg_data, 0));
+      delete put_reg_data;
+    }
+  }
+
+  // Split exported lines into a set, checking there are no duplicates.
+  static std::set<std::string> lines(const std::string& output)
+  {
+    std::set<std::string> result;
+    std::stringstream ss(output);
+    std::string line;
+
+    while (std::getline(ss, line))
+    {
+      EXPECT_TRUE(result.insert(line).second) << line;
+    }
+
+    return result;
+  }
+
+  std::string _dir;
+  LocalStore* _store;
+  Cache _cache;
+  NiceMock<MockCommunicationMonitor> _cm;
+};
+
+TEST_F(ExporterTest, ExportTable)
+{
+  put_impus(200);
+
+  Exporter exporter(&_cache, 3, 7);
+  std::stringstream output;
+  size_t rows;
+  EXPECT_TRUE(exporter.export_table("impu", output, rows));
+  EXPECT_EQ(200u, rows);
+
+  std::set<std::string> exported = lines(output.str());
+  EXPECT_EQ(200u, exported.size());
+
+  // The row also has a summary of its registration set, which isn't
+  // printable.
+  std::set<std::string>::const_iterator line =
+    exported.lower_bound("impu sip:user42@example.com ");
+  ASSERT_TRUE(line != exported.end());
+  EXPECT_EQ(0u, line->find("impu sip:user42@example.com ims_subscription_xml=<howdy> irs_summary=%"));
+}
+
+TEST_F(ExporterTest, EmptyTable)
+{
+  Exporter exporter(&_cache);
+  std::stringstream output;
+  size_t rows;
+  EXPECT_TRUE(exporter.export_table("impi", output, rows));
+  EXPECT_EQ(0u, rows);
+  EXPECT_EQ("", output.str());
+}
+
+// Rows are read no faster than the rate limit.
+TEST_F(ExporterTest, RateLimited)
+{
+  put_impus(40);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  Exporter exporter(&_cache, 2, 5, 200);
+  std::stringstream output;
+  size_t rows;
+  EXPECT_TRUE(exporter.export_table("impu", output, rows));
+  EXPECT_EQ(40u, rows);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000) +
+                    ((end.tv_nsec - start.tv_nsec) / 1000000);
+  EXPECT_GE(elapsed_ms, 150);
+}
+
+/// Thrift connection that serves range scans from a local store, standing in
+/// for a connection to Cassandra.
+class ThriftScanClient : public CassandraStore::Client
+{
+public:
+  ThriftScanClient(LocalStore* store) :
+    CassandraStore::Client(boost::shared_ptr<apache::thrift::protocol::TProtocol>(),
+                           boost::shared_ptr<apache::thrift::transport::TFramedTransport>()),
+    _store(store)
+  {}
+
+  void get_range_slices(std::vector<KeySlice>& _return,
+                        const ColumnParent& column_parent,
+                        const SlicePredicate& predicate,
+                        const KeyRange& range,
+                        const ConsistencyLevel::type consistency_level)
+  {
+    _store->get_range_slices(_return, column_parent, predicate, range, consistency_level);
+  }
+
+  LocalStore* _store;
+};
+
+/// Cache whose connections are Thrift connections.
+class ThriftScanCache : public Cache
+{
+public:
+  ThriftScanCache(LocalStore* store) : _client(store) {}
+
+  CassandraStore::ClientInterface* get_client() { return &_client; }
+  void release_client() {}
+
+  ThriftScanClient _client;
+};
+
+// Tables are scanned over Thrift connections to Cassandra.
+TEST_F(ExporterTest, ExportOverThrift)
+{
+  put_impus(20);
+
+  ThriftScanCache cache(_store);
+  cache.initialize();
+  cache.configure("localhost", 1234, 1, 0, &_cm);
+  cache.start();
+
+  Exporter exporter(&cache, 2, 7);
+  std::stringstream output;
+  size_t rows;
+  EXPECT_TRUE(exporter.export_table("impu", output, rows));
+  EXPECT_EQ(20u, rows);
+  EXPECT_EQ(20u, lines(output.str()).size());
+
+  cache.stop();
+  cache.wait_stopped();
+}
+
+/// Cache whose store doesn't support range scans.
+class NoScanCache : public Cache
+{
+public:
+  CassandraStore::ClientInterface* get_client() { return &_client; }
+  void release_client() {}
+
+  NiceMock<MockCassandraClient> _client;
+};
+
+TEST(ExporterUnsupportedTest, ScansNotSupported)
+{
+  NiceMock<MockCommunicationMonitor> cm;
+  NoScanCache cache;
+  cache.initialize();
+  cache.configure("localhost", 1234, 1, 0, &cm);
+  cache.start();
+
+  Exporter exporter(&cache);
+  std::stringstream output;
+  size_t rows;
+  EXPECT_FALSE(exporter.export_table("impu", output, rows));
+  EXPECT_EQ(0u, rows);
+
+  cache.stop();
+  cache.wait_stopped();
+}
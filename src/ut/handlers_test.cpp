@@ -69,6 +69,7 @@
 #include "fakehttpresolver.hpp"
 #include "handlers.h"
 #include "mockstatisticsmanager.hpp"
+#include "mockreregistrationscheduler.hpp"
 #include "sproutconnection.h"
 
 using ::testing::Return;
@@ -511,7 +512,8 @@ public:
                                 bool use_impi,
                                 RegistrationState db_regstate,
                                 int db_ttl = 3600,
-                                std::string expected_result = REGDATA_RESULT)
+                                std::string expected_result = REGDATA_RESULT,
+                                ReregistrationScheduler* scheduler = NULL)
   {
     MockHttpStack::Request req(_httpstack,
                                "/impu/" + IMPU + "/reg-data",
@@ -522,7 +524,7 @@ public:
 
     // Configure the task to use a HSS, and send a RE_REGISTRATION
     // SAR to the HSS every hour.
-    ImpuRegDataTask::Config cfg(true, 3600);
+    ImpuRegDataTask::Config cfg(true, 3600, 200, scheduler);
     ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
     // Once the request is processed by the task, we expect it to
@@ -554,6 +556,96 @@ public:
     EXPECT_EQ(expected_result, req.content());
   }
 
+  // Test function for background re-registrations made by the
+  // re-registration scheduler.  The registration state is read from the
+  // database and, if the subscriber is still registered, a RE_REGISTRATION
+  // Server-Assignment-Request is sent and the answer written back.
+  void background_rereg_template(RegistrationState db_regstate,
+                                 int32_t hss_rc = DIAMETER_SUCCESS)
+  {
+    MockReregistrationScheduler scheduler;
+    ImpuRegDataTask::Config cfg(true, 3600, 200, &scheduler);
+    ImpuRegDataTask::BackgroundReregisterer reregisterer(&cfg);
+
+    // The re-registration only needs the registration state.
+    MockCache::MockGetRegData mock_op;
+    EXPECT_CALL(*_cache, create_GetRegData(IMPU, Cache::REG_DATA_REG_STATE))
+      .WillOnce(Return(&mock_op));
+    _cache->EXPECT_DO_ASYNC(mock_op);
+    reregisterer.reregister(IMPU, IMPI);
+
+    CassandraStore::Transaction* t = mock_op.get_trx();
+    ASSERT_FALSE(t == NULL);
+    EXPECT_CALL(mock_op, get_registration_state(_, _))
+      .WillRepeatedly(DoAll(SetArgReferee<0>(db_regstate), SetArgReferee<1>(3600)));
+
+    if (db_regstate != RegistrationState::REGISTERED)
+    {
+      // The subscriber has been deregistered since the re-registration was
+      // scheduled, so it's dropped without contacting the HSS.
+      EXPECT_CALL(*_mock_stack, send(_, _, _)).Times(0);
+      EXPECT_CALL(scheduler, deregistered(IMPU));
+      EXPECT_CALL(scheduler, reregistration_complete(IMPU, true));
+      t->on_success(&mock_op);
+      return;
+    }
+
+    EXPECT_CALL(*_mock_stack, send(_, _, 200))
+      .Times(1)
+      .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+    t->on_success(&mock_op);
+
+    ASSERT_FALSE(_caught_diam_tsx == NULL);
+    Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+    Cx::ServerAssignmentRequest sar(msg);
+    EXPECT_EQ(IMPI, sar.impi());
+    EXPECT_EQ(IMPU, sar.impu());
+    EXPECT_TRUE(sar.server_assignment_type(test_i32));
+    EXPECT_EQ(Cx::ServerAssignmentType::RE_REGISTRATION, test_i32);
+
+    Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                   _mock_stack,
+                                   hss_rc,
+                                   (hss_rc == DIAMETER_SUCCESS) ? IMPU_IMS_SUBSCRIPTION : "",
+                                   NO_CHARGING_ADDRESSES);
+
+    MockCache::MockPutRegData mock_op2;
+    if (hss_rc == DIAMETER_SUCCESS)
+    {
+      // The refreshed data is written back to the database.
+      EXPECT_CALL(*_cache, create_PutRegData(IMPU_REG_SET, _, 7200))
+        .WillOnce(Return(&mock_op2));
+      EXPECT_CALL(mock_op2, with_xml(IMPU_IMS_SUBSCRIPTION))
+        .WillOnce(ReturnRef(mock_op2));
+      EXPECT_CALL(mock_op2, with_reg_state(RegistrationState::REGISTERED))
+        .WillOnce(ReturnRef(mock_op2));
+      EXPECT_CALL(mock_op2, with_associated_impis(IMPI_IN_VECTOR))
+        .WillOnce(ReturnRef(mock_op2));
+      EXPECT_CALL(mock_op2, with_charging_addrs(_))
+        .WillOnce(ReturnRef(mock_op2));
+      _cache->EXPECT_DO_ASYNC(mock_op2);
+      EXPECT_CALL(scheduler, deregistered(_)).Times(0);
+      EXPECT_CALL(scheduler, reregistration_complete(IMPU, true));
+    }
+    else if (hss_rc == DIAMETER_TOO_BUSY)
+    {
+      // The IRS is kept so that the scheduler tries again later.
+      EXPECT_CALL(scheduler, deregistered(_)).Times(0);
+      EXPECT_CALL(scheduler, reregistration_complete(IMPU, false));
+    }
+    else
+    {
+      // Any other failure is left for the next REGISTER to sort out.
+      EXPECT_CALL(scheduler, deregistered(IMPU));
+      EXPECT_CALL(scheduler, reregistration_complete(IMPU, false));
+    }
+
+    _caught_diam_tsx->on_response(saa);
+
+    _caught_fd_msg = NULL;
+    delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  }
+
   // Test function for the case where we have a HSS, and we're making a
   // request that should read from the database and generate a
   // Server-Assignment-Request, but not update the database.
@@ -834,6 +926,18 @@ public:
     EXPECT_EQ("", req.content());
   }
 
+  // The parts of the registration data that an RTR reads.
+  static int rtr_reg_data_columns(int32_t dereg_reason)
+  {
+    if ((dereg_reason == SERVER_CHANGE) ||
+        (dereg_reason == NEW_SERVER_ASSIGNED))
+    {
+      return Cache::REG_DATA_XML | Cache::REG_DATA_IMPIS;
+    }
+
+    return Cache::REG_DATA_XML;
+  }
+
   void rtr_template(int32_t dereg_reason,
                     std::string http_path,
                     std::string body,
@@ -861,35 +965,26 @@ public:
     task->_msg._stack = _mock_stack;
     task->_rtr._stack = _mock_stack;
 
-    // Once the task's run function is called, we expect a cache request for
-    // the IMS subscription of the final public identity in IMPUS.
-    MockCache::MockGetRegData mock_op;
-    EXPECT_CALL(*_cache, create_GetRegData(IMPU2))
+    // Once the task's run function is called, we expect a single cache
+    // request for the IMS subscriptions of all the public identities in
+    // IMPUS.
+    MockCache::MockGetRegDataMulti mock_op;
+    EXPECT_CALL(*_cache, create_GetRegDataMulti(IMPUS, rtr_reg_data_columns(dereg_reason)))
       .WillOnce(Return(&mock_op));
     _cache->EXPECT_DO_ASYNC(mock_op);
 
     task->run();
 
-    // The cache successfully returns the correct IMS subscription.
+    // The cache successfully returns the correct IMS subscriptions.
     CassandraStore::Transaction* t = mock_op.get_trx();
     ASSERT_FALSE(t == NULL);
-    EXPECT_CALL(mock_op, get_xml(_, _))
-      .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU3_IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
-
-    // Expect another cache request for the IMS subscription of the next
-    // public identity in IMPUS.
-    MockCache::MockGetRegData mock_op2;
-    EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-      .WillOnce(Return(&mock_op2));
-    _cache->EXPECT_DO_ASYNC(mock_op2);
-
-    t->on_success(&mock_op);
-
-    // The cache successfully returns the correct IMS subscription.
-    t = mock_op2.get_trx();
-    ASSERT_FALSE(t == NULL);
-    EXPECT_CALL(mock_op2, get_xml(_, _))
-      .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
+    std::map<std::string, Cache::GetRegData::Result> reg_data;
+    reg_data[IMPU].xml = IMPU_IMS_SUBSCRIPTION;
+    reg_data[IMPU].summary = IRSSummary(IMPU_IMS_SUBSCRIPTION);
+    reg_data[IMPU2].xml = IMPU3_IMS_SUBSCRIPTION;
+    reg_data[IMPU2].summary = IRSSummary(IMPU3_IMS_SUBSCRIPTION);
+    EXPECT_CALL(mock_op, get_result(_))
+      .WillRepeatedly(SetArgReferee<0>(reg_data));
 
     // Expect a delete to be sent to Sprout.
     EXPECT_CALL(*_mock_http_conn, send_delete(http_path, _, body))
@@ -913,7 +1008,7 @@ public:
       .WillOnce(Return(&mock_op4));
     _cache->EXPECT_DO_ASYNC(mock_op4);
 
-    t->on_success(&mock_op2);
+    t->on_success(&mock_op);
 
     // Turn the caught Diameter msg structure into a RTA and confirm it's contents.
     Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
@@ -980,53 +1075,31 @@ public:
     EXPECT_CALL(mock_op, get_result(_))
       .WillRepeatedly(SetArgReferee<0>(IMPUS));
 
-    // Next expect a cache request for the IMS subscription of the final
-    // public identity in IMPUS.
-    MockCache::MockGetRegData mock_op2;
-    EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-      .WillOnce(Return(&mock_op2));
-    _cache->EXPECT_DO_ASYNC(mock_op2);
-
-    t->on_success(&mock_op);
-
-    // The cache successfully returns the correct IMS subscription.
-    t = mock_op2.get_trx();
-    ASSERT_FALSE(t == NULL);
-    EXPECT_CALL(mock_op2, get_xml(_, _))
-      .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
-
-    // Sometimes we're interested in the associated identities returned by
-    // this cache request.
-    if ((dereg_reason == SERVER_CHANGE) ||
-        (dereg_reason == NEW_SERVER_ASSIGNED))
-    {
-      EXPECT_CALL(mock_op2, get_associated_impis(_))
-        .WillRepeatedly(SetArgReferee<0>(ASSOCIATED_IDENTITIES));
-    }
-
-    // Expect another cache request for the IMS subscription of the next
-    // public identity in IMPUS.
-    MockCache::MockGetRegData mock_op3;
-    EXPECT_CALL(*_cache, create_GetRegData(IMPU2))
+    // Next expect a single cache request for the IMS subscriptions of the
+    // public identities in IMPUS.
+    std::vector<std::string> sorted_impus = IMPUS;
+    std::sort(sorted_impus.begin(), sorted_impus.end());
+    MockCache::MockGetRegDataMulti mock_op3;
+    EXPECT_CALL(*_cache, create_GetRegDataMulti(sorted_impus, rtr_reg_data_columns(dereg_reason)))
       .WillOnce(Return(&mock_op3));
     _cache->EXPECT_DO_ASYNC(mock_op3);
 
-    t->on_success(&mock_op2);
+    t->on_success(&mock_op);
 
-    // The cache successfully returns the correct IMS subscription.
+    // The cache successfully returns the correct IMS subscriptions.  We're
+    // sometimes interested in the associated identities returned by this
+    // cache request.
     t = mock_op3.get_trx();
     ASSERT_FALSE(t == NULL);
-    EXPECT_CALL(mock_op3, get_xml(_, _))
-      .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU3_IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
-
-    // Sometimes we're interested in the associated identities returned by
-    // this cache request.
-    if ((dereg_reason == SERVER_CHANGE) ||
-        (dereg_reason == NEW_SERVER_ASSIGNED))
-    {
-      EXPECT_CALL(mock_op3, get_associated_impis(_))
-        .WillRepeatedly(SetArgReferee<0>(ASSOCIATED_IDENTITIES));
-    }
+    std::map<std::string, Cache::GetRegData::Result> reg_data;
+    reg_data[IMPU].xml = IMPU_IMS_SUBSCRIPTION;
+    reg_data[IMPU].impis = ASSOCIATED_IDENTITIES;
+    reg_data[IMPU].summary = IRSSummary(IMPU_IMS_SUBSCRIPTION);
+    reg_data[IMPU2].xml = IMPU3_IMS_SUBSCRIPTION;
+    reg_data[IMPU2].impis = ASSOCIATED_IDENTITIES;
+    reg_data[IMPU2].summary = IRSSummary(IMPU3_IMS_SUBSCRIPTION);
+    EXPECT_CALL(mock_op3, get_result(_))
+      .WillRepeatedly(SetArgReferee<0>(reg_data));
 
     // Expect a delete to be sent to Sprout.
     EXPECT_CALL(*_mock_http_conn, send_delete(http_path, _, body))
@@ -2054,6 +2127,38 @@ TEST_F(HandlersTest, IMSSubscriptionHSS_ReregWithoutSAR)
   reg_data_template_no_sar("reg", true, RegistrationState::REGISTERED);
 }
 
+// A re-registration answered from the cache has the HSS re-registration
+// scheduled in the background.
+
+TEST_F(HandlersTest, IMSSubscriptionHSS_ReregSchedulesSAR)
+{
+  MockReregistrationScheduler scheduler;
+  EXPECT_CALL(scheduler, registered(IMPU, IMPI, 5000));
+  reg_data_template_no_sar("reg", true, RegistrationState::REGISTERED, 5000, REGDATA_RESULT, &scheduler);
+}
+
+// Background re-registrations made by the re-registration scheduler.
+
+TEST_F(HandlersTest, BackgroundRereg)
+{
+  background_rereg_template(RegistrationState::REGISTERED);
+}
+
+TEST_F(HandlersTest, BackgroundReregError)
+{
+  background_rereg_template(RegistrationState::REGISTERED, DIAMETER_ERROR_USER_UNKNOWN);
+}
+
+TEST_F(HandlersTest, BackgroundReregTooBusy)
+{
+  background_rereg_template(RegistrationState::REGISTERED, DIAMETER_TOO_BUSY);
+}
+
+TEST_F(HandlersTest, BackgroundReregNoLongerRegistered)
+{
+  background_rereg_template(RegistrationState::NOT_REGISTERED);
+}
+
 // Call to a registered subscriber
 
 TEST_F(HandlersTest, IMSSubscriptionCallHSS)
@@ -3074,9 +3179,9 @@ TEST_F(HandlersTest, RegistrationTerminationNoRegSets)
   task->_rtr._stack = _mock_stack;
 
   // Once the task's run function is called, we expect a cache request for
-  // the IMS subscription of the final public identity in IMPUS.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU2))
+  // the IMS subscriptions of the public identities in IMPUS.
+  MockCache::MockGetRegDataMulti mock_op;
+  EXPECT_CALL(*_cache, create_GetRegDataMulti(IMPUS, Cache::REG_DATA_XML))
     .WillOnce(Return(&mock_op));
   _cache->EXPECT_DO_ASYNC(mock_op);
 
@@ -3086,31 +3191,18 @@ TEST_F(HandlersTest, RegistrationTerminationNoRegSets)
   // information.
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
-  EXPECT_CALL(mock_op, get_xml(_, _))
-    .WillRepeatedly(DoAll(SetArgReferee<0>(""), SetArgReferee<1>(0)));
-
-  // Expect another cache request for the IMS subscription of the next
-  // public identity in IMPUS.
-  MockCache::MockGetRegData mock_op2;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-    .WillOnce(Return(&mock_op2));
-  _cache->EXPECT_DO_ASYNC(mock_op2);
-
-  t->on_success(&mock_op);
-
-  // The cache indicates success, but couldn't find any IMS subscription
-  // information.
-  t = mock_op2.get_trx();
-  ASSERT_FALSE(t == NULL);
-  EXPECT_CALL(mock_op2, get_xml(_, _))
-    .WillRepeatedly(DoAll(SetArgReferee<0>(""), SetArgReferee<1>(0)));
+  std::map<std::string, Cache::GetRegData::Result> reg_data;
+  reg_data[IMPU].xml = "";
+  reg_data[IMPU2].xml = "";
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillRepeatedly(SetArgReferee<0>(reg_data));
 
   // Expect to receive a diameter message.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  t->on_success(&mock_op2);
+  t->on_success(&mock_op);
 
   // Turn the caught Diameter msg structure into a RTA and confirm the result
   // code is correct.
@@ -3144,9 +3236,9 @@ TEST_F(HandlersTest, RegistrationTerminationRegSetsCacheFailure)
   task->_rtr._stack = _mock_stack;
 
   // Once the task's run function is called, we expect a cache request for
-  // the IMS subscription of the final public identity in IMPUS.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU2))
+  // the IMS subscriptions of the public identities in IMPUS.
+  MockCache::MockGetRegDataMulti mock_op;
+  EXPECT_CALL(*_cache, create_GetRegDataMulti(IMPUS, Cache::REG_DATA_XML))
     .WillOnce(Return(&mock_op));
   _cache->EXPECT_DO_ASYNC(mock_op);
 
@@ -0,0 +1,100 @@
+/**
+ * @file irssummary_test.cpp UT for IRS summaries.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+
+#include "irssummary.h"
+
+/// Fixture for IRSSummaryTest.
+class IRSSummaryTest : public testing::Test
+{
+public:
+  IRSSummaryTest() :
+    _xml("<IMSSubscription><PrivateID>kermit@example.com</PrivateID>"
+         "<ServiceProfile>"
+         "<PublicIdentity><Identity>sip:kermit@example.com</Identity></PublicIdentity>"
+         "<PublicIdentity><Identity>tel:+15551234567</Identity></PublicIdentity>"
+         "</ServiceProfile></IMSSubscription>")
+  {}
+
+  std::string _xml;
+};
+
+TEST_F(IRSSummaryTest, FromXml)
+{
+  IRSSummary summary(_xml);
+
+  std::vector<std::string> expected = {"sip:kermit@example.com", "tel:+15551234567"};
+  EXPECT_EQ(expected, summary.public_ids);
+  EXPECT_EQ("kermit@example.com", summary.private_id);
+  EXPECT_TRUE(summary.matches(_xml));
+  EXPECT_FALSE(summary.matches(_xml + " "));
+}
+
+TEST_F(IRSSummaryTest, EmptyXml)
+{
+  IRSSummary summary("");
+  EXPECT_TRUE(summary.public_ids.empty());
+  EXPECT_EQ("", summary.private_id);
+  EXPECT_TRUE(summary.matches(""));
+}
+
+TEST_F(IRSSummaryTest, RoundTrip)
+{
+  IRSSummary summary(_xml);
+  IRSSummary decoded;
+
+  EXPECT_TRUE(decoded.decode(summary.encode()));
+  EXPECT_EQ(summary.public_ids, decoded.public_ids);
+  EXPECT_EQ(summary.private_id, decoded.private_id);
+  EXPECT_TRUE(decoded.matches(_xml));
+}
+
+TEST_F(IRSSummaryTest, DecodeInvalid)
+{
+  std::string encoded = IRSSummary(_xml).encode();
+  IRSSummary decoded;
+
+  // Empty, unknown version, truncated and with trailing data.
+  EXPECT_FALSE(decoded.decode(""));
+  EXPECT_FALSE(decoded.decode("\x02" + encoded.substr(1)));
+  EXPECT_FALSE(decoded.decode(encoded.substr(0, 5)));
+  EXPECT_FALSE(decoded.decode(encoded.substr(0, encoded.length() - 1)));
+  EXPECT_FALSE(decoded.decode(encoded + "x"));
+
+  // A failed decode leaves the summary unchanged.
+  EXPECT_TRUE(decoded.public_ids.empty());
+}
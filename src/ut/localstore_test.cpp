@@ -0,0 +1,631 @@
+/**
+ * @file localstore_test.cpp UT for the embedded store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gtest/gtest.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "localstore.h"
+#include "cache.h"
+
+using namespace org::apache::cassandra;
+
+/// Fixture for LocalStoreTest.  Each test gets its own empty directory.
+class LocalStoreTest : public testing::Test
+{
+public:
+  LocalStoreTest()
+  {
+    char dir[] = "/tmp/localstore_test.XXXXXX";
+    _dir = mkdtemp(dir);
+    _store = new LocalStore(_dir, 0);
+    _store->start();
+  }
+
+  virtual ~LocalStoreTest()
+  {
+    delete _store;
+    unlink((_dir + "/log").c_str());
+    unlink((_dir + "/snapshot").c_str());
+    unlink((_dir + "/lock").c_str());
+    rmdir(_dir.c_str());
+  }
+
+  // Stop the store and start a new one from what it wrote to disk.
+  void restart()
+  {
+    delete _store;
+    _store = new LocalStore(_dir, 0);
+    EXPECT_TRUE(_store->start());
+  }
+
+  // Stop the store without the final snapshot, as if the process had
+  // crashed, and then start a new one.
+  void crash_and_restart()
+  {
+    close(_store->_log_fd);
+    _store->_log_fd = -1;
+    restart();
+  }
+
+  off_t log_size()
+  {
+    struct stat st;
+    return (stat((_dir + "/log").c_str(), &st) == 0) ? st.st_size : -1;
+  }
+
+  void put(const std::string& table,
+           const std::string& key,
+           const std::string& name,
+           const std::string& value,
+           int64_t timestamp,
+           int32_t ttl = 0)
+  {
+    Column column;
+    column.__set_name(name);
+    column.__set_value(value);
+    column.__set_timestamp(timestamp);
+    if (ttl > 0)
+    {
+      column.__set_ttl(ttl);
+    }
+
+    ColumnOrSuperColumn csc;
+    csc.__set_column(column);
+    Mutation mutation;
+    mutation.__set_column_or_supercolumn(csc);
+
+    std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutations;
+    mutations[key][table].push_back(mutation);
+    _store->batch_mutate(mutations, ConsistencyLevel::ONE);
+  }
+
+  // Read some columns (or all of them if names is empty) of a row, and
+  // return them as a "name=value,..." string.
+  std::string get(const std::string& table,
+                  const std::string& key,
+                  const std::vector<std::string>& names = std::vector<std::string>())
+  {
+    ColumnParent parent;
+    parent.__set_column_family(table);
+    SlicePredicate predicate;
+
+    if (names.empty())
+    {
+      SliceRange range;
+      predicate.__set_slice_range(range);
+    }
+    else
+    {
+      predicate.__set_column_names(names);
+    }
+
+    std::vector<ColumnOrSuperColumn> columns;
+    _store->get_slice(columns, key, parent, predicate, ConsistencyLevel::ONE);
+    return to_string(columns);
+  }
+
+  static std::string to_string(const std::vector<ColumnOrSuperColumn>& columns)
+  {
+    std::string result;
+
+    for (std::vector<ColumnOrSuperColumn>::const_iterator column = columns.begin();
+         column != columns.end();
+         ++column)
+    {
+      if (!result.empty())
+      {
+        result += ",";
+      }
+      result += column->column.name + "=" + column->column.value;
+    }
+
+    return result;
+  }
+
+  std::string _dir;
+  LocalStore* _store;
+};
+
+TEST_F(LocalStoreTest, PutAndGet)
+{
+  put("impu", "kermit", "ims_subscription_xml", "<howdy>", 1);
+  put("impu", "kermit", "is_registered", "\x01", 1);
+  put("impi", "kermit", "digest_ha1", "hash", 1);
+
+  EXPECT_EQ("ims_subscription_xml=<howdy>,is_registered=\x01", get("impu", "kermit"));
+  EXPECT_EQ("digest_ha1=hash", get("impi", "kermit"));
+  EXPECT_EQ("", get("impu", "gonzo"));
+  EXPECT_EQ(1u, _store->num_rows("impu"));
+}
+
+TEST_F(LocalStoreTest, GetNamedColumns)
+{
+  put("impu", "kermit", "a", "1", 1);
+  put("impu", "kermit", "b", "2", 1);
+  put("impu", "kermit", "c", "3", 1);
+
+  std::vector<std::string> names;
+  names.push_back("c");
+  names.push_back("a");
+  names.push_back("missing");
+  EXPECT_EQ("a=1,c=3", get("impu", "kermit", names));
+}
+
+TEST_F(LocalStoreTest, GetSliceRange)
+{
+  put("impi", "kermit", "digest_ha1", "hash", 1);
+  put("impi", "kermit", "public_id_sip:a", "", 1);
+  put("impi", "kermit", "public_id_sip:b", "", 1);
+
+  ColumnParent parent;
+  parent.__set_column_family("impi");
+  SliceRange range;
+  range.__set_start("public_id_");
+  range.__set_finish("public_id_\xFF");
+  SlicePredicate predicate;
+  predicate.__set_slice_range(range);
+
+  std::vector<ColumnOrSuperColumn> columns;
+  _store->get_slice(columns, "kermit", parent, predicate, ConsistencyLevel::ONE);
+  EXPECT_EQ("public_id_sip:a=,public_id_sip:b=", to_string(columns));
+
+  range.__set_count(1);
+  range.__set_reversed(true);
+  range.__set_start("public_id_\xFF");
+  range.__set_finish("public_id_");
+  predicate.__set_slice_range(range);
+  columns.clear();
+  _store->get_slice(columns, "kermit", parent, predicate, ConsistencyLevel::ONE);
+  EXPECT_EQ("public_id_sip:b=", to_string(columns));
+}
+
+TEST_F(LocalStoreTest, Multiget)
+{
+  put("impu", "kermit", "a", "1", 1);
+  put("impu", "gonzo", "a", "2", 1);
+
+  ColumnParent parent;
+  parent.__set_column_family("impu");
+  SlicePredicate predicate;
+  predicate.__set_slice_range(SliceRange());
+
+  std::vector<std::string> keys;
+  keys.push_back("kermit");
+  keys.push_back("gonzo");
+  keys.push_back("robin");
+
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > results;
+  _store->multiget_slice(results, keys, parent, predicate, ConsistencyLevel::ONE);
+  EXPECT_EQ(3u, results.size());
+  EXPECT_EQ("a=1", to_string(results["kermit"]));
+  EXPECT_EQ("a=2", to_string(results["gonzo"]));
+  EXPECT_TRUE(results["robin"].empty());
+}
+
+// Rows are scanned in token order, a page at a time.
+TEST_F(LocalStoreTest, RangeScan)
+{
+  const char* keys[] = {"kermit", "gonzo", "robin", "piggy", "animal"};
+  std::map<int64_t, std::string> by_token;
+
+  for (size_t ii = 0; ii < sizeof(keys) / sizeof(keys[0]); ii++)
+  {
+    put("impu", keys[ii], "a", keys[ii], 1);
+    by_token[LocalStore::token(keys[ii])] = keys[ii];
+  }
+
+  ColumnParent parent;
+  parent.__set_column_family("impu");
+  SlicePredicate predicate;
+  predicate.__set_slice_range(SliceRange());
+
+  // Read the first two rows of the ring.
+  KeyRange range;
+  range.__set_start_token(std::to_string(INT64_MIN));
+  range.__set_end_token(std::to_string(INT64_MAX));
+  range.__set_count(2);
+
+  std::vector<KeySlice> slices;
+  _store->get_range_slices(slices, parent, predicate, range, ConsistencyLevel::ONE);
+
+  std::map<int64_t, std::string>::const_iterator expected = by_token.begin();
+  ASSERT_EQ(2u, slices.size());
+  EXPECT_EQ(expected->second, slices[0].key);
+  EXPECT_EQ("a=" + expected->second, to_string(slices[0].columns));
+  ++expected;
+  EXPECT_EQ(expected->second, slices[1].key);
+
+  // Carry on from the last key read.  The range includes that key.
+  KeyRange next;
+  next.__set_start_key(slices[1].key);
+  next.__set_end_token(std::to_string(INT64_MAX));
+  next.__set_count(100);
+
+  slices.clear();
+  _store->get_range_slices(slices, parent, predicate, next, ConsistencyLevel::ONE);
+  ASSERT_EQ(4u, slices.size());
+
+  for (size_t ii = 0; ii < slices.size(); ii++, ++expected)
+  {
+    EXPECT_EQ(expected->second, slices[ii].key);
+  }
+
+  // A range only includes the tokens after its start, up to its end.
+  KeyRange middle;
+  middle.__set_start_token(std::to_string(by_token.begin()->first));
+  middle.__set_end_token(std::to_string(by_token.rbegin()->first - 1));
+
+  slices.clear();
+  _store->get_range_slices(slices, parent, predicate, middle, ConsistencyLevel::ONE);
+  EXPECT_EQ(3u, slices.size());
+
+  // Scans by key aren't supported.
+  KeyRange by_key;
+  by_key.__set_start_key("kermit");
+  by_key.__set_end_key("robin");
+  EXPECT_THROW(_store->get_range_slices(slices, parent, predicate, by_key, ConsistencyLevel::ONE),
+               InvalidRequestException);
+}
+
+TEST_F(LocalStoreTest, LatestTimestampWins)
+{
+  put("impu", "kermit", "a", "new", 2);
+  put("impu", "kermit", "a", "old", 1);
+  EXPECT_EQ("a=new", get("impu", "kermit"));
+
+  put("impu", "kermit", "a", "newer", 3);
+  EXPECT_EQ("a=newer", get("impu", "kermit"));
+}
+
+TEST_F(LocalStoreTest, Remove)
+{
+  put("impu", "kermit", "a", "1", 1);
+  put("impu", "kermit", "b", "2", 1);
+  put("impu", "kermit", "c", "3", 5);
+
+  ColumnPath path;
+  path.__set_column_family("impu");
+  path.__set_column("a");
+  _store->remove("kermit", path, 2, ConsistencyLevel::ONE);
+  EXPECT_EQ("b=2,c=3", get("impu", "kermit"));
+
+  // Deleting the row leaves columns written after the deletion.
+  ColumnPath row_path;
+  row_path.__set_column_family("impu");
+  _store->remove("kermit", row_path, 2, ConsistencyLevel::ONE);
+  EXPECT_EQ("c=3", get("impu", "kermit"));
+
+  _store->remove("kermit", row_path, 5, ConsistencyLevel::ONE);
+  EXPECT_EQ("", get("impu", "kermit"));
+  EXPECT_EQ(0u, _store->num_rows("impu"));
+}
+
+TEST_F(LocalStoreTest, DeleteColumnsInBatch)
+{
+  put("impi_mapping", "kermit", "associated_primary_impi", "", 1);
+  put("impi_mapping", "kermit", "other", "", 1);
+
+  std::vector<std::string> names;
+  names.push_back("associated_primary_impi");
+  SlicePredicate predicate;
+  predicate.__set_column_names(names);
+  Deletion deletion;
+  deletion.__set_timestamp(2);
+  deletion.__set_predicate(predicate);
+  Mutation mutation;
+  mutation.__set_deletion(deletion);
+
+  std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutations;
+  mutations["kermit"]["impi_mapping"].push_back(mutation);
+  _store->batch_mutate(mutations, ConsistencyLevel::ONE);
+
+  EXPECT_EQ("other=", get("impi_mapping", "kermit"));
+}
+
+TEST_F(LocalStoreTest, Expiry)
+{
+  cwtest_completely_control_time();
+
+  put("impi", "kermit", "digest_ha1", "hash", 1, 10);
+  put("impi", "kermit", "forever", "", 1);
+
+  cwtest_advance_time_ms(9000);
+  EXPECT_EQ("digest_ha1=hash,forever=", get("impi", "kermit"));
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_EQ("forever=", get("impi", "kermit"));
+
+  cwtest_reset_time();
+}
+
+TEST_F(LocalStoreTest, RecoverFromLog)
+{
+  put("impu", "kermit", "a", "1", 1);
+  put("impu", "kermit", "b", "2", 1);
+
+  ColumnPath path;
+  path.__set_column_family("impu");
+  path.__set_column("a");
+  _store->remove("kermit", path, 2, ConsistencyLevel::ONE);
+
+  crash_and_restart();
+  EXPECT_EQ("b=2", get("impu", "kermit"));
+}
+
+TEST_F(LocalStoreTest, RecoverFromSnapshot)
+{
+  put("impu", "kermit", "a", "1", 1);
+  EXPECT_TRUE(_store->snapshot());
+  EXPECT_EQ(0, log_size());
+
+  // Changes made after the snapshot are in the log.
+  put("impu", "gonzo", "a", "2", 1);
+  EXPECT_LT(0, log_size());
+
+  crash_and_restart();
+  EXPECT_EQ("a=1", get("impu", "kermit"));
+  EXPECT_EQ("a=2", get("impu", "gonzo"));
+}
+
+TEST_F(LocalStoreTest, IncompleteLogRecordDiscarded)
+{
+  put("impu", "kermit", "a", "1", 1);
+  off_t good_size = log_size();
+  put("impu", "gonzo", "a", "2", 1);
+
+  // Cut the last record short, as a crash part way through writing it
+  // would.
+  EXPECT_EQ(0, truncate((_dir + "/log").c_str(), log_size() - 1));
+
+  crash_and_restart();
+  EXPECT_EQ("a=1", get("impu", "kermit"));
+  EXPECT_EQ("", get("impu", "gonzo"));
+  EXPECT_EQ(good_size, log_size());
+
+  // New writes follow on from the last complete record.
+  put("impu", "gonzo", "a", "3", 1);
+  crash_and_restart();
+  EXPECT_EQ("a=3", get("impu", "gonzo"));
+}
+
+// Writes made while a snapshot is being written out aren't held up, and are
+// kept in the log when the snapshot is swapped in.
+TEST_F(LocalStoreTest, WritesDuringSnapshotKept)
+{
+  put("impu", "kermit", "a", "1", 1);
+
+  // Take the snapshot in its stages, writing in the middle.
+  pthread_rwlock_rdlock(&_store->_lock);
+  std::map<std::string, LocalStore::Table> tables = _store->_tables;
+  size_t log_length = _store->_log_length;
+  pthread_rwlock_unlock(&_store->_lock);
+
+  std::string tmp_path = _dir + "/snapshot.tmp";
+  EXPECT_TRUE(_store->write_snapshot(tables, tmp_path));
+
+  put("impu", "gonzo", "a", "2", 1);
+  off_t tail_size = log_size() - log_length;
+
+  pthread_rwlock_wrlock(&_store->_lock);
+  EXPECT_TRUE(_store->install_snapshot(tmp_path, log_length));
+  pthread_rwlock_unlock(&_store->_lock);
+
+  // Only the write made after the copy is left in the log, and it carries
+  // on being written to.
+  EXPECT_EQ(tail_size, log_size());
+  put("impu", "rizzo", "a", "3", 1);
+
+  crash_and_restart();
+  EXPECT_EQ("a=1", get("impu", "kermit"));
+  EXPECT_EQ("a=2", get("impu", "gonzo"));
+  EXPECT_EQ("a=3", get("impu", "rizzo"));
+}
+
+// Writes aren't acknowledged until the log has been flushed.  Concurrent
+// writers share flushes, and none is left waiting.
+struct WriterArgs
+{
+  LocalStoreTest* test;
+  int id;
+};
+
+static void* concurrent_writer(void* arg)
+{
+  WriterArgs* args = (WriterArgs*)arg;
+
+  for (int ii = 0; ii < 50; ii++)
+  {
+    args->test->put("impu",
+                    "writer" + std::to_string(args->id),
+                    std::to_string(ii),
+                    "x",
+                    1);
+  }
+
+  return NULL;
+}
+
+TEST_F(LocalStoreTest, WritesSynced)
+{
+  put("impu", "kermit", "a", "1", 1);
+  EXPECT_EQ(1u, _store->_written_seq);
+  EXPECT_EQ(1u, _store->_synced_seq);
+
+  pthread_t threads[8];
+  WriterArgs args[8];
+
+  for (int ii = 0; ii < 8; ii++)
+  {
+    args[ii].test = this;
+    args[ii].id = ii;
+    ASSERT_EQ(0, pthread_create(&threads[ii], NULL, concurrent_writer, &args[ii]));
+  }
+
+  for (int ii = 0; ii < 8; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  EXPECT_EQ(401u, _store->_written_seq);
+  EXPECT_EQ(401u, _store->_synced_seq);
+  EXPECT_FALSE(_store->_syncing);
+
+  crash_and_restart();
+  EXPECT_EQ(9u, _store->num_rows("impu"));
+}
+
+// Flushing the log can be turned off, in which case writes are acknowledged
+// as soon as they are logged.
+TEST_F(LocalStoreTest, WritesNotSynced)
+{
+  delete _store;
+  _store = new LocalStore(_dir, 0, false, false);
+  ASSERT_TRUE(_store->start());
+
+  put("impu", "kermit", "a", "1", 1);
+  EXPECT_EQ(1u, _store->_written_seq);
+  EXPECT_EQ(0u, _store->_synced_seq);
+
+  crash_and_restart();
+  EXPECT_EQ("a=1", get("impu", "kermit"));
+}
+
+// The cache's operations run against the local store as they would against
+// Cassandra.
+TEST_F(LocalStoreTest, CacheOperations)
+{
+  Cache cache;
+  cache.configure_local_store(_store);
+
+  Cache::PutAssociatedPublicID* put_impu =
+    cache.create_PutAssociatedPublicID("kermit@example.com", "sip:kermit@example.com", 1);
+  EXPECT_TRUE(cache.do_sync(put_impu, 0));
+  delete put_impu;
+
+  Cache::GetAssociatedPublicIDs* get_impus =
+    cache.create_GetAssociatedPublicIDs("kermit@example.com");
+  EXPECT_TRUE(cache.do_sync(get_impus, 0));
+  std::vector<std::string> impus;
+  get_impus->get_result(impus);
+  delete get_impus;
+
+  ASSERT_EQ(1u, impus.size());
+  EXPECT_EQ("sip:kermit@example.com", impus[0]);
+
+  Cache::PutRegData* put_reg_data =
+    cache.create_PutRegData("sip:kermit@example.com", 1);
+  put_reg_data->with_xml("<howdy>")
+               .with_reg_state(RegistrationState::REGISTERED);
+  EXPECT_TRUE(cache.do_sync(put_reg_data, 0));
+  delete put_reg_data;
+
+  // The data survives a restart.
+  cache.configure_local_store(NULL);
+  restart();
+  cache.configure_local_store(_store);
+
+  Cache::GetRegData* get_reg_data = cache.create_GetRegData("sip:kermit@example.com");
+  EXPECT_TRUE(cache.do_sync(get_reg_data, 0));
+  std::string xml;
+  RegistrationState state;
+  int32_t ttl;
+  get_reg_data->get_xml(xml, ttl);
+  get_reg_data->get_registration_state(state, ttl);
+  delete get_reg_data;
+
+  EXPECT_EQ("<howdy>", xml);
+  EXPECT_EQ(RegistrationState::REGISTERED, state);
+}
+
+// A restart following a clean stop loads everything from the snapshot.
+TEST_F(LocalStoreTest, SnapshotOnStop)
+{
+  put("impu", "kermit", "a", "1", 1);
+  restart();
+  EXPECT_EQ(0, log_size());
+  EXPECT_EQ("a=1", get("impu", "kermit"));
+}
+
+// Only one store can use a directory at a time.
+TEST_F(LocalStoreTest, DirectoryInUse)
+{
+  LocalStore other(_dir, 0);
+  EXPECT_FALSE(other.start());
+}
+
+// A read-only copy of a store that is in use has everything in its snapshot
+// and log, but doesn't change either of them.
+TEST_F(LocalStoreTest, ReadOnlyCopy)
+{
+  put("impu", "kermit", "a", "1", 1);
+  EXPECT_TRUE(_store->snapshot());
+  put("impu", "gonzo", "a", "2", 1);
+
+  // Leave a record half written, as if the store were in the middle of
+  // writing it.
+  int fd = open((_dir + "/log").c_str(), O_WRONLY | O_APPEND);
+  ASSERT_LE(0, fd);
+  EXPECT_EQ(3, write(fd, "\x10\x00\x00", 3));
+  close(fd);
+  off_t size = log_size();
+
+  struct stat st;
+  ASSERT_EQ(0, stat((_dir + "/snapshot").c_str(), &st));
+  struct timespec snapshot_mtime = st.st_mtim;
+
+  LocalStore* copy = new LocalStore(_dir, 0, true);
+  EXPECT_TRUE(copy->start());
+  EXPECT_EQ(2u, copy->num_rows("impu"));
+  EXPECT_FALSE(copy->snapshot());
+
+  ColumnPath path;
+  path.__set_column_family("impu");
+  EXPECT_THROW(copy->remove("kermit", path, 2, ConsistencyLevel::ONE),
+               UnavailableException);
+  delete copy; copy = NULL;
+
+  EXPECT_EQ(size, log_size());
+  ASSERT_EQ(0, stat((_dir + "/snapshot").c_str(), &st));
+  EXPECT_EQ(snapshot_mtime.tv_sec, st.st_mtim.tv_sec);
+  EXPECT_EQ(snapshot_mtime.tv_nsec, st.st_mtim.tv_nsec);
+}
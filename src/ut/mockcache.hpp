@@ -78,6 +78,13 @@ public:
                                const int32_t ttl));
   MOCK_METHOD1(create_GetRegData,
                GetRegData*(const std::string& public_id));
+  MOCK_METHOD2(create_GetRegData,
+               GetRegData*(const std::string& public_id, int columns));
+  MOCK_METHOD1(create_GetRegDataMulti,
+               GetRegDataMulti*(const std::vector<std::string>& public_ids));
+  MOCK_METHOD2(create_GetRegDataMulti,
+               GetRegDataMulti*(const std::vector<std::string>& public_ids,
+                                int columns));
   MOCK_METHOD1(create_GetAssociatedPublicIDs,
                GetAssociatedPublicIDs*(const std::string& private_id));
   MOCK_METHOD1(create_GetAssociatedPublicIDs,
@@ -181,6 +188,23 @@ public:
     MOCK_METHOD2(get_registration_state, void(RegistrationState& state, int& ttl));
     MOCK_METHOD1(get_associated_impis, void(std::vector<std::string>& associated_impis));
     MOCK_METHOD1(get_charging_addrs, void(ChargingAddresses& charging_addrs));
+
+    // Summarize whatever XML the test has the mock return.
+    void get_irs_summary(IRSSummary& summary)
+    {
+      std::string xml;
+      int ttl;
+      get_xml(xml, ttl);
+      summary = IRSSummary(xml);
+    }
+  };
+
+  class MockGetRegDataMulti : public GetRegDataMulti, public MockOperationMixin
+  {
+    MockGetRegDataMulti() : GetRegDataMulti({}) {}
+    virtual ~MockGetRegDataMulti() {}
+
+    MOCK_METHOD1(get_result, void(std::map<std::string, GetRegData::Result>& results));
   };
 
   class MockGetAssociatedPublicIDs : public GetAssociatedPublicIDs, public MockOperationMixin
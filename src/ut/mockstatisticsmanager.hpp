@@ -52,13 +52,35 @@ public:
   MOCK_METHOD1(update_H_hss_digest_latency_us, void(unsigned long sample));
   MOCK_METHOD1(update_H_hss_subscription_latency_us, void(unsigned long sample));
   MOCK_METHOD1(update_H_cache_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_worker_threads, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_queue_depth, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_high_priority_queue_wait_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_normal_priority_queue_wait_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_low_priority_queue_wait_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_write_behind_backlog, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_write_behind_age_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_shard_imbalance, void(unsigned long sample));
 
   MOCK_METHOD0(incr_H_incoming_requests, void());
   MOCK_METHOD0(incr_H_rejected_overload, void());
+  MOCK_METHOD0(incr_H_cache_coalesced_reads, void());
+  MOCK_METHOD0(incr_H_cache_expired_operations, void());
+  MOCK_METHOD0(incr_H_cache_hedged_reads, void());
 
   MOCK_METHOD1(update_http_latency_us, void(unsigned long sample));
   MOCK_METHOD0(incr_http_incoming_requests, void());
   MOCK_METHOD0(incr_http_rejected_overload, void());
+
+  MOCK_METHOD0(incr_cache_coalesced_reads, void());
+  MOCK_METHOD1(update_cache_worker_threads, void(unsigned long threads));
+  MOCK_METHOD1(update_cache_queue_depth, void(unsigned long depth));
+  MOCK_METHOD2(update_cache_queue_wait_us, void(Cache::Priority priority,
+                                                unsigned long wait_us));
+  MOCK_METHOD1(update_cache_write_behind_backlog, void(unsigned long depth));
+  MOCK_METHOD1(update_cache_write_behind_age_us, void(unsigned long age_us));
+  MOCK_METHOD0(incr_cache_expired_operations, void());
+  MOCK_METHOD1(update_cache_shard_imbalance, void(unsigned long percent));
+  MOCK_METHOD0(incr_cache_hedged_reads, void());
 };
 
 #endif
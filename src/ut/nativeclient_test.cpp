@@ -0,0 +1,870 @@
+/**
+ * @file nativeclient_test.cpp UT for the native protocol Cassandra client.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <functional>
+
+#include "gtest/gtest.h"
+#include "test_utils.hpp"
+
+#include "nativeclient.h"
+
+using namespace org::apache::cassandra;
+
+// Encoding of the protocol's types, for the fake node's responses.
+static void put_short(std::string& out, uint16_t value)
+{
+  out.push_back((char)(value >> 8));
+  out.push_back((char)(value & 0xFF));
+}
+
+static void put_int(std::string& out, int32_t value)
+{
+  out.append(NativeConnection::int_value(value));
+}
+
+static void put_string(std::string& out, const std::string& value)
+{
+  put_short(out, value.size());
+  out.append(value);
+}
+
+static void put_bytes(std::string& out, const std::string& value)
+{
+  put_int(out, value.size());
+  out.append(value);
+}
+
+// Decoding of the protocol's types, for the requests the fake node receives.
+static uint16_t get_short(const std::string& in, size_t& pos)
+{
+  uint16_t value = ((uint8_t)in[pos] << 8) | (uint8_t)in[pos + 1];
+  pos += 2;
+  return value;
+}
+
+static int32_t get_int(const std::string& in, size_t& pos)
+{
+  int32_t value = NativeConnection::get_int_value(in.substr(pos, 4));
+  pos += 4;
+  return value;
+}
+
+static std::string get_string(const std::string& in, size_t& pos)
+{
+  size_t length = get_short(in, pos);
+  std::string value = in.substr(pos, length);
+  pos += length;
+  return value;
+}
+
+static std::string get_bytes(const std::string& in, size_t& pos)
+{
+  size_t length = get_int(in, pos);
+  std::string value = in.substr(pos, length);
+  pos += length;
+  return value;
+}
+
+/// A Cassandra node that speaks enough of the native protocol to test the
+/// client with.  It accepts one connection at a time.
+class FakeNode
+{
+public:
+  /// A statement the node has been asked to run.
+  struct Statement
+  {
+    std::string query;
+    std::vector<std::string> values;
+    uint16_t consistency;
+    std::string paging_state;
+  };
+
+  /// Builds the response to a statement.  By default statements return no
+  /// result.
+  std::function<std::string(const Statement&)> respond;
+
+  FakeNode() :
+    respond(void_result),
+    _listen_fd(-1),
+    _fd(-1),
+    _hold(0),
+    _close_on_execute(false),
+    _prepare_count(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+
+    _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(_listen_fd, 5);
+
+    socklen_t len = sizeof(addr);
+    getsockname(_listen_fd, (struct sockaddr*)&addr, &len);
+    _port = ntohs(addr.sin_port);
+
+    pthread_create(&_thread, NULL, thread_entry, this);
+  }
+
+  ~FakeNode()
+  {
+    shutdown(_listen_fd, SHUT_RDWR);
+    pthread_mutex_lock(&_lock);
+    if (_fd >= 0)
+    {
+      shutdown(_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_thread, NULL);
+    close(_listen_fd);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  uint16_t port() const { return _port; }
+
+  /// Hold the responses to the next n statements executed, and then send
+  /// them in the reverse order.
+  void hold(size_t n) { _hold = n; }
+
+  /// Close the connection when the next statement is executed.
+  void close_on_execute() { _close_on_execute = true; }
+
+  /// Forget the prepared statements, as a node does when it restarts.
+  void forget_prepared()
+  {
+    pthread_mutex_lock(&_lock);
+    _prepared.clear();
+    pthread_mutex_unlock(&_lock);
+  }
+
+  std::vector<Statement> executed()
+  {
+    pthread_mutex_lock(&_lock);
+    std::vector<Statement> executed = _executed;
+    pthread_mutex_unlock(&_lock);
+    return executed;
+  }
+
+  std::vector<std::vector<Statement> > batches()
+  {
+    pthread_mutex_lock(&_lock);
+    std::vector<std::vector<Statement> > batches = _batches;
+    pthread_mutex_unlock(&_lock);
+    return batches;
+  }
+
+  int prepare_count()
+  {
+    pthread_mutex_lock(&_lock);
+    int count = _prepare_count;
+    pthread_mutex_unlock(&_lock);
+    return count;
+  }
+
+  /// Responses to statements.
+  static std::string void_result(const Statement& statement)
+  {
+    std::string body;
+    put_int(body, 0x0001);
+    return body;
+  }
+
+  static std::string rows_result(const std::vector<std::vector<std::string> >& rows,
+                                 const std::string& paging_state = "")
+  {
+    size_t num_columns = rows.empty() ? 0 : rows.front().size();
+    std::string body;
+    put_int(body, 0x0002);
+    put_int(body, paging_state.empty() ? 0x0001 : 0x0003);
+    put_int(body, num_columns);
+
+    if (!paging_state.empty())
+    {
+      put_bytes(body, paging_state);
+    }
+
+    put_string(body, "homestead_cache");
+    put_string(body, "impu");
+
+    for (size_t ii = 0; ii < num_columns; ii++)
+    {
+      put_string(body, "column");
+      put_short(body, 0x0003);
+    }
+
+    put_int(body, rows.size());
+
+    for (size_t ii = 0; ii < rows.size(); ii++)
+    {
+      for (size_t jj = 0; jj < rows[ii].size(); jj++)
+      {
+        if (rows[ii][jj] == NULL_VALUE)
+        {
+          put_int(body, -1);
+        }
+        else
+        {
+          put_bytes(body, rows[ii][jj]);
+        }
+      }
+    }
+
+    return body;
+  }
+
+  static std::string error(int32_t code, const std::string& message)
+  {
+    std::string body;
+    put_int(body, code);
+    put_string(body, message);
+    return body;
+  }
+
+  static const std::string NULL_VALUE;
+
+private:
+  static void* thread_entry(void* node)
+  {
+    ((FakeNode*)node)->run();
+    return NULL;
+  }
+
+  void run()
+  {
+    while (true)
+    {
+      int fd = accept(_listen_fd, NULL, NULL);
+
+      if (fd < 0)
+      {
+        break;
+      }
+
+      pthread_mutex_lock(&_lock);
+      _fd = fd;
+      pthread_mutex_unlock(&_lock);
+
+      serve();
+
+      pthread_mutex_lock(&_lock);
+      close(_fd);
+      _fd = -1;
+      pthread_mutex_unlock(&_lock);
+    }
+  }
+
+  bool read_all(char* data, size_t length)
+  {
+    while (length > 0)
+    {
+      ssize_t rc = recv(_fd, data, length, 0);
+
+      if (rc <= 0)
+      {
+        return false;
+      }
+
+      data += rc;
+      length -= rc;
+    }
+
+    return true;
+  }
+
+  void send_frame(uint16_t stream, uint8_t opcode, const std::string& body)
+  {
+    std::string frame;
+    frame.push_back((char)0x83);
+    frame.push_back(0);
+    put_short(frame, stream);
+    frame.push_back((char)opcode);
+    put_bytes(frame, body);
+    send(_fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+  }
+
+  // Read the values bound to a statement.
+  static void get_values(const std::string& body, size_t& pos, Statement& statement)
+  {
+    uint16_t num_values = get_short(body, pos);
+
+    for (uint16_t ii = 0; ii < num_values; ii++)
+    {
+      statement.values.push_back(get_bytes(body, pos));
+    }
+  }
+
+  // Look up a prepared statement, and fill in an error response if it isn't
+  // prepared.
+  bool find_prepared(const std::string& id, Statement& statement, std::string& response)
+  {
+    pthread_mutex_lock(&_lock);
+    std::map<std::string, std::string>::const_iterator prepared = _prepared.find(id);
+    bool found = (prepared != _prepared.end());
+    statement.query = found ? prepared->second : "";
+    pthread_mutex_unlock(&_lock);
+
+    if (!found)
+    {
+      response = error(0x2500, "Unprepared");
+      put_string(response, id);
+    }
+
+    return found;
+  }
+
+  void serve()
+  {
+    std::vector<std::pair<uint16_t, std::string> > held;
+
+    while (true)
+    {
+      std::string header(9, '\0');
+
+      if (!read_all(&header[0], 9))
+      {
+        return;
+      }
+
+      size_t pos = 2;
+      uint16_t stream = get_short(header, pos);
+      uint8_t opcode = header[4];
+      pos = 5;
+      std::string body(get_int(header, pos), '\0');
+
+      if ((!body.empty()) && (!read_all(&body[0], body.size())))
+      {
+        return;
+      }
+
+      pos = 0;
+
+      if (opcode == 0x01)
+      {
+        // STARTUP.
+        send_frame(stream, 0x02, "");
+      }
+      else if (opcode == 0x07)
+      {
+        // QUERY, which is only used to set the keyspace.
+        std::string response;
+        put_int(response, 0x0003);
+        put_string(response, "homestead_cache");
+        send_frame(stream, 0x08, response);
+      }
+      else if (opcode == 0x09)
+      {
+        // PREPARE.
+        std::string query = get_bytes(body, pos);
+
+        pthread_mutex_lock(&_lock);
+        std::string id = "id" + std::to_string(_prepare_count++);
+        _prepared[id] = query;
+        pthread_mutex_unlock(&_lock);
+
+        std::string response;
+        put_int(response, 0x0004);
+        put_string(response, id);
+        send_frame(stream, 0x08, response);
+      }
+      else if (opcode == 0x0A)
+      {
+        // EXECUTE.
+        if (_close_on_execute)
+        {
+          _close_on_execute = false;
+          return;
+        }
+
+        Statement statement;
+        std::string response;
+
+        if (find_prepared(get_string(body, pos), statement, response))
+        {
+          statement.consistency = get_short(body, pos);
+          uint8_t flags = body[pos++];
+
+          if (flags & 0x01)
+          {
+            get_values(body, pos, statement);
+          }
+
+          if (flags & 0x04)
+          {
+            get_int(body, pos);
+          }
+
+          if (flags & 0x08)
+          {
+            statement.paging_state = get_bytes(body, pos);
+          }
+
+          pthread_mutex_lock(&_lock);
+          _executed.push_back(statement);
+          pthread_mutex_unlock(&_lock);
+
+          response = respond(statement);
+        }
+
+        // Results are of kinds 1 to 5, and the errors used have higher codes.
+        uint8_t response_opcode = (response.size() >= 4) &&
+                                  (NativeConnection::get_int_value(response.substr(0, 4)) >= 0x0100) ?
+                                    0x00 : 0x08;
+
+        if (_hold > 0)
+        {
+          held.push_back(std::make_pair(stream, response));
+
+          if (held.size() == _hold)
+          {
+            for (size_t ii = held.size(); ii > 0; ii--)
+            {
+              send_frame(held[ii - 1].first, response_opcode, held[ii - 1].second);
+            }
+
+            held.clear();
+            _hold = 0;
+          }
+        }
+        else
+        {
+          send_frame(stream, response_opcode, response);
+        }
+      }
+      else if (opcode == 0x0D)
+      {
+        // BATCH.
+        pos++;
+        uint16_t num_statements = get_short(body, pos);
+        std::vector<Statement> batch;
+        std::string response;
+        bool prepared = true;
+
+        for (uint16_t ii = 0; ii < num_statements; ii++)
+        {
+          pos++;
+          Statement statement;
+          prepared = find_prepared(get_string(body, pos), statement, response) && prepared;
+          get_values(body, pos, statement);
+          batch.push_back(statement);
+        }
+
+        if (prepared)
+        {
+          pthread_mutex_lock(&_lock);
+          _batches.push_back(batch);
+          pthread_mutex_unlock(&_lock);
+          response = void_result(batch.front());
+        }
+
+        send_frame(stream, prepared ? 0x08 : 0x00, response);
+      }
+    }
+  }
+
+  int _listen_fd;
+  uint16_t _port;
+  pthread_t _thread;
+
+  // Only used by the node's thread, once set up by the test.
+  int _fd;
+  size_t _hold;
+  bool _close_on_execute;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, std::string> _prepared;
+  int _prepare_count;
+  std::vector<Statement> _executed;
+  std::vector<std::vector<Statement> > _batches;
+};
+
+const std::string FakeNode::NULL_VALUE = "<null>";
+
+/// Fixture for NativeClientTest.
+class NativeClientTest : public testing::Test
+{
+public:
+  NativeClientTest()
+  {
+    _pool = new NativeConnectionPool();
+    _client = _pool->get_client("127.0.0.1", _node.port());
+    _client->set_keyspace("homestead_cache");
+  }
+
+  virtual ~NativeClientTest()
+  {
+    delete _client;
+    delete _pool;
+  }
+
+  NativeClient* client() { return (NativeClient*)_client; }
+
+  // Read some columns of a row.
+  std::vector<ColumnOrSuperColumn> get_columns(const std::string& key,
+                                               const std::vector<std::string>& names)
+  {
+    ColumnParent cp;
+    cp.__set_column_family("impu");
+    SlicePredicate sp;
+    sp.__set_column_names(names);
+    std::vector<ColumnOrSuperColumn> columns;
+    _client->get_slice(columns, key, cp, sp, ConsistencyLevel::ONE);
+    return columns;
+  }
+
+  FakeNode _node;
+  NativeConnectionPool* _pool;
+  CassandraStore::ClientInterface* _client;
+};
+
+// Build a vector of strings.
+static std::vector<std::string> strings(const std::string& a,
+                                        const std::string& b = "",
+                                        const std::string& c = "",
+                                        const std::string& d = "",
+                                        const std::string& e = "")
+{
+  std::vector<std::string> result;
+  const std::string* all[] = {&a, &b, &c, &d, &e};
+
+  for (size_t ii = 0; (ii < 5) && (!all[ii]->empty()); ii++)
+  {
+    result.push_back(*all[ii]);
+  }
+
+  return result;
+}
+
+static std::string row_response(const FakeNode::Statement& statement)
+{
+  std::vector<std::vector<std::string> > rows;
+  rows.push_back(strings("ims_subscription_xml",
+                         "<xml>" + statement.values[0],
+                         NativeConnection::bigint(1234),
+                         FakeNode::NULL_VALUE));
+  return FakeNode::rows_result(rows);
+}
+
+TEST_F(NativeClientTest, GetSlice)
+{
+  _node.respond = row_response;
+
+  std::vector<ColumnOrSuperColumn> columns =
+    get_columns("kermit", strings("ims_subscription_xml", "is_registered"));
+
+  std::vector<FakeNode::Statement> executed = _node.executed();
+  ASSERT_EQ(1u, executed.size());
+  EXPECT_EQ("SELECT column1, value, writetime(value), ttl(value) FROM \"impu\" "
+            "WHERE key = ? AND column1 IN (?, ?)",
+            executed[0].query);
+  EXPECT_EQ(strings("kermit", "ims_subscription_xml", "is_registered"), executed[0].values);
+  EXPECT_EQ(0x0001, executed[0].consistency);
+
+  ASSERT_EQ(1u, columns.size());
+  EXPECT_EQ("ims_subscription_xml", columns[0].column.name);
+  EXPECT_EQ("<xml>kermit", columns[0].column.value);
+  EXPECT_EQ(1234, columns[0].column.timestamp);
+  EXPECT_FALSE(columns[0].column.__isset.ttl);
+}
+
+TEST_F(NativeClientTest, SliceRange)
+{
+  ColumnParent cp;
+  cp.__set_column_family("impi");
+  SliceRange sr;
+  sr.__set_start("assoc_public_");
+  sr.__set_finish("assoc_public_\xff");
+  sr.__set_count(10);
+  SlicePredicate sp;
+  sp.__set_slice_range(sr);
+
+  std::vector<ColumnOrSuperColumn> columns;
+  _client->get_slice(columns, "gonzo", cp, sp, ConsistencyLevel::QUORUM);
+
+  std::vector<FakeNode::Statement> executed = _node.executed();
+  ASSERT_EQ(1u, executed.size());
+  EXPECT_EQ("SELECT column1, value, writetime(value), ttl(value) FROM \"impi\" "
+            "WHERE key = ? AND column1 >= ? AND column1 <= ? LIMIT 10",
+            executed[0].query);
+  EXPECT_EQ(strings("gonzo", "assoc_public_", "assoc_public_\xff"), executed[0].values);
+  EXPECT_EQ(0x0004, executed[0].consistency);
+  EXPECT_TRUE(columns.empty());
+}
+
+// The rows of a multiget are all read at once, and the answers are matched
+// up with them however they come back.
+TEST_F(NativeClientTest, MultigetOutOfOrder)
+{
+  _node.respond = row_response;
+  _node.hold(3);
+
+  ColumnParent cp;
+  cp.__set_column_family("impu");
+  SlicePredicate sp;
+  sp.__set_column_names(strings("ims_subscription_xml"));
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > rows;
+  _client->multiget_slice(rows,
+                          strings("kermit", "gonzo", "miss piggy"),
+                          cp,
+                          sp,
+                          ConsistencyLevel::ONE);
+
+  EXPECT_EQ(3u, _node.executed().size());
+  ASSERT_EQ(3u, rows.size());
+  EXPECT_EQ("<xml>kermit", rows["kermit"][0].column.value);
+  EXPECT_EQ("<xml>gonzo", rows["gonzo"][0].column.value);
+  EXPECT_EQ("<xml>miss piggy", rows["miss piggy"][0].column.value);
+
+  // Each statement was only prepared once.
+  EXPECT_EQ(1, _node.prepare_count());
+}
+
+TEST_F(NativeClientTest, BatchMutate)
+{
+  Column column;
+  column.__set_name("ims_subscription_xml");
+  column.__set_value("<xml>");
+  column.__set_timestamp(1000);
+  column.__set_ttl(3600);
+  ColumnOrSuperColumn csc;
+  csc.__set_column(column);
+  Mutation insert;
+  insert.__set_column_or_supercolumn(csc);
+
+  SlicePredicate sp;
+  sp.__set_column_names(strings("is_registered"));
+  Deletion column_deletion;
+  column_deletion.__set_timestamp(1001);
+  column_deletion.__set_predicate(sp);
+  Mutation delete_column;
+  delete_column.__set_deletion(column_deletion);
+
+  Deletion row_deletion;
+  row_deletion.__set_timestamp(1002);
+  Mutation delete_row;
+  delete_row.__set_deletion(row_deletion);
+
+  std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutations;
+  mutations["kermit"]["impu"].push_back(insert);
+  mutations["kermit"]["impu"].push_back(delete_column);
+  mutations["gonzo"]["impi"].push_back(delete_row);
+
+  _client->batch_mutate(mutations, ConsistencyLevel::ONE);
+
+  // Everything is written in a single batch.
+  std::vector<std::vector<FakeNode::Statement> > batches = _node.batches();
+  ASSERT_EQ(1u, batches.size());
+  ASSERT_EQ(3u, batches[0].size());
+
+  EXPECT_EQ("DELETE FROM \"impi\" USING TIMESTAMP ? WHERE key = ?",
+            batches[0][0].query);
+  EXPECT_EQ(strings(NativeConnection::bigint(1002), "gonzo"), batches[0][0].values);
+
+  EXPECT_EQ("INSERT INTO \"impu\" (key, column1, value) VALUES (?, ?, ?) "
+            "USING TTL ? AND TIMESTAMP ?",
+            batches[0][1].query);
+  EXPECT_EQ(strings("kermit",
+                    "ims_subscription_xml",
+                    "<xml>",
+                    NativeConnection::int_value(3600),
+                    NativeConnection::bigint(1000)),
+            batches[0][1].values);
+
+  EXPECT_EQ("DELETE FROM \"impu\" USING TIMESTAMP ? WHERE key = ? AND column1 = ?",
+            batches[0][2].query);
+  EXPECT_EQ(strings(NativeConnection::bigint(1001), "kermit", "is_registered"),
+            batches[0][2].values);
+}
+
+TEST_F(NativeClientTest, Remove)
+{
+  ColumnPath cp;
+  cp.__set_column_family("impi");
+  _client->remove("gonzo", cp, 1000, ConsistencyLevel::ONE);
+
+  std::vector<FakeNode::Statement> executed = _node.executed();
+  ASSERT_EQ(1u, executed.size());
+  EXPECT_EQ("DELETE FROM \"impi\" USING TIMESTAMP ? WHERE key = ?", executed[0].query);
+  EXPECT_EQ(strings(NativeConnection::bigint(1000), "gonzo"), executed[0].values);
+}
+
+static std::string unavailable_response(const FakeNode::Statement& statement)
+{
+  return FakeNode::error(0x1000, "Not enough replicas");
+}
+
+static std::string timeout_response(const FakeNode::Statement& statement)
+{
+  return FakeNode::error(0x1200, "Read timed out");
+}
+
+static std::string invalid_response(const FakeNode::Statement& statement)
+{
+  return FakeNode::error(0x2200, "Unknown table");
+}
+
+// Errors are reported with the exceptions the Thrift client throws.
+TEST_F(NativeClientTest, Errors)
+{
+  _node.respond = unavailable_response;
+  EXPECT_THROW(get_columns("kermit", strings("is_registered")), UnavailableException);
+
+  _node.respond = timeout_response;
+  EXPECT_THROW(get_columns("kermit", strings("is_registered")), TimedOutException);
+
+  _node.respond = invalid_response;
+
+  try
+  {
+    get_columns("kermit", strings("is_registered"));
+    FAIL() << "Expected InvalidRequestException";
+  }
+  catch (InvalidRequestException& ire)
+  {
+    EXPECT_EQ("Unknown table", ire.why);
+  }
+}
+
+// If the node forgets a statement was prepared, it is prepared again.
+TEST_F(NativeClientTest, Reprepare)
+{
+  _node.respond = row_response;
+
+  get_columns("kermit", strings("ims_subscription_xml"));
+  EXPECT_EQ(1, _node.prepare_count());
+
+  _node.forget_prepared();
+  std::vector<ColumnOrSuperColumn> columns =
+    get_columns("gonzo", strings("ims_subscription_xml"));
+
+  EXPECT_EQ(2, _node.prepare_count());
+  ASSERT_EQ(1u, columns.size());
+  EXPECT_EQ("<xml>gonzo", columns[0].column.value);
+}
+
+// If the connection fails, requests on it fail, and the pool makes a new one.
+TEST_F(NativeClientTest, ConnectionLost)
+{
+  _node.respond = row_response;
+  _node.close_on_execute();
+
+  EXPECT_THROW(get_columns("kermit", strings("ims_subscription_xml")),
+               apache::thrift::transport::TTransportException);
+  EXPECT_THROW(get_columns("kermit", strings("ims_subscription_xml")),
+               apache::thrift::transport::TTransportException);
+
+  delete _client;
+  _client = _pool->get_client("127.0.0.1", _node.port());
+  _client->set_keyspace("homestead_cache");
+
+  std::vector<ColumnOrSuperColumn> columns =
+    get_columns("kermit", strings("ims_subscription_xml"));
+  ASSERT_EQ(1u, columns.size());
+  EXPECT_EQ("<xml>kermit", columns[0].column.value);
+}
+
+// Clients for the same node share a connection.
+TEST_F(NativeClientTest, SharedConnection)
+{
+  CassandraStore::ClientInterface* other = _pool->get_client("127.0.0.1", _node.port());
+  EXPECT_EQ(client()->_connection.get(), ((NativeClient*)other)->_connection.get());
+  delete other;
+}
+
+static std::string scan_response(const FakeNode::Statement& statement)
+{
+  std::vector<std::vector<std::string> > rows;
+  std::string paging_state;
+  std::string ts = NativeConnection::bigint(1);
+  std::string null = FakeNode::NULL_VALUE;
+
+  if (statement.paging_state.empty())
+  {
+    rows.push_back(strings("kermit", "c1", "v1", ts, null));
+    rows.push_back(strings("kermit", "c2", "v2", ts, null));
+    rows.push_back(strings("gonzo", "c1", "v1", ts, null));
+    paging_state = "page2";
+  }
+  else
+  {
+    rows.push_back(strings("gonzo", "c2", "v2", ts, null));
+    rows.push_back(strings("miss piggy", "c1", "v1", ts, null));
+    paging_state = "page3";
+  }
+
+  return FakeNode::rows_result(rows, paging_state);
+}
+
+// Rows are read a page of columns at a time until there are enough of them.
+TEST_F(NativeClientTest, RangeScan)
+{
+  _node.respond = scan_response;
+
+  ColumnParent cp;
+  cp.__set_column_family("impu");
+  SliceRange sr;
+  sr.__set_count(10);
+  SlicePredicate sp;
+  sp.__set_slice_range(sr);
+  KeyRange range;
+  range.__set_start_token("-9223372036854775808");
+  range.__set_end_token("100");
+  range.__set_count(2);
+
+  std::vector<KeySlice> slices;
+  client()->get_range_slices(slices, cp, sp, range, ConsistencyLevel::ONE);
+
+  std::vector<FakeNode::Statement> executed = _node.executed();
+  ASSERT_EQ(2u, executed.size());
+  EXPECT_EQ("SELECT key, column1, value, writetime(value), ttl(value) FROM \"impu\" "
+            "WHERE token(key) > ? AND token(key) <= ?",
+            executed[0].query);
+  EXPECT_EQ(strings(NativeConnection::bigint(INT64_MIN), NativeConnection::bigint(100)),
+            executed[0].values);
+  EXPECT_EQ("page2", executed[1].paging_state);
+
+  ASSERT_EQ(2u, slices.size());
+  EXPECT_EQ("kermit", slices[0].key);
+  EXPECT_EQ(2u, slices[0].columns.size());
+  EXPECT_EQ("gonzo", slices[1].key);
+  ASSERT_EQ(2u, slices[1].columns.size());
+  EXPECT_EQ("c2", slices[1].columns[1].column.name);
+}
@@ -0,0 +1,129 @@
+/**
+ * @file negativecache_test.cpp UT for the negative cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "negativecache.h"
+
+/// Fixture for NegativeCacheTest.
+class NegativeCacheTest : public testing::Test
+{
+public:
+  NegativeCacheTest() : _cache(4, 1000, 2)
+  {
+    cwtest_completely_control_time();
+  }
+
+  ~NegativeCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  // Helper to record an absence that hasn't raced with any invalidations.
+  bool record(const std::string& table, const std::string& key)
+  {
+    return _cache.record_absent(table, key, _cache.generation(table, key));
+  }
+
+  NegativeCache _cache;
+};
+
+TEST_F(NegativeCacheTest, Unknown)
+{
+  EXPECT_FALSE(_cache.is_absent("impu", "sip:kermit@example.com"));
+}
+
+TEST_F(NegativeCacheTest, Absent)
+{
+  EXPECT_TRUE(record("impu", "sip:kermit@example.com"));
+  EXPECT_TRUE(_cache.is_absent("impu", "sip:kermit@example.com"));
+  EXPECT_FALSE(_cache.is_absent("impi", "sip:kermit@example.com"));
+  EXPECT_EQ(1u, _cache.size());
+}
+
+TEST_F(NegativeCacheTest, RecordTwice)
+{
+  EXPECT_TRUE(record("impu", "sip:kermit@example.com"));
+  EXPECT_TRUE(record("impu", "sip:kermit@example.com"));
+  EXPECT_EQ(1u, _cache.size());
+}
+
+TEST_F(NegativeCacheTest, Expiry)
+{
+  record("impu", "sip:kermit@example.com");
+
+  cwtest_advance_time_ms(999);
+  EXPECT_TRUE(_cache.is_absent("impu", "sip:kermit@example.com"));
+
+  cwtest_advance_time_ms(1);
+  EXPECT_FALSE(_cache.is_absent("impu", "sip:kermit@example.com"));
+  EXPECT_EQ(0u, _cache.size());
+}
+
+TEST_F(NegativeCacheTest, Invalidate)
+{
+  record("impu", "sip:kermit@example.com");
+  _cache.invalidate("impu", "sip:kermit@example.com");
+  EXPECT_FALSE(_cache.is_absent("impu", "sip:kermit@example.com"));
+  EXPECT_EQ(0u, _cache.size());
+}
+
+TEST_F(NegativeCacheTest, InvalidatedDuringRead)
+{
+  // A write that happens while the read is in progress stops the read's
+  // result being recorded.
+  uint64_t generation = _cache.generation("impu", "sip:kermit@example.com");
+  _cache.invalidate("impu", "sip:kermit@example.com");
+  EXPECT_FALSE(_cache.record_absent("impu", "sip:kermit@example.com", generation));
+  EXPECT_FALSE(_cache.is_absent("impu", "sip:kermit@example.com"));
+}
+
+TEST_F(NegativeCacheTest, Eviction)
+{
+  NegativeCache cache(1, 1000, 1);
+  cache.record_absent("impu",
+                      "sip:kermit@example.com",
+                      cache.generation("impu", "sip:kermit@example.com"));
+  cache.record_absent("impu",
+                      "sip:gonzo@example.com",
+                      cache.generation("impu", "sip:gonzo@example.com"));
+
+  EXPECT_FALSE(cache.is_absent("impu", "sip:kermit@example.com"));
+  EXPECT_TRUE(cache.is_absent("impu", "sip:gonzo@example.com"));
+  EXPECT_EQ(1u, cache.size());
+}
@@ -0,0 +1,272 @@
+/**
+ * @file objectpool_test.cpp UT for the object pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <pthread.h>
+#include <vector>
+#include <map>
+
+#include "gtest/gtest.h"
+
+#include "objectpool.h"
+
+/// Fixture for ObjectPoolTest.  Each test starts with empty free lists.
+class ObjectPoolTest : public testing::Test
+{
+public:
+  ObjectPoolTest()
+  {
+    ObjectPool::trim();
+    _start = ObjectPool::thread_stats();
+  }
+
+  ~ObjectPoolTest()
+  {
+    ObjectPool::trim();
+  }
+
+  uint64_t heap_allocations()
+  {
+    return ObjectPool::thread_stats().heap_allocations - _start.heap_allocations;
+  }
+
+  uint64_t pool_allocations()
+  {
+    return ObjectPool::thread_stats().pool_allocations - _start.pool_allocations;
+  }
+
+  ObjectPool::Stats _start;
+};
+
+class PooledThing : public PooledObject
+{
+public:
+  virtual ~PooledThing() {}
+  char data[100];
+};
+
+class BiggerPooledThing : public PooledThing
+{
+public:
+  char more_data[500];
+};
+
+static void* allocate_on_thread(void* size)
+{
+  return ObjectPool::allocate((size_t)size);
+}
+
+struct ReleaseArgs
+{
+  void* block;
+  size_t size;
+};
+
+static void* release_on_thread(void* args)
+{
+  ObjectPool::release(((ReleaseArgs*)args)->block, ((ReleaseArgs*)args)->size);
+  return NULL;
+}
+
+TEST_F(ObjectPoolTest, MemoryReused)
+{
+  void* first = ObjectPool::allocate(100);
+  ObjectPool::release(first, 100);
+  void* second = ObjectPool::allocate(100);
+
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(1u, heap_allocations());
+  EXPECT_EQ(1u, pool_allocations());
+
+  ObjectPool::release(second, 100);
+}
+
+TEST_F(ObjectPoolTest, SizesInSameClassShareMemory)
+{
+  void* first = ObjectPool::allocate(65);
+  ObjectPool::release(first, 65);
+  void* second = ObjectPool::allocate(128);
+
+  EXPECT_EQ(first, second);
+
+  // A different size class doesn't get the same memory.
+  void* third = ObjectPool::allocate(64);
+  EXPECT_NE(second, third);
+  EXPECT_EQ(2u, heap_allocations());
+  EXPECT_EQ(1u, pool_allocations());
+
+  ObjectPool::release(second, 128);
+  ObjectPool::release(third, 64);
+}
+
+TEST_F(ObjectPoolTest, LargeObjectsNotPooled)
+{
+  size_t size = ObjectPool::MAX_POOLED_SIZE + 1;
+
+  ObjectPool::release(ObjectPool::allocate(size), size);
+  ObjectPool::release(ObjectPool::allocate(size), size);
+
+  EXPECT_EQ(2u, heap_allocations());
+  EXPECT_EQ(0u, pool_allocations());
+}
+
+TEST_F(ObjectPoolTest, FreeListsBounded)
+{
+  size_t num_blocks = ObjectPool::MAX_FREE_PER_CLASS + 10;
+  std::vector<void*> blocks;
+
+  for (size_t ii = 0; ii < num_blocks; ii++)
+  {
+    blocks.push_back(ObjectPool::allocate(100));
+  }
+  for (size_t ii = 0; ii < num_blocks; ii++)
+  {
+    ObjectPool::release(blocks[ii], 100);
+  }
+  for (size_t ii = 0; ii < num_blocks; ii++)
+  {
+    blocks[ii] = ObjectPool::allocate(100);
+  }
+
+  // Only the blocks that fitted on the free list are reused.
+  EXPECT_EQ(num_blocks + 10, heap_allocations());
+  EXPECT_EQ(ObjectPool::MAX_FREE_PER_CLASS, pool_allocations());
+
+  for (size_t ii = 0; ii < num_blocks; ii++)
+  {
+    ObjectPool::release(blocks[ii], 100);
+  }
+}
+
+TEST_F(ObjectPoolTest, ReleasedOnOtherThread)
+{
+  // Memory allocated by this thread and freed by another is returned to
+  // this thread, and reused by it.
+  void* block = ObjectPool::allocate(100);
+  EXPECT_EQ(1u, ObjectPool::thread_stats().outstanding);
+
+  pthread_t thread;
+  ReleaseArgs args = {block, 100};
+  pthread_create(&thread, NULL, &release_on_thread, &args);
+  pthread_join(thread, NULL);
+  EXPECT_EQ(0u, ObjectPool::thread_stats().outstanding);
+
+  void* reused = ObjectPool::allocate(100);
+
+  EXPECT_EQ(block, reused);
+  EXPECT_EQ(1u, heap_allocations());
+  EXPECT_EQ(1u, pool_allocations());
+
+  ObjectPool::release(reused, 100);
+}
+
+TEST_F(ObjectPoolTest, ManyReleasedOnOtherThread)
+{
+  // Requests typically allocate on one thread and free on another, so in
+  // the steady state that mustn't go to the heap either.
+  std::vector<void*> blocks;
+
+  for (int round = 0; round < 10; round++)
+  {
+    for (int ii = 0; ii < 10; ii++)
+    {
+      blocks.push_back(ObjectPool::allocate(100));
+    }
+
+    for (size_t ii = 0; ii < blocks.size(); ii++)
+    {
+      pthread_t thread;
+      ReleaseArgs args = {blocks[ii], 100};
+      pthread_create(&thread, NULL, &release_on_thread, &args);
+      pthread_join(thread, NULL);
+    }
+    blocks.clear();
+  }
+
+  EXPECT_EQ(10u, heap_allocations());
+  EXPECT_EQ(90u, pool_allocations());
+  EXPECT_EQ(0u, ObjectPool::thread_stats().outstanding);
+}
+
+TEST_F(ObjectPoolTest, ReleasedAfterOwnerExits)
+{
+  // Memory allocated by a thread that has since exited goes back to the
+  // heap, rather than to the thread that freed it.
+  pthread_t thread;
+  void* block;
+  pthread_create(&thread, NULL, &allocate_on_thread, (void*)100);
+  pthread_join(thread, &block);
+
+  ObjectPool::release(block, 100);
+  void* other = ObjectPool::allocate(100);
+
+  EXPECT_EQ(1u, heap_allocations());
+  EXPECT_EQ(0u, pool_allocations());
+
+  ObjectPool::release(other, 100);
+}
+
+TEST_F(ObjectPoolTest, PooledContainers)
+{
+  // Containers using PoolAllocator reuse memory in the same way.
+  {
+    std::vector<int, PoolAllocator<int> > numbers(10, 1);
+    std::map<int, int, std::less<int>, PoolAllocator<std::pair<const int, int> > > map;
+    map[1] = 2;
+  }
+  uint64_t heap_before = heap_allocations();
+  {
+    std::vector<int, PoolAllocator<int> > numbers(10, 1);
+    std::map<int, int, std::less<int>, PoolAllocator<std::pair<const int, int> > > map;
+    map[1] = 2;
+  }
+
+  EXPECT_EQ(heap_before, heap_allocations());
+  EXPECT_EQ(2u, pool_allocations());
+}
+
+TEST_F(ObjectPoolTest, PooledObjects)
+{
+  // Objects are freed using the size of their most derived class.
+  PooledThing* thing = new BiggerPooledThing();
+  delete thing;
+  BiggerPooledThing* bigger_thing = new BiggerPooledThing();
+
+  EXPECT_EQ((void*)thing, (void*)bigger_thing);
+  EXPECT_EQ(1u, heap_allocations());
+  EXPECT_EQ(1u, pool_allocations());
+
+  delete bigger_thing;
+}
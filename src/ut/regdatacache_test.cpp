@@ -0,0 +1,204 @@
+/**
+ * @file regdatacache_test.cpp UT for the registration data cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "regdatacache.h"
+
+/// Fixture for RegDataCacheTest.
+class RegDataCacheTest : public testing::Test
+{
+public:
+  RegDataCacheTest() : _cache(4, 5000, 2)
+  {
+    cwtest_completely_control_time();
+  }
+
+  ~RegDataCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  // Helper to store an entry that hasn't raced with any invalidations.
+  bool put(const std::string& public_id, const RegDataCache::RegData& data)
+  {
+    return _cache.put(public_id, data, _cache.generation(public_id));
+  }
+
+  static RegDataCache::RegData make_data(const std::string& xml,
+                                         int32_t ttl = 0)
+  {
+    RegDataCache::RegData data;
+    data.xml = xml;
+    data.xml_ttl = ttl;
+    data.reg_state = RegistrationState::REGISTERED;
+    data.reg_state_ttl = ttl;
+    data.impis.push_back("kermit@example.com");
+    data.charging_addrs.ccfs.push_back("ccf1");
+    return data;
+  }
+
+  RegDataCache _cache;
+};
+
+TEST_F(RegDataCacheTest, Miss)
+{
+  RegDataCache::RegData data;
+  EXPECT_FALSE(_cache.get("sip:kermit@example.com", data));
+}
+
+TEST_F(RegDataCacheTest, Hit)
+{
+  EXPECT_TRUE(put("sip:kermit@example.com", make_data("<xml>")));
+
+  RegDataCache::RegData data;
+  EXPECT_TRUE(_cache.get("sip:kermit@example.com", data));
+  EXPECT_EQ("<xml>", data.xml);
+  EXPECT_EQ(RegistrationState::REGISTERED, data.reg_state);
+  EXPECT_EQ(0, data.xml_ttl);
+  EXPECT_EQ(1u, data.impis.size());
+  EXPECT_EQ(1u, data.charging_addrs.ccfs.size());
+  EXPECT_EQ(1u, _cache.size());
+}
+
+TEST_F(RegDataCacheTest, Overwrite)
+{
+  EXPECT_TRUE(put("sip:kermit@example.com", make_data("<old>")));
+  EXPECT_TRUE(put("sip:kermit@example.com", make_data("<new>")));
+
+  RegDataCache::RegData data;
+  EXPECT_TRUE(_cache.get("sip:kermit@example.com", data));
+  EXPECT_EQ("<new>", data.xml);
+  EXPECT_EQ(1u, _cache.size());
+}
+
+TEST_F(RegDataCacheTest, MaxAge)
+{
+  put("sip:kermit@example.com", make_data("<xml>"));
+
+  RegDataCache::RegData data;
+  cwtest_advance_time_ms(4999);
+  EXPECT_TRUE(_cache.get("sip:kermit@example.com", data));
+
+  cwtest_advance_time_ms(1);
+  EXPECT_FALSE(_cache.get("sip:kermit@example.com", data));
+  EXPECT_EQ(0u, _cache.size());
+}
+
+// TTLs are reduced by the time spent in the cache, and an entry is never
+// served once the underlying columns would have expired.
+TEST_F(RegDataCacheTest, ColumnTTL)
+{
+  put("sip:kermit@example.com", make_data("<xml>", 3));
+
+  RegDataCache::RegData data;
+  cwtest_advance_time_ms(2000);
+  EXPECT_TRUE(_cache.get("sip:kermit@example.com", data));
+  EXPECT_EQ(1, data.xml_ttl);
+  EXPECT_EQ(1, data.reg_state_ttl);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_FALSE(_cache.get("sip:kermit@example.com", data));
+}
+
+TEST_F(RegDataCacheTest, Invalidate)
+{
+  put("sip:kermit@example.com", make_data("<xml>"));
+  put("sip:gonzo@example.com", make_data("<xml>"));
+
+  std::vector<std::string> public_ids;
+  public_ids.push_back("sip:kermit@example.com");
+  public_ids.push_back("sip:gonzo@example.com");
+  _cache.invalidate(public_ids);
+
+  RegDataCache::RegData data;
+  EXPECT_FALSE(_cache.get("sip:kermit@example.com", data));
+  EXPECT_FALSE(_cache.get("sip:gonzo@example.com", data));
+}
+
+// A read that started before an invalidation must not populate the cache.
+TEST_F(RegDataCacheTest, InvalidatedDuringRead)
+{
+  uint64_t generation = _cache.generation("sip:kermit@example.com");
+  _cache.invalidate("sip:kermit@example.com");
+
+  EXPECT_FALSE(_cache.put("sip:kermit@example.com",
+                          make_data("<stale>"),
+                          generation));
+
+  RegDataCache::RegData data;
+  EXPECT_FALSE(_cache.get("sip:kermit@example.com", data));
+}
+
+// The least recently used entry is evicted when a shard is full.
+TEST_F(RegDataCacheTest, Eviction)
+{
+  RegDataCache cache(1, 5000, 1);
+  cache.put("sip:kermit@example.com",
+            make_data("<kermit>"),
+            cache.generation("sip:kermit@example.com"));
+  cache.put("sip:gonzo@example.com",
+            make_data("<gonzo>"),
+            cache.generation("sip:gonzo@example.com"));
+
+  RegDataCache::RegData data;
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", data));
+  EXPECT_TRUE(cache.get("sip:gonzo@example.com", data));
+  EXPECT_EQ("<gonzo>", data.xml);
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST_F(RegDataCacheTest, PublicIDs)
+{
+  RegDataCache cache(4, 5000, 1);
+  cache.put("sip:kermit@example.com",
+            make_data("<kermit>"),
+            cache.generation("sip:kermit@example.com"));
+  cache.put("sip:gonzo@example.com",
+            make_data("<gonzo>"),
+            cache.generation("sip:gonzo@example.com"));
+
+  RegDataCache::RegData data;
+  cache.get("sip:kermit@example.com", data);
+
+  std::vector<std::string> public_ids;
+  cache.public_ids(public_ids);
+  ASSERT_EQ(2u, public_ids.size());
+  EXPECT_EQ("sip:kermit@example.com", public_ids[0]);
+  EXPECT_EQ("sip:gonzo@example.com", public_ids[1]);
+}
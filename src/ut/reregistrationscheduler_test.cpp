@@ -0,0 +1,204 @@
+/**
+ * @file reregistrationscheduler_test.cpp UT for the re-registration scheduler
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <semaphore.h>
+#include <time.h>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "reregistrationscheduler.h"
+
+using ::testing::_;
+using ::testing::InvokeWithoutArgs;
+
+class MockReregisterer : public ReregistrationScheduler::Reregisterer
+{
+public:
+  MOCK_METHOD2(reregister, void(const std::string& impu,
+                                const std::string& impi));
+};
+
+/// Fixture for ReregistrationSchedulerTest.  The scheduler's thread isn't
+/// started - the tests run it by hand, controlling the time.
+class ReregistrationSchedulerTest : public testing::Test
+{
+public:
+  ReregistrationSchedulerTest() :
+    // Re-register every hour, a minute ahead of time, with at most two
+    // re-registrations in flight.
+    _scheduler(&_reregisterer, 3600, 60, 2)
+  {
+    cwtest_completely_control_time();
+  }
+
+  virtual ~ReregistrationSchedulerTest()
+  {
+    cwtest_reset_time();
+  }
+
+  MockReregisterer _reregisterer;
+  ReregistrationScheduler _scheduler;
+};
+
+// The re-registration is made a minute before a REGISTER would need it.
+TEST_F(ReregistrationSchedulerTest, ReregisteredAheadOfTime)
+{
+  EXPECT_CALL(_reregisterer, reregister(_, _)).Times(0);
+  _scheduler.registered("sip:kermit@example.com", "kermit", 7200);
+  EXPECT_EQ(3540000, _scheduler.run_due());
+
+  cwtest_advance_time_ms(3539000);
+  EXPECT_EQ(1000, _scheduler.run_due());
+  testing::Mock::VerifyAndClearExpectations(&_reregisterer);
+
+  EXPECT_CALL(_reregisterer, reregister("sip:kermit@example.com", "kermit"));
+  cwtest_advance_time_ms(1000);
+  EXPECT_EQ(-1, _scheduler.run_due());
+
+  // Each REGISTER only arms one re-registration.
+  _scheduler.reregistration_complete("sip:kermit@example.com", true);
+  EXPECT_EQ(0u, _scheduler.size());
+}
+
+// An IRS that is already past the point of re-registering is re-registered
+// straight away.
+TEST_F(ReregistrationSchedulerTest, AlreadyDue)
+{
+  EXPECT_CALL(_reregisterer, reregister("sip:kermit@example.com", "kermit"));
+  _scheduler.registered("sip:kermit@example.com", "kermit", 3000);
+  _scheduler.run_due();
+}
+
+// A REGISTER during the re-registration arms another one.
+TEST_F(ReregistrationSchedulerTest, RegisteredWhileInFlight)
+{
+  EXPECT_CALL(_reregisterer, reregister("sip:kermit@example.com", "kermit"));
+  _scheduler.registered("sip:kermit@example.com", "kermit", 3000);
+  _scheduler.run_due();
+
+  _scheduler.registered("sip:kermit@example.com", "kermit", 2990);
+  _scheduler.reregistration_complete("sip:kermit@example.com", true);
+
+  // The data has been refreshed, so the next re-registration is due after
+  // the re-registration time (less the lead time).
+  EXPECT_EQ(1u, _scheduler.size());
+  EXPECT_EQ(3540000, _scheduler.run_due());
+}
+
+// Failed re-registrations are retried until the data would have expired.
+TEST_F(ReregistrationSchedulerTest, Retries)
+{
+  EXPECT_CALL(_reregisterer, reregister("sip:kermit@example.com", "kermit"))
+    .Times(2);
+  _scheduler.registered("sip:kermit@example.com", "kermit", 15);
+  _scheduler.run_due();
+  _scheduler.reregistration_complete("sip:kermit@example.com", false);
+  EXPECT_EQ(10000, _scheduler.run_due());
+
+  cwtest_advance_time_ms(10000);
+  _scheduler.run_due();
+  _scheduler.reregistration_complete("sip:kermit@example.com", false);
+  EXPECT_EQ(0u, _scheduler.size());
+}
+
+TEST_F(ReregistrationSchedulerTest, Deregistered)
+{
+  EXPECT_CALL(_reregisterer, reregister(_, _)).Times(0);
+  _scheduler.registered("sip:kermit@example.com", "kermit", 7200);
+  _scheduler.deregistered("sip:kermit@example.com");
+  EXPECT_EQ(0u, _scheduler.size());
+  EXPECT_EQ(-1, _scheduler.run_due());
+}
+
+// An IRS deregistered during its re-registration isn't retried.
+TEST_F(ReregistrationSchedulerTest, DeregisteredWhileInFlight)
+{
+  EXPECT_CALL(_reregisterer, reregister("sip:kermit@example.com", "kermit"));
+  _scheduler.registered("sip:kermit@example.com", "kermit", 3000);
+  _scheduler.run_due();
+  _scheduler.deregistered("sip:kermit@example.com");
+  _scheduler.reregistration_complete("sip:kermit@example.com", false);
+  EXPECT_EQ(0u, _scheduler.size());
+}
+
+TEST_F(ReregistrationSchedulerTest, MaxInFlight)
+{
+  _scheduler.registered("sip:kermit@example.com", "kermit", 3000);
+  _scheduler.registered("sip:gonzo@example.com", "gonzo", 3000);
+  _scheduler.registered("sip:robin@example.com", "robin", 3000);
+
+  EXPECT_CALL(_reregisterer, reregister(_, _)).Times(2);
+  EXPECT_EQ(-1, _scheduler.run_due());
+  testing::Mock::VerifyAndClearExpectations(&_reregisterer);
+
+  // Once one completes, the last one is started.
+  _scheduler.reregistration_complete("sip:kermit@example.com", true);
+  EXPECT_CALL(_reregisterer, reregister("sip:robin@example.com", "robin"));
+  _scheduler.run_due();
+}
+
+// Data that never expires (because there's no HSS) isn't tracked.
+TEST_F(ReregistrationSchedulerTest, NoTTL)
+{
+  _scheduler.registered("sip:kermit@example.com", "kermit", 0);
+  EXPECT_EQ(0u, _scheduler.size());
+}
+
+// The scheduler's thread runs re-registrations as they fall due.
+TEST(ReregistrationSchedulerThreadTest, Thread)
+{
+  sem_t sem;
+  sem_init(&sem, 0, 0);
+
+  MockReregisterer reregisterer;
+  ReregistrationScheduler scheduler(&reregisterer, 3600);
+  EXPECT_CALL(reregisterer, reregister("sip:kermit@example.com", "kermit"))
+    .WillOnce(InvokeWithoutArgs([&sem]() { sem_post(&sem); }));
+
+  ASSERT_TRUE(scheduler.start());
+  scheduler.registered("sip:kermit@example.com", "kermit", 100);
+
+  struct timespec timeout;
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec += 2;
+  EXPECT_EQ(0, sem_timedwait(&sem, &timeout));
+
+  scheduler.stop();
+  sem_destroy(&sem);
+}